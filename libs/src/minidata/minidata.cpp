@@ -13,6 +13,9 @@
 
 #include <mini/database.h> // for databuf
 
+#include <stdlib.h>
+#include <string.h>
+
 // parameters for converting external formats
 struct MINI_CONVERSION_HOOK_STRUCT
 {
@@ -138,10 +141,11 @@ int conversionhook(int israwdata,unsigned char *srcdata,unsigned int bytes,unsig
 	return(1); // return success
 }
 
+static MINI_CONVERSION_PARAMS conversion_params;
+
 void InitMiniConvHook(int iJpegQuality)
 {
 	// specify conversion parameters
-	static MINI_CONVERSION_PARAMS conversion_params;
 	conversion_params.jpeg_quality = (float) iJpegQuality; // jpeg quality in percent
 	conversion_params.png_gamma=0.0f; // png gamma (0.0=default 1.0=neutral)
 	conversion_params.zlib_level=9; // zlib compression level (0=none 6=standard 9=highest)
@@ -149,3 +153,139 @@ void InitMiniConvHook(int iJpegQuality)
 	// register libMini conversion hook (JPEG/PNG)
 	databuf::setconversion(conversionhook,&conversion_params);
 }
+
+// Parse a number in the header of a .db file.  This does not depend on the
+//  locale, so it is safe to use from any thread.
+static float ParseHeaderValue(const char *p)
+{
+	double sign = 1, value = 0;
+	if (*p == '-' || *p == '+')
+		sign = (*p++ == '-') ? -1 : 1;
+	while (*p >= '0' && *p <= '9')
+		value = value * 10 + (*p++ - '0');
+	if (*p == '.')
+	{
+		double place = 0.1;
+		for (p++; *p >= '0' && *p <= '9'; p++, place /= 10)
+			value += (*p - '0') * place;
+	}
+	if (*p == 'e' || *p == 'E')
+	{
+		int exp = (int) ParseHeaderValue(p + 1);
+		for (; exp > 0; exp--) value *= 10;
+		for (; exp < 0; exp++) value /= 10;
+	}
+	return (float) (sign * value);
+}
+
+/**
+ * Read a tile in libMini's native (.db) format from memory, as
+ * databuf::loaddata would read it from a file.  A tile which was streamed
+ * from a server can then be used without writing it to a file first.
+ *
+ * \return true if successful.  On failure, the buffer is left empty.
+ */
+bool ReadMiniDatabuf(const unsigned char *data, unsigned int len, databuf *buf)
+{
+	buf->reset();
+
+	// The header is lines of "name=value", ending with a zero byte
+	const unsigned char *end = (const unsigned char *) memchr(data, 0, len);
+	if (end == NULL || strncmp((const char *) data, "MAGIC=", 6) != 0)
+		return false;
+
+	struct { const char *name; float databuf::*member; } floats[] = {
+		{ "swx", &databuf::swx }, { "swy", &databuf::swy },
+		{ "nwx", &databuf::nwx }, { "nwy", &databuf::nwy },
+		{ "nex", &databuf::nex }, { "ney", &databuf::ney },
+		{ "sex", &databuf::sex }, { "sey", &databuf::sey },
+		{ "h0", &databuf::h0 }, { "dh", &databuf::dh },
+		{ "t0", &databuf::t0 }, { "dt", &databuf::dt },
+		{ "scaling", &databuf::scaling }, { "bias", &databuf::bias },
+		{ "minvalue", &databuf::minvalue }, { "maxvalue", &databuf::maxvalue },
+		{ "LLWGS84_swx", &databuf::LLWGS84_swx }, { "LLWGS84_swy", &databuf::LLWGS84_swy },
+		{ "LLWGS84_nwx", &databuf::LLWGS84_nwx }, { "LLWGS84_nwy", &databuf::LLWGS84_nwy },
+		{ "LLWGS84_nex", &databuf::LLWGS84_nex }, { "LLWGS84_ney", &databuf::LLWGS84_ney },
+		{ "LLWGS84_sex", &databuf::LLWGS84_sex }, { "LLWGS84_sey", &databuf::LLWGS84_sey },
+	};
+	struct { const char *name; unsigned int databuf::*member; } ints[] = {
+		{ "xsize", &databuf::xsize }, { "ysize", &databuf::ysize },
+		{ "zsize", &databuf::zsize }, { "tsteps", &databuf::tsteps },
+		{ "type", &databuf::type }, { "extformat", &databuf::extformat },
+		{ "implformat", &databuf::implformat }, { "bytes", &databuf::bytes },
+	};
+	const int num_floats = sizeof(floats) / sizeof(floats[0]);
+	const int num_ints = sizeof(ints) / sizeof(ints[0]);
+
+	const char *line = (const char *) data;
+	while (line < (const char *) end)
+	{
+		const char *eol = (const char *) memchr(line, '\n', (const char *) end - line);
+		if (eol == NULL)
+			eol = (const char *) end;
+		const char *equals = (const char *) memchr(line, '=', eol - line);
+		if (equals != NULL)
+		{
+			// Names which are not known here are skipped
+			const size_t name_len = equals - line;
+			for (int i = 0; i < num_floats; i++)
+				if (strlen(floats[i].name) == name_len && !strncmp(line, floats[i].name, name_len))
+					buf->*floats[i].member = ParseHeaderValue(equals + 1);
+			// Integers are parsed as such, since a float would round them
+			for (int i = 0; i < num_ints; i++)
+				if (strlen(ints[i].name) == name_len && !strncmp(line, ints[i].name, name_len))
+					buf->*ints[i].member = (unsigned int) strtoul(equals + 1, NULL, 10);
+		}
+		line = eol + 1;
+	}
+
+	// The data chunk follows the zero byte
+	const unsigned char *chunk = end + 1;
+	if (buf->bytes == 0 || (size_t) (data + len - chunk) < buf->bytes)
+	{
+		buf->reset();
+		return false;
+	}
+	unsigned char *newdata = NULL;
+	unsigned int newbytes = 0;
+	if (buf->extformat != 0)
+	{
+		// JPEG, PNG or zlib
+		if (!conversionhook(0, (unsigned char *) chunk, buf->bytes, buf->extformat,
+			&newdata, &newbytes, buf, &conversion_params))
+		{
+			buf->reset();
+			return false;
+		}
+		buf->extformat = 0;
+	}
+	else
+	{
+		newbytes = buf->bytes;
+		if ((newdata = (unsigned char *) malloc(newbytes)) == NULL)
+		{
+			buf->reset();
+			return false;
+		}
+		memcpy(newdata, chunk, newbytes);
+	}
+	buf->data = newdata;
+	buf->bytes = newbytes;
+
+	// Shorts and floats are stored most significant byte first
+	static const unsigned short intel_check = 1;
+	const unsigned int size = (buf->type == 1) ? 2 : (buf->type == 2) ? 4 : 1;
+	if (*(const unsigned char *) &intel_check == 1 && size > 1)
+	{
+		for (unsigned char *p = newdata; p + size <= newdata + newbytes; p += size)
+		{
+			for (unsigned int i = 0; i < size / 2; i++)
+			{
+				unsigned char tmp = p[i];
+				p[i] = p[size - 1 - i];
+				p[size - 1 - i] = tmp;
+			}
+		}
+	}
+	return true;
+}
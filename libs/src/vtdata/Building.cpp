@@ -22,8 +22,6 @@
 #define DOOR_WIDTH		1.0f
 #define DOOR_TOP		0.7f
 
-vtLocalConversion vtBuilding::s_Conv;
-
 /////////////////////////////////////
 
 vtEdgeFeature::vtEdgeFeature()
@@ -166,8 +164,9 @@ float vtEdge::ProportionTotal()
 
 /////////////////////////////////////
 
-vtLevel::vtLevel()
+vtLevel::vtLevel(vtStructureArena *arena)
 {
+	m_pArena = arena;
 	m_iStories = 1;
 	m_fStoryHeight = STORY_HEIGHT;
 }
@@ -194,7 +193,7 @@ vtLevel &vtLevel::operator=(const vtLevel &v)
 	m_Edges.SetSize(v.m_Edges.GetSize());
 	for (uint i = 0; i < v.m_Edges.GetSize(); i++)
 	{
-		vtEdge *pnew = new vtEdge(*v.m_Edges[i]);
+		vtEdge *pnew = new (m_pArena) vtEdge(*v.m_Edges[i]);
 		m_Edges.SetAt(i, pnew);
 	}
 	m_Foot = v.m_Foot;
@@ -215,7 +214,7 @@ bool vtLevel::AddEdge(const int iEdge, const DPoint2 &Point)
 	int iNumEdges = m_Edges.GetSize();
 	int iIndex;
 
-	vtEdge *pEdge = new vtEdge(*GetEdge(iEdge));
+	vtEdge *pEdge = new (m_pArena) vtEdge(*GetEdge(iEdge));
 
 	if (NULL == pEdge)
 		return false;
@@ -294,7 +293,7 @@ void vtLevel::RebuildEdges(uint n)
 	DeleteEdges();
 	for (uint i = 0; i < n; i++)
 	{
-		vtEdge *pnew = new vtEdge;
+		vtEdge *pnew = new (m_pArena) vtEdge;
 		pnew->Set(0, 0, BMAT_NAME_SIDING);
 		m_Edges.Append(pnew);
 	}
@@ -474,7 +473,7 @@ bool vtLevel::IsUniform() const
 	return true;
 }
 
-void vtLevel::DetermineLocalFootprint(float fHeight)
+void vtLevel::DetermineLocalFootprint(float fHeight, const vtLocalConversion &conv)
 {
 	DPoint2 p;
 	FPoint3 lp;
@@ -491,7 +490,7 @@ void vtLevel::DetermineLocalFootprint(float fHeight)
 		for (unsigned i = 0; i < edges; i++)
 		{
 			p = dline2.GetAt(i);
-			vtBuilding::s_Conv.ConvertFromEarth(p, lp.x, lp.z);
+			conv.ConvertFromEarth(p, lp.x, lp.z);
 			lp.y = fHeight;
 			fline3.SetAt(i, lp);
 		}
@@ -676,6 +675,7 @@ void vtLevel::FlipFootprintDirection()
 vtBuilding::vtBuilding() : vtStructure()
 {
 	SetType(ST_BUILDING);
+	m_pArena = NULL;
 }
 
 vtBuilding::~vtBuilding()
@@ -693,6 +693,14 @@ void vtBuilding::DeleteLevels()
 	m_Levels.SetSize(0);
 }
 
+/**
+ * Make a new level, in the building's arena if it has one.
+ */
+vtLevel *vtBuilding::NewLevel()
+{
+	return new (m_pArena) vtLevel(m_pArena);
+}
+
 /**
  * Asignment operator, which makes an explicit copy the entire building
  * including each level.
@@ -705,7 +713,11 @@ vtBuilding &vtBuilding::operator=(const vtBuilding &v)
 	// copy class data
 	DeleteLevels();
 	for (uint i = 0; i < v.m_Levels.GetSize(); i++)
-		m_Levels.Append(new vtLevel(* v.m_Levels.GetAt(i)));
+	{
+		vtLevel *pLev = NewLevel();
+		*pLev = *v.m_Levels.GetAt(i);
+		m_Levels.Append(pLev);
+	}
 	return *this;
 }
 
@@ -1114,7 +1126,7 @@ bool vtBuilding::GetExtents(DRECT &rect) const
 
 vtLevel *vtBuilding::CreateLevel()
 {
-	vtLevel *pLev = new vtLevel;
+	vtLevel *pLev = NewLevel();
 	m_Levels.Append(pLev);
 
 	// keep 2d and 3d in synch
@@ -1125,7 +1137,7 @@ vtLevel *vtBuilding::CreateLevel()
 
 vtLevel *vtBuilding::CreateLevel(const DPolygon2 &footprint)
 {
-	vtLevel *pLev = new vtLevel;
+	vtLevel *pLev = NewLevel();
 	pLev->SetFootprint(footprint);
 
 	m_Levels.Append(pLev);
@@ -1171,7 +1183,7 @@ void vtBuilding::SetRectangle(const DPoint2 &center, float fWidth,
 	// this function requires at least one level to exist
 	if (m_Levels.GetSize() == 0)
 	{
-		pLev = new vtLevel;
+		pLev = NewLevel();
 		pLev->m_iStories = 1;
 		m_Levels.Append(pLev);
 	}
@@ -1397,9 +1409,10 @@ void vtBuilding::DetermineLocalFootprints()
 	GetBaseLevelCenter(center);
 
 	// The local conversion for a building must be the same as the global conversion,
-	//  wiht the only difference being a different origin.
-	s_Conv = g_Conv;
-	s_Conv.SetOrigin(center);
+	//  wiht the only difference being a different origin.  It is a local
+	//  variable, so buildings can be made on several threads at once.
+	vtLocalConversion conv = g_Conv;
+	conv.SetOrigin(center);
 
 	int i;
 	int levs = m_Levels.GetSize();
@@ -1408,7 +1421,7 @@ void vtBuilding::DetermineLocalFootprints()
 	for (i = 0; i < levs; i++)
 	{
 		vtLevel *lev = m_Levels[i];
-		lev->DetermineLocalFootprint(fHeight);
+		lev->DetermineLocalFootprint(fHeight, conv);
 		fHeight += (lev->m_iStories * lev->m_fStoryHeight);
 	}
 }
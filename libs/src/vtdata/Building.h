@@ -14,6 +14,7 @@
 #include "MathTypes.h"
 #include "LocalConversion.h"
 #include "Structure.h"
+#include "StructArena.h"
 #include "ogrsf_frmts.h"
 
 class vtHeightField;
@@ -77,7 +78,7 @@ public:
  * which represent such things as walls, doors, and windows.  An edge
  * can also simply consist of a Facade texture map.
  */
-class vtEdge
+class vtEdge : public vtArenaObject
 {
 public:
 	vtEdge();
@@ -124,12 +125,12 @@ public:
  * Each level can have its own footprint polygon, although in simple cases
  * they will all be the same polygon.
  */
-class vtLevel
+class vtLevel : public vtArenaObject
 {
 	friend class vtBuilding;
 public:
-	vtLevel();
-	vtLevel(const vtLevel &from) { *this = from; }
+	vtLevel(vtStructureArena *arena = NULL);
+	vtLevel(const vtLevel &from) { m_pArena = NULL; *this = from; }
 	~vtLevel();
 
 	// assignment operator
@@ -170,7 +171,7 @@ public:
 	DLine2 &GetOuterFootprint() { return m_Foot[0]; }
 	const DLine2 &GetOuterFootprint() const { return m_Foot[0]; }
 
-	void DetermineLocalFootprint(float fHeight);
+	void DetermineLocalFootprint(float fHeight, const vtLocalConversion &conv);
 	const FPolygon3 &GetLocalFootprint() const { return m_LocalFootprint; }
 
 private:
@@ -179,6 +180,8 @@ private:
 	bool DetermineHeightFromSlopes();
 	void DeleteEdges();
 
+	// The edges come from this arena, if it is not NULL
+	vtStructureArena *m_pArena;
 	vtArray<vtEdge *> m_Edges;
 
 	// footprint of the stories in this level
@@ -198,7 +201,7 @@ private:
  * which can be used to construct a reasonable (visually similar) model of
  * the building.
  */
-class vtBuilding : public vtStructure
+class vtBuilding : public vtStructure, public vtArenaObject
 {
 public:
 	vtBuilding();
@@ -251,7 +254,6 @@ public:
 	void DetermineLocalFootprints();
 	const FPolygon3 &GetLocalFootprint(int i) const { return m_Levels[i]->GetLocalFootprint(); }
 
-	static vtLocalConversion s_Conv;
 	static const char *GetEdgeFeatureString(int edgetype);
 	static int		   GetEdgeFeatureValue(const char *value);
 
@@ -259,12 +261,18 @@ public:
 	void SwapLevels(int lev1, int lev2);
 	void CopyFromDefault(vtBuilding *pDefBld, bool bDoHeight);
 
+	/// Levels and edges which are created after this come from the arena.
+	void SetArena(vtStructureArena *arena) { m_pArena = arena; }
+	vtStructureArena *GetArena() const { return m_pArena; }
+
 protected:
 	// information about each story
 	vtArray<vtLevel *> m_Levels;
+	vtStructureArena *m_pArena;
 
 private:
 	void DeleteLevels();
+	vtLevel *NewLevel();
 };
 
 typedef vtBuilding *vtBuildingPtr;
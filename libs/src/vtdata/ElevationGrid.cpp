@@ -9,6 +9,9 @@
 #include <string.h>
 
 #include "ElevationGrid.h"
+#include "ElevationTiles.h"
+#include "FilePath.h"
+#include "HeightFieldBatch.h"
 #include "ByteOrder.h"
 #include "vtDIB.h"
 #include "vtLog.h"
@@ -28,6 +31,8 @@ void vtElevationGrid::SetupMembers()
 	m_bFloatMode = false;
 	m_pData = NULL;
 	m_pFData = NULL;
+	m_pTiles = NULL;
+	m_pMapping = NULL;
 	m_fVMeters = 1.0f;
 
 	for (int i = 0; i < 4; i++)
@@ -128,14 +133,23 @@ bool vtElevationGrid::CopyDataFrom(const vtElevationGrid &rhs)
 	if (m_iColumns != rx || m_iRows != ry)
 		return false;
 
-	if (m_bFloatMode && rhs.m_pFData)
+	if (m_pTiles || rhs.m_pTiles)
 	{
-		size_t Size = m_iColumns * m_iRows * sizeof(float);
+		// The layouts differ, so copy one heixel at a time
+		if (!HasData() || !rhs.HasData())
+			return false;
+		for (int i = 0; i < m_iColumns; i++)
+			for (int j = 0; j < m_iRows; j++)
+				SetFValue(i, j, rhs.GetFValue(i, j));
+	}
+	else if (m_bFloatMode && rhs.m_pFData)
+	{
+		size_t Size = MemoryNeededToLoad();
 		memcpy(m_pFData, rhs.m_pFData, Size );
 	}
 	else if (!m_bFloatMode && rhs.m_pData)
 	{
-		size_t Size = m_iColumns * m_iRows * sizeof(short);
+		size_t Size = MemoryNeededToLoad();
 		memcpy(m_pData, rhs.m_pData, Size );
 	}
 	else return false;
@@ -181,17 +195,81 @@ bool vtElevationGrid::Create(const DRECT &area, int iColumns, int iRows,
 	return _AllocateArray();
 }
 
+/**
+ * Create a grid of given size, whose heixels are stored in a memory-mapped
+ * tiles file rather than in memory.  This allows grids far larger than
+ * the available memory; only the parts of the grid which are actually used
+ * are paged in.  The grid can later be opened again with LoadFromTiles.
+ *
+ * \param szFileName The tiles file to create.
+ * \param area the coordinate extents of the grid (rectangular area)
+ * \param iColumns number of columns in the grid (east-west)
+ * \param iRows number of rows (north-south)
+ * \param bFloat data size: \c true to use floating-point, \c false for shorts.
+ * \param proj the geographical projection to use.
+ * \param iTileBits The size of the tiles as a power of two, default 8 (256x256).
+ *
+ * The grid will initially have no data in it (all values are INVALID_ELEVATION).
+ */
+bool vtElevationGrid::CreateTiled(const char *szFileName, const DRECT &area,
+	int iColumns, int iRows, bool bFloat, const vtProjection &proj, int iTileBits)
+{
+	FreeData();
+
+	vtHeightFieldGrid3d::Initialize(proj.GetUnits(), area, INVALID_ELEVATION,
+		INVALID_ELEVATION, iColumns, iRows);
+
+	m_bFloatMode = bFloat;
+
+	ComputeCornersFromExtents();
+
+	m_proj = proj;
+	m_fVMeters = 1.0f;
+	m_fVerticalScale = 1.0f;
+
+	m_pTiles = new vtElevationTiles;
+	if (!m_pTiles->Create(szFileName, iColumns, iRows, bFloat, iTileBits))
+	{
+		m_strError.Format("Could not create a tiled elevation grid of size %d x %d\n",
+			iColumns, iRows);
+		VTLOG(m_strError);
+		FreeData();
+		return false;
+	}
+	m_pTiles->SetExtents(area);
+	m_proj.WriteProjFile(ChangeFileExtension(szFileName, ".prj"));
+
+	m_fMinHeight = m_fMaxHeight = INVALID_ELEVATION;
+	return true;
+}
+
 /**
  * Free any memory being used by this class for elevation data.
  */
 void vtElevationGrid::FreeData()
 {
+	if (m_pMapping)
+	{
+		// The array is the mapping itself, so there is nothing to free
+		delete m_pMapping;
+		m_pMapping = NULL;
+		m_pData = NULL;
+		m_pFData = NULL;
+	}
 	if (m_pData)
 		free(m_pData);
 	m_pData = NULL;
 	if (m_pFData)
 		free(m_pFData);
 	m_pFData = NULL;
+	if (m_pTiles)
+	{
+		// Remember the height extents, so the next open is instant
+		if (m_pTiles->IsWritable())
+			m_pTiles->SetHeightExtents(m_fMinHeight, m_fMaxHeight);
+		delete m_pTiles;
+	}
+	m_pTiles = NULL;
 }
 
 /**
@@ -200,17 +278,19 @@ void vtElevationGrid::FreeData()
 void vtElevationGrid::Clear()
 {
 	int i, j;
-	if (m_bFloatMode)
+	if (m_pTiles)
+		m_pTiles->Fill(0.0f);
+	else if (m_bFloatMode)
 	{
 		for (i = 0; i < m_iColumns; i++)
 			for (j = 0; j < m_iRows; j++)
-				m_pFData[i*m_iRows+j] = 0.0f;
+				m_pFData[Offset(i, j)] = 0.0f;
 	}
 	else
 	{
 		for (i = 0; i < m_iColumns; i++)
 			for (j = 0; j < m_iRows; j++)
-				m_pData[i*m_iRows+j] = 0;
+				m_pData[Offset(i, j)] = 0;
 	}
 }
 
@@ -220,17 +300,19 @@ void vtElevationGrid::Clear()
 void vtElevationGrid::Invalidate()
 {
 	int i, j;
-	if (m_bFloatMode)
+	if (m_pTiles)
+		m_pTiles->Fill(INVALID_ELEVATION);
+	else if (m_bFloatMode)
 	{
 		for (i = 0; i < m_iColumns; i++)
 			for (j = 0; j < m_iRows; j++)
-				m_pFData[i*m_iRows+j] = INVALID_ELEVATION;
+				m_pFData[Offset(i, j)] = INVALID_ELEVATION;
 	}
 	else
 	{
 		for (i = 0; i < m_iColumns; i++)
 			for (j = 0; j < m_iRows; j++)
-				m_pData[i*m_iRows+j] = INVALID_ELEVATION;
+				m_pData[Offset(i, j)] = INVALID_ELEVATION;
 	}
 }
 
@@ -1170,19 +1252,29 @@ void vtElevationGrid::SetValue(int i, int j, short value)
 {
 	assert(i >= 0 && i < m_iColumns);
 	assert(j >= 0 && j < m_iRows);
-	if (m_bFloatMode)
+	if (m_pTiles)
+	{
+		float fvalue = (float)value;
+		if (m_fVMeters != 1.0f && value != INVALID_ELEVATION)
+			fvalue /= m_fVMeters;
+		if (m_bFloatMode)
+			m_pTiles->SetFloat(i, j, fvalue);
+		else
+			m_pTiles->SetShort(i, j, (short) fvalue);
+	}
+	else if (m_bFloatMode)
 	{
 		if (m_fVMeters == 1.0f || value == INVALID_ELEVATION)
-			m_pFData[i*m_iRows+j] = (float)value;
+			m_pFData[Offset(i, j)] = (float)value;
 		else
-			m_pFData[i*m_iRows+j] = (float)value / m_fVMeters;
+			m_pFData[Offset(i, j)] = (float)value / m_fVMeters;
 	}
 	else
 	{
 		if (m_fVMeters == 1.0f || value == INVALID_ELEVATION)
-			m_pData[i*m_iRows+j] = value;
+			m_pData[Offset(i, j)] = value;
 		else
-			m_pData[i*m_iRows+j] = (short) ((float)value / m_fVMeters);
+			m_pData[Offset(i, j)] = (short) ((float)value / m_fVMeters);
 	}
 }
 
@@ -1194,19 +1286,28 @@ void vtElevationGrid::SetFValue(int i, int j, float value)
 {
 	assert(i >= 0 && i < m_iColumns);
 	assert(j >= 0 && j < m_iRows);
-	if (m_bFloatMode)
+	if (m_pTiles)
+	{
+		if (m_fVMeters != 1.0f && value != INVALID_ELEVATION)
+			value /= m_fVMeters;
+		if (m_bFloatMode)
+			m_pTiles->SetFloat(i, j, value);
+		else
+			m_pTiles->SetShort(i, j, (short) value);
+	}
+	else if (m_bFloatMode)
 	{
 		if (m_fVMeters == 1.0f || value == INVALID_ELEVATION)
-			m_pFData[i*m_iRows+j] = value;
+			m_pFData[Offset(i, j)] = value;
 		else
-			m_pFData[i*m_iRows+j] = value / m_fVMeters;
+			m_pFData[Offset(i, j)] = value / m_fVMeters;
 	}
 	else
 	{
 		if (m_fVMeters == 1.0f || value == INVALID_ELEVATION)
-			m_pData[i*m_iRows+j] = (short) value;
+			m_pData[Offset(i, j)] = (short) value;
 		else
-			m_pData[i*m_iRows+j] = (short) (value / m_fVMeters);
+			m_pData[Offset(i, j)] = (short) (value / m_fVMeters);
 	}
 }
 
@@ -1217,7 +1318,9 @@ void vtElevationGrid::SetFValue(int i, int j, float value)
  */
 short vtElevationGrid::GetShortValue(int i, int j) const
 {
-	return m_pData[i*m_iRows+j];
+	if (m_pTiles)
+		return m_pTiles->GetShort(i, j);
+	return m_pData[Offset(i, j)];
 }
 
 /** Get an elevation value from the grid.
@@ -1228,13 +1331,13 @@ float vtElevationGrid::GetFValue(int i, int j) const
 {
 	if (m_bFloatMode)
 	{
-		float value = m_pFData[i*m_iRows+j];
+		float value = m_pTiles ? m_pTiles->GetFloat(i, j) : m_pFData[Offset(i, j)];
 		if (m_fVMeters == 1.0f || value == INVALID_ELEVATION)
 			return value;
 		else
 			return value * m_fVMeters;
 	}
-	short svalue = m_pData[i*m_iRows+j];
+	short svalue = m_pTiles ? m_pTiles->GetShort(i, j) : m_pData[Offset(i, j)];
 	if (m_fVMeters == 1.0f || svalue == INVALID_ELEVATION)
 		return (float) svalue;
 	else
@@ -1276,26 +1379,28 @@ void vtElevationGrid::ComputeCornersFromExtents()
 //
 bool vtElevationGrid::_AllocateArray()
 {
+	// Use size_t math, so grids larger than 2 GB don't overflow
+	const size_t bytes = MemoryNeededToLoad();
 	if (m_bFloatMode)
 	{
 		m_pData = NULL;
-		m_pFData = (float *)malloc(m_iColumns * m_iRows * sizeof(float));
+		m_pFData = (float *)malloc(bytes);
 		if (!m_pFData)
 		{
 			m_strError.Format("Could not allocate a floating-point elevation grid of size %d x %d (%d MB)\n",
-				m_iColumns, m_iRows, (m_iColumns * m_iRows * 4) / (1024 * 1024));
+				m_iColumns, m_iRows, (int) (bytes / (1024 * 1024)));
 			VTLOG(m_strError);
 			return false;
 		}
 	}
 	else
 	{
-		m_pData = (short *)malloc(m_iColumns * m_iRows * sizeof(short));
+		m_pData = (short *)malloc(bytes);
 		m_pFData = NULL;
 		if (!m_pData)
 		{
 			m_strError.Format("Could not allocate a short-integer elevation grid of size %d x %d (%d MB)\n",
-				m_iColumns, m_iRows, (m_iColumns * m_iRows * 2) / (1024 * 1024));
+				m_iColumns, m_iRows, (int) (bytes / (1024 * 1024)));
 			VTLOG(m_strError);
 			return false;
 		}
@@ -1305,10 +1410,48 @@ bool vtElevationGrid::_AllocateArray()
 	return true;
 }
 
+//
+// Replaces a memory-mapped data array with a copy in memory, so that the
+// file it was mapped from can be rewritten.
+//
+bool vtElevationGrid::_CopyMappedArray()
+{
+	if (!m_pMapping)
+		return true;
+
+	const size_t bytes = MemoryNeededToLoad();
+	void *copy = malloc(bytes);
+	if (!copy)
+	{
+		m_strError.Format("Could not allocate an elevation grid of size %d x %d (%d MB)\n",
+			m_iColumns, m_iRows, (int) (bytes / (1024 * 1024)));
+		VTLOG(m_strError);
+		return false;
+	}
+	if (m_bFloatMode)
+	{
+		memcpy(copy, m_pFData, bytes);
+		m_pFData = (float *) copy;
+	}
+	else
+	{
+		memcpy(copy, m_pData, bytes);
+		m_pData = (short *) copy;
+	}
+	delete m_pMapping;
+	m_pMapping = NULL;
+	return true;
+}
+
 void vtElevationGrid::FillWithSingleValue(float fValue)
 {
 	int i, j;
-	if (m_bFloatMode)
+	if (m_pTiles)
+	{
+		const bool bScale = (m_fVMeters != 1.0f && fValue != INVALID_ELEVATION);
+		m_pTiles->Fill(bScale ? fValue / m_fVMeters : fValue);
+	}
+	else if (m_bFloatMode)
 	{
 		for (i = 0; i < m_iColumns; i++)
 			for (j = 0; j < m_iRows; j++)
@@ -1634,6 +1777,41 @@ bool vtElevationGrid::FindAltitudeAtPoint(const FPoint3 &p, float &fAltitude,
 	return true;
 }
 
+// Provides the heixels of an elevation grid to FindGridAltitudes
+class ElevGridSampler
+{
+public:
+	ElevGridSampler(const vtElevationGrid *grid, bool bTrue) : m_grid(grid), m_bTrue(bTrue) {}
+	void Corners(int iX, int iZ, float alt[4]) const
+	{
+		alt[0] = m_grid->GetFValue(iX, iZ);
+		alt[1] = m_grid->GetFValue(iX+1, iZ);
+		alt[2] = m_grid->GetFValue(iX+1, iZ+1);
+		alt[3] = m_grid->GetFValue(iX, iZ+1);
+	}
+	bool Single(const FPoint3 &p, float &fAltitude) const
+	{
+		return m_grid->FindAltitudeAtPoint(p, fAltitude, m_bTrue);
+	}
+	const vtElevationGrid *m_grid;
+	bool m_bTrue;
+};
+
+/**
+ * Find the altitude of many points at once.  The results are the same as
+ * calling FindAltitudeAtPoint for each point, but much faster.
+ *
+ * \return The number of points which were inside the elevation grid.
+ */
+int vtElevationGrid::FindAltitudesAtPoints(const FPoint3 *points,
+	float *altitudes, int count, bool bTrue, int iCultureFlags) const
+{
+	ElevGridSampler sampler(this, bTrue);
+	return FindGridAltitudes(sampler, m_WorldExtents, m_fXStep, m_fZStep,
+		m_iColumns, m_iRows, false, bTrue ? 1.0f : m_fVerticalScale,
+		points, altitudes, count);
+}
+
 /**
  * Return the elevation value at a given point in earth coordinates.
  *
@@ -15,6 +15,8 @@
 #include "vtString.h"
 
 class vtDIB;
+class vtElevationTiles;
+class vtMappedFile;
 class OGRDataSource;
 
 enum vtElevError {
@@ -56,6 +58,8 @@ public:
 
 	bool Create(const DRECT &area, int iColumns, int iRows, bool bFloat,
 		const vtProjection &proj);
+	bool CreateTiled(const char *szFileName, const DRECT &area, int iColumns,
+		int iRows, bool bFloat, const vtProjection &proj, int iTileBits = 8);
 	void FreeData();
 
 	void Clear();
@@ -102,6 +106,13 @@ public:
 	bool LoadBTData(const char *szFileName, bool progress_callback(int) = NULL,
 		vtElevError *err = NULL);
 
+	// Uncompressed BT file, memory-mapped rather than read
+	bool MapBT(const char *szFileName, vtElevError *err = NULL);
+	static vtString GetExtentsFilename(const char *szFileName);
+
+	// Memory-mapped tiles file, which is not read into memory
+	bool LoadFromTiles(const char *szFileName, bool bWritable = false);
+
 	// Use GDAL to read a file
 	bool LoadWithGDAL(const char *szFileName, bool progress_callback(int) = NULL);
 
@@ -124,6 +135,8 @@ public:
 	bool SaveToXYZ(const char *szFileName, bool progress_callback(int) = NULL) const;
 	bool SaveToRAWINF(const char *szFileName, bool progress_callback(int) = NULL) const;
 	bool SaveToPNG16(const char *fname);
+	bool SaveToTiles(const char *szFileName, bool progress_callback(int) = NULL,
+		int iTileBits = 8) const;
 
 	// Set/Get height values
 	void  SetFValue(int i, int j, float value);
@@ -158,19 +171,30 @@ public:
 	bool GetCorners(DLine2 &line, bool bGeo) const;
 	void SetCorners(const DLine2 &line);
 
+	/** Direct access to the column-major data array.  These return NULL
+	 * for a tiled grid, whose heixels are not stored in a single array.
+	 */
 	short *GetData() { return m_pData; }
 	float *GetFloatData() { return m_pFData; }
 
 	const short *GetData()	  const { return m_pData;  }
 	const float *GetFloatData() const { return m_pFData; }
 
+	/** Returns true if the heixels are stored in a memory-mapped tiles file. */
+	bool IsTiled() const { return m_pTiles != NULL; }
+
+	/** Returns true if the data array is a memory-mapped BT file. */
+	bool IsMapped() const { return m_pMapping != NULL; }
+
 	void SetScale(float sc) { m_fVMeters = sc; }
 	float GetScale() const { return m_fVMeters; }
 
-	bool HasData() const { return (m_pData != NULL || m_pFData != NULL); }
-	int MemoryNeededToLoad() const { return m_iColumns * m_iRows * (m_bFloatMode ? 4 : 2); }
-	int MemoryUsed() const { if (m_pData) return m_iColumns * m_iRows * 2;
-						 else if (m_pFData) return m_iColumns * m_iRows * 4;
+	bool HasData() const { return (m_pData != NULL || m_pFData != NULL || m_pTiles != NULL); }
+	size_t MemoryNeededToLoad() const { return (size_t) m_iColumns * m_iRows * (m_bFloatMode ? 4 : 2); }
+	// A tiled or mapped grid is paged in on demand, so it is not counted here
+	size_t MemoryUsed() const { if (m_pMapping) return 0;
+						 else if (m_pData) return (size_t) m_iColumns * m_iRows * 2;
+						 else if (m_pFData) return (size_t) m_iColumns * m_iRows * 4;
 						 else return 0; }
 
 	// Implement vtHeightField methods
@@ -186,11 +210,15 @@ public:
 	bool FindAltitudeAtPoint(const FPoint3 &p3, float &fAltitude,
 		bool bTrue = false, int iCultureFlags = 0,
 		FPoint3 *vNormal = NULL) const;
+	int FindAltitudesAtPoints(const FPoint3 *points, float *altitudes,
+		int count, bool bTrue = false, int iCultureFlags = 0) const;
 
 protected:
 	bool	m_bFloatMode;
 	short	*m_pData;
 	float	*m_pFData;
+	vtElevationTiles *m_pTiles;	// if not NULL, used instead of the arrays
+	vtMappedFile *m_pMapping;	// if not NULL, the array points into it
 	float	m_fVMeters;	// scale factor to convert stored heights to meters
 	float	m_fVerticalScale;
 
@@ -205,6 +233,10 @@ protected:
 	vtProjection	m_proj;		// a grid always has some projection
 
 	bool	_AllocateArray();
+	bool	_CopyMappedArray();
+	size_t	Offset(int i, int j) const { return (size_t) i * m_iRows + j; }
+	float	*_GetColumn(int i, std::vector<float> &buf);
+	short	*_GetColumn(int i, std::vector<short> &buf);
 	vtString	m_strOriginalDEMName;
 	vtString	m_strError;
 };
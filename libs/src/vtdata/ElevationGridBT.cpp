@@ -9,6 +9,7 @@
 //
 
 #include "ElevationGrid.h"
+#include "ElevationTiles.h"
 #include "ByteOrder.h"
 #include "vtdata/vtLog.h"
 #include "vtdata/FilePath.h"
@@ -288,6 +289,121 @@ bool vtElevationGrid::LoadBTData(const char *szFileName, bool progress_callback(
 	return true;
 }
 
+/**
+ * The name of the file in which MapBT keeps the height extents of a BT
+ * file, so that it does not have to read the whole file to find them.
+ */
+vtString vtElevationGrid::GetExtentsFilename(const char *szFileName)
+{
+	return vtString(szFileName) + ".minmax";
+}
+
+// The extents file holds the size and modification time of the BT file,
+//  then the extents.  When either of the former changes, it is out of date.
+static bool ReadExtentsFile(const char *szFileName, float &fMin, float &fMax)
+{
+	long long size, mtime, cached_size, cached_mtime;
+	if (!GetFileStamp(szFileName, size, mtime))
+		return false;
+
+	FILE *fp = vtFileOpen(vtElevationGrid::GetExtentsFilename(szFileName), "r");
+	if (!fp)
+		return false;
+	const int got = fscanf(fp, "%lld %lld %f %f", &cached_size, &cached_mtime,
+		&fMin, &fMax);
+	fclose(fp);
+	return (got == 4 && cached_size == size && cached_mtime == mtime);
+}
+
+static void WriteExtentsFile(const char *szFileName, float fMin, float fMax)
+{
+	long long size, mtime;
+	if (!GetFileStamp(szFileName, size, mtime))
+		return;
+
+	// This is only an optimization, so if the folder is read-only, so be it
+	FILE *fp = vtFileOpen(vtElevationGrid::GetExtentsFilename(szFileName), "w");
+	if (!fp)
+		return;
+	fprintf(fp, "%lld %lld %.9g %.9g\n", size, mtime, fMin, fMax);
+	fclose(fp);
+}
+
+/**
+ * Opens an uncompressed BT file by mapping it into memory, rather than
+ * reading it.  The grid's data array is then the file itself, so even a
+ * very large grid opens almost instantly, and its pages are only read from
+ * disk as they are used.
+ *
+ * The mapping is copy-on-write: the grid can be edited like any other, but
+ * the edits are never written back to the file, except by SaveToBT.  The
+ * file must not be changed by another program while it is mapped.
+ *
+ * This is only possible for a BT file which is not compressed, on a
+ * little-endian machine, since the data must be stored exactly as it is in
+ * memory; otherwise this method fails, and LoadFromBT should be used.
+ *
+ * The height extents are read from a small file next to the BT file (see
+ * GetExtentsFilename).  If there is none, or the BT file has changed since
+ * it was written, the extents are computed, which reads the whole file
+ * once, and written for the next time, if the folder can be written.
+ *
+ * \returns \c true if the file was successfully mapped.
+ */
+bool vtElevationGrid::MapBT(const char *szFileName, vtElevError *err)
+{
+	// Free buffers to prepare to receive new data
+	FreeData();
+
+	if (NativeByteOrder() != BO_LITTLE_ENDIAN)
+	{
+		if (err) *err = EGE_NOT_FORMAT;
+		m_strError = "Can only map BT files on a little-endian machine";
+		return false;
+	}
+	if (!LoadBTHeader(szFileName, err))
+		return false;
+
+	vtMappedFile *mapping = new vtMappedFile;
+	if (!mapping->Open(szFileName, vtMappedFile::COPY_ON_WRITE))
+	{
+		if (err) *err = EGE_FILE_OPEN;
+		m_strError.Format("Could not map '%s'", szFileName);
+		VTLOG(" MapBT: can't map '%s'\n", szFileName);
+		delete mapping;
+		return false;
+	}
+
+	// A compressed file has the gzip signature instead of the BT one.  The
+	//  elevation data always starts at offset 256, which is aligned, since
+	//  a mapping always starts on a page.
+	const uchar *data = mapping->GetData();
+	if (mapping->GetSize() < 256 + MemoryNeededToLoad() ||
+		strncmp((const char *) data, "binterr", 7))
+	{
+		if (err) *err = EGE_NOT_FORMAT;
+		m_strError.Format("'%s' is not an uncompressed BT file", szFileName);
+		VTLOG(" MapBT: '%s' is compressed or truncated\n", szFileName);
+		delete mapping;
+		return false;
+	}
+	m_pMapping = mapping;
+	if (m_bFloatMode)
+		m_pFData = (float *) (data + 256);
+	else
+		m_pData = (short *) (data + 256);
+
+	if (!ReadExtentsFile(szFileName, m_fMinHeight, m_fMaxHeight))
+	{
+		VTLOG1(" MapBT: scanning for the height extents\n");
+		ComputeHeightExtents();
+		WriteExtentsFile(szFileName, m_fMinHeight, m_fMaxHeight);
+	}
+
+	VTLOG("Mapped BT file: %d x %d, float %d\n", m_iColumns, m_iRows, m_bFloatMode);
+	return true;
+}
+
 
 /**
  * Writes the grid to a BT (Binary Terrain) file.
@@ -302,6 +418,11 @@ bool vtElevationGrid::LoadBTData(const char *szFileName, bool progress_callback(
 bool vtElevationGrid::SaveToBT(const char *szFileName,
 							   bool progress_callback(int), bool bGZip)
 {
+	// A mapped grid may be mapped from the very file we are about to write,
+	//  so it must be copied into memory first.
+	if (!_CopyMappedArray())
+		return false;
+
 	int w = m_iColumns;
 	int h = m_iRows;
 	short zone = (short) m_proj.GetUTMZone();
@@ -316,6 +437,10 @@ bool vtElevationGrid::SaveToBT(const char *szFileName,
 	short datasize = m_bFloatMode ? 4 : 2;
 	DataType datatype = m_bFloatMode ? DT_FLOAT : DT_SHORT;
 
+	// Buffers for the columns of a tiled grid, which has no column-major array
+	std::vector<float> fcolumn;
+	std::vector<short> scolumn;
+
 	if (bGZip == false)
 	{
 		// Use conventional IO
@@ -371,7 +496,7 @@ bool vtElevationGrid::SaveToBT(const char *szFileName,
 					if (progress_callback(i * 100 / w))
 					{ fclose(fp); return false; }
 				}
-				FWrite(m_pFData + (i * m_iRows), DT_FLOAT, m_iRows, fp, BO_LITTLE_ENDIAN);
+				FWrite(_GetColumn(i, fcolumn), DT_FLOAT, m_iRows, fp, BO_LITTLE_ENDIAN);
 			}
 		}
 		else
@@ -383,7 +508,7 @@ bool vtElevationGrid::SaveToBT(const char *szFileName,
 					if (progress_callback(i * 100 / w))
 					{ fclose(fp); return false; }
 				}
-				FWrite(m_pData + (i * m_iRows), DT_SHORT, m_iRows, fp, BO_LITTLE_ENDIAN);
+				FWrite(_GetColumn(i, scolumn), DT_SHORT, m_iRows, fp, BO_LITTLE_ENDIAN);
 			}
 		}
 #endif
@@ -427,7 +552,7 @@ bool vtElevationGrid::SaveToBT(const char *szFileName,
 					if (progress_callback(i * 100 / w))
 					{ gzclose(fp); return false; }
 				}
-				GZFWrite(m_pFData + (i * m_iRows), DT_FLOAT, m_iRows, fp, BO_LITTLE_ENDIAN);
+				GZFWrite(_GetColumn(i, fcolumn), DT_FLOAT, m_iRows, fp, BO_LITTLE_ENDIAN);
 			}
 		}
 		else
@@ -439,7 +564,7 @@ bool vtElevationGrid::SaveToBT(const char *szFileName,
 					if (progress_callback(i * 100 / w))
 					{ gzclose(fp); return false; }
 				}
-				GZFWrite(m_pData + (i * m_iRows), DT_SHORT, m_iRows, fp, BO_LITTLE_ENDIAN);
+				GZFWrite(_GetColumn(i, scolumn), DT_SHORT, m_iRows, fp, BO_LITTLE_ENDIAN);
 			}
 		}
 		gzclose(fp);
@@ -461,3 +586,26 @@ bool vtElevationGrid::SaveToBT(const char *szFileName,
 	return true;
 }
 
+/**
+ * Get a pointer to one column of the grid, in the same column-major layout
+ * as a BT file.  For a tiled grid, the column is gathered into the buffer.
+ */
+float *vtElevationGrid::_GetColumn(int i, std::vector<float> &buf)
+{
+	if (!m_pTiles)
+		return m_pFData + Offset(i, 0);
+	buf.resize(m_iRows);
+	for (int j = 0; j < m_iRows; j++)
+		buf[j] = m_pTiles->GetFloat(i, j);
+	return &buf[0];
+}
+
+short *vtElevationGrid::_GetColumn(int i, std::vector<short> &buf)
+{
+	if (!m_pTiles)
+		return m_pData + Offset(i, 0);
+	buf.resize(m_iRows);
+	for (int j = 0; j < m_iRows; j++)
+		buf[j] = m_pTiles->GetShort(i, j);
+	return &buf[0];
+}
@@ -181,6 +181,10 @@ bool vtElevationGrid::LoadFromFile(const char *szFileName,
 	{
 		Success = LoadFromTerragen(szFileName, progress_callback);
 	}
+	else if (!FileExt.CompareNoCase(".vtt"))
+	{
+		Success = LoadFromTiles(szFileName);
+	}
 	return Success;
 }
 
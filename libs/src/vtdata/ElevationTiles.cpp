@@ -0,0 +1,357 @@
+//
+// ElevationTiles.cpp
+//
+// Copyright (c) 2001-2011 Virtual Terrain Project.
+// Free for all uses, see license.txt for details.
+//
+
+#include <string.h>
+
+#include "ElevationTiles.h"
+#include "ElevationGrid.h"
+#include "vtLog.h"
+
+// The tiled data always starts at this offset, so that the tiles are
+//  aligned to page boundaries in memory.
+#define TILES_DATA_OFFSET	4096
+
+/**
+ * The header at the start of a tiles file.  It is stored in the byte order
+ * of the machine, which is checked when the file is opened.
+ */
+struct vtElevationTiles::Header
+{
+	char	magic[10];		// "vttiles1.0"
+	short	byte_order;		// always 1, to detect the wrong byte order
+	short	float_mode;		// 1 for floating-point heixels, 0 for shorts
+	short	tile_bits;		// tile size is (1 << tile_bits)
+	int		columns, rows;
+	float	vmeters;		// vertical scale factor (meters/units)
+	float	min_height, max_height;
+	double	left, right, bottom, top;	// coordinate extents
+};
+
+vtElevationTiles::vtElevationTiles()
+{
+	m_pTileData = NULL;
+	SetupMembers(0, 0, false, 8);
+}
+
+vtElevationTiles::~vtElevationTiles()
+{
+	Close();
+}
+
+void vtElevationTiles::SetupMembers(int iColumns, int iRows, bool bFloat,
+	int iTileBits)
+{
+	m_iColumns = iColumns;
+	m_iRows = iRows;
+	m_bFloatMode = bFloat;
+	m_iTileBits = iTileBits;
+	m_iTileMask = (1 << iTileBits) - 1;
+	m_iTilesAcross = (iColumns + m_iTileMask) >> iTileBits;
+	m_iTilesDown = (iRows + m_iTileMask) >> iTileBits;
+}
+
+/**
+ * Find the size of the file for a grid, checking that the grid is valid and
+ * that the size is one which this platform can address.
+ */
+bool vtElevationTiles::FileSize(int iColumns, int iRows, bool bFloat,
+	int iTileBits, size_t &size)
+{
+	if (iColumns < 1 || iRows < 1 || iTileBits < 4 || iTileBits > 12)
+		return false;
+
+	const size_t mask = ((size_t) 1 << iTileBits) - 1;
+	const size_t across = ((size_t) iColumns + mask) >> iTileBits;
+	const size_t down = ((size_t) iRows + mask) >> iTileBits;
+	const size_t elem = bFloat ? sizeof(float) : sizeof(short);
+	const size_t tile_bytes = (elem << (iTileBits * 2));
+	const size_t limit = (((size_t) -1) - TILES_DATA_OFFSET) / tile_bytes;
+	if (across > limit / down)
+		return false;
+	size = TILES_DATA_OFFSET + across * down * tile_bytes;
+	return true;
+}
+
+/**
+ * Create a new tiles file, large enough to hold a grid of the given size.
+ * The heixels are initially INVALID_ELEVATION.
+ *
+ * \param szFileName The file to create.
+ * \param iColumns, iRows The size of the grid.
+ * \param bFloat \c true for floating-point heixels, \c false for shorts.
+ * \param iTileBits The size of the tiles, as a power of two; the default
+ *		of 8 produces tiles of 256x256.
+ */
+bool vtElevationTiles::Create(const char *szFileName, int iColumns, int iRows,
+	bool bFloat, int iTileBits)
+{
+	Close();
+
+	if (iColumns < 1 || iRows < 1 || iTileBits < 4 || iTileBits > 12)
+		return false;
+
+	// Guard against a size which this platform can't address
+	size_t size;
+	if (!FileSize(iColumns, iRows, bFloat, iTileBits, size))
+	{
+		VTLOG("vtElevationTiles: a grid of %d x %d is too large to map.\n",
+			iColumns, iRows);
+		return false;
+	}
+	SetupMembers(iColumns, iRows, bFloat, iTileBits);
+	const size_t tiles = m_iTilesAcross * m_iTilesDown;
+
+	if (!m_File.Create(szFileName, size))
+		return false;
+	m_pTileData = m_File.GetData() + TILES_DATA_OFFSET;
+
+	Header *head = GetHeader();
+	memset(head, 0, sizeof(Header));
+	memcpy(head->magic, "vttiles1.0", 10);
+	head->byte_order = 1;
+	head->float_mode = bFloat ? 1 : 0;
+	head->tile_bits = (short) iTileBits;
+	head->columns = iColumns;
+	head->rows = iRows;
+	head->vmeters = 1.0f;
+	head->min_height = INVALID_ELEVATION;
+	head->max_height = INVALID_ELEVATION;
+
+	VTLOG("Created tiles file '%s': %d x %d, %d tiles of %d, %d MB\n",
+		szFileName, iColumns, iRows, (int) tiles, 1 << iTileBits,
+		(int) (size >> 20));
+
+	Fill(INVALID_ELEVATION);
+	return true;
+}
+
+/**
+ * Open an existing tiles file.  This is fast no matter how large the file
+ * is, since none of the heixels are read until they are used.
+ *
+ * \param szFileName The file to open.
+ * \param bWritable If true, changes to the heixels are written back to the
+ *		file.  Otherwise, the heixels may still be changed, but the changes
+ *		are private to this process and the file is left untouched.
+ */
+bool vtElevationTiles::Open(const char *szFileName, bool bWritable)
+{
+	Close();
+
+	if (!m_File.Open(szFileName, bWritable ? vtMappedFile::READ_WRITE :
+		vtMappedFile::COPY_ON_WRITE))
+		return false;
+
+	const Header *head = GetHeader();
+	if (m_File.GetSize() < TILES_DATA_OFFSET ||
+		strncmp(head->magic, "vttiles", 7) != 0)
+	{
+		VTLOG("vtElevationTiles: '%s' is not a tiles file.\n", szFileName);
+		Close();
+		return false;
+	}
+	if (head->byte_order != 1)
+	{
+		VTLOG("vtElevationTiles: '%s' was written with another byte order.\n",
+			szFileName);
+		Close();
+		return false;
+	}
+
+	// Check the header, and the length of the file, before using any of it
+	size_t needed;
+	if ((head->float_mode != 0 && head->float_mode != 1) ||
+		!FileSize(head->columns, head->rows, head->float_mode == 1,
+			head->tile_bits, needed))
+	{
+		VTLOG("vtElevationTiles: '%s' has a bad header.\n", szFileName);
+		Close();
+		return false;
+	}
+	if (m_File.GetSize() < needed)
+	{
+		VTLOG("vtElevationTiles: '%s' is truncated.\n", szFileName);
+		Close();
+		return false;
+	}
+	SetupMembers(head->columns, head->rows, head->float_mode == 1,
+		head->tile_bits);
+	m_pTileData = m_File.GetData() + TILES_DATA_OFFSET;
+	return true;
+}
+
+/**
+ * Close the file.  If it was writable, the operating system takes care of
+ * writing any changed tiles back to it.
+ */
+void vtElevationTiles::Close()
+{
+	m_File.Close();
+	m_pTileData = NULL;
+}
+
+void vtElevationTiles::SetExtents(const DRECT &ext)
+{
+	Header *head = GetHeader();
+	head->left = ext.left;
+	head->right = ext.right;
+	head->bottom = ext.bottom;
+	head->top = ext.top;
+}
+
+DRECT vtElevationTiles::GetExtents() const
+{
+	const Header *head = GetHeader();
+	return DRECT(head->left, head->top, head->right, head->bottom);
+}
+
+void vtElevationTiles::SetScale(float fVMeters)
+{
+	GetHeader()->vmeters = fVMeters;
+}
+
+float vtElevationTiles::GetScale() const
+{
+	return GetHeader()->vmeters;
+}
+
+void vtElevationTiles::SetHeightExtents(float fMin, float fMax)
+{
+	GetHeader()->min_height = fMin;
+	GetHeader()->max_height = fMax;
+}
+
+void vtElevationTiles::GetHeightExtents(float &fMin, float &fMax) const
+{
+	fMin = GetHeader()->min_height;
+	fMax = GetHeader()->max_height;
+}
+
+/**
+ * Set every heixel to the same raw value.  The padding past the edges of
+ * the grid is filled too, which is faster and keeps the file tidy.
+ */
+void vtElevationTiles::Fill(float fValue)
+{
+	const size_t count = (m_iTilesAcross * m_iTilesDown) << (m_iTileBits * 2);
+	if (m_bFloatMode)
+	{
+		float *data = (float *) m_pTileData;
+		for (size_t n = 0; n < count; n++)
+			data[n] = fValue;
+	}
+	else
+	{
+		short *data = (short *) m_pTileData;
+		const short svalue = (short) fValue;
+		for (size_t n = 0; n < count; n++)
+			data[n] = svalue;
+	}
+}
+
+
+///////////////////////////////////////////////////////////////////////
+// Methods of vtElevationGrid which deal with tiles files
+//
+
+/**
+ * Open a tiles file, as written by SaveToTiles or CreateTiled.
+ * \par
+ * The heixels are not read; the file is memory-mapped, and each tile is
+ * paged in by the operating system the first time it is used.  This makes
+ * opening even a very large grid nearly instant.  The CRS is read from the
+ * .prj file of the same name.
+ *
+ * \param szFileName The file to open.
+ * \param bWritable If true, changes to the grid are written back to the file.
+ *		Otherwise the grid can still be changed, but the file is not.
+ * \returns \c true if the file was successfully opened.
+ */
+bool vtElevationGrid::LoadFromTiles(const char *szFileName, bool bWritable)
+{
+	// Free buffers to prepare to receive new data
+	FreeData();
+
+	vtElevationTiles *tiles = new vtElevationTiles;
+	if (!tiles->Open(szFileName, bWritable))
+	{
+		m_strError.Format("Could not open tiles file '%s'", szFileName);
+		delete tiles;
+		return false;
+	}
+	if (!m_proj.ReadProjFile(szFileName))
+	{
+		m_strError = "Could not read the CRS of the tiles file";
+		delete tiles;
+		return false;
+	}
+	m_bFloatMode = tiles->IsFloatMode();
+	m_iColumns = tiles->GetColumns();
+	m_iRows = tiles->GetRows();
+	m_fVMeters = tiles->GetScale();
+	m_fVerticalScale = 1.0f;
+	SetEarthExtents(tiles->GetExtents());
+	ComputeCornersFromExtents();
+
+	m_pTiles = tiles;
+
+	// The height extents were stored when the file was written; computing
+	//  them here would page in the entire grid.
+	m_pTiles->GetHeightExtents(m_fMinHeight, m_fMaxHeight);
+	if (m_fMinHeight == INVALID_ELEVATION || m_fMaxHeight == INVALID_ELEVATION)
+		ComputeHeightExtents();
+
+	VTLOG("Opened tiles file: %d x %d, float %d, tile size %d\n",
+		m_iColumns, m_iRows, m_bFloatMode, m_pTiles->GetTileSize());
+	return true;
+}
+
+/**
+ * Write the grid to a tiles file, which can be opened quickly later with
+ * LoadFromTiles.  The CRS is written to a .prj file of the same name.
+ *
+ * \param szFileName	The file name to write to.
+ * \param progress_callback If supplied, this function will be called back
+ *				with a value of 0 to 100 as the operation progresses.
+ * \param iTileBits The size of the tiles as a power of two, default 8 (256x256).
+ */
+bool vtElevationGrid::SaveToTiles(const char *szFileName,
+	bool progress_callback(int), int iTileBits) const
+{
+	vtElevationTiles tiles;
+	if (!tiles.Create(szFileName, m_iColumns, m_iRows, m_bFloatMode, iTileBits))
+		return false;
+
+	tiles.SetExtents(m_EarthExtents);
+	tiles.SetScale(m_fVMeters);
+	tiles.SetHeightExtents(m_fMinHeight, m_fMaxHeight);
+
+	// Copy the raw (unscaled) heixels, one row of tiles at a time, so that
+	//  only a few tiles of the output are being written at once.
+	const int size = tiles.GetTileSize();
+	for (int j0 = 0; j0 < m_iRows; j0 += size)
+	{
+		if (progress_callback != NULL && progress_callback(j0 * 100 / m_iRows))
+		{
+			tiles.Close();
+			vtDeleteFile(szFileName);
+			return false;
+		}
+		const int j1 = std::min(j0 + size, m_iRows);
+		for (int i = 0; i < m_iColumns; i++)
+		{
+			for (int j = j0; j < j1; j++)
+			{
+				if (m_bFloatMode)
+					tiles.SetFloat(i, j, m_pTiles ? m_pTiles->GetFloat(i, j) : m_pFData[Offset(i, j)]);
+				else
+					tiles.SetShort(i, j, m_pTiles ? m_pTiles->GetShort(i, j) : m_pData[Offset(i, j)]);
+			}
+		}
+	}
+	return m_proj.WriteProjFile(ChangeFileExtension(szFileName, ".prj"));
+}
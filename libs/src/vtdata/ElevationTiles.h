@@ -0,0 +1,88 @@
+//
+// ElevationTiles.h
+//
+// Copyright (c) 2001-2011 Virtual Terrain Project.
+// Free for all uses, see license.txt for details.
+//
+
+#ifndef ELEVATIONTILESH
+#define ELEVATIONTILESH
+
+#include "MathTypes.h"
+#include "FilePath.h"
+
+/**
+ * Storage for the heixels of a very large elevation grid, in a file which
+ * is memory-mapped rather than read into memory.
+ *
+ * The grid is divided into square tiles (by default, 256x256).  Within each
+ * tile, the heixels are stored row by row, and the tiles themselves are
+ * stored row by row in the file.  Any small neighborhood of the grid is
+ * therefore contiguous in the file, so the operating system pages in only
+ * the tiles which are actually touched.  Opening a file is nearly instant
+ * regardless of its size.
+ *
+ * The heixels are raw stored values (no vertical scale is applied); the
+ * vtElevationGrid which owns this storage takes care of that.
+ * All indexing is done with size_t, so grids larger than 2 GB are supported
+ * on 64-bit platforms.
+ */
+class vtElevationTiles
+{
+public:
+	vtElevationTiles();
+	~vtElevationTiles();
+
+	bool Create(const char *szFileName, int iColumns, int iRows, bool bFloat,
+		int iTileBits = 8);
+	bool Open(const char *szFileName, bool bWritable = false);
+	void Close();
+
+	bool IsOpen() const { return m_File.IsOpen(); }
+	bool IsWritable() const { return m_File.GetMode() == vtMappedFile::READ_WRITE; }
+	bool IsFloatMode() const { return m_bFloatMode; }
+	int GetColumns() const { return m_iColumns; }
+	int GetRows() const { return m_iRows; }
+	int GetTileSize() const { return 1 << m_iTileBits; }
+	size_t GetFileSize() const { return m_File.GetSize(); }
+
+	// Descriptive values which are kept in the file header
+	void SetExtents(const DRECT &ext);
+	DRECT GetExtents() const;
+	void SetScale(float fVMeters);
+	float GetScale() const;
+	void SetHeightExtents(float fMin, float fMax);
+	void GetHeightExtents(float &fMin, float &fMax) const;
+
+	/// Offset of a heixel from the start of the tiled data.
+	size_t Index(int i, int j) const
+	{
+		const size_t tile = (size_t) (j >> m_iTileBits) * m_iTilesAcross +
+			(i >> m_iTileBits);
+		return (tile << (m_iTileBits * 2)) +
+			((size_t) (j & m_iTileMask) << m_iTileBits) + (i & m_iTileMask);
+	}
+
+	short GetShort(int i, int j) const { return ((const short *)m_pTileData)[Index(i, j)]; }
+	float GetFloat(int i, int j) const { return ((const float *)m_pTileData)[Index(i, j)]; }
+	void SetShort(int i, int j, short value) { ((short *)m_pTileData)[Index(i, j)] = value; }
+	void SetFloat(int i, int j, float value) { ((float *)m_pTileData)[Index(i, j)] = value; }
+
+	void Fill(float fValue);
+
+protected:
+	struct Header;
+	Header *GetHeader() const { return (Header *) m_File.GetData(); }
+	void SetupMembers(int iColumns, int iRows, bool bFloat, int iTileBits);
+	static bool FileSize(int iColumns, int iRows, bool bFloat, int iTileBits,
+		size_t &size);
+
+	vtMappedFile m_File;
+	uchar	*m_pTileData;	// start of the first tile within the mapping
+	bool	m_bFloatMode;
+	int		m_iColumns, m_iRows;
+	int		m_iTileBits, m_iTileMask;
+	size_t	m_iTilesAcross, m_iTilesDown;
+};
+
+#endif	// ELEVATIONTILESH
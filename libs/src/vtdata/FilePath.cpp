@@ -16,12 +16,14 @@
 #ifdef VTUNIX
 # include <unistd.h>
 # include <sys/stat.h>
+# include <sys/mman.h>
 #if __GNUC__ == 4 && __GNUC_MINOR__ >= 3
   #include <cstdlib>
 #endif
 #else
 # include <direct.h>
 # include <io.h>
+# include <windows.h>	// for the file mapping API
  #ifdef _MSC_VER	// MSVC also has sys/stat
  # include <sys/stat.h>
  #endif
@@ -548,6 +550,20 @@ int GetFileSize(const char *fname)
 	return buf.st_size;
 }
 
+/**
+ * Get the size and modification time of a file.  A file derived from it,
+ * such as a cache, is out of date when either of them changes.
+ */
+bool GetFileStamp(const char *fname, long long &size, long long &mtime)
+{
+	struct stat buf;
+	if (stat(fname, &buf) != 0)
+		return false;
+	size = buf.st_size;
+	mtime = buf.st_mtime;
+	return true;
+}
+
 void SetEnvironmentVar(const vtString &var, const vtString &value)
 {
 #if VTUNIX
@@ -876,3 +892,151 @@ FILE *vtFileOpen(const wstring &fname_ws, const char *mode)
 }
 
 #endif // SUPPORT_WSTRING
+
+
+///////////////////////////////////////////////////////////////////////
+// vtMappedFile
+//
+
+vtMappedFile::vtMappedFile()
+{
+	m_pData = NULL;
+	m_Size = 0;
+	m_Mode = READ_ONLY;
+#if WIN32
+	m_hMapping = NULL;
+#endif
+}
+
+vtMappedFile::~vtMappedFile()
+{
+	Close();
+}
+
+/**
+ * Map an existing file into memory.
+ *
+ * \param fname_utf8 The file to open, as a UTF-8 encoded filename.
+ * \param mode READ_ONLY, READ_WRITE, or COPY_ON_WRITE.  With COPY_ON_WRITE,
+ *		the mapping can be modified but the file itself is never changed.
+ * \return true if successful.
+ */
+bool vtMappedFile::Open(const char *fname_utf8, Mode mode)
+{
+	Close();
+
+	FILE *fp = vtFileOpen(fname_utf8, mode == READ_WRITE ? "r+b" : "rb");
+	if (!fp)
+		return false;
+
+	// Use 64-bit offsets, so that files larger than 2 GB can be mapped
+#if WIN32
+	_fseeki64(fp, 0, SEEK_END);
+	__int64 size = _ftelli64(fp);
+#else
+	fseeko(fp, 0, SEEK_END);
+	off_t size = ftello(fp);
+#endif
+	bool success = (size > 0 && MapFile(fp, (size_t) size, mode));
+	fclose(fp);
+	return success;
+}
+
+/**
+ * Create a new file of the given size, and map it into memory for writing.
+ * Any existing file of that name is overwritten.
+ */
+bool vtMappedFile::Create(const char *fname_utf8, size_t size)
+{
+	Close();
+
+	FILE *fp = vtFileOpen(fname_utf8, "w+b");
+	if (!fp)
+		return false;
+
+#if !WIN32
+	// On Windows, creating the mapping object extends the file for us
+	if (ftruncate(fileno(fp), (off_t) size) != 0)
+	{
+		VTLOG("vtMappedFile: could not extend '%s' to %lu bytes\n",
+			fname_utf8, (unsigned long) size);
+		fclose(fp);
+		return false;
+	}
+#endif
+	bool success = MapFile(fp, size, READ_WRITE);
+	fclose(fp);
+	return success;
+}
+
+bool vtMappedFile::MapFile(FILE *fp, size_t size, Mode mode)
+{
+#if WIN32
+	HANDLE hFile = (HANDLE) _get_osfhandle(_fileno(fp));
+	DWORD protect = (mode == READ_ONLY) ? PAGE_READONLY :
+		(mode == READ_WRITE) ? PAGE_READWRITE : PAGE_WRITECOPY;
+	DWORD access = (mode == READ_ONLY) ? FILE_MAP_READ :
+		(mode == READ_WRITE) ? FILE_MAP_WRITE : FILE_MAP_COPY;
+
+	unsigned __int64 size64 = size;
+	m_hMapping = CreateFileMapping(hFile, NULL, protect,
+		(DWORD) (size64 >> 32), (DWORD) (size64 & 0xFFFFFFFF), NULL);
+	if (!m_hMapping)
+		return false;
+	m_pData = (uchar *) MapViewOfFile(m_hMapping, access, 0, 0, size);
+	if (!m_pData)
+	{
+		CloseHandle(m_hMapping);
+		m_hMapping = NULL;
+		return false;
+	}
+#else
+	int prot = (mode == READ_ONLY) ? PROT_READ : (PROT_READ | PROT_WRITE);
+	int flags = (mode == COPY_ON_WRITE) ? MAP_PRIVATE : MAP_SHARED;
+	void *addr = mmap(NULL, size, prot, flags, fileno(fp), 0);
+	if (addr == MAP_FAILED)
+	{
+		VTLOG("vtMappedFile: mmap of %lu bytes failed, errno %d\n",
+			(unsigned long) size, errno);
+		return false;
+	}
+	m_pData = (uchar *) addr;
+#endif
+	m_Size = size;
+	m_Mode = mode;
+	return true;
+}
+
+/**
+ * Unmap the file.  For READ_WRITE mappings, any changes are written back
+ * to the file by the operating system.
+ */
+void vtMappedFile::Close()
+{
+	if (!m_pData)
+		return;
+#if WIN32
+	UnmapViewOfFile(m_pData);
+	CloseHandle(m_hMapping);
+	m_hMapping = NULL;
+#else
+	munmap(m_pData, m_Size);
+#endif
+	m_pData = NULL;
+	m_Size = 0;
+}
+
+/**
+ * The granularity of offsets in the file at which a mapping may begin.
+ * This is 64 KB on Windows, and the page size (usually 4 KB) elsewhere.
+ */
+size_t vtMappedFile::GetGranularity()
+{
+#if WIN32
+	SYSTEM_INFO info;
+	GetSystemInfo(&info);
+	return (size_t) info.dwAllocationGranularity;
+#else
+	return (size_t) sysconf(_SC_PAGESIZE);
+#endif
+}
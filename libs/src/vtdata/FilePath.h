@@ -101,6 +101,7 @@ vtString GetExtension(const vtString &fname, bool bFull = true);
 vtString ChangeFileExtension(const char *input, const char *extension);
 bool vtFileExists(const char *fname);
 int GetFileSize(const char *fname);
+bool GetFileStamp(const char *fname, long long &size, long long &mtime);
 
 void SetEnvironmentVar(const vtString &var, const vtString &value);
 
@@ -156,5 +157,65 @@ FILE *vtFileOpen(wchar_t *fname_wide, const char *mode);
 FILE *vtFileOpen(const std::wstring &fname_ws, const char *mode);
 #endif
 
+
+/////////////////////////////////////////////
+// Portable memory-mapped file access.
+
+/**
+ * A portable class for mapping a file into memory.
+ *
+ * The operating system pages the contents in on demand, so only the parts
+ * of the file which are actually touched consume physical memory, and
+ * several processes which map the same file share those pages.
+ *
+ * Example of use:
+\code
+	vtMappedFile map;
+	if (map.Open("C:/temp/big.bin", vtMappedFile::READ_ONLY))
+	{
+		const uchar *data = map.GetData();
+		printf("First byte of %d: %d\n", (int) map.GetSize(), data[0]);
+	}
+\endcode
+ */
+class vtMappedFile
+{
+public:
+	enum Mode
+	{
+		READ_ONLY,		/// Map for reading only.
+		READ_WRITE,		/// Writes go back to the file.
+		COPY_ON_WRITE	/// Writes go to private copies of the touched pages.
+	};
+
+	vtMappedFile();
+	~vtMappedFile();
+
+	bool Open(const char *fname_utf8, Mode mode = READ_ONLY);
+	bool Create(const char *fname_utf8, size_t size);
+	void Close();
+
+	bool IsOpen() const { return m_pData != NULL; }
+	Mode GetMode() const { return m_Mode; }
+
+	/// Get the address of the first byte of the mapping.
+	uchar *GetData() const { return m_pData; }
+
+	/// Get the size of the mapping, in bytes.
+	size_t GetSize() const { return m_Size; }
+
+	static size_t GetGranularity();
+
+protected:
+	bool MapFile(FILE *fp, size_t size, Mode mode);
+
+	uchar	*m_pData;
+	size_t	m_Size;
+	Mode	m_Mode;
+#if WIN32
+	void	*m_hMapping;
+#endif
+};
+
 #endif // FILEPATHH
 
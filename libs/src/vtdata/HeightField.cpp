@@ -5,10 +5,12 @@
 // Free for all uses, see license.txt for details.
 //
 
+#include <float.h>
 #include "HeightField.h"
 #include "vtDIB.h"
 #include "vtLog.h"
 #include "FilePath.h"
+#include "ShadingContext.h"
 
 //
 // Class implementation: ColorMap
@@ -265,6 +267,62 @@ bool vtHeightField3d::ConvertEarthToSurfacePoint(const DPoint2 &epos,
 	return FindAltitudeAtPoint(p3, p3.y, bTrue, iCultureFlags);
 }
 
+/**
+ * Find the altitude of many points at once.  This is much faster than
+ * calling FindAltitudeAtPoint for each point, because the subclasses of
+ * vtHeightField3d override it to avoid repeating the per-point work.
+ * This default implementation simply tests each point in turn.
+ *
+ * \param points The points to test, in world coordinates.  Only the X and Z
+ *		values are used.
+ * \param altitudes An array of at least 'count' values, which receives the
+ *		altitude of each point, or 0 for points which are not on the surface.
+ * \param count The number of points.
+ * \param bTrue True to test true elevation.  False to test the displayed
+ *		elevation (possibly exaggerated.)
+ * \param iCultureFlags Which culture to test, as with FindAltitudeAtPoint.
+ *
+ * \return The number of points which were on the surface.
+ */
+int vtHeightField3d::FindAltitudesAtPoints(const FPoint3 *points,
+	float *altitudes, int count, bool bTrue, int iCultureFlags) const
+{
+	int found = 0;
+	for (int i = 0; i < count; i++)
+	{
+		if (FindAltitudeAtPoint(points[i], altitudes[i], bTrue, iCultureFlags))
+			found++;
+		else
+			altitudes[i] = 0.0f;
+	}
+	return found;
+}
+
+/**
+ * Converts many earth coordinates to world coordinates on the surface of
+ * the heightfield at once, using FindAltitudesAtPoints.
+ *
+ * \return The number of points which had an elevation.
+ */
+int vtHeightField3d::ConvertEarthToSurfacePoints(const DPoint2 *epos,
+	FPoint3 *p3, int count, int iCultureFlags, bool bTrue)
+{
+	if (count < 1)
+		return 0;
+
+	std::vector<float> altitudes(count);
+	for (int i = 0; i < count; i++)
+	{
+		m_Conversion.ConvertFromEarth(epos[i], p3[i].x, p3[i].z);
+		p3[i].y = 0.0f;
+	}
+	const int found = FindAltitudesAtPoints(p3, &altitudes[0], count, bTrue,
+		iCultureFlags);
+	for (int i = 0; i < count; i++)
+		p3[i].y = altitudes[i];
+	return found;
+}
+
 /**
  * Tests whether a given point is within the current terrain
  */
@@ -332,6 +390,7 @@ vtHeightFieldGrid3d::vtHeightFieldGrid3d()
 	m_iRows = 0;
 	m_fXStep = 0.0f;
 	m_fZStep = 0.0f;
+	m_iPyramidBits = 0;
 }
 
 void vtHeightFieldGrid3d::Initialize(const LinearUnits units,
@@ -343,6 +402,7 @@ void vtHeightFieldGrid3d::Initialize(const LinearUnits units,
 
 	m_iColumns = cols;
 	m_iRows = rows;
+	FreeMaxPyramid();
 
 	m_fXStep = m_WorldExtents.Width() / (m_iColumns-1);
 	m_fZStep = -m_WorldExtents.Height() / (m_iRows-1);
@@ -534,6 +594,10 @@ int vtHeightFieldGrid3d::FindNumUnknown()
  * there is a small chance that it will give results that are off by a small
  * distance (less than 1 grid element)
  *
+ * If the grid has a max pyramid (see BuildMaxPyramid), stretches of the ray
+ * which are well above the surface are skipped without testing each point,
+ * so the test takes time roughly proportional to the log of the grid size.
+ *
  * \return true if hit terrain.  The resulting point of intersection is
  *		placed in the 'result' argument.
  */
@@ -567,7 +631,16 @@ bool vtHeightFieldGrid3d::CastRayToSurface(const FPoint3 &point,
 
 	bool found_above = false;
 	FPoint3 p = point, lastp = point;
-	while (true)
+	if (HasMaxPyramid())
+	{
+		double t_above, t_below;
+		if (!MarchMaxPyramid(point, dir, FLT_MAX, adjust, false, t_above,
+			t_below, found_above))
+			return false;
+		lastp = point + dir * (float) t_above;
+		p = point + dir * (float) t_below;
+	}
+	else while (true)
 	{
 		// are we out of bounds and moving away?
 		if (p.x < m_WorldExtents.left && dir2.x < 0)
@@ -640,6 +713,15 @@ bool vtHeightFieldGrid3d::LineOfSight(const FPoint3 &point1,
 	int steps = (int) (mag2 / smallest) + 1;
 	if (steps < 2)
 		steps = 2;
+
+	if (HasMaxPyramid())
+	{
+		// Test the same points, but skip those which are certainly visible
+		double t_above, t_below;
+		bool bFoundAbove;
+		return !MarchMaxPyramid(point1, dir, 1.0, 1.0 / steps, true, t_above,
+			t_below, bFoundAbove);
+	}
 	dir /= (float) steps;
 
 	FPoint3 p = point1;
@@ -653,6 +735,239 @@ bool vtHeightFieldGrid3d::LineOfSight(const FPoint3 &point1,
 	return true;	// visible, didn't hit the ground
 }
 
+/**
+ * Build a pyramid of maximum heights, which greatly speeds up
+ * CastRayToSurface and LineOfSight on large grids.
+ *
+ * The bottom level of the pyramid holds the highest heixel in each block of
+ * cells, and each level above holds the highest value of four blocks below
+ * it, up to a single block for the whole grid.  A ray can then skip any
+ * block which it passes entirely above.
+ *
+ * The maxima are taken from the heights with the grid's current vertical
+ * exaggeration applied, the same heights which the rays are tested against.
+ * The pyramid is a copy of them, so it must be built again (or freed with
+ * FreeMaxPyramid) whenever the heights or the vertical scale change.
+ *
+ * \param iBaseBits The size of the smallest blocks, as a power of two.  The
+ *		default of 3 (8x8 cells) uses 2% as much memory as a grid of floats.
+ * \param progress_callback If supplied, will be called with values from 0 to 100.
+ */
+bool vtHeightFieldGrid3d::BuildMaxPyramid(int iBaseBits,
+	bool progress_callback(int))
+{
+	FreeMaxPyramid();
+	if (m_iColumns < 2 || m_iRows < 2)
+		return false;
+
+	VTLOG("BuildMaxPyramid: grid %d x %d,", m_iColumns, m_iRows);
+	m_iPyramidBits = iBaseBits;
+	const int block = 1 << iBaseBits;
+
+	// The bottom level, from the heixels.  Each block includes the heixels
+	//  on all four of its edges, since those are the corners of its cells.
+	MaxLevel base;
+	base.iWidth = (m_iColumns - 2) / block + 1;
+	base.iHeight = (m_iRows - 2) / block + 1;
+	base.m_Max.resize((size_t) base.iWidth * base.iHeight);
+
+	const int band = 16;
+	for (int bz0 = 0; bz0 < base.iHeight; bz0 += band)
+	{
+		if (progress_callback != NULL)
+			progress_callback(bz0 * 100 / base.iHeight);
+
+		const int bz1 = std::min(bz0 + band, base.iHeight);
+#pragma omp parallel for
+		for (int bz = bz0; bz < bz1; bz++)
+		{
+			const int j0 = bz * block, j1 = std::min(j0 + block, m_iRows - 1);
+			for (int bx = 0; bx < base.iWidth; bx++)
+			{
+				const int i0 = bx * block, i1 = std::min(i0 + block, m_iColumns - 1);
+				float fMax = -FLT_MAX;
+				FPoint3 loc;
+				for (int j = j0; j <= j1; j++)
+					for (int i = i0; i <= i1; i++)
+					{
+						GetWorldLocation(i, j, loc);
+						if (loc.y != INVALID_ELEVATION && loc.y > fMax)
+							fMax = loc.y;
+					}
+				base.m_Max[(size_t) bz * base.iWidth + bx] = fMax;
+			}
+		}
+	}
+	m_MaxPyramid.push_back(base);
+
+	// Each level above, until a single block covers the grid
+	while (m_MaxPyramid.back().iWidth > 1 || m_MaxPyramid.back().iHeight > 1)
+	{
+		const MaxLevel &below = m_MaxPyramid.back();
+		MaxLevel level;
+		level.iWidth = (below.iWidth + 1) / 2;
+		level.iHeight = (below.iHeight + 1) / 2;
+		level.m_Max.resize((size_t) level.iWidth * level.iHeight);
+		for (int z = 0; z < level.iHeight; z++)
+			for (int x = 0; x < level.iWidth; x++)
+			{
+				float fMax = -FLT_MAX;
+				for (int z2 = z*2; z2 < std::min(z*2 + 2, below.iHeight); z2++)
+					for (int x2 = x*2; x2 < std::min(x*2 + 2, below.iWidth); x2++)
+						fMax = std::max(fMax, below.m_Max[(size_t) z2 * below.iWidth + x2]);
+				level.m_Max[(size_t) z * level.iWidth + x] = fMax;
+			}
+		m_MaxPyramid.push_back(level);
+	}
+	VTLOG(" %d levels.\n", (int) m_MaxPyramid.size());
+	return true;
+}
+
+/**
+ * Free the max pyramid which was made by BuildMaxPyramid.
+ */
+void vtHeightFieldGrid3d::FreeMaxPyramid()
+{
+	m_MaxPyramid.clear();
+}
+
+// The cell or block which contains a coordinate, when moving in the given
+//  direction.  A coordinate exactly on a boundary belongs to the side which
+//  is being moved into.
+static inline int CellAlong(double g, double dg, int shift)
+{
+	int cell = (int) floor(g);
+	if (dg < 0 && cell == g)
+		cell--;
+	return (cell < 0 ? 0 : cell) >> shift;
+}
+
+// The parameter at which a ray leaves a block along one axis.
+static inline double ExitAlong(double g0, double dg, int block, int shift)
+{
+	if (dg > 0)
+		return ((double) ((block + 1) << shift) - g0) / dg;
+	if (dg < 0)
+		return ((double) (block << shift) - g0) / dg;
+	return DBL_MAX;
+}
+
+/**
+ * Test points along the ray point + dir * t, at each multiple of dt up to
+ * tmax, using the max pyramid to skip the blocks which the ray passes over.
+ * The points tested are the same as the simple stepping which is done
+ * without a pyramid.
+ *
+ * \param bStrict If true, a point only counts as below the surface when it
+ *		is strictly lower, as LineOfSight tests it.  If false, a point exactly
+ *		on the surface also counts, as CastRayToSurface tests it.
+ *
+ * \return true if a point below the surface was found, at t_below.  If any
+ *		point on the grid before it was above the surface, bFoundAbove is set
+ *		and the last such point is at t_above.
+ */
+bool vtHeightFieldGrid3d::MarchMaxPyramid(const FPoint3 &point,
+	const FPoint3 &dir, double tmax, double dt, bool bStrict,
+	double &t_above, double &t_below, bool &bFoundAbove) const
+{
+	bFoundAbove = false;
+
+	// Work in grid coordinates, where each cell is 1x1
+	const double gx0 = (point.x - m_WorldExtents.left) / m_fXStep;
+	const double gz0 = (point.z - m_WorldExtents.bottom) / -m_fZStep;
+	const double gdx = dir.x / m_fXStep;
+	const double gdz = dir.z / -m_fZStep;
+
+	// Clip to the part of the ray which is over the grid
+	double t0 = 0, t1 = tmax;
+	const double gmax[2] = { (double) m_iColumns - 1, (double) m_iRows - 1 };
+	const double g0[2] = { gx0, gz0 }, dg[2] = { gdx, gdz };
+	for (int a = 0; a < 2; a++)
+	{
+		if (dg[a] == 0)
+		{
+			if (g0[a] < 0 || g0[a] > gmax[a])
+				return false;
+			continue;
+		}
+		double ta = (0 - g0[a]) / dg[a], tb = (gmax[a] - g0[a]) / dg[a];
+		if (ta > tb)
+			std::swap(ta, tb);
+		t0 = std::max(t0, ta);
+		t1 = std::min(t1, tb);
+	}
+	if (t0 > t1)
+		return false;
+
+	const int top = (int) m_MaxPyramid.size() - 1;
+	int level = top;
+	double t = t0;
+	float alt;
+	while (true)
+	{
+		// The block at this level which the ray is in, and where it leaves it
+		const int shift = m_iPyramidBits + level;
+		const MaxLevel &ml = m_MaxPyramid[level];
+		const int bx = std::min(CellAlong(gx0 + gdx * t, gdx, shift), ml.iWidth - 1);
+		const int bz = std::min(CellAlong(gz0 + gdz * t, gdz, shift), ml.iHeight - 1);
+		double t_exit = std::min(ExitAlong(gx0, gdx, bx, shift),
+			ExitAlong(gz0, gdz, bz, shift));
+		if (t_exit > t1)
+			t_exit = t1;
+		if (t_exit < t)
+			t_exit = t;
+
+		// The lowest point of the ray within the block is at one end
+		const double y = point.y + dir.y * (dir.y < 0 ? t_exit : t);
+		if (y > ml.m_Max[(size_t) bz * ml.iWidth + bx])
+		{
+			// Entirely above this block, skip it and try a larger step.  The
+			//  last point tested within it is the last one known above.
+			const double k1 = floor(t_exit / dt);
+			if (k1 * dt >= t)
+			{
+				bFoundAbove = true;
+				t_above = k1 * dt;
+			}
+			if (level < top)
+				level++;
+		}
+		else if (level > 0)
+		{
+			// Look more closely
+			level--;
+			continue;
+		}
+		else
+		{
+			// Test each point within the smallest block
+			const double k1 = floor(t_exit / dt);
+			for (double k = ceil(t / dt); k <= k1; k++)
+			{
+				const FPoint3 p = point + dir * (float) (k * dt);
+				if (!FindAltitudeAtPoint(p, alt))
+					continue;
+				if (bStrict ? p.y >= alt : p.y > alt)
+				{
+					bFoundAbove = true;
+					t_above = k * dt;
+				}
+				else
+				{
+					t_below = k * dt;
+					return true;
+				}
+			}
+		}
+		if (t_exit >= t1)
+			break;
+
+		// Move on, making sure the ray doesn't get stuck on a boundary
+		t = std::max(t_exit, t + dt * 1e-6);
+	}
+	return false;
+}
+
 /**
  * Use the height data in the grid to fill a bitmap with colors.
  *
@@ -663,12 +978,13 @@ bool vtHeightFieldGrid3d::LineOfSight(const FPoint3 &point1,
  * \param nodata		The color to use for NODATA areas, where there are no elevation values.
  * \param progress_callback If supplied, this function will be called back
  *			with a value of 0 to 100 as the operation progresses.
+ * \param pShading		Optional, see ColorDibFromTable.
  *
  * \return true if any invalid elevation values were encountered.
  */
 bool vtHeightFieldGrid3d::ColorDibFromElevation(vtBitmapBase *pBM,
 	const ColorMap *cmap, int iGranularity, const RGBAi &nodata,
-	bool progress_callback(int))
+	bool progress_callback(int), const vtShadingContext *pShading)
 {
 	if (!pBM || !cmap)
 		return false;
@@ -697,9 +1013,13 @@ bool vtHeightFieldGrid3d::ColorDibFromElevation(vtBitmapBase *pBM,
 	std::vector<RGBi> table;
 	cmap->GenerateColors(table, iGranularity, fMin, fMax);
 
-	return ColorDibFromTable(pBM, table, fMin, fMax, nodata, progress_callback);
+	return ColorDibFromTable(pBM, table, fMin, fMax, nodata, progress_callback,
+		pShading);
 }
 
+// The number of rows which are colored between calls to the progress callback
+#define COLOR_BAND	64
+
 /**
  * Use the height data in the grid and a colormap fill a bitmap with colors.
  * Any undefined heixels in the source will be fill with red (255,0,0).
@@ -710,12 +1030,16 @@ bool vtHeightFieldGrid3d::ColorDibFromElevation(vtBitmapBase *pBM,
  * \param nodata		The color to use for NODATA areas, where there are no elevation values.
  * \param progress_callback If supplied, this function will be called back
  *			with a value of 0 to 100 as the operation progresses.
+ * \param pShading		Optional.  If supplied, each texel is also shaded as it is
+ *			colored, saving a second pass over the bitmap.  The context must
+ *			already be set up for the size of the bitmap, and its light set with
+ *			vtShadingContext::SetLight.
  *
  * \return true if any invalid elevation values were encountered.
  */
 bool vtHeightFieldGrid3d::ColorDibFromTable(vtBitmapBase *pBM,
 	   std::vector<RGBi> &table, float fMin, float fMax, const RGBAi &nodata,
-	   bool progress_callback(int))
+	   bool progress_callback(int), const vtShadingContext *pShading)
 {
 	VTLOG1(" ColorDibFromTable:");
 	int w = pBM->GetWidth();
@@ -731,49 +1055,92 @@ bool vtHeightFieldGrid3d::ColorDibFromTable(vtBitmapBase *pBM,
 
 	float fRange = fMax - fMin;
 	uint iGranularity = table.size()-1;
-	bool has_invalid = false;
+	int invalid = 0;
 	RGBi nodata_24bit(nodata.r, nodata.g, nodata.b);
-	double x, y;
-	float elev;
+	const int bytes = depth / 8;
 
-	// now iterate over the texels
-	for (int i = 0; i < w; i++)
+	if (pShading && (pShading->GetWidth() != w || pShading->GetHeight() != h))
+	{
+		VTLOG1("(shading context doesn't match) ");
+		pShading = NULL;
+	}
+
+	// Iterate over the texels, a band of rows at a time.  The rows of each
+	//  band are independent, so they are divided among the processors, while
+	//  progress is reported from this thread between bands.
+	for (int j0 = 0; j0 < h; j0 += COLOR_BAND)
 	{
 		if (progress_callback != NULL)
-		{
-			if ((i&7) == 0)
-				progress_callback(i * 100 / w);
-		}
-		x = i * ratiox;		// find corresponding location in height grid
+			progress_callback(j0 * 100 / h);
 
-		for (int j = 0; j < h; j++)
+		const int j1 = std::min(j0 + COLOR_BAND, h);
+#pragma omp parallel for reduction(|:invalid)
+		for (int j = j0; j < j1; j++)
 		{
-			y = j * ratioy;
+			const double y = j * ratioy;	// corresponding location in height grid
 
-			if (bExact)
-				elev = GetElevation(i, j);
-			else
-				elev = GetInterpolatedElevation(x, y);
-			if (elev == INVALID_ELEVATION)
+			// Write straight into the bitmap's memory, if it allows that
+			uchar *row = (depth == 24 || depth == 32) ? pBM->GetPixelRow(h-1-j) : NULL;
+
+			for (int i = 0; i < w; i++)
 			{
-				if (depth == 32)
-					pBM->SetPixel32(i, h-1-j, nodata);
+				float elev;
+				if (bExact)
+					elev = GetElevation(i, j);
 				else
-					pBM->SetPixel24(i, h-1-j, nodata_24bit);
-				has_invalid = true;
-				continue;
+					elev = GetInterpolatedElevation(i * ratiox, y);
+
+				const float shade = pShading ? pShading->ShadeAt(i, j) : -1.0f;
+				if (elev == INVALID_ELEVATION)
+				{
+					if (row)
+					{
+						uchar *pixel = row + i * bytes;
+						pixel[0] = (uchar) nodata.r;
+						pixel[1] = (uchar) nodata.g;
+						pixel[2] = (uchar) nodata.b;
+						if (bytes == 4)
+							pixel[3] = (uchar) nodata.a;
+					}
+					else if (depth == 32)
+						pBM->SetPixel32(i, h-1-j, nodata);
+					else
+						pBM->SetPixel24(i, h-1-j, nodata_24bit);
+					invalid |= 1;
+				}
+				else
+				{
+					uint table_entry = (uint) ((elev - fMin) / fRange * iGranularity);
+					if (table_entry > iGranularity-1)
+						table_entry = iGranularity-1;
+					const RGBi &color = table[table_entry];
+					if (row)
+					{
+						uchar *pixel = row + i * bytes;
+						pixel[0] = (uchar) color.r;
+						pixel[1] = (uchar) color.g;
+						pixel[2] = (uchar) color.b;
+						if (bytes == 4)
+							pixel[3] = 255;
+					}
+					else if (depth == 32)
+						pBM->SetPixel32(i, h-1-j, color);
+					else
+						pBM->SetPixel24(i, h-1-j, color);
+				}
+				if (shade < 0)
+					continue;
+				if (row)
+					vtBitmapBase::ScaleRawPixel(row + i * bytes, bytes, shade);
+				else if (depth == 32)
+					pBM->ScalePixel32(i, h-1-j, shade);
+				else
+					pBM->ScalePixel24(i, h-1-j, shade);
 			}
-			uint table_entry = (uint) ((elev - fMin) / fRange * iGranularity);
-			if (table_entry > iGranularity-1)
-				table_entry = iGranularity-1;
-			if (depth == 32)
-				pBM->SetPixel32(i, h-1-j, table[table_entry]);
-			else
-				pBM->SetPixel24(i, h-1-j, table[table_entry]);
 		}
 	}
 	VTLOG("Done.\n");
-	return has_invalid;
+	return (invalid != 0);
 }
 
 /**
@@ -792,119 +1159,13 @@ bool vtHeightFieldGrid3d::ColorDibFromTable(vtBitmapBase *pBM,
 void vtHeightFieldGrid3d::ShadeDibFromElevation(vtBitmapBase *pBM, const FPoint3 &light_dir,
 	float fLightFactor, float fAmbient, float fGamma, bool bTrue, bool progress_callback(int))
 {
-	// consider upward-pointing normal vector, rather than downward-pointing
-	FPoint3 light_direction = -light_dir;
-
-	int w = pBM->GetWidth();
-	int h = pBM->GetHeight();
-	int gw = m_iColumns, gh = m_iRows;
-
-	double ratiox = (double)(gw-1)/(w-1), ratioy = (double)(gh-1)/(h-1);
-
-	// For purposes of shading, we need to look at adjacent heixels which are
-	//  at least one grid cell away:
-	int xOffset = (int)ratiox;
-	int yOffset = (int)ratioy;
-	if (xOffset < 1) xOffset = 1;
-	if (yOffset < 1) yOffset = 1;
-
-	int depth = pBM->GetDepth();
-	int x, y;
-
-	// Center, Left, Right, Top, Bottom
-	FPoint3 c, l, r, t, b, v3;
-
-	// iterate over the texels
-	for (int j = 0; j < h; j++)
-	{
-		if (progress_callback != NULL)
-		{
-			if ((j&7) == 0)
-				progress_callback(j * 100 / h);
-		}
-		// find corresponding location in terrain
-		y = (int) (j * ratioy);
-		for (int i = 0; i < w; i++)
-		{
-			x = (int) (i * ratiox);
-
-			GetWorldLocation(x, y, c, bTrue);
-			if (c.y == INVALID_ELEVATION)
-				continue;
-
-			// Check to see what surrounding values are valid
-			GetWorldLocation(x-xOffset, y, l, bTrue);
-			GetWorldLocation(x+xOffset, y, r, bTrue);
-			GetWorldLocation(x, y+yOffset, t, bTrue);
-			GetWorldLocation(x, y-yOffset, b, bTrue);
-
-			FPoint3 p1, p2, p3, p4;
-
-			// compute surface normal
-			if (l.y != INVALID_ELEVATION)
-				p1 = l;
-			else
-				p1 = c;
-
-			if (r.y != INVALID_ELEVATION)
-				p2 = r;
-			else
-				p2 = c;
-
-			if (t.y != INVALID_ELEVATION)
-				p3 = t;
-			else
-				p3 = c;
-
-			if (b.y != INVALID_ELEVATION)
-				p4 = b;
-			else
-				p4 = c;
-
-#if 0
-			// The naive way is to use the surface vectors and cross them to
-			//  find the normal.
-			FPoint3 v1 = p2 - p1;
-			FPoint3 v2 = p3 - p4;
-
-			// This provides some 'exaggeration' for the lighting
-			v1.y *= fLightFactor;
-			v2.y *= fLightFactor;
-
-			v3 = v1.Cross(v2);
-#else
-			// This is equivalent to the cross product, and the overall
-			//  render is 2% faster
-			v3.Set((p1.y - p2.y)*fLightFactor/(p2.x - p1.x), 1,
-				   (p3.y - p4.y)*fLightFactor/(p4.z - p3.z));
-#endif
-			v3.Normalize();
-
-			float shade = v3.Dot(light_direction); // shading 0 (dark) to 1 (light)
-
-			// Most of the values are in the bottom half of the 0-1 range, so push
-			//  them upwards with a gamma factor.
-			if (fGamma != 1.0f)
-				shade = powf(shade, fGamma);
-
-			// boost with ambient light
-			shade += fAmbient;
-
-			// Never shade below zero, can cause RGB wraparound
-			if (shade < 0)
-				shade = 0;
-			if (shade > 1.1f)
-				shade = 1.1f;
-
-			// combine color and shading
-			if (depth == 8)
-				pBM->ScalePixel8(i, h-1-j, shade);
-			else if (depth == 24)
-				pBM->ScalePixel24(i, h-1-j, shade);
-			else if (depth == 32)
-				pBM->ScalePixel32(i, h-1-j, shade);
-		}
-	}
+	// To shade the same bitmap several times, it is faster for the caller
+	//  to keep a vtShadingContext and re-use it.
+	vtShadingContext context;
+	if (!context.Setup(this, pBM->GetWidth(), pBM->GetHeight(), fLightFactor,
+		bTrue, progress_callback))
+		return;
+	context.ShadeBitmap(pBM, light_dir, fAmbient, fGamma);
 }
 
 /**
@@ -1001,33 +1262,22 @@ void vtHeightFieldGrid3d::ShadeQuick(vtBitmapBase *pBM, float fLightFactor,
 // Begin shadow-casting code.
 //
 
+// The rows of the bitmap are processed in bands of this many rows.  The
+//  rows within a band are shared among the threads (when vtdata is built
+//  with OpenMP), and the progress callback is only called between bands.
+#define SHADOW_BAND	64
+
 class LightMap
 {
 public:
-	LightMap(int w, int h)
-	{
-		m_w = w;
-		m_h = h;
-		m_data = new uchar*[m_w];
-		int rows, cols;
-		for (cols = 0; cols < m_w; cols++)
-			m_data[cols] = new uchar[m_h];
-		for (cols = 0; cols < m_w; cols++)
-			for (rows = 0; rows < m_h ; rows++)
-				m_data[cols][rows] = 0;
-	}
-	~LightMap()
-	{
-		// Dispose with the temporary arrays
-		for (int cols = 0 ; cols < m_w ; ++cols)
-			delete [] m_data[cols];
-		delete [] m_data;
-	}
-	void Set(int x, int y, uchar val) { m_data[x][y] = val; }
-	uchar Get(int x, int y) { return m_data[x][y]; }
+	LightMap(int w, int h) : m_w(w), m_h(h), m_data((size_t) w * h, 0) {}
+
+	void Set(int x, int y, uchar val) { m_data[(size_t) y * m_w + x] = val; }
+	uchar Get(int x, int y) const { return m_data[(size_t) y * m_w + x]; }
+	uchar &At(int x, int y) { return m_data[(size_t) y * m_w + x]; }
 
-	uchar **m_data;
 	int m_w, m_h;
+	std::vector<uchar> m_data;
 };
 
 
@@ -1040,6 +1290,9 @@ inline DPoint2 GridPos(const DPoint2 &base, const DPoint2 &spacing, int i, int j
  * ShadowCastDib - method to create shadows over the terrain based on the
  * angle of the sun.
  *
+ * When vtdata is built with OpenMP, the work is shared among all the
+ * processors.  The result is exactly the same as with a single thread.
+ *
  * \param pBM	An interface to the bitmap to be shaded.
  * \param light_dir	The direction of the light, in world coordinates, coming
  *		down toward the terrain.  For example, (-1,-1,0) is pointing down
@@ -1055,31 +1308,27 @@ inline DPoint2 GridPos(const DPoint2 &base, const DPoint2 &spacing, int i, int j
  * Possible TODO: add code to soften and blend shadow edges
  *  (see aliasing comments in source).
  *
- * Definite TODO: the whole thing can be sped up by precalculating the
- *  surface normals once.  In fact that should be placed in a separate Shading
- *  Context, so that it could be re-used for quickly re-shading multiple times.
+ * To re-shade quickly for many positions of the sun, see
+ *  vtShadingContext::SetupHorizons.
  */
 void vtHeightFieldGrid3d::ShadowCastDib(vtBitmapBase *pBM, const FPoint3 &light_dir,
 	float fLightFactor, float fAmbient, bool progress_callback(int))
 {
-	int w = pBM->GetWidth();
-	int h = pBM->GetHeight();
-
-	int gw, gh;
-	GetDimensions(gw, gh);
+	const int w = pBM->GetWidth();
+	const int h = pBM->GetHeight();
 
 	// Compute area that we will sample for shading, bounded by the texel
 	//  centers, which are 1/2 texel in from the grid extents.
-	DPoint2 texel_size(m_EarthExtents.Width() / w, m_EarthExtents.Height() / h);
+	const DPoint2 texel_size(m_EarthExtents.Width() / w, m_EarthExtents.Height() / h);
 	DRECT texel_area = m_EarthExtents;
 	texel_area.Grow(-texel_size.x/2, -texel_size.y/2);
-	DPoint2 texel_base(texel_area.left, texel_area.bottom);
+	const DPoint2 texel_base(texel_area.left, texel_area.bottom);
 
-	bool b8bit = (pBM->GetDepth() == 8);
+	const bool b8bit = (pBM->GetDepth() == 8);
 	int i, j;
 
 	// These values are hardcoded here but could be exposed in the GUI
-	float sun =  0.7f;
+	const float sun =  0.7f;
 
 	// If we have light that's pointing UP, rather than down at the terrain,
 	//  then it's only going to take a really long time to produce a
@@ -1102,13 +1351,6 @@ void vtHeightFieldGrid3d::ShadowCastDib(vtBitmapBase *pBM, const FPoint3 &light_
 	// Create array to hold flags
 	LightMap lightmap(w, h);
 
-	// This factor is used when applying shading to non-shadowed areas to
-	// try and keep the "contrast" down to a min. (still get "patches" of
-	// dark/light spots though).
-	// It is initialized to 1.0, because in case there are no shadows at all
-	//  (such as at noon) we still need a reasonable value.
-	float darkest_shadow = 1.0;
-
 	// For the vector used to cast shadows, we need it in grid coordinates,
 	//  which are (Column,Row) where Row is north.  But the direction passed
 	//  in uses OpenGL coordinates where Z is south.  So flip Z.
@@ -1135,195 +1377,195 @@ void vtHeightFieldGrid3d::ShadowCastDib(vtBitmapBase *pBM, const FPoint3 &light_
 	}
 	grid_light_dir /= f;
 
-	int i_init, i_final, i_incr;
-	int j_init, j_final, j_incr;
-	if (grid_light_dir.x > 0)
-	{
-		i_init=0;
-		i_final=w;
-		i_incr=1;
-	}
-	else
-	{
-		i_init=w-1;
-		i_final=-1;
-		i_incr=-1;
-	}
-	if (grid_light_dir.z > 0)
-	{
-		j_init=0;
-		j_final=h;
-		j_incr=1;
-	}
-	else
-	{
-		j_init=h-1;
-		j_final=-1;
-		j_incr=-1;
-	}
-
-	// First pass: find each point that it is in shadow.
-	DPoint2 pos;
-	float shadowheight, elevation;
-	FPoint3 normal;
-	FPoint3 p3;
-	int x, z;
-	float shade;
-
-	for (j = j_init; j != j_final; j += j_incr)
+	// First pass: find each texel which is in shadow.  Each texel casts its
+	//  shadow without regard to any other, so the order in which they are
+	//  visited does not matter, and the rows can be shared among threads.
+	//  A texel may be in several shadows; it is simply flagged each time.
+	for (int j0 = 0; j0 < h; j0 += SHADOW_BAND)
 	{
 		if (progress_callback != NULL)
-		{
-			if ((j&7) == 0)
-				progress_callback(abs(j-j_init) * 100 / h);
-		}
-		for (i = i_init; i != i_final; i += i_incr)
-		{
-			pos = GridPos(texel_base, texel_size, i, j);
-			FindAltitudeOnEarth(pos, shadowheight, true);
+			progress_callback(j0 * 100 / h);
 
-			if (shadowheight == INVALID_ELEVATION)
+		const int j1 = std::min(j0 + SHADOW_BAND, h);
+#pragma omp parallel for schedule(dynamic)
+		for (int jj = j0; jj < j1; jj++)
+		{
+			DPoint2 pos;
+			float shadowheight, elevation;
+			int x, z;
+			for (int ii = 0; ii < w; ii++)
 			{
-				// set a flag so we won't visit this one again
-				lightmap.Set(i, j, 1);
-				continue;
-			}
+				pos = GridPos(texel_base, texel_size, ii, jj);
+				shadowheight = INVALID_ELEVATION;
+				FindAltitudeOnEarth(pos, shadowheight, true);
 
-			bool Under_Out = false;
-			for (int k = 1; Under_Out == false; k++)
-			{
-				x = (int) (i + grid_light_dir.x*k + 0.5f);
-				z = (int) (j + grid_light_dir.z*k + 0.5f);
-				shadowheight += grid_light_dir.y * HScale;
+				// texels with no elevation cast no shadow
+				if (shadowheight == INVALID_ELEVATION)
+					continue;
 
-				if ((x<0) || (x>w-1) || (z<0) || (z>h-1))
+				for (int k = 1; ; k++)
 				{
-					Under_Out = true; // Out of the grid
-					break;
-				}
+					x = (int) (ii + grid_light_dir.x*k + 0.5f);
+					z = (int) (jj + grid_light_dir.z*k + 0.5f);
+					shadowheight += grid_light_dir.y * HScale;
 
-				pos = GridPos(texel_base, texel_size, x, z);
-				FindAltitudeOnEarth(pos, elevation, true);
+					if ((x<0) || (x>w-1) || (z<0) || (z>h-1))
+						break;	// Out of the grid
 
-				// skip holes in the grid
-				if (elevation == INVALID_ELEVATION)
-					continue;
+					pos = GridPos(texel_base, texel_size, x, z);
+					elevation = INVALID_ELEVATION;
+					FindAltitudeOnEarth(pos, elevation, true);
 
-				if (elevation > shadowheight)
-				{
-					if (k>1)
-						Under_Out = true; // Under the terrain
-					break;
-				}
+					// skip holes in the grid
+					if (elevation == INVALID_ELEVATION)
+						continue;
 
-				// Combine color and shading.
-				// Only do shadow if we have not shaded this i,j before.
-				if (lightmap.Get(x,z) < 1)
-				{
-					// 3D elevation query to get slope
-					m_Conversion.ConvertFromEarth(pos, p3.x, p3.z);
-					FindAltitudeAtPoint(p3, p3.y, true, 0, &normal);
-
-					//*****************************************
-					// Here the Sun(r, g, b) = 0 because we are in the shade
-					// therefore I(r, g, b) = Amb(r, g, b) * (0.5*N[z] + 0.5)
-
-				//	shade =  sun*normal.Dot(-light_direction) + fAmbient * (0.5f*normal.y + 0.5f);
-					shade =  fAmbient * (0.5f*normal.y + 0.5f);
-					//*****************************************
-					//*****************************************
-					if (darkest_shadow > shade)
-						darkest_shadow = shade;
-
-					//Rather than doing the shading at this point we may want to
-					//simply save the value into the LightMap array. Then apply
-					//some anti-aliasing or edge softening algorithm to the LightMap.
-					//Once that's done, apply the whole LightMap to the DIB.
-					if (b8bit)
-						pBM->ScalePixel8(x, h-1-z, shade);
-					else
-						pBM->ScalePixel24(x, h-1-z, shade);
+					if (elevation > shadowheight)
+						break;	// Under the terrain
 
-					//set a flag to show that this texel has been shaded.
-					// (or set to value of the shading - see comment above)
-					lightmap.Set(x, z, lightmap.Get(x, z)+1);
+					// set a flag to show that this texel is in shadow
+					uchar &flag = lightmap.At(x, z);
+#pragma omp atomic
+					flag |= 1;
 				}
 			}
-		} //for i
-	} //for j
+		}
+	}
+
+	// Second pass: shade the texels which are in shadow.
+	//
+	// This factor is used when applying shading to non-shadowed areas to
+	// try and keep the "contrast" down to a min. (still get "patches" of
+	// dark/light spots though).
+	// It is initialized to 1.0, because in case there are no shadows at all
+	//  (such as at noon) we still need a reasonable value.
+	float darkest_shadow = 1.0;
+
+#pragma omp parallel
+	{
+		float thread_darkest = 1.0f;
+		FPoint3 normal, p3;
+
+#pragma omp for
+		for (int jj = 0; jj < h; jj++)
+		{
+			for (int ii = 0; ii < w; ii++)
+			{
+				if (lightmap.Get(ii, jj) == 0)
+					continue;
+
+				// 3D elevation query to get slope
+				DPoint2 pos = GridPos(texel_base, texel_size, ii, jj);
+				m_Conversion.ConvertFromEarth(pos, p3.x, p3.z);
+				FindAltitudeAtPoint(p3, p3.y, true, 0, &normal);
+
+				//*****************************************
+				// Here the Sun(r, g, b) = 0 because we are in the shade
+				// therefore I(r, g, b) = Amb(r, g, b) * (0.5*N[z] + 0.5)
+
+			//	shade =  sun*normal.Dot(-light_direction) + fAmbient * (0.5f*normal.y + 0.5f);
+				float shade =  fAmbient * (0.5f*normal.y + 0.5f);
+				//*****************************************
+				//*****************************************
+				if (thread_darkest > shade)
+					thread_darkest = shade;
+
+				//Rather than doing the shading at this point we may want to
+				//simply save the value into the LightMap array. Then apply
+				//some anti-aliasing or edge softening algorithm to the LightMap.
+				//Once that's done, apply the whole LightMap to the DIB.
+				if (b8bit)
+					pBM->ScalePixel8(ii, h-1-jj, shade);
+				else
+					pBM->ScalePixel24(ii, h-1-jj, shade);
+			}
+		}
+#pragma omp critical
+		{
+			if (darkest_shadow > thread_darkest)
+				darkest_shadow = thread_darkest;
+		}
+	}
 
 	// For dot-product lighting, we use the normal 3D vector, only inverted
 	//  so that we can compare it to the upward-pointing ground normals.
-	FPoint3 inv_light_dir = -light_dir;
+	const FPoint3 inv_light_dir = -light_dir;
 
-	// Second pass.  Now we are going to loop through the LightMap and apply
-	//  the full lighting formula to each texel that has not been shaded yet.
-	for (j = 0; j < h; j++)
+	// Third pass.  Now we are going to loop through the LightMap and apply
+	//  the full lighting formula to each texel that is not in shadow.
+	for (int j0 = 0; j0 < h; j0 += SHADOW_BAND)
 	{
 		if (progress_callback != NULL)
+			progress_callback(j0 * 100 / h);
+
+		const int j1 = std::min(j0 + SHADOW_BAND, h);
+#pragma omp parallel for
+		for (int jj = j0; jj < j1; jj++)
 		{
-			if ((j&7) == 0)
-				progress_callback(j * 100 / h);
-		}
-		for (i = 0; i < w; i++)
-		{
-			if (lightmap.Get(i, j) > 0)
-				continue;
+			DPoint2 pos;
+			float elevation;
+			FPoint3 normal, p3;
+			for (int ii = 0; ii < w; ii++)
+			{
+				if (lightmap.Get(ii, jj) > 0)
+					continue;
 
-			pos = GridPos(texel_base, texel_size, i, j);
+				pos = GridPos(texel_base, texel_size, ii, jj);
 
-			// 2D elevation query to check for holes in the grid
-			FindAltitudeOnEarth(pos, elevation, true);
-			if (elevation == INVALID_ELEVATION)
-				continue;
+				// 2D elevation query to check for holes in the grid
+				elevation = INVALID_ELEVATION;
+				FindAltitudeOnEarth(pos, elevation, true);
+				if (elevation == INVALID_ELEVATION)
+					continue;
 
-			// 3D elevation query to get slope
-			m_Conversion.ConvertFromEarth(pos, p3.x, p3.z);
-			FindAltitudeAtPoint(p3, p3.y, true, 0, &normal);
-
-			//*****************************************
-			//*****************************************
-			//shade formula based on:
-			//http://www.geocities.com/aaron_torpy/algorithms.htm#calc_intensity
-
-			// The Amb value was arbitrarily chosen
-			// Need to experiment more to determine the best value
-			// Perhaps calculating Sun(r, g, b) and Amb(r, g, b) for a
-			//  given time of day (e.g. warmer colors close to sunset)
-			// or give control to user since textures will differ
-
-			// I(r, g, b) = Sun(r, g, b) * scalarprod(N, v) + Amb(r, g, b) * (0.5*N[z] + 0.5)
-			shade = sun * normal.Dot(inv_light_dir);
-
-			// It's a reasonable assuption that an angle of 45 degrees is
-			//  sufficient to fully illuminate the ground.
-			shade /= .7071f;
-
-			// Now add ambient component
-			shade += fAmbient * (0.5f*normal.y + 0.5f);
-
-			// Maybe clipping values can be exposed to the user as well.
-			// Clip - don't shade down below lowest ambient level
-			if (shade < darkest_shadow)
-				shade = darkest_shadow;
-			else if (shade > 1.2f)
-				shade = 1.2f;
-
-			// Push the value of 'shade' toward 1.0 by the fLightFactor factor.
-			// This means that fLightFactor=0 means no lighting, 1 means full lighting.
-			float diff = 1 - shade;
-			diff = diff * (1 - fLightFactor);
-			shade += diff;
-
-			// Rather than doing the shading at this point we may want to
-			// simply save the value into the LightMap array. Then apply
-			// some anti-aliasing or edge softening algorithm to the LightMap.
-			// Once that's done, apply the whole LightMap to the DIB.
-			// LightMap[I][J]= shade; // set to value of the shading - see comment above)
-			if (b8bit)
-				pBM->ScalePixel8(i, h-1-j, shade);
-			else
-				pBM->ScalePixel24(i, h-1-j, shade);
+				// 3D elevation query to get slope
+				m_Conversion.ConvertFromEarth(pos, p3.x, p3.z);
+				FindAltitudeAtPoint(p3, p3.y, true, 0, &normal);
+
+				//*****************************************
+				//*****************************************
+				//shade formula based on:
+				//http://www.geocities.com/aaron_torpy/algorithms.htm#calc_intensity
+
+				// The Amb value was arbitrarily chosen
+				// Need to experiment more to determine the best value
+				// Perhaps calculating Sun(r, g, b) and Amb(r, g, b) for a
+				//  given time of day (e.g. warmer colors close to sunset)
+				// or give control to user since textures will differ
+
+				// I(r, g, b) = Sun(r, g, b) * scalarprod(N, v) + Amb(r, g, b) * (0.5*N[z] + 0.5)
+				float shade = sun * normal.Dot(inv_light_dir);
+
+				// It's a reasonable assuption that an angle of 45 degrees is
+				//  sufficient to fully illuminate the ground.
+				shade /= .7071f;
+
+				// Now add ambient component
+				shade += fAmbient * (0.5f*normal.y + 0.5f);
+
+				// Maybe clipping values can be exposed to the user as well.
+				// Clip - don't shade down below lowest ambient level
+				if (shade < darkest_shadow)
+					shade = darkest_shadow;
+				else if (shade > 1.2f)
+					shade = 1.2f;
+
+				// Push the value of 'shade' toward 1.0 by the fLightFactor factor.
+				// This means that fLightFactor=0 means no lighting, 1 means full lighting.
+				float diff = 1 - shade;
+				diff = diff * (1 - fLightFactor);
+				shade += diff;
+
+				// Rather than doing the shading at this point we may want to
+				// simply save the value into the LightMap array. Then apply
+				// some anti-aliasing or edge softening algorithm to the LightMap.
+				// Once that's done, apply the whole LightMap to the DIB.
+				// LightMap[I][J]= shade; // set to value of the shading - see comment above)
+				if (b8bit)
+					pBM->ScalePixel8(ii, h-1-jj, shade);
+				else
+					pBM->ScalePixel24(ii, h-1-jj, shade);
+			}
 		}
 	}
 
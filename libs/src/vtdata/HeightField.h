@@ -12,6 +12,7 @@
 #include "LocalConversion.h"
 
 class vtBitmapBase;
+class vtShadingContext;
 #define INVALID_ELEVATION	SHRT_MIN
 
 /**
@@ -129,6 +130,9 @@ public:
 		bool bTrue = false, int iCultureFlags = 0,
 		FPoint3 *vNormal = NULL) const = 0;
 
+	virtual int FindAltitudesAtPoints(const FPoint3 *points, float *altitudes,
+		int count, bool bTrue = false, int iCultureFlags = 0) const;
+
 	/// Find the intersection point of a ray with the heightfield
 	virtual bool CastRayToSurface(const FPoint3 &point, const FPoint3 &dir,
 		FPoint3 &result) const = 0;
@@ -137,6 +141,8 @@ public:
 
 	bool ConvertEarthToSurfacePoint(const DPoint2 &epos, FPoint3 &p3,
 		int iCultureFlags = 0, bool bTrue = false);
+	int ConvertEarthToSurfacePoints(const DPoint2 *epos, FPoint3 *p3,
+		int count, int iCultureFlags = 0, bool bTrue = false);
 
 	bool ContainsWorldPoint(float x, float z);
 	void GetCenter(FPoint3 &center);
@@ -173,6 +179,12 @@ public:
 	bool CastRayToSurface(const FPoint3 &point, const FPoint3 &dir,
 		FPoint3 &result) const;
 	bool LineOfSight(const FPoint3 &point1, const FPoint3 &point2) const;
+
+	// Optional acceleration for CastRayToSurface and LineOfSight
+	bool BuildMaxPyramid(int iBaseBits = 3, bool progress_callback(int) = NULL);
+	void FreeMaxPyramid();
+	bool HasMaxPyramid() const { return !m_MaxPyramid.empty(); }
+
 	DPoint2 GetSpacing() const;
 	FPoint2 GetWorldSpacing() const;
 	void GetDimensions(int &nColumns, int &nRows) const;
@@ -189,9 +201,11 @@ public:
 	virtual void GetWorldLocation(int i, int j, FPoint3 &loc, bool bTrue = false) const = 0;
 
 	bool ColorDibFromElevation(vtBitmapBase *pBM, const ColorMap *cmap,
-		int iGranularity, const RGBAi &nodata, bool progress_callback(int) = NULL);
+		int iGranularity, const RGBAi &nodata, bool progress_callback(int) = NULL,
+		const vtShadingContext *pShading = NULL);
 	bool ColorDibFromTable(vtBitmapBase *pBM, std::vector<RGBi> &table,
-		float fMin, float fMax, const RGBAi &nodata, bool progress_callback(int) = NULL);
+		float fMin, float fMax, const RGBAi &nodata, bool progress_callback(int) = NULL,
+		const vtShadingContext *pShading = NULL);
 
 	void ShadeDibFromElevation(vtBitmapBase *pBM, const FPoint3 &light_dir,
 		float fLightFactor, float fAmbient = 0.1f, float fGamma = 1.0f,
@@ -202,9 +216,24 @@ public:
 		float fLightFactor, float fAmbient, bool progress_callback(int) = NULL);
 
 protected:
+	// One level of the max pyramid: the highest heixel in each block
+	struct MaxLevel
+	{
+		int iWidth, iHeight;
+		std::vector<float> m_Max;
+	};
+	bool MarchMaxPyramid(const FPoint3 &point, const FPoint3 &dir, double tmax,
+		double dt, bool bStrict, double &t_above, double &t_below,
+		bool &bFoundAbove) const;
+
 	int		m_iColumns, m_iRows;
 	float	m_fXStep, m_fZStep;	// step size between the World grid points
 	double	m_dXStep, m_dYStep;	// step size between the Earth grid points
+
+	// Max pyramid: level 0 has blocks of (1 << m_iPyramidBits) cells square,
+	//  and each level above has blocks twice the size.
+	int		m_iPyramidBits;
+	std::vector<MaxLevel> m_MaxPyramid;
 };
 
 #endif	// HEIGHTFIELDH
@@ -0,0 +1,202 @@
+//
+// HeightFieldBatch.h
+//
+// Copyright (c) 2002-2011 Virtual Terrain Project
+// Free for all uses, see license.txt for details.
+//
+/** \file HeightFieldBatch.h */
+
+#ifndef HEIGHTFIELDBATCHH
+#define HEIGHTFIELDBATCHH
+
+#include "config_vtdata.h"
+#include "MathTypes.h"
+
+#if SUPPORT_SSE2
+  #include <emmintrin.h>
+#endif
+
+/**
+ * The inner loop of a batched altitude query on a regular grid of heixels,
+ * as used by the FindAltitudesAtPoints methods of the grid classes.
+ *
+ * The conversion from world coordinates to a grid cell, and the
+ * interpolation within that cell, are done four points at a time with
+ * SSE2 when available.  The results are the same as testing each point
+ * with FindAltitudeAtPoint.
+ *
+ * The Sampler is a small class which provides the heixels, with the methods:
+ *  - void Corners(int iX, int iZ, float alt[4]) const;  Get the heixels at
+ *		(iX,iZ), (iX+1,iZ), (iX+1,iZ+1) and (iX,iZ+1).
+ *  - bool Single(const FPoint3 &p, float &fAltitude) const;  Test one point
+ *		the slow way.  This is only called for points which are on or past
+ *		the edges of the grid.
+ *
+ * \param bAlternate If false, each cell is split into two triangles along
+ *		the same diagonal.  If true, the diagonal alternates from cell to cell,
+ *		as the dynamic terrain classes do.
+ * \param fScale Factor applied to each interpolated altitude.
+ * \return The number of points which were on the grid.  Points which are
+ *		not on the grid get an altitude of 0.
+ */
+template <class Sampler>
+int FindGridAltitudes(const Sampler &s, const FRECT &world, float fXStep,
+	float fZStep, int iColumns, int iRows, bool bAlternate, float fScale,
+	const FPoint3 *points, float *altitudes, int count)
+{
+	int found = 0;
+	int n = 0;
+	float alt[4];
+
+#if SUPPORT_SSE2
+	const __m128 left = _mm_set1_ps(world.left);
+	const __m128 bottom = _mm_set1_ps(world.bottom);
+	const __m128 xstep = _mm_set1_ps(fXStep);
+	const __m128 zstep = _mm_set1_ps(fZStep);
+	const __m128 nzstep = _mm_set1_ps(-fZStep);
+	const __m128 one = _mm_set1_ps(1.0f);
+	const __m128 scale = _mm_set1_ps(fScale);
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i ione = _mm_set1_epi32(1);
+	const __m128i maxx = _mm_set1_epi32(iColumns - 2);
+	const __m128i maxz = _mm_set1_epi32(iRows - 2);
+
+	int IX[4], IZ[4];
+	float a0[4], a1[4], a2[4], a3[4], result[4];
+	for (; n + 4 <= count; n += 4)
+	{
+		const FPoint3 *p = points + n;
+		const __m128 x = _mm_setr_ps(p[0].x, p[1].x, p[2].x, p[3].x);
+		const __m128 z = _mm_setr_ps(p[0].z, p[1].z, p[2].z, p[3].z);
+
+		// Which cell each point is in (truncating, like the scalar code)
+		const __m128i ix = _mm_cvttps_epi32(_mm_div_ps(_mm_sub_ps(x, left), xstep));
+		const __m128i iz = _mm_cvttps_epi32(_mm_div_ps(_mm_sub_ps(z, bottom), nzstep));
+		_mm_storeu_si128((__m128i *) IX, ix);
+		_mm_storeu_si128((__m128i *) IZ, iz);
+
+		// Points which are not safely inside the grid take the slow path
+		const __m128i outside = _mm_or_si128(
+			_mm_or_si128(_mm_cmplt_epi32(ix, zero), _mm_cmpgt_epi32(ix, maxx)),
+			_mm_or_si128(_mm_cmplt_epi32(iz, zero), _mm_cmpgt_epi32(iz, maxz)));
+		const int iOutside = _mm_movemask_ps(_mm_castsi128_ps(outside));
+
+		for (int k = 0; k < 4; k++)
+		{
+			if (iOutside & (1 << k))
+			{
+				a0[k] = a1[k] = a2[k] = a3[k] = 0.0f;
+				continue;
+			}
+			s.Corners(IX[k], IZ[k], alt);
+			a0[k] = alt[0];
+			a1[k] = alt[1];
+			a2[k] = alt[2];
+			a3[k] = alt[3];
+		}
+		const __m128 alt0 = _mm_loadu_ps(a0);
+		const __m128 alt1 = _mm_loadu_ps(a1);
+		const __m128 alt2 = _mm_loadu_ps(a2);
+		const __m128 alt3 = _mm_loadu_ps(a3);
+
+		// find fractional amount (0..1 across quad)
+		const __m128 fX = _mm_div_ps(_mm_sub_ps(x,
+			_mm_add_ps(left, _mm_mul_ps(_mm_cvtepi32_ps(ix), xstep))), xstep);
+		const __m128 fY = _mm_div_ps(_mm_sub_ps(z,
+			_mm_sub_ps(bottom, _mm_mul_ps(_mm_cvtepi32_ps(iz), zstep))), nzstep);
+		const __m128 rX = _mm_sub_ps(one, fX);
+		const __m128 rY = _mm_sub_ps(one, fY);
+
+		// The two triangles on either side of the first diagonal
+		const __m128 lower = _mm_add_ps(_mm_add_ps(alt0,
+			_mm_mul_ps(fX, _mm_sub_ps(alt1, alt0))),
+			_mm_mul_ps(fY, _mm_sub_ps(alt3, alt0)));
+		const __m128 upper = _mm_add_ps(_mm_add_ps(alt2,
+			_mm_mul_ps(rX, _mm_sub_ps(alt3, alt2))),
+			_mm_mul_ps(rY, _mm_sub_ps(alt1, alt2)));
+		const __m128 first = _mm_cmplt_ps(_mm_add_ps(fX, fY), one);
+		__m128 value = _mm_or_ps(_mm_and_ps(first, lower),
+			_mm_andnot_ps(first, upper));
+
+		if (bAlternate)
+		{
+			// The two triangles on either side of the other diagonal
+			const __m128 right = _mm_add_ps(_mm_add_ps(alt0,
+				_mm_mul_ps(fX, _mm_sub_ps(alt1, alt0))),
+				_mm_mul_ps(fY, _mm_sub_ps(alt2, alt1)));
+			const __m128 left_tri = _mm_add_ps(_mm_add_ps(alt0,
+				_mm_mul_ps(fX, _mm_sub_ps(alt2, alt3))),
+				_mm_mul_ps(fY, _mm_sub_ps(alt3, alt0)));
+			const __m128 second = _mm_cmpgt_ps(fX, fY);
+			const __m128 other = _mm_or_ps(_mm_and_ps(second, right),
+				_mm_andnot_ps(second, left_tri));
+
+			// cells with (iX + iZ) even use the other diagonal
+			const __m128 even = _mm_castsi128_ps(_mm_cmpeq_epi32(
+				_mm_and_si128(_mm_add_epi32(ix, iz), ione), zero));
+			value = _mm_or_ps(_mm_and_ps(even, other),
+				_mm_andnot_ps(even, value));
+		}
+		_mm_storeu_ps(result, _mm_mul_ps(value, scale));
+
+		for (int k = 0; k < 4; k++)
+		{
+			if (iOutside & (1 << k))
+			{
+				if (s.Single(p[k], altitudes[n+k]))
+					found++;
+				else
+					altitudes[n+k] = 0.0f;
+			}
+			else
+			{
+				altitudes[n+k] = result[k];
+				found++;
+			}
+		}
+	}
+#endif	// SUPPORT_SSE2
+
+	// Scalar fallback, and the remainder of the points
+	for (; n < count; n++)
+	{
+		const FPoint3 &p = points[n];
+		const int iX = (int)((p.x - world.left) / fXStep);
+		const int iZ = (int)((p.z - world.bottom) / -fZStep);
+		if (iX < 0 || iX > iColumns-2 || iZ < 0 || iZ > iRows-2)
+		{
+			if (s.Single(p, altitudes[n]))
+				found++;
+			else
+				altitudes[n] = 0.0f;
+			continue;
+		}
+		s.Corners(iX, iZ, alt);
+
+		// find fractional amount (0..1 across quad)
+		const float fX = (p.x - (world.left + iX * fXStep)) / fXStep;
+		const float fY = (p.z - (world.bottom - iZ * fZStep)) / -fZStep;
+
+		float value;
+		if (!bAlternate || ((iX + iZ) & 1))
+		{
+			// which of the two triangles in the quad is it?
+			if (fX + fY < 1)
+				value = alt[0] + fX * (alt[1] - alt[0]) + fY * (alt[3] - alt[0]);
+			else
+				value = alt[2] + (1.0f-fX) * (alt[3] - alt[2]) + (1.0f-fY) * (alt[1] - alt[2]);
+		}
+		else
+		{
+			if (fX > fY)
+				value = alt[0] + fX * (alt[1] - alt[0]) + fY * (alt[2] - alt[1]);
+			else
+				value = alt[0] + fX * (alt[2] - alt[3]) + fY * (alt[3] - alt[0]);
+		}
+		altitudes[n] = value * fScale;
+		found++;
+	}
+	return found;
+}
+
+#endif	// HEIGHTFIELDBATCHH
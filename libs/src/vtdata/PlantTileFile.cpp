@@ -0,0 +1,235 @@
+//
+// PlantTileFile.cpp
+//
+// Copyright (c) 2001-2012 Virtual Terrain Project
+// Free for all uses, see license.txt for details.
+//
+
+#include "PlantTileFile.h"
+#include "vtLog.h"
+
+vtPlantTileFile::vtPlantTileFile()
+{
+	m_pTiles = NULL;
+	m_pRecords = NULL;
+	m_iPlants = 0;
+	m_iColumns = m_iRows = 0;
+}
+
+/**
+ * Open a tiled vegetation file, and read its header.
+ *
+ * \return true if successful.  The file is checked to make sure it is large
+ *		enough to hold all the tiles and plants it claims to have.
+ */
+bool vtPlantTileFile::Open(const char *fname)
+{
+	Close();
+
+	if (!m_File.Open(fname, vtMappedFile::READ_ONLY))
+		return false;
+
+	const uchar *data = m_File.GetData();
+	const size_t size = m_File.GetSize();
+	if (size < 6 || strncmp((const char *) data, "vf3.0", 5))
+	{
+		Close();
+		return false;
+	}
+	size_t pos = 6;
+
+	// Read a value from the header, if there is room for it
+	#define READ_HEADER(dest, bytes) \
+		if (pos + (bytes) > size) { \
+			VTLOG("vtPlantTileFile: '%s' is truncated.\n", fname); \
+			Close(); \
+			return false; \
+		} \
+		memcpy(dest, data + pos, bytes); \
+		pos += (bytes);
+
+	// WKT SRS
+	short len;
+	READ_HEADER(&len, sizeof(short));
+	if (len < 0 || len > 2000)
+	{
+		Close();
+		return false;
+	}
+	char wkt_buf[2001], *wkt = wkt_buf;
+	READ_HEADER(wkt_buf, len);
+	wkt_buf[len] = 0;
+	m_proj.importFromWkt((char **) &wkt);	// A missing projection is not fatal
+
+	// Species names
+	int numspecies;
+	READ_HEADER(&numspecies, sizeof(int));
+	if (numspecies < 0 || numspecies > 65535)
+	{
+		Close();
+		return false;
+	}
+	char name[256];
+	for (int i = 0; i < numspecies; i++)
+	{
+		READ_HEADER(&len, sizeof(short));
+		if (len < 0 || len > 255)
+		{
+			Close();
+			return false;
+		}
+		READ_HEADER(name, len);
+		name[len] = 0;
+		m_SpeciesNames.push_back(vtString(name));
+	}
+
+	// The grid of tiles
+	READ_HEADER(&m_iPlants, sizeof(int));
+	READ_HEADER(&m_iColumns, sizeof(int));
+	READ_HEADER(&m_iRows, sizeof(int));
+	READ_HEADER(&m_Extents.left, sizeof(double));
+	READ_HEADER(&m_Extents.top, sizeof(double));
+	READ_HEADER(&m_Extents.right, sizeof(double));
+	READ_HEADER(&m_Extents.bottom, sizeof(double));
+	#undef READ_HEADER
+
+	if (m_iPlants < 0 || m_iColumns < 1 || m_iRows < 1 ||
+		m_iColumns > 4096 || m_iRows > 4096)
+	{
+		VTLOG("vtPlantTileFile: '%s' has a bad header.\n", fname);
+		Close();
+		return false;
+	}
+	m_TileSize.x = m_Extents.Width() / m_iColumns;
+	m_TileSize.y = m_Extents.Height() / m_iRows;
+
+	// The tables start on an 8-byte boundary
+	pos = (pos + 7) & ~7;
+	const size_t tiles = (size_t) m_iColumns * m_iRows;
+	const size_t needed = pos + tiles * 2 * sizeof(uint) +
+		(size_t) m_iPlants * sizeof(Record);
+	if (size < needed)
+	{
+		VTLOG("vtPlantTileFile: '%s' is truncated.\n", fname);
+		Close();
+		return false;
+	}
+	m_pTiles = data + pos;
+	m_pRecords = (const Record *) (m_pTiles + tiles * 2 * sizeof(uint));
+
+	// Make sure each tile's plants are in the file
+	for (size_t t = 0; t < tiles; t++)
+	{
+		uint range[2];
+		memcpy(range, m_pTiles + t * 2 * sizeof(uint), 2 * sizeof(uint));
+		if (range[0] > (uint) m_iPlants || range[1] > (uint) m_iPlants - range[0])
+		{
+			VTLOG("vtPlantTileFile: '%s' has a bad table of tiles.\n", fname);
+			Close();
+			return false;
+		}
+	}
+	VTLOG("vtPlantTileFile: %d plants in %d x %d tiles.\n", m_iPlants,
+		m_iColumns, m_iRows);
+	return true;
+}
+
+/**
+ * Close the file.  Any pointers to its data are no longer valid.
+ */
+void vtPlantTileFile::Close()
+{
+	m_File.Close();
+	m_pTiles = NULL;
+	m_pRecords = NULL;
+	m_SpeciesNames.clear();
+	m_iPlants = 0;
+	m_iColumns = m_iRows = 0;
+}
+
+void vtPlantTileFile::GetTileExtents(int col, int row, DRECT &rect) const
+{
+	rect.left = m_Extents.left + col * m_TileSize.x;
+	rect.right = rect.left + m_TileSize.x;
+	rect.bottom = m_Extents.bottom + row * m_TileSize.y;
+	rect.top = rect.bottom + m_TileSize.y;
+}
+
+uint vtPlantTileFile::NumPlantsInTile(int col, int row) const
+{
+	uint count;
+	memcpy(&count, m_pTiles + ((size_t) row * m_iColumns + col) * 2 * sizeof(uint) +
+		sizeof(uint), sizeof(uint));
+	return count;
+}
+
+/**
+ * The plants of a tile, of which there are NumPlantsInTile.
+ */
+const vtPlantTileFile::Record *vtPlantTileFile::GetTileRecords(int col, int row) const
+{
+	uint first;
+	memcpy(&first, m_pTiles + ((size_t) row * m_iColumns + col) * 2 * sizeof(uint),
+		sizeof(uint));
+	return m_pRecords + first;
+}
+
+/**
+ * Get a plant of a tile.
+ *
+ * \param col, row The tile.
+ * \param i Index of the plant within the tile.
+ * \param pos Location of the plant, in the file's CRS.
+ * \param size Height of the plant, in meters.
+ * \param species Index into the file's table of species.
+ */
+void vtPlantTileFile::GetPlant(int col, int row, uint i, DPoint2 &pos,
+	float &size, unsigned short &species) const
+{
+	const Record &rec = GetTileRecords(col, row)[i];
+	pos.x = m_Extents.left + (col + rec.x / 65535.0) * m_TileSize.x;
+	pos.y = m_Extents.bottom + (row + rec.y / 65535.0) * m_TileSize.y;
+	size = rec.height / 100.0f;
+	species = rec.species;
+}
+
+void vtPlantTileFile::TileOf(const DPoint2 &p, const DRECT &extents, int cols,
+	int rows, int &col, int &row)
+{
+	col = (int) ((p.x - extents.left) / extents.Width() * cols);
+	row = (int) ((p.y - extents.bottom) / extents.Height() * rows);
+	if (col < 0) col = 0;
+	if (col > cols-1) col = cols-1;
+	if (row < 0) row = 0;
+	if (row > rows-1) row = rows-1;
+}
+
+/**
+ * The distance along a Hilbert curve which fills the 65536 x 65536 square,
+ * of a point in that square.  Points which are near each other in the
+ * square are usually near each other on the curve.
+ */
+uint vtPlantTileFile::HilbertIndex(unsigned short xs, unsigned short ys)
+{
+	uint x = xs, y = ys, d = 0;
+	for (uint s = 1 << 15; s > 0; s >>= 1)
+	{
+		const uint rx = (x & s) ? 1 : 0;
+		const uint ry = (y & s) ? 1 : 0;
+		d += s * s * ((3 * rx) ^ ry);
+
+		// Rotate the quadrant
+		if (ry == 0)
+		{
+			if (rx == 1)
+			{
+				x = 65535 - x;
+				y = 65535 - y;
+			}
+			const uint t = x;
+			x = y;
+			y = t;
+		}
+	}
+	return d;
+}
@@ -0,0 +1,83 @@
+//
+// PlantTileFile.h
+//
+// Copyright (c) 2001-2012 Virtual Terrain Project
+// Free for all uses, see license.txt for details.
+//
+
+#ifndef PLANTTILEFILEH
+#define PLANTTILEFILEH
+
+#include <string.h>
+#include <vector>
+#include "MathTypes.h"
+#include "Projections.h"
+#include "FilePath.h"
+
+/**
+ * Direct access to a tiled vegetation file (VF version 3.0), which is
+ * memory-mapped rather than read.
+ *
+ * The plants in the file are divided into a grid of square tiles.  The
+ * plants of each tile are stored together, ordered along a Hilbert curve
+ * so that plants which are near each other in the tile are also near each
+ * other in the file.  Each plant is 8 bytes: its position within the tile,
+ * quantized to 16 bits on each axis, its height in centimeters, and an
+ * index into the file's table of species.
+ *
+ * Opening a file only reads its header and the table of tiles, so a
+ * program can load just the tiles it needs, as it needs them.  See
+ * vtPlantInstanceArray::ReadVF to read a whole file, and WriteVF to write
+ * one.
+ */
+class vtPlantTileFile
+{
+public:
+	vtPlantTileFile();
+
+	bool Open(const char *fname);
+	void Close();
+	bool IsOpen() const { return m_File.IsOpen(); }
+
+	const vtProjection &GetProjection() const { return m_proj; }
+	uint NumSpecies() const { return m_SpeciesNames.size(); }
+	const char *GetSpeciesName(uint i) const { return m_SpeciesNames[i]; }
+	int NumPlants() const { return m_iPlants; }
+
+	// The grid of tiles
+	int NumColumns() const { return m_iColumns; }
+	int NumRows() const { return m_iRows; }
+	const DRECT &GetExtents() const { return m_Extents; }
+	void GetTileExtents(int col, int row, DRECT &rect) const;
+	uint NumPlantsInTile(int col, int row) const;
+
+	/// One plant, as it is stored in the file.
+	struct Record
+	{
+		unsigned short x, y;		// Position within the tile, 0-65535
+		unsigned short height;		// In centimeters
+		unsigned short species;		// Index into the table of species
+	};
+	const Record *GetTileRecords(int col, int row) const;
+	void GetPlant(int col, int row, uint i, DPoint2 &pos, float &size,
+		unsigned short &species) const;
+
+	/// The tile which contains a point, given the grid of tiles.
+	static void TileOf(const DPoint2 &p, const DRECT &extents, int cols,
+		int rows, int &col, int &row);
+	static uint HilbertIndex(unsigned short x, unsigned short y);
+
+protected:
+	vtMappedFile m_File;
+	const uchar *m_pTiles;		// first and count of each tile
+	const Record *m_pRecords;
+
+	vtProjection m_proj;
+	std::vector<vtString> m_SpeciesNames;
+	int		m_iPlants;
+	int		m_iColumns, m_iRows;
+	DRECT	m_Extents;
+	DPoint2	m_TileSize;
+};
+
+#endif	// PLANTTILEFILEH
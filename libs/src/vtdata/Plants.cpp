@@ -13,8 +13,11 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include <algorithm>	// for sort
+
 #include "vtLog.h"
 #include "Plants.h"
+#include "PlantTileFile.h"
 #include "MathTypes.h"
 #include "FilePath.h"
 #include "xmlhelper/easyxml.hpp"
@@ -881,6 +884,11 @@ bool vtPlantInstanceArray::ReadVF(const char *fname)
 		fclose(fp);
 		return ReadVF_version11(fname);
 	}
+	if (version >= 3.0f)
+	{
+		fclose(fp);
+		return ReadVF_version3(fname);
+	}
 
 	int i, numinstances, numspecies, quiet;
 
@@ -968,14 +976,119 @@ bool vtPlantInstanceArray::ReadVF(const char *fname)
 	return true;
 }
 
-bool vtPlantInstanceArray::WriteVF(const char *fname) const
+/**
+ * Read a tiled (version 3) VF file.  All of its plants are read; to load
+ * only some of the tiles, use vtPlantTileFile directly.
+ */
+bool vtPlantInstanceArray::ReadVF_version3(const char *fname)
+{
+	if (m_pPlantList == NULL)
+		return false;
+
+	vtPlantTileFile file;
+	if (!file.Open(fname))
+		return false;
+	m_proj = file.GetProjection();
+
+	// Create lookup table of new IDs
+	uint i, unknown = 0;
+	vector<short> local_ids;
+	for (i = 0; i < file.NumSpecies(); i++)
+	{
+		short species_id = m_pPlantList->GetSpeciesIdByName(file.GetSpeciesName(i));
+		if (species_id == -1)
+		{
+			VTLOG("  Unknown species: %s\n", file.GetSpeciesName(i));
+			unknown++;
+		}
+		local_ids.push_back(species_id);
+	}
+	if (unknown > 0)
+		VTLOG("Warning: %d unknown species encountered in VF table\n", unknown);
+
+	Reserve(file.NumPlants());
+
+	DPoint2 pos;
+	float size;
+	unsigned short local_species_id;
+	unknown = 0;
+	for (int row = 0; row < file.NumRows(); row++)
+	{
+		for (int col = 0; col < file.NumColumns(); col++)
+		{
+			const uint count = file.NumPlantsInTile(col, row);
+			for (i = 0; i < count; i++)
+			{
+				file.GetPlant(col, row, i, pos, size, local_species_id);
+				if (local_species_id >= local_ids.size() ||
+					local_ids[local_species_id] == -1)
+					unknown++;
+				else
+					AddPlant(pos, size, local_ids[local_species_id]);
+			}
+		}
+	}
+	if (unknown > 0)
+		VTLOG("Warning: %d/%d instances were ignored because of unknown species.\n", unknown, file.NumPlants());
+	return true;
+}
+
+/**
+ * Make a table of the species which are used by at least one plant.
+ *
+ * \param index_table Receives the ID of each species which is used.
+ * \param reverse_table Receives, for each species ID, its index in index_table.
+ * \return The number of species used.
+ */
+int vtPlantInstanceArray::GetUsedSpecies(vector<int> &index_table,
+										 vector<short> &reverse_table) const
+{
+	int i, numinstances = GetNumEntities();
+	int numspecies = m_pPlantList->NumSpecies();
+	short species_id;
+	float size;
+
+	vector<int> index_count;
+	for (i = 0; i < numspecies; i++)
+		index_count.push_back(0);
+	for (i = 0; i < numinstances; i++)
+	{
+		GetPlant(i, size, species_id);
+		index_count[species_id]++;
+	}
+	index_table.clear();
+	for (i = 0; i < numspecies; i++)
+	{
+		if (index_count[i] > 0)
+			index_table.push_back(i);
+	}
+	int used = index_table.size();
+
+	// reverse table for lookup
+	reverse_table.resize(numspecies);
+	for (i = 0; i < used; i++)
+		reverse_table[index_table[i]] = i;
+
+	return used;
+}
+
+/**
+ * Write the plants to a VF file.
+ *
+ * \param fname The file to write.
+ * \param iVersion 2 for the original format, or 3 for the tiled format,
+ *		which can be paged (see vtPlantTileFile).
+ */
+bool vtPlantInstanceArray::WriteVF(const char *fname, int iVersion) const
 {
 	int i, numinstances = GetNumEntities();
 	if (numinstances == 0)
 		return false;	// empty files not allowed
 	if (!m_pPlantList)
 		return false;
-	int numspecies = m_pPlantList->NumSpecies();
+	if (iVersion == 3)
+		return WriteVF_version3(fname);
+
 	short len;	// for string lengths
 	short species_id;
 	float size;
@@ -997,21 +1110,9 @@ bool vtPlantInstanceArray::WriteVF(const char *fname) const
 	OGRFree(wkt);
 
 	// filter out ununsed species, create table of used species
-	vector<int> index_count;
-	for (i = 0; i < numspecies; i++)
-		index_count.push_back(0);
-	for (i = 0; i < numinstances; i++)
-	{
-		GetPlant(i, size, species_id);
-		index_count[species_id]++;
-	}
 	vector<int> index_table;
-	for (i = 0; i < numspecies; i++)
-	{
-		if (index_count[i] > 0)
-			index_table.push_back(i);
-	}
-	int used = index_table.size();
+	vector<short> reverse_table;
+	int used = GetUsedSpecies(index_table, reverse_table);
 
 	// write number of species
 	fwrite(&used, sizeof(int), 1, fp);
@@ -1026,12 +1127,6 @@ bool vtPlantInstanceArray::WriteVF(const char *fname) const
 		fwrite(name, len, 1, fp);
 	}
 
-	// reverse table for lookup
-	vector<short> reverse_table;
-	reverse_table.resize(numspecies);
-	for (i = 0; i < used; i++)
-		reverse_table[index_table[i]] = i;
-
 	// write number of instances
 	fwrite(&numinstances, sizeof(int), 1, fp);
 
@@ -1066,6 +1161,168 @@ bool vtPlantInstanceArray::WriteVF(const char *fname) const
 	return true;
 }
 
+// One plant, in the order it is written to a tiled VF file
+struct TiledPlant
+{
+	uint tile, key;
+	int index;
+	bool operator<(const TiledPlant &other) const
+	{
+		if (tile != other.tile)
+			return tile < other.tile;
+		return key < other.key;
+	}
+};
+
+static unsigned short QuantizeToTile(double value, double origin, double size)
+{
+	double q = (value - origin) / size * 65535.0 + 0.5;
+	if (q < 0.0) q = 0.0;
+	if (q > 65535.0) q = 65535.0;
+	return (unsigned short) q;
+}
+
+/**
+ * Write a tiled (version 3) VF file.
+ *
+ * The tiles are sized to hold a few thousand plants each, on average, and
+ * small enough that the 16-bit positions within them are still precise to
+ * about a centimeter (or 1E-7 degree, for geographic coordinates).  Within
+ * each tile, the plants are sorted along a Hilbert curve.
+ *
+ * There are at most 1024 tiles in each direction, so that precision holds
+ * for extents up to about 670 km (or 6.7 degrees) across.  Beyond that the
+ * tiles must be larger, and positions are only precise to the extent
+ * divided by 1024 * 65535, which is logged as a warning.
+ */
+bool vtPlantInstanceArray::WriteVF_version3(const char *fname) const
+{
+	int i, numinstances = GetNumEntities();
+	short species_id;
+	float size;
+
+	vector<int> index_table;
+	vector<short> reverse_table;
+	int used = GetUsedSpecies(index_table, reverse_table);
+
+	// Decide the grid of tiles
+	const double precision = m_proj.IsGeographic() ? 1E-7 : 0.01;
+	const double max_tile = 65535 * precision;
+	DRECT rect;
+	ComputeExtent(rect);
+	if (rect.Width() < precision)
+		rect.right = rect.left + precision;
+	if (rect.Height() < precision)
+		rect.top = rect.bottom + precision;
+
+	const int tiles = (numinstances + 4095) / 4096;
+	int cols = (int) ceil(sqrt(tiles * rect.Width() / rect.Height()));
+	if (cols < 1) cols = 1;
+	int rows = (tiles + cols - 1) / cols;
+	cols = std::max(cols, (int) ceil(rect.Width() / max_tile));
+	rows = std::max(rows, (int) ceil(rect.Height() / max_tile));
+	cols = std::min(cols, 1024);
+	rows = std::min(rows, 1024);
+	const double tile_width = rect.Width() / cols;
+	const double tile_height = rect.Height() / rows;
+	if (tile_width > max_tile || tile_height > max_tile)
+	{
+		VTLOG("Warning: VF extents are too large for %g precision, positions are only precise to %g\n",
+			precision, std::max(tile_width, tile_height) / 65535);
+	}
+
+	// Sort the plants by tile, then along the curve within each tile
+	vector<TiledPlant> order(numinstances);
+	vector<unsigned short> qx(numinstances), qy(numinstances);
+	for (i = 0; i < numinstances; i++)
+	{
+		const DPoint2 &p = GetPoint(i);
+		int col, row;
+		vtPlantTileFile::TileOf(p, rect, cols, rows, col, row);
+		qx[i] = QuantizeToTile(p.x, rect.left + col * tile_width, tile_width);
+		qy[i] = QuantizeToTile(p.y, rect.bottom + row * tile_height, tile_height);
+		order[i].tile = row * cols + col;
+		order[i].key = vtPlantTileFile::HilbertIndex(qx[i], qy[i]);
+		order[i].index = i;
+	}
+	std::sort(order.begin(), order.end());
+
+	FILE *fp = vtFileOpen(fname, "wb");
+	if (!fp)
+		return false;
+
+	fwrite("vf3.0", 6, 1, fp);
+
+	// write SRS as WKT
+	char *wkt;
+	OGRErr err = m_proj.exportToWkt(&wkt);
+	if (err != OGRERR_NONE)
+	{
+		fclose(fp);
+		return false;
+	}
+	short len = (short) strlen(wkt);
+	fwrite(&len, sizeof(short), 1, fp);
+	fwrite(wkt, len, 1, fp);
+	OGRFree(wkt);
+	size_t written = 6 + sizeof(short) + len;
+
+	// write species binomial strings
+	fwrite(&used, sizeof(int), 1, fp);
+	written += sizeof(int);
+	for (i = 0; i < used; i++)
+	{
+		const char *name = m_pPlantList->GetSpecies(index_table[i])->GetSciName();
+		len = (short) strlen(name);
+		fwrite(&len, sizeof(short), 1, fp);
+		fwrite(name, len, 1, fp);
+		written += sizeof(short) + len;
+	}
+
+	// write the grid: count, columns, rows, extents (left, top, right, bottom)
+	fwrite(&numinstances, sizeof(int), 1, fp);
+	fwrite(&cols, sizeof(int), 1, fp);
+	fwrite(&rows, sizeof(int), 1, fp);
+	fwrite(&rect.left, sizeof(double), 1, fp);
+	fwrite(&rect.top, sizeof(double), 1, fp);
+	fwrite(&rect.right, sizeof(double), 1, fp);
+	fwrite(&rect.bottom, sizeof(double), 1, fp);
+	written += 3 * sizeof(int) + 4 * sizeof(double);
+
+	// pad to an 8-byte boundary
+	const char zeros[8] = { 0, 0, 0, 0, 0, 0, 0, 0 };
+	fwrite(zeros, ((written + 7) & ~7) - written, 1, fp);
+
+	// write the first plant and number of plants in each tile
+	const uint numtiles = cols * rows;
+	vector<uint> first(numtiles, 0), count(numtiles, 0);
+	for (i = 0; i < numinstances; i++)
+		count[order[i].tile]++;
+	for (uint t = 1; t < numtiles; t++)
+		first[t] = first[t-1] + count[t-1];
+	for (uint t = 0; t < numtiles; t++)
+	{
+		fwrite(&first[t], sizeof(uint), 1, fp);
+		fwrite(&count[t], sizeof(uint), 1, fp);
+	}
+
+	// write instances
+	vtPlantTileFile::Record rec;
+	for (i = 0; i < numinstances; i++)
+	{
+		const int index = order[i].index;
+		GetPlant(index, size, species_id);
+		rec.x = qx[index];
+		rec.y = qy[index];
+		rec.height = (unsigned short) std::min(std::max(size * 100.0f + 0.5f, 0.0f), 65535.0f);
+		rec.species = reverse_table[species_id];
+		fwrite(&rec, sizeof(rec), 1, fp);
+	}
+
+	fclose(fp);
+	return true;
+}
+
 bool vtPlantInstanceArray::ReadSHP(const char *fname)
 {
 	// SHPOpen doesn't yet support utf-8 or wide filenames, so convert
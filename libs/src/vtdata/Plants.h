@@ -193,6 +193,9 @@ public:
  * It can be read from/written to the VF format ("vegetation file")
  * designed specifically for the purpose of storing plants, which makes
  * it very compact and much more efficient than, e.g. SHP format.
+ *
+ * Version 3 of the VF format divides the plants into tiles, so that a very
+ * large forest can be paged in a piece at a time; see vtPlantTileFile.
  */
 class vtPlantInstanceArray : public vtFeatureSetPoint2D
 {
@@ -207,11 +210,16 @@ public:
 	uint InstancesOfSpecies(short species_id);
 
 	bool ReadVF_version11(const char *fname);
+	bool ReadVF_version3(const char *fname);
 	bool ReadVF(const char *fname);
 	bool ReadSHP(const char *fname);
-	bool WriteVF(const char *fname) const;
+	bool WriteVF(const char *fname, int iVersion = 2) const;
 
 protected:
+	bool WriteVF_version3(const char *fname) const;
+	int GetUsedSpecies(std::vector<int> &index_table,
+		std::vector<short> &reverse_table) const;
+
 	vtSpeciesList *m_pPlantList;
 
 	int m_SizeField;
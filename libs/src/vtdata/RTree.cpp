@@ -0,0 +1,155 @@
+//
+// RTree.cpp
+//
+// Copyright (c) 2001-2012 Virtual Terrain Project
+// Free for all uses, see license.txt for details.
+//
+
+#include <algorithm>
+#include <math.h>
+#include "RTree.h"
+
+struct RTreeItem
+{
+	DRECT rect;
+	int id;
+	double cx, cy;		// center
+};
+
+static bool CompareX(const RTreeItem &a, const RTreeItem &b) { return a.cx < b.cx; }
+static bool CompareY(const RTreeItem &a, const RTreeItem &b) { return a.cy < b.cy; }
+
+vtRTree::vtRTree()
+{
+	m_iItems = 0;
+}
+
+/**
+ * Remove all the rectangles.
+ */
+void vtRTree::Clear()
+{
+	m_iItems = 0;
+	m_Rects.clear();
+	m_Index.clear();
+	m_LevelEnds.clear();
+}
+
+/**
+ * Add a rectangle, to be indexed when Build is called.
+ */
+void vtRTree::Add(int id, const DRECT &rect)
+{
+	m_Rects.push_back(rect);
+	m_Index.push_back(id);
+}
+
+/**
+ * Build the tree from the rectangles which have been added.
+ */
+void vtRTree::Build()
+{
+	const uint n = m_Rects.size() < m_Index.size() ? m_Rects.size() : m_Index.size();
+	std::vector<RTreeItem> items(n);
+	for (uint i = 0; i < n; i++)
+	{
+		items[i].rect = m_Rects[i];
+		items[i].id = m_Index[i];
+		items[i].cx = (m_Rects[i].left + m_Rects[i].right) / 2;
+		items[i].cy = (m_Rects[i].bottom + m_Rects[i].top) / 2;
+	}
+	Clear();
+	m_iItems = n;
+	if (n == 0)
+		return;
+
+	// Sort-Tile-Recursive: sort by x into vertical slices, then each slice
+	//  by y, so that each run of NODE_SIZE items is a compact tile.
+	const uint leaves = (n + NODE_SIZE - 1) / NODE_SIZE;
+	const uint slices = (uint) ceil(sqrt((double) leaves));
+	const uint per_slice = slices * NODE_SIZE;
+	std::sort(items.begin(), items.end(), CompareX);
+	for (uint start = 0; start < n; start += per_slice)
+	{
+		const uint end = (start + per_slice < n) ? start + per_slice : n;
+		std::sort(items.begin() + start, items.begin() + end, CompareY);
+	}
+
+	// Count the nodes of each level, up to the root
+	uint count = n, total = n;
+	m_LevelEnds.push_back(n);
+	do
+	{
+		count = (count + NODE_SIZE - 1) / NODE_SIZE;
+		total += count;
+		m_LevelEnds.push_back(total);
+	}
+	while (count > 1);
+
+	m_Rects.resize(total);
+	m_Index.resize(total);
+	for (uint i = 0; i < n; i++)
+	{
+		m_Rects[i] = items[i].rect;
+		m_Index[i] = items[i].id;
+	}
+
+	// Each node holds the bounds of its children, and where they start
+	uint pos = 0, out = n;
+	for (uint level = 0; level + 1 < m_LevelEnds.size(); level++)
+	{
+		const uint end = m_LevelEnds[level];
+		while (pos < end)
+		{
+			DRECT bounds = m_Rects[pos];
+			m_Index[out] = pos;
+			for (uint j = 0; j < NODE_SIZE && pos < end; j++, pos++)
+			{
+				const DRECT &r = m_Rects[pos];
+				if (r.left < bounds.left) bounds.left = r.left;
+				if (r.right > bounds.right) bounds.right = r.right;
+				if (r.bottom < bounds.bottom) bounds.bottom = r.bottom;
+				if (r.top > bounds.top) bounds.top = r.top;
+			}
+			m_Rects[out++] = bounds;
+		}
+	}
+}
+
+/**
+ * Find the rectangles which overlap an area (including those which only
+ * touch it).  Their ids are added to the vector, in no particular order.
+ */
+void vtRTree::Query(const DRECT &area, std::vector<int> &ids) const
+{
+	if (m_iItems == 0)
+		return;
+
+	// Nodes still to visit, and their levels
+	std::vector<uint> stack, levels;
+	uint node = m_Rects.size() - 1;		// the root
+	uint level = m_LevelEnds.size() - 1;
+	while (true)
+	{
+		const uint end = (node + NODE_SIZE < m_LevelEnds[level]) ?
+			node + NODE_SIZE : m_LevelEnds[level];
+		for (uint pos = node; pos < end; pos++)
+		{
+			if (!area.OverlapsRect(m_Rects[pos]))
+				continue;
+			if (level == 0)
+				ids.push_back(m_Index[pos]);
+			else
+			{
+				stack.push_back(m_Index[pos]);
+				levels.push_back(level - 1);
+			}
+		}
+		if (stack.empty())
+			break;
+		node = stack.back();
+		level = levels.back();
+		stack.pop_back();
+		levels.pop_back();
+	}
+}
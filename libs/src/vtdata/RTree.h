@@ -0,0 +1,45 @@
+//
+// RTree.h
+//
+// Copyright (c) 2001-2012 Virtual Terrain Project
+// Free for all uses, see license.txt for details.
+//
+
+#ifndef VTDATA_RTREEH
+#define VTDATA_RTREEH
+
+#include <vector>
+#include "MathTypes.h"
+
+/**
+ * A packed R-tree: a spatial index of rectangles, each with an integer id,
+ * which finds the rectangles that overlap an area in logarithmic time.
+ *
+ * The tree is built all at once, from the rectangles given with Add, by
+ * sorting them into tiles (Sort-Tile-Recursive packing) which are then
+ * grouped into nodes of up to 16, and so on up to the root.  To change its
+ * contents, Clear it and build it again; this is fast, roughly the cost of
+ * sorting the rectangles.
+ */
+class vtRTree
+{
+public:
+	vtRTree();
+
+	void Clear();
+	void Add(int id, const DRECT &rect);
+	void Build();
+
+	uint NumItems() const { return m_iItems; }
+	void Query(const DRECT &area, std::vector<int> &ids) const;
+
+protected:
+	enum { NODE_SIZE = 16 };
+
+	uint m_iItems;
+	std::vector<DRECT> m_Rects;		// items, then each level of nodes
+	std::vector<int> m_Index;		// id of item, or first child of node
+	std::vector<uint> m_LevelEnds;	// where each level ends in m_Rects
+};
+
+#endif	// VTDATA_RTREEH
@@ -0,0 +1,536 @@
+//
+// ShadingContext.cpp
+//
+// Copyright (c) 2002-2011 Virtual Terrain Project
+// Free for all uses, see license.txt for details.
+//
+
+#include "ShadingContext.h"
+#include "HeightField.h"
+#include "vtDIB.h"
+#include "vtLog.h"
+#include <new>			// for bad_alloc
+
+// The rows are processed in bands of this many rows.  The rows within a
+//  band are shared among the threads, and the progress callback is only
+//  called between bands, from the calling thread.
+#define SHADING_BAND	64
+
+// Scale factor for the fixed-point normals
+#define NORMAL_SCALE	32767.0f
+
+// A normal with this X value marks a texel which has no elevation
+#define NORMAL_INVALID	SHRT_MIN
+
+// The most memory a horizon map may use.  A larger map is made with fewer
+//  directions, down to the minimum of 4.
+#define HORIZON_MAX_BYTES	((size_t) 512 * 1024 * 1024)
+
+vtShadingContext::vtShadingContext()
+{
+	m_pGrid = NULL;
+	m_iWidth = m_iHeight = 0;
+	m_fLightFactor = 1.0f;
+	m_bTrue = false;
+	m_iDirections = 0;
+	SetLight(FPoint3(0, -1, 0));
+}
+
+/**
+ * Compute the surface normals for the texels of a bitmap to be shaded.
+ * The normals are the same as those used by
+ * vtHeightFieldGrid3d::ShadeDibFromElevation.
+ *
+ * \param pGrid The heightfield grid.  It must stay valid for as long as
+ *		the context is used.
+ * \param iWidth, iHeight The size of the bitmap which will be shaded.
+ * \param fLightFactor Value from 0 (no shading) to 1 (full shading)
+ * \param bTrue	If true, use the real elevation values, ignoring vertical
+ *		exaggeration.
+ * \param progress_callback	If supplied, will be called with values from 0 to 100.
+ */
+bool vtShadingContext::Setup(const vtHeightFieldGrid3d *pGrid, int iWidth,
+	int iHeight, float fLightFactor, bool bTrue, bool progress_callback(int))
+{
+	Clear();
+	if (!pGrid || iWidth < 2 || iHeight < 2)
+		return false;
+
+	m_pGrid = pGrid;
+	m_iWidth = iWidth;
+	m_iHeight = iHeight;
+	m_fLightFactor = fLightFactor;
+	m_bTrue = bTrue;
+	m_Normals.resize((size_t) iWidth * iHeight);
+
+	for (int j0 = 0; j0 < m_iHeight; j0 += SHADING_BAND)
+	{
+		if (progress_callback != NULL)
+			progress_callback(j0 * 100 / m_iHeight);
+
+		SetupRows(j0, std::min(j0 + SHADING_BAND, m_iHeight));
+	}
+	return true;
+}
+
+void vtShadingContext::SetupRows(int j0, int j1)
+{
+	const int w = m_iWidth, h = m_iHeight;
+	int gw, gh;
+	m_pGrid->GetDimensions(gw, gh);
+
+	double ratiox = (double)(gw-1)/(w-1), ratioy = (double)(gh-1)/(h-1);
+
+	// For purposes of shading, we need to look at adjacent heixels which are
+	//  at least one grid cell away:
+	int xOffset = (int)ratiox;
+	int yOffset = (int)ratioy;
+	if (xOffset < 1) xOffset = 1;
+	if (yOffset < 1) yOffset = 1;
+
+#pragma omp parallel for
+	for (int j = j0; j < j1; j++)
+	{
+		// Center, Left, Right, Top, Bottom
+		FPoint3 c, l, r, t, b, v3;
+
+		// find corresponding location in terrain
+		int y = (int) (j * ratioy);
+		for (int i = 0; i < w; i++)
+		{
+			PackedNormal &pn = m_Normals[(size_t) j * w + i];
+			int x = (int) (i * ratiox);
+
+			m_pGrid->GetWorldLocation(x, y, c, m_bTrue);
+			if (c.y == INVALID_ELEVATION)
+			{
+				pn.x = NORMAL_INVALID;
+				pn.y = pn.z = 0;
+				continue;
+			}
+
+			// Check to see what surrounding values are valid
+			m_pGrid->GetWorldLocation(x-xOffset, y, l, m_bTrue);
+			m_pGrid->GetWorldLocation(x+xOffset, y, r, m_bTrue);
+			m_pGrid->GetWorldLocation(x, y+yOffset, t, m_bTrue);
+			m_pGrid->GetWorldLocation(x, y-yOffset, b, m_bTrue);
+
+			const FPoint3 &p1 = (l.y != INVALID_ELEVATION) ? l : c;
+			const FPoint3 &p2 = (r.y != INVALID_ELEVATION) ? r : c;
+			const FPoint3 &p3 = (t.y != INVALID_ELEVATION) ? t : c;
+			const FPoint3 &p4 = (b.y != INVALID_ELEVATION) ? b : c;
+
+			// This is equivalent to the cross product of the surface vectors
+			v3.Set((p1.y - p2.y)*m_fLightFactor/(p2.x - p1.x), 1,
+				   (p3.y - p4.y)*m_fLightFactor/(p4.z - p3.z));
+			v3.Normalize();
+
+			pn.x = (short) (v3.x * NORMAL_SCALE);
+			pn.y = (short) (v3.y * NORMAL_SCALE);
+			pn.z = (short) (v3.z * NORMAL_SCALE);
+		}
+	}
+}
+
+/**
+ * Return true if this context was set up with the given values, so it can
+ * be used without calling Setup again.
+ */
+bool vtShadingContext::Matches(const vtHeightFieldGrid3d *pGrid, int iWidth,
+	int iHeight, float fLightFactor, bool bTrue) const
+{
+	return (!IsEmpty() && m_pGrid == pGrid && m_iWidth == iWidth &&
+		m_iHeight == iHeight && m_fLightFactor == fLightFactor &&
+		m_bTrue == bTrue);
+}
+
+/**
+ * Free the normals.  Call this if the elevation values of the grid change.
+ */
+void vtShadingContext::Clear()
+{
+	m_Normals.clear();
+	m_Horizons.clear();
+	m_pGrid = NULL;
+	m_iWidth = m_iHeight = m_iDirections = 0;
+}
+
+/**
+ * Get the normal at a texel, where (0,0) is the southwest corner.
+ * \return false if there is no elevation at that texel.
+ */
+bool vtShadingContext::GetNormal(int i, int j, FPoint3 &normal) const
+{
+	const PackedNormal &pn = m_Normals[(size_t) j * m_iWidth + i];
+	if (pn.x == NORMAL_INVALID)
+		return false;
+	normal.Set(pn.x / NORMAL_SCALE, pn.y / NORMAL_SCALE, pn.z / NORMAL_SCALE);
+	return true;
+}
+
+/**
+ * Set the light which is used by ShadeAt.
+ *
+ * \param light_dir	Direction vector of the light.
+ * \param fAmbient Ambient light values from 0 to 1, a typical value is 0.1.
+ * \param fGamma Gamma values from 0 to 1, values less than 1 boost the brightness curve.
+ */
+void vtShadingContext::SetLight(const FPoint3 &light_dir, float fAmbient,
+	float fGamma)
+{
+	// consider upward-pointing normal vector, rather than downward-pointing.
+	//  Fold the fixed-point scale into the light direction.
+	m_Light = -light_dir / NORMAL_SCALE;
+	m_fAmbient = fAmbient;
+	m_fGamma = fGamma;
+}
+
+/**
+ * The amount of light at a texel, for the light given to SetLight, as a
+ * factor to multiply the color by.  (0,0) is the southwest corner.
+ * \return The shade, or -1 if there is no elevation at that texel.
+ */
+float vtShadingContext::ShadeAt(int i, int j) const
+{
+	const PackedNormal &pn = m_Normals[(size_t) j * m_iWidth + i];
+	if (pn.x == NORMAL_INVALID)
+		return -1.0f;
+
+	// shading 0 (dark) to 1 (light)
+	float shade = pn.x * m_Light.x + pn.y * m_Light.y + pn.z * m_Light.z;
+
+	// Most of the values are in the bottom half of the 0-1 range, so push
+	//  them upwards with a gamma factor.
+	if (m_fGamma != 1.0f)
+		shade = (shade > 0) ? powf(shade, m_fGamma) : 0;
+
+	// boost with ambient light
+	shade += m_fAmbient;
+
+	// Never shade below zero, can cause RGB wraparound
+	if (shade < 0)
+		shade = 0;
+	if (shade > 1.1f)
+		shade = 1.1f;
+	return shade;
+}
+
+/**
+ * Shade a bitmap using the cached normals and dot-product lighting.
+ * The bitmap must be the size that was passed to Setup.  Texels which have
+ * no elevation are not changed.
+ *
+ * \param pBM	The bitmap to shade.
+ * \param light_dir	Direction vector of the light.
+ * \param fAmbient Ambient light values from 0 to 1, a typical value is 0.1.
+ * \param fGamma Gamma values from 0 to 1, values less than 1 boost the brightness curve.
+ * \param progress_callback	If supplied, will be called with values from 0 to 100.
+ */
+void vtShadingContext::ShadeBitmap(vtBitmapBase *pBM, const FPoint3 &light_dir,
+	float fAmbient, float fGamma, bool progress_callback(int))
+{
+	const int w = m_iWidth, h = m_iHeight;
+	if ((int) pBM->GetWidth() != w || (int) pBM->GetHeight() != h)
+		return;
+
+	SetLight(light_dir, fAmbient, fGamma);
+	const int depth = pBM->GetDepth();
+	const int bytes = depth / 8;
+
+	for (int j0 = 0; j0 < h; j0 += SHADING_BAND)
+	{
+		if (progress_callback != NULL)
+			progress_callback(j0 * 100 / h);
+
+		const int j1 = std::min(j0 + SHADING_BAND, h);
+#pragma omp parallel for
+		for (int j = j0; j < j1; j++)
+		{
+			uchar *row = pBM->GetPixelRow(h-1-j);
+			for (int i = 0; i < w; i++)
+			{
+				const float shade = ShadeAt(i, j);
+				if (shade < 0)
+					continue;
+
+				// combine color and shading
+				if (row)
+					vtBitmapBase::ScaleRawPixel(row + i * bytes, bytes, shade);
+				else if (depth == 8)
+					pBM->ScalePixel8(i, h-1-j, shade);
+				else if (depth == 24)
+					pBM->ScalePixel24(i, h-1-j, shade);
+				else if (depth == 32)
+					pBM->ScalePixel32(i, h-1-j, shade);
+			}
+		}
+	}
+}
+
+/**
+ * Compute a horizon map: for each texel, and each of a number of compass
+ * directions, the angle from the texel up to the horizon in that direction.
+ * With this, ShadowBitmap can cast shadows for any position of the sun with
+ * a single lookup per texel.
+ *
+ * This takes time and memory: one byte for each texel for each direction.
+ * If that would be more than 512 MB, fewer directions are used; if even 4
+ * directions would be too many, no map is made.
+ * Distant terrain is sampled more sparsely than nearby terrain, so the
+ * shadows are a close approximation of those from
+ * vtHeightFieldGrid3d::ShadowCastDib.  Setup must be called first.
+ *
+ * \param iDirections The number of compass directions, e.g. 32.
+ * \param progress_callback	If supplied, will be called with values from 0 to 100.
+ * \return true if the horizon map was made.
+ */
+bool vtShadingContext::SetupHorizons(int iDirections, bool progress_callback(int))
+{
+	m_Horizons.clear();
+	if (IsEmpty() || iDirections < 4 || iDirections > 256)
+		return false;
+
+	const int w = m_iWidth, h = m_iHeight;
+	const size_t texels = (size_t) w * h;
+	if (texels * 4 > HORIZON_MAX_BYTES)
+	{
+		VTLOG("  Horizon map of %d x %d is too large, not using it.\n", w, h);
+		return false;
+	}
+	const int iRequested = iDirections;
+	while (texels * iDirections > HORIZON_MAX_BYTES)
+		iDirections /= 2;
+	if (iDirections < 4)
+		iDirections = 4;
+	if (iDirections != iRequested)
+		VTLOG("  Horizon map of %d x %d: using %d directions instead of %d.\n",
+			w, h, iDirections, iRequested);
+
+	int gw, gh;
+	m_pGrid->GetDimensions(gw, gh);
+	double ratiox = (double)(gw-1)/(w-1), ratioy = (double)(gh-1)/(h-1);
+
+	// The true height at each texel, sampled as for the normals
+	std::vector<float> heights((size_t) w * h);
+	float fMaxHeight = -1E9f;
+	for (int j = 0; j < h; j++)
+	{
+		FPoint3 c;
+		int y = (int) (j * ratioy);
+		for (int i = 0; i < w; i++)
+		{
+			m_pGrid->GetWorldLocation((int) (i * ratiox), y, c, true);
+			heights[(size_t) j * w + i] = c.y;
+			if (c.y != INVALID_ELEVATION && c.y > fMaxHeight)
+				fMaxHeight = c.y;
+		}
+	}
+	try
+	{
+		m_Horizons.resize(texels * iDirections);
+	}
+	catch (std::bad_alloc &)
+	{
+		VTLOG("  Not enough memory for a horizon map of %d x %d x %d.\n",
+			w, h, iDirections);
+		m_Horizons.clear();
+		return false;
+	}
+	m_iDirections = iDirections;
+
+	for (int j0 = 0; j0 < h; j0 += SHADING_BAND)
+	{
+		if (progress_callback != NULL)
+			progress_callback(j0 * 100 / h);
+
+		SetupHorizonRows(j0, std::min(j0 + SHADING_BAND, h), heights, fMaxHeight);
+	}
+	return true;
+}
+
+void vtShadingContext::SetupHorizonRows(int j0, int j1,
+	const std::vector<float> &heights, float fMaxHeight)
+{
+	const int w = m_iWidth, h = m_iHeight;
+	const size_t texels = (size_t) w * h;
+
+	// The size of a texel in world units
+	const FPoint2 spacing = m_pGrid->GetWorldSpacing();
+	int gw, gh;
+	m_pGrid->GetDimensions(gw, gh);
+	const float sx = spacing.x * (gw-1) / (w-1);
+	const float sz = spacing.y * (gh-1) / (h-1);
+
+#pragma omp parallel for schedule(dynamic)
+	for (int j = j0; j < j1; j++)
+	{
+		for (int d = 0; d < m_iDirections; d++)
+		{
+			// Direction of the step, with north up, scaled so that each step
+			//  moves one texel east-west or north-south
+			const float a = PI2f * d / m_iDirections;
+			const float ca = cosf(a) / sx, sa = sinf(a) / sz;
+			const float scale = 1.0f / std::max(fabsf(ca), fabsf(sa));
+			const float dx = ca * scale, dy = sa * scale;
+			const float dist_per_step = scale;
+
+			uchar *horizon = &m_Horizons[d * texels + (size_t) j * w];
+			for (int i = 0; i < w; i++)
+			{
+				const float h0 = heights[(size_t) j * w + i];
+				float best = 0.0f;
+				if (h0 != INVALID_ELEVATION)
+				{
+					// Step outward, farther apart as we go
+					for (int s = 1; ; s += 1 + s/16)
+					{
+						const float dist = s * dist_per_step;
+
+						// Can anything farther away be higher than the horizon?
+						if ((fMaxHeight - h0) / dist <= best)
+							break;
+
+						const int x = (int) floorf(i + dx * s + 0.5f);
+						const int y = (int) floorf(j + dy * s + 0.5f);
+						if (x < 0 || x >= w || y < 0 || y >= h)
+							break;
+						const float h1 = heights[(size_t) y * w + x];
+						if (h1 == INVALID_ELEVATION)
+							continue;
+						const float slope = (h1 - h0) / dist;
+						if (slope > best)
+							best = slope;
+					}
+				}
+				horizon[i] = (uchar) (atanf(best) / PID2f * 255.0f + 0.5f);
+			}
+		}
+	}
+}
+
+// Find which horizon direction the sun is in, and how high it is
+int vtShadingContext::DirectionOf(const FPoint3 &light_dir, uchar &sun_angle) const
+{
+	// The sun is in the direction opposite the light, and north is -Z
+	float a = atan2f(light_dir.z, -light_dir.x);
+	if (a < 0)
+		a += PI2f;
+	const int d = (int) (a / PI2f * m_iDirections + 0.5f) % m_iDirections;
+
+	const float elev = atan2f(-light_dir.y,
+		sqrtf(light_dir.x * light_dir.x + light_dir.z * light_dir.z));
+	sun_angle = (uchar) (elev / PID2f * 255.0f + 0.5f);
+	return d;
+}
+
+/**
+ * Shade a bitmap with cast shadows, using the horizon map which was made by
+ * SetupHorizons.  The lighting is the same as that of
+ * vtHeightFieldGrid3d::ShadowCastDib.  For the closest match, call Setup
+ * with a light factor of 1 and bTrue.
+ *
+ * \param pBM	The bitmap to shade.  It must be the size that was passed to Setup.
+ * \param light_dir	The direction of the light, coming down toward the terrain.
+ * \param fLightFactor	Amount of shading, from 0 to 1.
+ * \param fAmbient	Amount of ambient light, from 0 to 1.  A typical value is 0.1.
+ * \param progress_callback	If supplied, will be called with values from 0 to 100.
+ */
+void vtShadingContext::ShadowBitmap(vtBitmapBase *pBM, const FPoint3 &light_dir,
+	float fLightFactor, float fAmbient, bool progress_callback(int)) const
+{
+	const int w = m_iWidth, h = m_iHeight;
+	if (!HasHorizons() || (int) pBM->GetWidth() != w || (int) pBM->GetHeight() != h)
+		return;
+
+	const int depth = pBM->GetDepth();
+	const int bytes = depth / 8;
+	const float sun = 0.7f;
+
+	// With the sun below the horizon, everything is in shadow
+	const bool bNight = (light_dir.y >= 0);
+	uchar sun_angle = 0;
+	const int dir = bNight ? 0 : DirectionOf(light_dir, sun_angle);
+	const uchar *horizons = &m_Horizons[(size_t) dir * w * h];
+
+	// The darkest shadow is the floor for the lit texels
+	float darkest_shadow = 1.0f;
+#pragma omp parallel
+	{
+		float thread_darkest = 1.0f;
+#pragma omp for
+		for (int j = 0; j < h; j++)
+		{
+			for (int i = 0; i < w; i++)
+			{
+				const size_t idx = (size_t) j * w + i;
+				if (m_Normals[idx].x == NORMAL_INVALID)
+					continue;
+				if (bNight || sun_angle < horizons[idx])
+				{
+					const float shade = fAmbient * (0.5f * m_Normals[idx].y / NORMAL_SCALE + 0.5f);
+					if (thread_darkest > shade)
+						thread_darkest = shade;
+				}
+			}
+		}
+#pragma omp critical
+		{
+			if (darkest_shadow > thread_darkest)
+				darkest_shadow = thread_darkest;
+		}
+	}
+
+	// consider upward-pointing normal vector.  Fold the fixed-point scale
+	//  into the light direction.
+	const FPoint3 light = -light_dir / NORMAL_SCALE;
+
+	for (int j0 = 0; j0 < h; j0 += SHADING_BAND)
+	{
+		if (progress_callback != NULL)
+			progress_callback(j0 * 100 / h);
+
+		const int j1 = std::min(j0 + SHADING_BAND, h);
+#pragma omp parallel for
+		for (int j = j0; j < j1; j++)
+		{
+			const PackedNormal *pn = &m_Normals[(size_t) j * w];
+			const uchar *horizon = horizons + (size_t) j * w;
+			uchar *row = pBM->GetPixelRow(h-1-j);
+			for (int i = 0; i < w; i++, pn++)
+			{
+				if (pn->x == NORMAL_INVALID)
+					continue;
+
+				const float ambient = fAmbient * (0.5f * pn->y / NORMAL_SCALE + 0.5f);
+				float shade;
+				if (bNight || sun_angle < horizon[i])
+					shade = ambient;
+				else
+				{
+					shade = sun * (pn->x * light.x + pn->y * light.y + pn->z * light.z);
+
+					// an angle of 45 degrees fully illuminates the ground
+					shade = shade / .7071f + ambient;
+
+					if (shade < darkest_shadow)
+						shade = darkest_shadow;
+					else if (shade > 1.2f)
+						shade = 1.2f;
+
+					// Push the value toward 1.0 by the fLightFactor factor.
+					shade += (1 - shade) * (1 - fLightFactor);
+				}
+
+				// combine color and shading
+				if (row)
+					vtBitmapBase::ScaleRawPixel(row + i * bytes, bytes, shade);
+				else if (depth == 8)
+					pBM->ScalePixel8(i, h-1-j, shade);
+				else if (depth == 24)
+					pBM->ScalePixel24(i, h-1-j, shade);
+				else if (depth == 32)
+					pBM->ScalePixel32(i, h-1-j, shade);
+			}
+		}
+	}
+}
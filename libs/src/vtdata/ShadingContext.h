@@ -0,0 +1,103 @@
+//
+// ShadingContext.h
+//
+// Copyright (c) 2002-2011 Virtual Terrain Project
+// Free for all uses, see license.txt for details.
+//
+
+#ifndef SHADINGCONTEXTH
+#define SHADINGCONTEXTH
+
+#include <vector>
+#include "MathTypes.h"
+
+class vtBitmapBase;
+class vtHeightFieldGrid3d;
+
+/**
+ * A shading context holds the surface normals of a heightfield grid,
+ * sampled at the texels of a bitmap which is to be shaded.
+ *
+ * Finding the normals is the slow part of shading.  It depends only on the
+ * grid and the size of the bitmap, not on the direction of the light, so
+ * it is done once by Setup.  After that, each call to ShadeBitmap is a
+ * single quick pass which takes the dot product of each normal with the
+ * light.  This makes it practical to re-shade a terrain texture every time
+ * the sun moves.
+ *
+ * The context can also hold a horizon map (see SetupHorizons), which
+ * allows shadows to be cast for any position of the sun with a single
+ * lookup per texel.
+ *
+ * When vtdata is built with OpenMP, all the methods which loop over the
+ * texels use all the available processors.
+ *
+ * \par Example:
+	\code
+	vtShadingContext context;
+	context.Setup(pGrid, pBitmap->GetWidth(), pBitmap->GetHeight(), 1.0f);
+	...
+	// each time the sun moves
+	context.ShadeBitmap(pBitmap, light_dir, 0.1f);
+	\endcode
+ */
+class vtShadingContext
+{
+public:
+	vtShadingContext();
+
+	bool Setup(const vtHeightFieldGrid3d *pGrid, int iWidth, int iHeight,
+		float fLightFactor, bool bTrue = false, bool progress_callback(int) = NULL);
+	bool Matches(const vtHeightFieldGrid3d *pGrid, int iWidth, int iHeight,
+		float fLightFactor, bool bTrue = false) const;
+	void Clear();
+	bool IsEmpty() const { return m_Normals.empty(); }
+
+	int GetWidth() const { return m_iWidth; }
+	int GetHeight() const { return m_iHeight; }
+	bool GetNormal(int i, int j, FPoint3 &normal) const;
+
+	void SetLight(const FPoint3 &light_dir, float fAmbient = 0.1f,
+		float fGamma = 1.0f);
+	float ShadeAt(int i, int j) const;
+	void ShadeBitmap(vtBitmapBase *pBM, const FPoint3 &light_dir,
+		float fAmbient = 0.1f, float fGamma = 1.0f,
+		bool progress_callback(int) = NULL);
+
+	// Horizon map, for casting shadows
+	bool SetupHorizons(int iDirections = 32, bool progress_callback(int) = NULL);
+	bool HasHorizons() const { return !m_Horizons.empty(); }
+	int GetNumDirections() const { return m_iDirections; }
+	void ShadowBitmap(vtBitmapBase *pBM, const FPoint3 &light_dir,
+		float fLightFactor, float fAmbient, bool progress_callback(int) = NULL) const;
+
+protected:
+	// Normals are stored compactly, as 16-bit fixed point values.
+	struct PackedNormal
+	{
+		short x, y, z;
+	};
+	void SetupRows(int j0, int j1);
+	void SetupHorizonRows(int j0, int j1, const std::vector<float> &heights,
+		float fMaxHeight);
+	int DirectionOf(const FPoint3 &light_dir, uchar &sun_angle) const;
+
+	const vtHeightFieldGrid3d *m_pGrid;
+	int		m_iWidth, m_iHeight;
+	float	m_fLightFactor;
+	bool	m_bTrue;
+
+	// One normal for each texel, by rows starting from the south
+	std::vector<PackedNormal> m_Normals;
+
+	// The light for ShadeAt
+	FPoint3	m_Light;
+	float	m_fAmbient, m_fGamma;
+
+	// For each direction, the angle from each texel up to the horizon in
+	//  that direction, where 0 is level and 255 is straight up.
+	int		m_iDirections;
+	std::vector<uchar> m_Horizons;
+};
+
+#endif	// SHADINGCONTEXTH
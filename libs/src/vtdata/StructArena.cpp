@@ -0,0 +1,250 @@
+//
+// StructArena.cpp
+//
+// Copyright (c) 2001-2012 Virtual Terrain Project
+// Free for all uses, see license.txt for details.
+//
+
+#include <stdlib.h>
+#include <new>			// for bad_alloc
+#include "StructArena.h"
+
+#ifdef _MSC_VER
+#include <windows.h>
+#else
+#include <pthread.h>
+#endif
+
+// Each slab is at least this large
+#define ARENA_SLAB_SIZE		(64 * 1024)
+
+/**
+ * Every object, in an arena or not, is preceded by this header.  It points
+ * to the pool of the object, or is NULL for an object on the heap.  Once a
+ * block is freed, it links the block into the pool's list of free blocks.
+ */
+union vtArenaHeader
+{
+	vtArenaPool *pool;
+	char *next;
+	double align;
+};
+
+/** The blocks of one size in an arena. */
+struct vtArenaPool
+{
+	vtStructureArena *m_pArena;
+	size_t m_iBlockSize;
+	char *m_pFree;		// list of free blocks
+	char *m_pNext;		// unused part of the newest slab
+	char *m_pEnd;
+};
+
+struct vtArenaLock
+{
+#ifdef _MSC_VER
+	vtArenaLock() { InitializeCriticalSection(&m_Mutex); }
+	~vtArenaLock() { DeleteCriticalSection(&m_Mutex); }
+	void Lock() { EnterCriticalSection(&m_Mutex); }
+	void Unlock() { LeaveCriticalSection(&m_Mutex); }
+	CRITICAL_SECTION m_Mutex;
+#else
+	vtArenaLock() { pthread_mutex_init(&m_Mutex, NULL); }
+	~vtArenaLock() { pthread_mutex_destroy(&m_Mutex); }
+	void Lock() { pthread_mutex_lock(&m_Mutex); }
+	void Unlock() { pthread_mutex_unlock(&m_Mutex); }
+	pthread_mutex_t m_Mutex;
+#endif
+};
+
+vtStructureArena::vtStructureArena()
+{
+	m_pLock = new vtArenaLock;
+	m_iObjects = 0;
+	m_bReleased = false;
+	m_bBulkFree = false;
+	m_iBulkFreed = 0;
+}
+
+vtStructureArena::~vtStructureArena()
+{
+	for (size_t i = 0; i < m_Slabs.size(); i++)
+		free(m_Slabs[i]);
+	for (size_t i = 0; i < m_Pools.size(); i++)
+		delete m_Pools[i];
+	delete m_pLock;
+}
+
+/**
+ * Call this instead of deleting the arena.  It is deleted now if it is
+ * empty, otherwise as soon as the last of its objects is deleted.
+ */
+void vtStructureArena::Release()
+{
+	m_pLock->Lock();
+	m_bReleased = true;
+	const bool bEmpty = (m_iObjects == 0);
+	m_pLock->Unlock();
+	if (bEmpty)
+		delete this;
+}
+
+/**
+ * Start deleting many objects at once.  Until EndBulkFree, no other thread
+ * may allocate from, or free to, this arena.
+ */
+void vtStructureArena::BeginBulkFree()
+{
+	m_bBulkFree = true;
+	m_iBulkFreed = 0;
+}
+
+/**
+ * Finish deleting many objects at once.  If the arena is now empty, all its
+ * slabs are freed together, and the arena is ready to be used again.
+ */
+void vtStructureArena::EndBulkFree()
+{
+	m_bBulkFree = false;
+
+	m_pLock->Lock();
+	m_iObjects -= m_iBulkFreed;
+	m_iBulkFreed = 0;
+	const bool bEmpty = (m_iObjects == 0);
+	if (bEmpty)
+	{
+		for (size_t i = 0; i < m_Slabs.size(); i++)
+			free(m_Slabs[i]);
+		m_Slabs.clear();
+		for (size_t i = 0; i < m_Pools.size(); i++)
+		{
+			m_Pools[i]->m_pFree = NULL;
+			m_Pools[i]->m_pNext = m_Pools[i]->m_pEnd = NULL;
+		}
+	}
+	const bool bDelete = (bEmpty && m_bReleased);
+	m_pLock->Unlock();
+
+	if (bDelete)
+		delete this;
+}
+
+/**
+ * Allocate memory for an object, from an arena, or from the heap if the
+ * arena is NULL.
+ */
+void *vtStructureArena::Allocate(size_t size, vtStructureArena *arena)
+{
+	void *p;
+	if (arena)
+		p = arena->AllocateBlock(size);
+	else
+	{
+		vtArenaHeader *header = (vtArenaHeader *) malloc(sizeof(vtArenaHeader) + size);
+		if (header)
+			header->pool = NULL;
+		p = header;
+	}
+	if (!p)
+		throw std::bad_alloc();
+	return (vtArenaHeader *) p + 1;
+}
+
+/**
+ * Free the memory of an object made by Allocate.
+ */
+void vtStructureArena::Free(void *p)
+{
+	if (!p)
+		return;
+	vtArenaHeader *header = (vtArenaHeader *) p - 1;
+	vtArenaPool *pool = header->pool;
+	if (pool)
+		pool->m_pArena->FreeBlock(pool, (char *) header);
+	else
+		free(header);
+}
+
+void *vtStructureArena::AllocateBlock(size_t size)
+{
+	// Round up, so each block keeps the alignment of the slab
+	const size_t unit = sizeof(vtArenaHeader);
+	const size_t block_size = (size + 2 * unit - 1) / unit * unit;
+
+	m_pLock->Lock();
+
+	// There are only a few sizes, so the pool of each is easily found
+	vtArenaPool *pool = NULL;
+	for (size_t i = 0; i < m_Pools.size(); i++)
+	{
+		if (m_Pools[i]->m_iBlockSize == block_size)
+		{
+			pool = m_Pools[i];
+			break;
+		}
+	}
+	if (!pool)
+	{
+		pool = new vtArenaPool;
+		pool->m_pArena = this;
+		pool->m_iBlockSize = block_size;
+		pool->m_pFree = NULL;
+		pool->m_pNext = pool->m_pEnd = NULL;
+		m_Pools.push_back(pool);
+	}
+
+	char *block;
+	if (pool->m_pFree)
+	{
+		block = pool->m_pFree;
+		pool->m_pFree = ((vtArenaHeader *) block)->next;
+	}
+	else
+	{
+		if ((size_t) (pool->m_pEnd - pool->m_pNext) < block_size)
+		{
+			size_t slab_size = ARENA_SLAB_SIZE;
+			if (slab_size < block_size * 16)
+				slab_size = block_size * 16;
+			char *slab = (char *) malloc(slab_size);
+			if (!slab)
+			{
+				m_pLock->Unlock();
+				return NULL;
+			}
+			m_Slabs.push_back(slab);
+			pool->m_pNext = slab;
+			pool->m_pEnd = slab + slab_size;
+		}
+		block = pool->m_pNext;
+		pool->m_pNext += block_size;
+	}
+	((vtArenaHeader *) block)->pool = pool;
+	m_iObjects++;
+
+	m_pLock->Unlock();
+	return block;
+}
+
+void vtStructureArena::FreeBlock(vtArenaPool *pool, void *block)
+{
+	if (m_bBulkFree)
+	{
+		// The block is only linked in case some objects outlive the bulk
+		//  free; otherwise its slab is freed by EndBulkFree.
+		((vtArenaHeader *) block)->next = pool->m_pFree;
+		pool->m_pFree = (char *) block;
+		m_iBulkFreed++;
+		return;
+	}
+	m_pLock->Lock();
+	((vtArenaHeader *) block)->next = pool->m_pFree;
+	pool->m_pFree = (char *) block;
+	m_iObjects--;
+	const bool bDelete = (m_bReleased && m_iObjects == 0);
+	m_pLock->Unlock();
+
+	// The last object of a released arena
+	if (bDelete)
+		delete this;
+}
@@ -0,0 +1,84 @@
+//
+// StructArena.h
+//
+// Copyright (c) 2001-2012 Virtual Terrain Project
+// Free for all uses, see license.txt for details.
+//
+
+#ifndef STRUCTARENAH
+#define STRUCTARENAH
+
+#include <stddef.h>
+#include <vector>
+
+struct vtArenaPool;
+struct vtArenaLock;
+
+/**
+ * Memory for the parts of the buildings of a structure array: vtBuilding,
+ * vtLevel and vtEdge objects.  Rather than each being its own heap
+ * allocation, the objects are carved from large slabs, so a layer of many
+ * buildings takes less memory, and is much faster to create and destroy.
+ *
+ * Objects are placed in an arena with "new (arena) vtEdge", or on the heap
+ * if the arena is NULL.  Either way, they are deleted with plain delete.
+ * An arena lives until its owner releases it and every object in it has
+ * been deleted; then its slabs are freed all at once.
+ *
+ * Several threads can allocate from the same arena.
+ *
+ * To delete many objects at once, such as all the buildings of an array,
+ * call BeginBulkFree first and EndBulkFree after.  In between, deleting
+ * an object of the arena takes no lock, and no other thread may use the
+ * arena.  If no objects are left at the end, the slabs are freed.
+ */
+class vtStructureArena
+{
+public:
+	vtStructureArena();
+
+	void Release();
+	void BeginBulkFree();
+	void EndBulkFree();
+
+	static void *Allocate(size_t size, vtStructureArena *arena);
+	static void Free(void *p);
+
+	size_t NumObjects() const { return m_iObjects; }
+	size_t NumSlabs() const { return m_Slabs.size(); }
+
+protected:
+	~vtStructureArena();
+	void *AllocateBlock(size_t size);
+	void FreeBlock(vtArenaPool *pool, void *block);
+
+	vtArenaLock *m_pLock;
+	std::vector<vtArenaPool *> m_Pools;
+	std::vector<char *> m_Slabs;
+	size_t m_iObjects;
+	bool m_bReleased;
+
+	// Only touched by the thread which is doing a bulk free
+	bool m_bBulkFree;
+	size_t m_iBulkFreed;
+};
+
+/**
+ * The base of classes whose objects can be placed in a vtStructureArena.
+ */
+class vtArenaObject
+{
+public:
+	static void *operator new(size_t size)
+	{
+		return vtStructureArena::Allocate(size, NULL);
+	}
+	static void *operator new(size_t size, vtStructureArena *arena)
+	{
+		return vtStructureArena::Allocate(size, arena);
+	}
+	static void operator delete(void *p) { vtStructureArena::Free(p); }
+	static void operator delete(void *p, vtStructureArena *) { vtStructureArena::Free(p); }
+};
+
+#endif	// STRUCTARENAH
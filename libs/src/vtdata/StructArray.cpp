@@ -14,6 +14,7 @@
 
 #include <stdlib.h>
 #include <string.h>
+#include <algorithm>
 #include "LocalConversion.h"
 #include "shapelib/shapefil.h"
 #include "xmlhelper/easyxml.hpp"
@@ -25,23 +26,64 @@
 #include "FilePath.h"
 #include "PolyChecker.h"
 
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
 vtStructureArray g_DefaultStructures;
 
 
 /////////////////////////////////////////////////////////////////////////////
 
+bool vtStructureArray::s_bParallelParse = true;
+
+bool vtStructureArray::s_bUseArena = false;
+
 vtStructureArray::vtStructureArray()
 {
 	m_strFilename = "Untitled.vtst";
 	m_pEditBuilding = NULL;
 	m_iLastSelected = -1;
+	m_pArena = s_bUseArena ? new vtStructureArena : NULL;
+	m_bIndexValid = false;
+	m_iIndexed = 0;
+}
+
+vtStructureArray::~vtStructureArray()
+{
+	Empty();
+	free(m_Data);
+	m_Data = NULL;
+	m_MaxSize = 0;
+	if (m_pArena)
+		m_pArena->Release();
+}
+
+/**
+ * Choose whether buildings which are created after this are allocated,
+ * along with their levels and edges, in an arena which belongs to this
+ * array.  That is much faster, and uses less memory, for large numbers of
+ * buildings.  See vtStructureArena.
+ */
+void vtStructureArray::UseArena(bool bArena)
+{
+	if (bArena && !m_pArena)
+		m_pArena = new vtStructureArena;
+	else if (!bArena && m_pArena)
+	{
+		// The buildings already in the arena keep it alive
+		m_pArena->Release();
+		m_pArena = NULL;
+	}
 }
 
 
 // Factories
 vtBuilding *vtStructureArray::NewBuilding()
 {
-	return new vtBuilding;
+	vtBuilding *bld = new (m_pArena) vtBuilding;
+	bld->SetArena(m_pArena);
+	return bld;
 }
 
 vtFence *vtStructureArray::NewFence()
@@ -77,8 +119,54 @@ vtStructInstance *vtStructureArray::AddNewInstance()
 
 void vtStructureArray::DestructItems(uint first, uint last)
 {
+	// When the whole array is emptied, the arena frees its memory at once,
+	//  rather than one object at a time
+	const bool bBulk = (m_pArena && first == 0 && last + 1 == GetSize());
+	if (bBulk)
+		m_pArena->BeginBulkFree();
 	for (uint i = first; i <= last; i++)
 		delete GetAt(i);
+	if (bBulk)
+		m_pArena->EndBulkFree();
+	InvalidateIndex();
+}
+
+/**
+ * Append a structure.  It is found without the spatial index until there
+ * are enough new structures to be worth indexing again.
+ */
+int vtStructureArray::Append(vtStructure *const &str)
+{
+	if (GetSize() < m_iIndexed)
+		InvalidateIndex();
+	return vtArray<vtStructure*>::Append(str);
+}
+
+int vtStructureArray::Append(const vtArray<vtStructure*> &src)
+{
+	if (GetSize() < m_iIndexed)
+		InvalidateIndex();
+	return vtArray<vtStructure*>::Append(src);
+}
+
+bool vtStructureArray::SetAt(uint i, vtStructure *str)
+{
+	if (i < m_iIndexed)
+		InvalidateIndex();
+	return vtArray<vtStructure*>::SetAt(i, str);
+}
+
+bool vtStructureArray::SetSize(uint s)
+{
+	if (s < m_iIndexed)
+		InvalidateIndex();
+	return vtArray<vtStructure*>::SetSize(s);
+}
+
+bool vtStructureArray::RemoveAt(uint i, int n)
+{
+	InvalidateIndex();
+	return vtArray<vtStructure*>::RemoveAt(i, n);
 }
 
 void vtStructureArray::SetEditedEdge(vtBuilding *bld, int lev, int edge)
@@ -88,6 +176,54 @@ void vtStructureArray::SetEditedEdge(vtBuilding *bld, int lev, int edge)
 	m_iEditEdge = edge;
 }
 
+/**
+ * Find the structures whose extents overlap an area, in order of index,
+ * using the spatial index.
+ */
+void vtStructureArray::FindCandidates(const DRECT &area, std::vector<int> &result)
+{
+	result.clear();
+	UpdateIndex();
+	m_Index.Query(area, result);
+
+	// Structures which were added since the index was built
+	DRECT ext;
+	for (uint i = m_iIndexed; i < GetSize(); i++)
+	{
+		if (GetAt(i)->GetExtents(ext) && area.OverlapsRect(ext))
+			result.push_back(i);
+	}
+	std::sort(result.begin(), result.end());
+}
+
+/**
+ * Make sure the spatial index is up to date.  Structures which are
+ * appended to the array are checked without the index until there are
+ * enough of them to be worth indexing again.
+ */
+void vtStructureArray::UpdateIndex()
+{
+	const uint size = GetSize();
+	if (m_bIndexValid && size - m_iIndexed <= 64 + m_iIndexed / 16)
+		return;
+
+	m_Index.Clear();
+	DRECT ext;
+	for (uint i = 0; i < size; i++)
+	{
+		if (GetAt(i)->GetExtents(ext))
+			m_Index.Add(i, ext);
+	}
+	m_Index.Build();
+	m_iIndexed = size;
+	m_bIndexValid = true;
+}
+
+static DRECT AreaAround(const DPoint2 &p, double epsilon)
+{
+	return DRECT(p.x - epsilon, p.y + epsilon, p.x + epsilon, p.y - epsilon);
+}
+
 /** Find the building corner closest to the given point, if it is within
  * 'epsilon' distance.  The building index, corner index, and distance from
  * the given point are all returned by reference.
@@ -103,8 +239,11 @@ bool vtStructureArray::FindClosestBuildingCorner(const DPoint2 &point,
 	building = -1;
 	closest = 1E8;
 
-	for (uint i = 0; i < GetSize(); i++)
+	std::vector<int> nearby;
+	FindCandidates(AreaAround(point, epsilon), nearby);
+	for (uint k = 0; k < nearby.size(); k++)
 	{
+		const int i = nearby[k];
 		vtStructure *str = GetAt(i);
 		if (str->GetType() != ST_BUILDING)
 			continue;
@@ -142,8 +281,11 @@ bool vtStructureArray::FindClosestBuildingCenter(const DPoint2 &point,
 	double dist;
 	closest = 1E8;
 
-	for (uint i = 0; i < GetSize(); i++)
+	std::vector<int> nearby;
+	FindCandidates(AreaAround(point, epsilon), nearby);
+	for (uint k = 0; k < nearby.size(); k++)
 	{
+		const int i = nearby[k];
 		vtStructure *str = GetAt(i);
 		vtBuilding *bld = str->GetBuilding();
 		if (!bld)
@@ -167,14 +309,17 @@ bool vtStructureArray::FindClosestLinearCorner(const DPoint2 &point, double epsi
 {
 	DPoint2 loc;
 	double dist;
-	uint i, j;
+	uint j;
 
 	structure = -1;
 	corner = -1;
 	closest = 1E8;
 
-	for (i = 0; i < GetSize(); i++)
+	std::vector<int> nearby;
+	FindCandidates(AreaAround(point, epsilon), nearby);
+	for (uint k = 0; k < nearby.size(); k++)
 	{
+		const int i = nearby[k];
 		vtStructure *str = GetAt(i);
 		vtFence *fen = str->GetFence();
 		if (!fen)
@@ -216,9 +361,30 @@ bool vtStructureArray::FindClosestStructure(const DPoint2 &point, double epsilon
 	DPoint2 loc;
 	double dist;
 
+	std::vector<int> nearby;
+	FindCandidates(AreaAround(point, epsilon), nearby);
+
+	// An instance may be measured from the edge of its model's bounding
+	//  sphere, which can be as large as fMaxInstRadius, so look further
+	//  for instances.
+	DPoint2 radius;
+	g_Conv.ConvertVectorToEarth(fMaxInstRadius, 0, radius);
+	const double inst_epsilon = epsilon + 2 * fabs(radius.x);
+	if (inst_epsilon > epsilon)
+	{
+		std::vector<int> farther;
+		FindCandidates(AreaAround(point, inst_epsilon), farther);
+		for (uint k = 0; k < farther.size(); k++)
+			if (GetAt(farther[k])->GetType() == ST_INSTANCE)
+				nearby.push_back(farther[k]);
+		std::sort(nearby.begin(), nearby.end());
+		nearby.erase(std::unique(nearby.begin(), nearby.end()), nearby.end());
+	}
+
 	// Check buildings and instances first
-	for (uint i = 0; i < GetSize(); i++)
+	for (uint k = 0; k < nearby.size(); k++)
 	{
+		const int i = nearby[k];
 		vtStructure *str = GetAt(i);
 		dist = 1E9;
 
@@ -241,8 +407,9 @@ bool vtStructureArray::FindClosestStructure(const DPoint2 &point, double epsilon
 		}
 	}
 	// then check fences
-	for (uint i = 0; i < GetSize(); i++)
+	for (uint k = 0; k < nearby.size(); k++)
 	{
+		const int i = nearby[k];
 		vtStructure *str = GetAt(i);
 
 		vtFence *fen = str->GetFence();
@@ -285,8 +452,11 @@ bool vtStructureArray::FindClosestBuilding(const DPoint2 &point,
 	DPoint2 loc;
 	double dist;
 
-	for (uint i = 0; i < GetSize(); i++)
+	std::vector<int> nearby;
+	FindCandidates(AreaAround(point, epsilon), nearby);
+	for (uint k = 0; k < nearby.size(); k++)
 	{
+		const int i = nearby[k];
 		vtStructure *str = GetAt(i);
 		vtBuilding *bld = str->GetBuilding();
 		if (!bld) continue;
@@ -303,6 +473,66 @@ bool vtStructureArray::FindClosestBuilding(const DPoint2 &point,
 	return (structure != -1);
 }
 
+/**
+ * Find the structures which are entirely inside a rectangle.
+ *
+ * \param rect The rectangle, in the CRS of the structures.
+ * \param result Receives the index of each structure, in order.
+ */
+void vtStructureArray::FindStructuresInRect(const DRECT &rect,
+											std::vector<int> &result)
+{
+	std::vector<int> nearby;
+	FindCandidates(rect, nearby);
+	result.clear();
+	for (uint k = 0; k < nearby.size(); k++)
+	{
+		if (GetAt(nearby[k])->IsContainedBy(rect))
+			result.push_back(nearby[k]);
+	}
+}
+
+/**
+ * Select the structures which are inside a rectangle, in the same way as
+ * vtFeatureSet::DoBoxSelect.
+ *
+ * \return The number of structures which were affected.
+ */
+int vtStructureArray::DoBoxSelect(const DRECT &rect, SelectionType st)
+{
+	if (st == ST_NORMAL)
+		DeselectAll();
+
+	std::vector<int> inside;
+	FindStructuresInRect(rect, inside);
+
+	int affected = 0;
+	for (uint k = 0; k < inside.size(); k++)
+	{
+		vtStructure *str = GetAt(inside[k]);
+		const bool bWas = str->IsSelected();
+		switch (st)
+		{
+		case ST_NORMAL:
+			str->Select(true);
+			affected++;
+			break;
+		case ST_ADD:
+			str->Select(true);
+			if (!bWas) affected++;
+			break;
+		case ST_SUBTRACT:
+			str->Select(false);
+			if (bWas) affected++;
+			break;
+		case ST_TOGGLE:
+			str->Select(!bWas);
+			affected++;
+			break;
+		}
+	}
+	return affected;
+}
 
 void vtStructureArray::GetExtents(DRECT &rect) const
 {
@@ -346,6 +576,7 @@ void vtStructureArray::Offset(const DPoint2 &delta)
 		if (inst)
 			inst->Offset(delta);
 	}
+	InvalidateIndex();
 }
 
 int vtStructureArray::AddFoundations(vtHeightField *pHF, bool progress_callback(int))
@@ -391,7 +622,7 @@ int vtStructureArray::AddFoundations(vtHeightField *pHF, bool progress_callback(
 			continue;
 
 		// Create and add a foundation level
-		pNewLev = new vtLevel;
+		pNewLev = new (bld->GetArena()) vtLevel(bld->GetArena());
 		pNewLev->m_iStories = 1;
 		pNewLev->m_fStoryHeight = fDiff;
 		bld->InsertLevel(0, pNewLev);
@@ -901,11 +1132,32 @@ RGBi ParseHexColor(const char *str)
 	return color;
 }
 
+/**
+ * One piece of a GML structure file, which is parsed on its own thread.
+ * See vtStructureArray::ReadGMLParallel.
+ */
+struct GMLPiece
+{
+	GMLPiece() : m_bOK(false) {}
+
+	string m_text;
+	bool m_bOK;
+	std::vector<vtStructure*> m_structs;
+
+	// Edges whose material is not yet in the global materials
+	std::vector<vtEdge*> m_edges;
+	std::vector<vtString> m_materials;
+};
+
 class StructVisitorGML : public XMLVisitor
 {
 public:
 	StructVisitorGML(vtStructureArray *sa) :
-	  m_state(0), m_pSA(sa) {}
+	  m_state(0), m_pSA(sa), m_pPiece(NULL) {}
+	/// Parse one piece of a file.  The structures are made by sa, but they
+	///  are collected in the piece, without touching any shared state.
+	StructVisitorGML(vtStructureArray *sa, GMLPiece *piece) :
+	  m_state(0), m_pSA(sa), m_pPiece(piece) {}
 	void startXML() { m_state = 0; }
 	void endXML() { m_state = 0; }
 	void startElement(const char *name, const XMLAttributes &atts);
@@ -913,10 +1165,13 @@ public:
 	void data(const char *s, int length);
 
 private:
+	void AddStructure();
+
 	string m_data;
 	int m_state;
 
 	vtStructureArray *m_pSA;
+	GMLPiece *m_pPiece;
 	vtStructure *m_pStructure;
 	vtBuilding *m_pBuilding;
 	vtStructInstance *m_pInstance;
@@ -1017,23 +1272,18 @@ void StructVisitorGML::startElement(const char *name, const XMLAttributes &atts)
 				m_pEdge->m_Features.clear();
 
 				attval = atts.getValue("Material");
-				if (attval)
+				if (attval && m_pPiece)
 				{
-					vtMaterialDescriptorArray *mats = GetGlobalMaterials();
-					m_pEdge->m_pMaterial = mats->FindName(attval);
-					if (m_pEdge->m_pMaterial == NULL)
+					// Adding to the global materials must wait for the caller
+					m_pEdge->m_pMaterial = GetGlobalMaterials()->FindName(attval);
+					if (!m_pEdge->m_pMaterial)
 					{
-						// What to do when a VTST references a material that
-						// we don't have?  We don't want to lose the material
-						// name information, and we also don't want to crash
-						// later with a NULL material.  So, make a dummy.
-						vtMaterialDescriptor *mat;
-						mat = new vtMaterialDescriptor(attval, "", VT_MATERIAL_COLOUR);
-						mat->SetRGB(RGBi(255,255,255));	// white means: missing
-						mats->Append(mat);
-						m_pEdge->m_pMaterial = &mat->GetName();
+						m_pPiece->m_edges.push_back(m_pEdge);
+						m_pPiece->m_materials.push_back(vtString(attval));
 					}
 				}
+				else if (attval)
+					m_pEdge->m_pMaterial = GetGlobalMaterials()->FindOrAddName(attval);
 				attval = atts.getValue("Color");
 				if (attval)
 					m_pEdge->m_Color = ParseHexColor(attval);
@@ -1188,26 +1438,137 @@ void StructVisitorGML::startElement(const char *name, const XMLAttributes &atts)
 	}
 }
 
+/**
+ * Read a number written in the C locale, such as "-12.25" or "3e-4", much
+ * faster than sscanf and regardless of the current locale.
+ *
+ * \return A pointer just past the number, or NULL if there is no number.
+ */
+static const char *ParseDouble(const char *p, double &result)
+{
+	while (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n')
+		p++;
+	const bool bNegative = (*p == '-');
+	if (*p == '-' || *p == '+')
+		p++;
+
+	// Gather the significant digits, and the power of ten which they need.
+	//  Beyond 32 digits, they no longer affect a double.
+	char digits[48];
+	int iDigits = 0, iExponent = 0;
+	bool bAny = false;
+	for (; *p >= '0' && *p <= '9'; p++)
+	{
+		bAny = true;
+		if (iDigits < 32)
+		{
+			if (iDigits > 0 || *p != '0')
+				digits[iDigits++] = *p;
+		}
+		else
+			iExponent++;
+	}
+	if (*p == '.')
+	{
+		for (p++; *p >= '0' && *p <= '9'; p++)
+		{
+			bAny = true;
+			if (iDigits < 32)
+			{
+				if (iDigits > 0 || *p != '0')
+					digits[iDigits++] = *p;
+				iExponent--;
+			}
+		}
+	}
+	if (!bAny)
+		return NULL;
+	if (*p == 'e' || *p == 'E')
+	{
+		const char *q = p + 1;
+		const bool bNegExp = (*q == '-');
+		if (*q == '-' || *q == '+')
+			q++;
+		if (*q >= '0' && *q <= '9')
+		{
+			int exp = 0;
+			for (; *q >= '0' && *q <= '9'; q++)
+				if (exp < 100000)
+					exp = exp * 10 + (*q - '0');
+			iExponent += bNegExp ? -exp : exp;
+			p = q;
+		}
+	}
+
+	// Most numbers are exact in a double, as is the power of ten, so one
+	//  multiply or divide gives the correctly rounded value.
+	static const double powers[23] = { 1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6,
+		1e7, 1e8, 1e9, 1e10, 1e11, 1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18,
+		1e19, 1e20, 1e21, 1e22 };
+	if (iDigits <= 15 && iExponent >= -22 && iExponent <= 22)
+	{
+		double value = 0;
+		for (int i = 0; i < iDigits; i++)
+			value = value * 10 + (digits[i] - '0');
+		if (iExponent < 0)
+			value /= powers[-iExponent];
+		else
+			value *= powers[iExponent];
+		result = bNegative ? -value : value;
+		return p;
+	}
+
+	// Otherwise let strtod round it.  Written without a decimal point, the
+	//  number means the same in every locale.
+	if (iDigits == 0)
+		digits[iDigits++] = '0';
+	sprintf(digits + iDigits, "e%d", iExponent);
+	result = strtod(digits, NULL);
+	if (bNegative)
+		result = -result;
+	return p;
+}
+
+/**
+ * Read a GML coordinate, "x,y", and skip anything else which follows it
+ * (such as a z value) up to the next space.
+ */
+static const char *ParseCoordinate(const char *p, DPoint2 &pt)
+{
+	p = ParseDouble(p, pt.x);
+	if (!p || *p != ',')
+		return NULL;
+	p = ParseDouble(p + 1, pt.y);
+	if (!p)
+		return NULL;
+	while (*p && *p != ' ' && *p != '\t' && *p != '\r' && *p != '\n')
+		p++;
+	return p;
+}
+
 void DLine2FromString(const char *data, DLine2 &line)
 {
 	// Speed/memory optimization: quick check of how many vertices
 	//  there are, then preallocate that many
 	uint verts = 0;
-	for (size_t i = 0; i < strlen(data); i++)
-		if (data[i] == ',')
+	for (const char *c = data; *c; c++)
+		if (*c == ',')
 			verts++;
 	line.Empty();
 	line.SetMaxSize(verts);
 
-	double x, y;
-	while (sscanf(data, "%lf,%lf", &x, &y) == 2)
-	{
-		line.Append(DPoint2(x,y));
-		data = strchr(data, ' ');
-		if (!data)
-			break;
-		data++;
-	}
+	DPoint2 p;
+	while ((data = ParseCoordinate(data, p)) != NULL)
+		line.Append(p);
+}
+
+void StructVisitorGML::AddStructure()
+{
+	if (m_pPiece)
+		m_pPiece->m_structs.push_back(m_pStructure);
+	else
+		m_pSA->Append(m_pStructure);
+	m_pStructure = NULL;
 }
 
 void StructVisitorGML::endElement(const char *name)
@@ -1264,13 +1625,12 @@ void StructVisitorGML::endElement(const char *name)
 			// do this once after we done adding levels
 			m_pBuilding->DetermineLocalFootprints();
 
-			m_pSA->Append(m_pStructure);
-			m_pStructure = NULL;
+			AddStructure();
 		}
 		else
 			bGrabAttribute = true;
 	}
-	else if (m_state == 1 && (!strcmp(name, "SRS")))
+	else if (m_state == 1 && !m_pPiece && (!strcmp(name, "SRS")))
 	{
 		m_pSA->m_proj.SetTextDescription("wkt", data);
 
@@ -1282,9 +1642,7 @@ void StructVisitorGML::endElement(const char *name)
 		if (!strcmp(name, "Linear"))
 		{
 			m_state = 1;
-
-			m_pSA->Append(m_pStructure);
-			m_pStructure = NULL;
+			AddStructure();
 		}
 	}
 	else if (m_state == 11)
@@ -1292,16 +1650,9 @@ void StructVisitorGML::endElement(const char *name)
 		if (!strcmp(name, "gml:coordinates"))
 		{
 			DLine2 &fencepts = m_pFence->GetFencePoints();
-			double x, y;
-			while (sscanf(data, "%lf,%lf", &x, &y) == 2)
-			{
-				fencepts.Append(DPoint2(x,y));
-				data = strchr(data, ' ');
-				if (data)
-					data++;
-				else
-					break;
-			}
+			DPoint2 p;
+			while ((data = ParseCoordinate(data, p)) != NULL)
+				fencepts.Append(p);
 		}
 		else if (!strcmp(name, "Path"))
 			m_state = 10;
@@ -1311,8 +1662,7 @@ void StructVisitorGML::endElement(const char *name)
 		if (!strcmp(name, "Imported"))
 		{
 			m_state = 1;
-			m_pSA->Append(m_pStructure);
-			m_pStructure = NULL;
+			AddStructure();
 		}
 		else if (!strcmp(name, "Rotation"))
 		{
@@ -1333,9 +1683,9 @@ void StructVisitorGML::endElement(const char *name)
 	{
 		if (!strcmp(name, "gml:coordinates"))
 		{
-			double x, y;
-			sscanf(data, "%lf,%lf", &x, &y);
-			m_pInstance->SetPoint(DPoint2(x,y));
+			DPoint2 p(0, 0);
+			ParseCoordinate(data, p);
+			m_pInstance->SetPoint(p);
 		}
 		else if (!strcmp(name, "Location"))
 			m_state = 20;
@@ -1434,6 +1784,14 @@ bool vtStructureArray::ReadXML(const char *pathname, bool progress_callback(int)
 
 	m_strFilename = pathname;
 
+	// If there is a cache of the file which is up to date, it is much faster
+	const bool bWasEmpty = IsEmpty();
+	if (s_bUseCache && bWasEmpty && ReadCache(pathname, progress_callback))
+	{
+		gzclose(fp);
+		return true;
+	}
+
 	gzseek(fp, 24, SEEK_SET);
 	char buf[10];
 	gzread(fp, buf, 10);
@@ -1467,6 +1825,11 @@ bool vtStructureArray::ReadXML(const char *pathname, bool progress_callback(int)
 			return false;
 		}
 	}
+	else if (s_bParallelParse && bWasEmpty &&
+		ReadGMLParallel(pathname, progress_callback))
+	{
+		success = true;
+	}
 	else
 	{
 		StructVisitorGML visitor(this);
@@ -1484,9 +1847,223 @@ bool vtStructureArray::ReadXML(const char *pathname, bool progress_callback(int)
 		}
 	}
 
+	// Cache the structures, for next time
+	if (success && s_bUseCache && bWasEmpty)
+		WriteCache(pathname);
+
 	return success;
 }
 
+/**
+ * Find the structures in the text of a GML structure file: the Building,
+ * Linear and Imported elements directly inside the StructureCollection.
+ *
+ * \param buf The text, which must end with a zero.
+ * \param starts Receives the offset of each structure.
+ * \param end Receives the offset of the closing StructureCollection tag.
+ * \return false if there are no structures, or the file contains anything
+ *	else after them.
+ */
+static bool FindGMLStructures(const char *buf, std::vector<size_t> &starts,
+	size_t &end)
+{
+	int depth = 0;
+	const char *p = buf;
+	while ((p = strchr(p, '<')) != NULL)
+	{
+		const char *tag = p;
+		if (!strncmp(p, "<!--", 4))
+			p = strstr(p, "-->");
+		else if (!strncmp(p, "<![CDATA[", 9))
+			p = strstr(p, "]]>");
+		else if (p[1] == '?' || p[1] == '!')
+			p = strchr(p, '>');
+		else if (p[1] == '/')
+		{
+			if (--depth == 0)
+			{
+				end = tag - buf;
+				return !starts.empty();
+			}
+			p = strchr(p, '>');
+		}
+		else
+		{
+			// A start tag; the attribute values may contain a '>'
+			char quote = 0;
+			for (p++; *p; p++)
+			{
+				if (quote)
+				{
+					if (*p == quote)
+						quote = 0;
+				}
+				else if (*p == '"' || *p == '\'')
+					quote = *p;
+				else if (*p == '>')
+					break;
+			}
+			if (!*p)
+				return false;
+			if (depth == 1)
+			{
+				const size_t n = strcspn(tag + 1, " \t\r\n/>");
+				if ((n == 8 && !strncmp(tag + 1, "Building", 8)) ||
+					(n == 6 && !strncmp(tag + 1, "Linear", 6)) ||
+					(n == 8 && !strncmp(tag + 1, "Imported", 8)))
+					starts.push_back(tag - buf);
+				else if (!starts.empty())
+					return false;
+			}
+			if (p[-1] != '/')
+				depth++;
+		}
+		if (!p)
+			return false;
+		p++;
+	}
+	return false;
+}
+
+/**
+ * Read a GML structure file using several threads.  The text is split
+ * between structures into pieces, which are parsed at the same time, then
+ * the structures of each piece are added to this array, in order.
+ *
+ * \return false if the file could not be read this way.  Nothing has been
+ *	added to the array, and the file can still be read with readXML.
+ */
+bool vtStructureArray::ReadGMLParallel(const char *pathname,
+	bool progress_callback(int))
+{
+	gzFile fp = vtGZOpen(pathname, "rb");
+	if (!fp)
+		return false;
+
+	// Read all the (uncompressed) text
+	std::vector<char> text;
+	const int BLOCK = 1 << 20;
+	int count;
+	do
+	{
+		const size_t size = text.size();
+		text.resize(size + BLOCK);
+		count = gzread(fp, &text[size], BLOCK);
+		text.resize(size + (count > 0 ? count : 0));
+	}
+	while (count > 0);
+	gzclose(fp);
+	if (count < 0)
+		return false;
+	text.push_back(0);
+	const char *buf = &text[0];
+
+	std::vector<size_t> starts;
+	size_t end;
+	if (!FindGMLStructures(buf, starts, end))
+		return false;
+
+	// Each piece is a complete document: the XML declaration (which gives the
+	//  encoding), and the structures inside a StructureCollection.
+	string decl;
+	if (!strncmp(buf, "<?xml", 5) && strstr(buf, "?>"))
+		decl.assign(buf, strstr(buf, "?>") + 2 - buf);
+	const char *close = strchr(buf + end, '>');
+	if (!close)
+		return false;
+	const string close_tag(buf + end, close + 1 - (buf + end));
+	const string open_tag = "<" + close_tag.substr(2);
+
+	// The header, before the first structure, has the CRS
+	StructVisitorGML header_visitor(this);
+	try
+	{
+		const string header = string(buf, starts[0]) + close_tag;
+		readXMLBuffer(header.c_str(), header.size(), header_visitor, pathname);
+	}
+	catch (xh_exception &ex)
+	{
+		VTLOG("XML Error: %s", ex.getFormattedMessage().c_str());
+		return false;
+	}
+
+#ifdef _OPENMP
+	const int threads = omp_get_max_threads();
+#else
+	const int threads = 1;
+#endif
+	// Several pieces for each thread, so the threads finish close together
+	const int structs = (int) starts.size();
+	const int pieces = (threads * 4 < structs) ? threads * 4 : structs;
+	VTLOG("ReadGMLParallel: %d structures in %d pieces, %d threads\n", structs,
+		pieces, threads);
+
+	// Pieces look up materials in the global array, so it must exist first
+	GetGlobalMaterials();
+
+	std::vector<GMLPiece> piece(pieces);
+	int done = 0;
+#pragma omp parallel for schedule(dynamic, 1)
+	for (int i = 0; i < pieces; i++)
+	{
+		const size_t first = starts[(size_t) structs * i / pieces];
+		const size_t last = (i == pieces - 1) ? end :
+			starts[(size_t) structs * (i + 1) / pieces];
+
+		GMLPiece &p = piece[i];
+		p.m_text = decl + open_tag;
+		p.m_text.append(buf + first, last - first);
+		p.m_text += close_tag;
+
+		StructVisitorGML visitor(this, &p);
+		try
+		{
+			readXMLBuffer(p.m_text.c_str(), p.m_text.size(), visitor, pathname);
+			p.m_bOK = true;
+		}
+		catch (xh_exception &ex)
+		{
+			VTLOG("XML Error: %s", ex.getFormattedMessage().c_str());
+		}
+		string().swap(p.m_text);
+
+#pragma omp atomic
+		done++;
+
+#ifdef _OPENMP
+		if (progress_callback != NULL && omp_get_thread_num() == 0)
+#else
+		if (progress_callback != NULL)
+#endif
+		{
+#pragma omp flush(done)
+			progress_callback(done * 99 / pieces);
+		}
+	}
+
+	bool bOK = true;
+	for (int i = 0; i < pieces; i++)
+		bOK = bOK && piece[i].m_bOK;
+	if (!bOK)
+	{
+		for (int i = 0; i < pieces; i++)
+			for (size_t j = 0; j < piece[i].m_structs.size(); j++)
+				delete piece[i].m_structs[j];
+		return false;
+	}
+
+	// Add the materials which the threads could not, then the structures
+	for (int i = 0; i < pieces; i++)
+	{
+		GMLPiece &p = piece[i];
+		for (size_t j = 0; j < p.m_edges.size(); j++)
+			p.m_edges[j]->m_pMaterial = GetGlobalMaterials()->FindOrAddName(p.m_materials[j]);
+		for (size_t j = 0; j < p.m_structs.size(); j++)
+			Append(p.m_structs[j]);
+	}
+	return true;
+}
+
 bool vtStructureArray::WriteFootprintsToSHP(const char* filename)
 {
 	SHPHandle hSHP = SHPCreate(filename, SHPT_POLYGON);
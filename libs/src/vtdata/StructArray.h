@@ -12,6 +12,8 @@
 #include "Projections.h"
 #include "Building.h"
 #include "HeightField.h"
+#include "Features.h"
+#include "RTree.h"
 #include <stdio.h>
 
 
@@ -71,9 +73,16 @@ class vtStructureArray : public vtArray<vtStructure*>
 {
 public:
 	vtStructureArray();
-	virtual ~vtStructureArray() { Empty(); free(m_Data); m_Data = NULL; m_MaxSize = 0; }
+	virtual ~vtStructureArray();
 	virtual void DestructItems(uint first, uint last);
 
+	// These hide the vtArray methods, to keep the spatial index in step
+	int Append(vtStructure *const &str);
+	int Append(const vtArray<vtStructure*> &src);
+	bool SetAt(uint i, vtStructure *str);
+	bool SetSize(uint s);
+	bool RemoveAt(uint i, int n = 1);
+
 	void SetFilename(const vtString &str) { m_strFilename = str; }
 	vtString GetFilename() { return m_strFilename; }
 
@@ -102,6 +111,16 @@ public:
 	bool ReadBCF(const char *pathname);		// read a .bcf file
 	bool ReadBCF_Old(FILE *fp);				// support obsolete format
 	bool ReadXML(const char *pathname, bool progress_callback(int) = NULL);
+	bool ReadGMLParallel(const char *pathname, bool progress_callback(int) = NULL);
+	/// If true (the default), ReadXML parses GML files on several threads.
+	static bool s_bParallelParse;
+
+	// Binary cache, which is much faster to load than the XML
+	bool ReadCache(const char *pathname, bool progress_callback(int) = NULL);
+	bool WriteCache(const char *pathname) const;
+	static vtString GetCacheFilename(const char *pathname);
+	/// If true (the default), ReadXML uses and creates cache files.
+	static bool s_bUseCache;
 
 	bool WriteXML(const char *pathname, bool bGZip = false) const;
 	bool WriteFootprintsToSHP(const char *pathname);
@@ -120,6 +139,14 @@ public:
 			float fLinearWidthBuffer = 0.0f);
 	bool FindClosestBuilding(const DPoint2 &point, double epsilon,
 			int &structure, double &closest);
+	void FindStructuresInRect(const DRECT &rect, std::vector<int> &result);
+	int DoBoxSelect(const DRECT &rect, SelectionType st);
+
+	/// Call this after moving or reshaping structures, so that the Find
+	///  methods, which use a spatial index, will know where they are.
+	///  Adding, replacing and removing structures in the array does not
+	///  need it.
+	void InvalidateIndex() { m_bIndexValid = false; }
 
 	bool IsEmpty() { return (GetSize() == 0); }
 	void GetExtents(DRECT &ext) const;
@@ -145,6 +172,12 @@ public:
 
 	vtBuilding *AddBuildingFromLineString(class OGRLineString *pLineString);
 
+	// Arena allocation of buildings
+	void UseArena(bool bArena);
+	vtStructureArena *GetArena() const { return m_pArena; }
+	/// If true, new structure arrays allocate their buildings in an arena.
+	static bool s_bUseArena;
+
 	// override to catch edit hightlighting
 	virtual void SetEditedEdge(vtBuilding *bld, int lev, int edge);
 
@@ -158,6 +191,15 @@ protected:
 	int m_iEditLevel;
 	int m_iEditEdge;
 	int m_iLastSelected;
+
+	vtStructureArena *m_pArena;
+
+	// Spatial index of the structures' extents
+	void FindCandidates(const DRECT &area, std::vector<int> &result);
+	void UpdateIndex();
+	vtRTree m_Index;
+	uint m_iIndexed;	// number of structures in the index
+	bool m_bIndexValid;
 };
 
 extern vtStructureArray g_DefaultStructures;
@@ -0,0 +1,461 @@
+//
+// StructCache.cpp
+//
+// A binary cache of a structure (VTST) file, which loads much faster than
+// parsing the XML.
+//
+// Copyright (c) 2001-2012 Virtual Terrain Project
+// Free for all uses, see license.txt for details.
+//
+
+#include <string.h>
+#include <map>
+
+#include "StructArray.h"
+#include "Building.h"
+#include "Fence.h"
+#include "FilePath.h"
+#include "vtLog.h"
+
+// Increase this whenever the layout of the cache changes
+#define STRUCT_CACHE_VERSION	1
+
+bool vtStructureArray::s_bUseCache = true;
+
+/**
+ * Writes values to the cache file.  The values are packed, in native byte
+ * order, like the other binary formats of vtdata.
+ */
+class StructCacheWriter
+{
+public:
+	StructCacheWriter(FILE *fp) : m_fp(fp) {}
+
+	void Write(const void *data, size_t bytes) { fwrite(data, bytes, 1, m_fp); }
+	void WriteByte(uchar b) { Write(&b, 1); }
+	void WriteInt(int i) { Write(&i, sizeof(int)); }
+	void WriteFloat(float f) { Write(&f, sizeof(float)); }
+	void WriteColor(const RGBi &c) { Write(&c.r, 3 * sizeof(short)); }
+	void WriteString(const char *str)
+	{
+		const int len = str ? (int) strlen(str) : 0;
+		WriteInt(len);
+		Write(str, len);
+	}
+	void WriteLine(const DLine2 &line)
+	{
+		WriteInt(line.GetSize());
+		if (line.GetSize() > 0)
+			Write(line.GetData(), line.GetSize() * sizeof(DPoint2));
+	}
+
+protected:
+	FILE *m_fp;
+};
+
+/**
+ * Reads values from the cache file, in place.  Reading past the end of the
+ * file sets a flag rather than failing, so the caller need only check
+ * IsOK once at the end.
+ */
+class StructCacheReader
+{
+public:
+	StructCacheReader(const uchar *data, size_t size) :
+		m_data(data), m_size(size), m_pos(0), m_bOK(true) {}
+
+	bool IsOK() const { return m_bOK; }
+	void Fail() { m_bOK = false; }
+	bool Read(void *dest, size_t bytes)
+	{
+		if (!m_bOK || bytes > m_size - m_pos)
+		{
+			m_bOK = false;
+			return false;
+		}
+		memcpy(dest, m_data + m_pos, bytes);
+		m_pos += bytes;
+		return true;
+	}
+	uchar ReadByte() { uchar b = 0; Read(&b, 1); return b; }
+	int ReadInt() { int i = 0; Read(&i, sizeof(int)); return i; }
+	float ReadFloat() { float f = 0; Read(&f, sizeof(float)); return f; }
+	RGBi ReadColor() { RGBi c(0,0,0); Read(&c.r, 3 * sizeof(short)); return c; }
+	void ReadString(vtString &str)
+	{
+		const int len = ReadInt();
+		if (len < 0 || (size_t) len > m_size - m_pos)
+		{
+			m_bOK = false;
+			return;
+		}
+		str = vtString((const char *) m_data + m_pos, len);
+		m_pos += len;
+	}
+	void ReadLine(DLine2 &line)
+	{
+		const int num = ReadInt();
+		if (num < 0 || (size_t) num > (m_size - m_pos) / sizeof(DPoint2))
+		{
+			m_bOK = false;
+			return;
+		}
+		line.SetSize(num);
+		if (num > 0)
+			Read(line.GetData(), num * sizeof(DPoint2));
+	}
+
+protected:
+	const uchar *m_data;
+	size_t m_size;
+	size_t m_pos;
+	bool m_bOK;
+};
+
+/**
+ * The name of the cache file for a structure file: the same name, with
+ * ".vtsc" appended.
+ */
+vtString vtStructureArray::GetCacheFilename(const char *pathname)
+{
+	return vtString(pathname) + ".vtsc";
+}
+
+/**
+ * Write a binary cache of these structures, which were read from the given
+ * file.  The cache is written next to the file (see GetCacheFilename) and
+ * is used by ReadCache for as long as the file does not change.
+ */
+bool vtStructureArray::WriteCache(const char *pathname) const
+{
+	long long size, mtime;
+	if (!GetFileStamp(pathname, size, mtime))
+		return false;
+
+	vtString cachename = GetCacheFilename(pathname);
+	FILE *fp = vtFileOpen(cachename, "wb");
+	if (!fp)
+	{
+		VTLOG("Couldn't write structure cache '%s'\n", (const char *) cachename);
+		return false;
+	}
+	StructCacheWriter out(fp);
+
+	out.Write("vtsc", 4);
+	out.WriteInt(STRUCT_CACHE_VERSION);
+	out.Write(&size, sizeof(size));
+	out.Write(&mtime, sizeof(mtime));
+
+	char *wkt = NULL;
+	m_proj.exportToWkt(&wkt);
+	out.WriteString(wkt);
+	OGRFree(wkt);
+
+	// Edges refer to a few materials many times, so write a table of them
+	std::map<const vtString *, int> material_index;
+	std::vector<const vtString *> materials;
+	uint i, j, num = GetSize();
+	for (i = 0; i < num; i++)
+	{
+		vtBuilding *bld = GetAt(i)->GetBuilding();
+		if (!bld)
+			continue;
+		for (j = 0; j < bld->GetNumLevels(); j++)
+		{
+			const vtLevel *lev = bld->GetLevel(j);
+			for (int e = 0; e < lev->NumEdges(); e++)
+			{
+				const vtString *mat = lev->GetEdge(e)->m_pMaterial;
+				if (mat && material_index.find(mat) == material_index.end())
+				{
+					material_index[mat] = materials.size();
+					materials.push_back(mat);
+				}
+			}
+		}
+	}
+	out.WriteInt(materials.size());
+	for (i = 0; i < materials.size(); i++)
+		out.WriteString(*materials[i]);
+
+	out.WriteInt(num);
+	for (i = 0; i < num; i++)
+	{
+		vtStructure *str = GetAt(i);
+		out.WriteByte((uchar) str->GetType());
+		out.WriteFloat(str->GetElevationOffset());
+		out.WriteByte(str->GetAbsolute());
+		out.WriteInt(str->NumTags());
+		for (j = 0; j < str->NumTags(); j++)
+		{
+			out.WriteString(str->GetTag(j)->name);
+			out.WriteString(str->GetTag(j)->value);
+		}
+
+		if (vtBuilding *bld = str->GetBuilding())
+		{
+			out.WriteInt(bld->GetNumLevels());
+			for (j = 0; j < bld->GetNumLevels(); j++)
+			{
+				const vtLevel *lev = bld->GetLevel(j);
+				out.WriteInt(lev->m_iStories);
+				out.WriteFloat(lev->m_fStoryHeight);
+
+				const DPolygon2 &foot = lev->GetFootprint();
+				out.WriteInt(foot.size());
+				for (uint r = 0; r < foot.size(); r++)
+					out.WriteLine(foot[r]);
+
+				out.WriteInt(lev->NumEdges());
+				for (int e = 0; e < lev->NumEdges(); e++)
+				{
+					const vtEdge *edge = lev->GetEdge(e);
+					out.WriteColor(edge->m_Color);
+					out.WriteInt(edge->m_iSlope);
+					out.WriteFloat(edge->m_fEaveLength);
+					out.WriteInt(edge->m_pMaterial ? material_index[edge->m_pMaterial] : -1);
+					out.WriteString(edge->m_Facade);
+					out.WriteInt(edge->m_Features.size());
+					for (uint f = 0; f < edge->m_Features.size(); f++)
+					{
+						const vtEdgeFeature &feat = edge->m_Features[f];
+						out.WriteInt(feat.m_code);
+						out.WriteColor(feat.m_color);
+						out.WriteFloat(feat.m_width);
+						out.WriteFloat(feat.m_vf1);
+						out.WriteFloat(feat.m_vf2);
+					}
+				}
+			}
+		}
+		else if (vtFence *fen = str->GetFence())
+		{
+			out.WriteLine(fen->GetFencePoints());
+			const vtLinearParams &param = fen->GetParams();
+			out.WriteString(param.m_PostType);
+			out.WriteFloat(param.m_fPostHeight);
+			out.WriteFloat(param.m_fPostSpacing);
+			out.WriteFloat(param.m_fPostWidth);
+			out.WriteFloat(param.m_fPostDepth);
+			out.WriteString(param.m_PostExtension);
+			out.WriteInt(param.m_iConnectType);
+			out.WriteString(param.m_ConnectMaterial);
+			out.WriteFloat(param.m_fConnectTop);
+			out.WriteFloat(param.m_fConnectBottom);
+			out.WriteFloat(param.m_fConnectWidth);
+			out.WriteInt(param.m_iConnectSlope);
+			out.WriteByte(param.m_bConstantTop);
+			out.WriteString(param.m_ConnectProfile);
+		}
+		else if (vtStructInstance *inst = str->GetInstance())
+		{
+			const DPoint2 p = inst->GetPoint();
+			out.Write(&p, sizeof(DPoint2));
+			out.WriteFloat(inst->GetRotation());
+			out.WriteFloat(inst->GetScale());
+		}
+	}
+	// A complete file ends with its marker again
+	out.Write("vtsc", 4);
+
+	const bool success = (ferror(fp) == 0);
+	fclose(fp);
+	if (!success)
+		vtDeleteFile(cachename);
+	else
+		VTLOG("Wrote structure cache '%s'\n", (const char *) cachename);
+	return success;
+}
+
+/**
+ * Read the structures of a file from its binary cache, if there is a cache
+ * and it is up to date.  The cache is memory-mapped, and the structures are
+ * copied out of it with no parsing.
+ *
+ * \param pathname The structure file, not the cache file.
+ * \return true if the structures were read from the cache.
+ */
+bool vtStructureArray::ReadCache(const char *pathname, bool progress_callback(int))
+{
+	long long size, mtime;
+	if (!GetFileStamp(pathname, size, mtime))
+		return false;
+
+	vtString cachename = GetCacheFilename(pathname);
+	vtMappedFile file;
+	if (!file.Open(cachename, vtMappedFile::READ_ONLY))
+		return false;
+
+	StructCacheReader in(file.GetData(), file.GetSize());
+	char marker[4];
+	long long cached_size = 0, cached_mtime = 0;
+	in.Read(marker, 4);
+	const int version = in.ReadInt();
+	in.Read(&cached_size, sizeof(cached_size));
+	in.Read(&cached_mtime, sizeof(cached_mtime));
+	if (!in.IsOK() || strncmp(marker, "vtsc", 4) || version != STRUCT_CACHE_VERSION)
+		return false;
+	if (cached_size != size || cached_mtime != mtime)
+	{
+		VTLOG("Structure cache '%s' is out of date.\n", (const char *) cachename);
+		return false;
+	}
+
+	vtString wkt;
+	in.ReadString(wkt);
+
+	vtMaterialDescriptorArray *mats = GetGlobalMaterials();
+	const int num_materials = in.ReadInt();
+	if (!in.IsOK() || num_materials < 0 || num_materials > 65536)
+		return false;
+	std::vector<const vtString *> materials(num_materials);
+	uint i, j;
+	for (i = 0; i < materials.size() && in.IsOK(); i++)
+	{
+		vtString name;
+		in.ReadString(name);
+		materials[i] = mats->FindOrAddName(name);
+	}
+
+	// Read into a separate list, so that nothing is added if the cache
+	//  turns out to be bad.
+	const int num = in.ReadInt();
+	if (!in.IsOK() || num < 0)
+		return false;
+	std::vector<vtStructure *> structures;
+	structures.reserve(num);
+
+	vtString name, value;
+	for (int s = 0; s < num && in.IsOK(); s++)
+	{
+		const vtStructureType type = (vtStructureType) in.ReadByte();
+		const float fElevationOffset = in.ReadFloat();
+		const bool bAbsolute = (in.ReadByte() != 0);
+
+		vtStructure *str;
+		if (type == ST_BUILDING)
+			str = NewBuilding();
+		else if (type == ST_LINEAR)
+			str = NewFence();
+		else if (type == ST_INSTANCE)
+			str = NewInstance();
+		else
+			break;
+		structures.push_back(str);
+
+		str->SetElevationOffset(fElevationOffset);
+		str->SetAbsolute(bAbsolute);
+		const int tags = in.ReadInt();
+		for (int t = 0; t < tags && in.IsOK(); t++)
+		{
+			in.ReadString(name);
+			in.ReadString(value);
+			str->AddTag(name, value);
+		}
+
+		if (vtBuilding *bld = str->GetBuilding())
+		{
+			const int levels = in.ReadInt();
+			DPolygon2 foot;
+			for (int l = 0; l < levels && in.IsOK(); l++)
+			{
+				vtLevel *lev = bld->CreateLevel();
+				lev->m_iStories = in.ReadInt();
+				lev->m_fStoryHeight = in.ReadFloat();
+
+				const int rings = in.ReadInt();
+				if (rings < 0 || rings > 100000)
+				{
+					in.Fail();
+					break;
+				}
+				foot.resize(rings);
+				for (j = 0; j < (uint) rings; j++)
+					in.ReadLine(foot[j]);
+				lev->SetFootprint(foot);
+
+				const int edges = in.ReadInt();
+				for (int e = 0; e < edges && in.IsOK(); e++)
+				{
+					// The footprint determines the number of edges, so there
+					//  should be no extra ones; if there are, skip them.
+					vtEdge dummy;
+					vtEdge *edge = (e < lev->NumEdges()) ? lev->GetEdge(e) : &dummy;
+					edge->m_Color = in.ReadColor();
+					edge->m_iSlope = in.ReadInt();
+					edge->m_fEaveLength = in.ReadFloat();
+					const int mat = in.ReadInt();
+					edge->m_pMaterial = (mat >= 0 && mat < (int) materials.size()) ?
+						materials[mat] : NULL;
+					in.ReadString(edge->m_Facade);
+
+					const int features = in.ReadInt();
+					if (features < 0 || features > 100000)
+					{
+						in.Fail();
+						break;
+					}
+					edge->m_Features.resize(features);
+					for (int f = 0; f < features; f++)
+					{
+						vtEdgeFeature &feat = edge->m_Features[f];
+						feat.m_code = in.ReadInt();
+						feat.m_color = in.ReadColor();
+						feat.m_width = in.ReadFloat();
+						feat.m_vf1 = in.ReadFloat();
+						feat.m_vf2 = in.ReadFloat();
+					}
+				}
+			}
+			bld->DetermineLocalFootprints();
+		}
+		else if (vtFence *fen = str->GetFence())
+		{
+			in.ReadLine(fen->GetFencePoints());
+			vtLinearParams &param = fen->GetParams();
+			in.ReadString(param.m_PostType);
+			param.m_fPostHeight = in.ReadFloat();
+			param.m_fPostSpacing = in.ReadFloat();
+			param.m_fPostWidth = in.ReadFloat();
+			param.m_fPostDepth = in.ReadFloat();
+			in.ReadString(param.m_PostExtension);
+			param.m_iConnectType = in.ReadInt();
+			in.ReadString(param.m_ConnectMaterial);
+			param.m_fConnectTop = in.ReadFloat();
+			param.m_fConnectBottom = in.ReadFloat();
+			param.m_fConnectWidth = in.ReadFloat();
+			param.m_iConnectSlope = (short) in.ReadInt();
+			param.m_bConstantTop = (in.ReadByte() != 0);
+			in.ReadString(param.m_ConnectProfile);
+		}
+		else if (vtStructInstance *inst = str->GetInstance())
+		{
+			DPoint2 p;
+			in.Read(&p, sizeof(DPoint2));
+			inst->SetPoint(p);
+			inst->SetRotation(in.ReadFloat());
+			inst->SetScale(in.ReadFloat());
+		}
+
+		if (progress_callback != NULL && (s % 1024) == 0)
+			progress_callback(s * 100 / num);
+	}
+	in.Read(marker, 4);
+
+	if (!in.IsOK() || (int) structures.size() != num || strncmp(marker, "vtsc", 4))
+	{
+		VTLOG("Structure cache '%s' is damaged.\n", (const char *) cachename);
+		for (i = 0; i < structures.size(); i++)
+			delete structures[i];
+		return false;
+	}
+
+	m_proj.SetTextDescription("wkt", wkt);
+	SetMaxSize(GetSize() + num);
+	for (i = 0; i < structures.size(); i++)
+		Append(structures[i]);
+
+	VTLOG("Read %d structures from cache '%s'\n", num, (const char *) cachename);
+	return true;
+}
+
@@ -854,7 +854,7 @@ void vtStructureArray::AddBuildingsFromOGR(OGRLayer *pLayer,
 			if (fDiff > MINIMUM_BASEMENT_SIZE)
 			{
 				// Create and add a foundation level
-				vtLevel *pNewLevel = new vtLevel;
+				vtLevel *pNewLevel = new (pBld->GetArena()) vtLevel(pBld->GetArena());
 				pNewLevel->m_iStories = 1;
 				pNewLevel->m_fStoryHeight = fDiff;
 				pBld->InsertLevel(0, pNewLevel);
@@ -385,6 +385,24 @@ const vtString *vtMaterialDescriptorArray::FindName(const char *name) const
 	return NULL;
 }
 
+/**
+ * Find a material by name.  If there is no such material, a placeholder is
+ * added, so that the name is not lost, and there is no NULL material to
+ * crash on later.
+ */
+const vtString *vtMaterialDescriptorArray::FindOrAddName(const char *name)
+{
+	const vtString *pFoundName = FindName(name);
+	if (pFoundName)
+		return pFoundName;
+
+	vtMaterialDescriptor *mat;
+	mat = new vtMaterialDescriptor(name, "", VT_MATERIAL_COLOUR);
+	mat->SetRGB(RGBi(255,255,255));	// white means: missing
+	Append(mat);
+	return &mat->GetName();
+}
+
 bool vtMaterialDescriptorArray::LoadExternalMaterials()
 {
 	VTLOG1("vtMaterialDescriptorArray::LoadExternalMaterials:\n");
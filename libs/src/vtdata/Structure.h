@@ -190,6 +190,7 @@ public:
 	}
 	bool LoadExternalMaterials();
 	const vtString *FindName(const char *matname) const;
+	const vtString *FindOrAddName(const char *matname);
 	void CreatePlain();
 
 	bool Load(const char *szFileName);
@@ -0,0 +1,110 @@
+//
+// TinFile.cpp
+//
+// Copyright (c) 2002-2011 Virtual Terrain Project
+// Free for all uses, see license.txt for details.
+//
+
+#include "TinFile.h"
+#include "vtLog.h"
+
+// The fixed part of the header: marker, verts, tris, data start, wkt length
+#define ITF_HEADER_SIZE		(5 + 4 * 4)
+
+vtTinFile::vtTinFile()
+{
+	m_pVerts = NULL;
+	m_pTris = NULL;
+	m_iVersion = 0;
+	m_iVerts = m_iTris = 0;
+	m_bHasProjection = false;
+	m_fMinHeight = m_fMaxHeight = 0.0f;
+}
+
+/**
+ * Open a native TIN (.itf) file, and read its header.
+ *
+ * \return true if successful.  The file is checked to make sure it is large
+ *		enough to hold all the vertices and triangles it claims to have.
+ */
+bool vtTinFile::Open(const char *fname)
+{
+	Close();
+
+	if (!m_File.Open(fname, vtMappedFile::READ_ONLY))
+		return false;
+
+	const uchar *data = m_File.GetData();
+	const size_t size = m_File.GetSize();
+	if (size < ITF_HEADER_SIZE || strncmp((const char *) data, "tin", 3))
+	{
+		VTLOG("vtTinFile: '%s' is not a TIN file.\n", fname);
+		Close();
+		return false;
+	}
+	m_iVersion = data[4] - '0';
+
+	int data_start, proj_len;
+	memcpy(&m_iVerts, data + 5, 4);
+	memcpy(&m_iTris, data + 9, 4);
+	memcpy(&data_start, data + 13, 4);
+	memcpy(&proj_len, data + 17, 4);
+
+	size_t header = ITF_HEADER_SIZE + proj_len;
+	if (m_iVersion > 1)
+		header += 4 * sizeof(double) + 2 * sizeof(float);
+	if (m_iVerts < 0 || m_iTris < 0 || proj_len < 0 || proj_len > 2000 ||
+		data_start < (int) header)
+	{
+		VTLOG("vtTinFile: '%s' has a bad header.\n", fname);
+		Close();
+		return false;
+	}
+	const size_t needed = data_start + (size_t) m_iVerts * VERT_SIZE +
+		(size_t) m_iTris * 3 * sizeof(int);
+	if (size < needed)
+	{
+		VTLOG("vtTinFile: '%s' is truncated.\n", fname);
+		Close();
+		return false;
+	}
+
+	const uchar *ptr = data + ITF_HEADER_SIZE;
+	m_bHasProjection = (proj_len > 0);
+	if (m_bHasProjection)
+	{
+		char wkt_buf[2001], *wkt = wkt_buf;
+		memcpy(wkt_buf, ptr, proj_len);
+		wkt_buf[proj_len] = 0;
+		ptr += proj_len;
+
+		OGRErr err = m_proj.importFromWkt((char **) &wkt);
+		if (err != OGRERR_NONE)
+		{
+			Close();
+			return false;
+		}
+	}
+	if (m_iVersion > 1)
+	{
+		// version 2 of the format has extents: left, top, right, bottom, min z, max h
+		memcpy(&m_EarthExtents.left, ptr, 4 * sizeof(double));
+		memcpy(&m_fMinHeight, ptr + 4 * sizeof(double), sizeof(float));
+		memcpy(&m_fMaxHeight, ptr + 4 * sizeof(double) + sizeof(float), sizeof(float));
+	}
+
+	m_pVerts = data + data_start;
+	m_pTris = m_pVerts + (size_t) m_iVerts * VERT_SIZE;
+	return true;
+}
+
+/**
+ * Close the file.  Any pointers to its data are no longer valid.
+ */
+void vtTinFile::Close()
+{
+	m_File.Close();
+	m_pVerts = NULL;
+	m_pTris = NULL;
+	m_iVerts = m_iTris = 0;
+}
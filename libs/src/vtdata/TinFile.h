@@ -0,0 +1,87 @@
+//
+// TinFile.h
+//
+// Copyright (c) 2002-2011 Virtual Terrain Project
+// Free for all uses, see license.txt for details.
+//
+
+#ifndef TINFILEH
+#define TINFILEH
+
+#include <string.h>
+#include "MathTypes.h"
+#include "Projections.h"
+#include "FilePath.h"
+
+/**
+ * Direct access to the contents of a native TIN (.itf) file, which is
+ * memory-mapped rather than read.
+ *
+ * Opening a file reads only its header, so it is nearly instant regardless
+ * of the size of the file.  The vertices and triangles are then accessed
+ * in place: the operating system pages in the parts of the file which are
+ * touched, and can discard them again when memory is short.  This is how
+ * vtTin::Read loads a TIN, and how vtTin3d can build the geometry of a very
+ * large TIN a piece at a time (see vtTin3d::OpenStreaming).
+ *
+ * In the file, each vertex is 2 doubles (x, y) followed by 1 float (z), and
+ * each triangle is 3 ints, all in native byte order.  The records are
+ * packed, so the values are not necessarily aligned.
+ */
+class vtTinFile
+{
+public:
+	vtTinFile();
+
+	bool Open(const char *fname);
+	void Close();
+	bool IsOpen() const { return m_File.IsOpen(); }
+
+	int GetVersion() const { return m_iVersion; }
+	int NumVerts() const { return m_iVerts; }
+	int NumTris() const { return m_iTris; }
+
+	// Values from the header
+	bool HasProjection() const { return m_bHasProjection; }
+	const vtProjection &GetProjection() const { return m_proj; }
+	bool HasExtents() const { return m_iVersion > 1; }
+	const DRECT &GetEarthExtents() const { return m_EarthExtents; }
+	void GetHeightExtents(float &fMin, float &fMax) const
+	{
+		fMin = m_fMinHeight;
+		fMax = m_fMaxHeight;
+	}
+
+	/// Size in bytes of each vertex in the file.
+	enum { VERT_SIZE = 20 };
+
+	/// The vertex records, VERT_SIZE bytes each.
+	const uchar *GetVertData() const { return m_pVerts; }
+	/// The triangle vertex indices, 3 for each triangle.
+	const int *GetTriData() const { return (const int *) m_pTris; }
+
+	void GetVert(int v, DPoint2 &p, float &z) const
+	{
+		const uchar *rec = m_pVerts + (size_t) v * VERT_SIZE;
+		memcpy(&p.x, rec, 2 * sizeof(double));
+		memcpy(&z, rec + 2 * sizeof(double), sizeof(float));
+	}
+	void GetTri(int t, int *v) const
+	{
+		memcpy(v, m_pTris + (size_t) t * 3 * sizeof(int), 3 * sizeof(int));
+	}
+
+protected:
+	vtMappedFile m_File;
+	const uchar *m_pVerts;
+	const uchar *m_pTris;
+
+	int		m_iVersion;
+	int		m_iVerts, m_iTris;
+	bool	m_bHasProjection;
+	vtProjection m_proj;
+	DRECT	m_EarthExtents;
+	float	m_fMinHeight, m_fMaxHeight;
+};
+
+#endif	// TINFILEH
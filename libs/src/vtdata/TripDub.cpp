@@ -66,7 +66,9 @@ size_t write_as_string( void *ptr, size_t size, size_t nmemb, void *stream)
 	ReqContext *context = (ReqContext *)stream;
 	size_t length = size * nmemb;
 
-	context->m_pDataString->Concat((pcchar) ptr, length);
+	// Don't give the caller the server's error page
+	if (!context->IsErrorResponse())
+		context->m_pDataString->Concat((pcchar) ptr, length);
 	return length;
 }
 
@@ -75,7 +77,8 @@ size_t write_as_bytes( void *ptr, size_t size, size_t nmemb, void *stream)
 	ReqContext *context = (ReqContext *)stream;
 	size_t length = size * nmemb;
 
-	context->m_pDataBytes->Append((uchar *) ptr, length);
+	if (!context->IsErrorResponse())
+		context->m_pDataBytes->Append((uchar *) ptr, length);
 	return length;
 }
 
@@ -120,12 +123,16 @@ ReqContext::ReqContext()
 	CURLcode result;
 	result = curl_easy_setopt(m_curl, CURLOPT_WRITEDATA, this);
 
-	// This tells CURL to give us an error if we get an e.g. 404, instead
-	//  of giving us the HTML page from the server, e.g. "The page cannot
-	//  be found..."
-	result = curl_easy_setopt(m_curl, CURLOPT_FAILONERROR, 1);
+	// An HTTP error, e.g. 404, is turned into a failure by Fetch, rather
+	//  than with CURLOPT_FAILONERROR, since that makes libcurl close the
+	//  connection instead of keeping it to be reused.
+
+	// Don't use signals for timeouts, so that contexts can be used from
+	//  several threads.
+	result = curl_easy_setopt(m_curl, CURLOPT_NOSIGNAL, 1);
 
 	m_progress_callback = NULL;
+	m_iResponseCode = 0;
 }
 
 ReqContext::~ReqContext()
@@ -145,15 +152,30 @@ bool ReqContext::Fetch(const char *url)
 	result = curl_easy_setopt(m_curl, CURLOPT_URL, url);
 	result = curl_easy_setopt(m_curl, CURLOPT_ERRORBUFFER, errorbuf);
 
-	// setup progress indication
-	result = curl_easy_setopt(m_curl, CURLOPT_NOPROGRESS, false);
-	result = curl_easy_setopt(m_curl, CURLOPT_PROGRESSFUNCTION, tripdub_progress);
-	result = curl_easy_setopt(m_curl, CURLOPT_PROGRESSDATA, this);
+	// setup progress indication, if anyone is listening
+	if (m_progress_callback != NULL)
+	{
+		result = curl_easy_setopt(m_curl, CURLOPT_NOPROGRESS, false);
+		result = curl_easy_setopt(m_curl, CURLOPT_PROGRESSFUNCTION, tripdub_progress);
+		result = curl_easy_setopt(m_curl, CURLOPT_PROGRESSDATA, this);
+	}
+	else
+		result = curl_easy_setopt(m_curl, CURLOPT_NOPROGRESS, true);
 
+	// The same handle is used for each request, so libcurl can keep the
+	//  connection open and reuse it.
 	result = curl_easy_perform(m_curl);
-	if (result == 0)	// 0 means everything was ok
+	m_iResponseCode = 0;
+	curl_easy_getinfo(m_curl, CURLINFO_RESPONSE_CODE, &m_iResponseCode);
+	if (result == 0 && m_iResponseCode >= 400)
+	{
+		VTLOG("ReqContext::Fetch HTTP error: %ld\n", m_iResponseCode);
+		m_strErrorMsg.Format("The requested URL returned error: %ld", m_iResponseCode);
+		return false;
+	}
+	else if (result == 0)	// 0 means everything was ok
 	{
-		m_strErrorMsg = "";
+		m_strErrorMsg.Empty();
 		return true;
 	}
 	else
@@ -164,6 +186,17 @@ bool ReqContext::Fetch(const char *url)
 	}
 }
 
+/**
+ * True if the response which is being received is an HTTP error, such as
+ * 404, in which case its body is the server's error page.
+ */
+bool ReqContext::IsErrorResponse()
+{
+	long code = 0;
+	curl_easy_getinfo(m_curl, CURLINFO_RESPONSE_CODE, &code);
+	return (code >= 400);
+}
+
 bool ReqContext::GetURL(const char *url, vtString &str)
 {
 	m_pDataString = &str;
@@ -63,6 +63,10 @@ public:
 	void SetProgressCallback(bool progress_callback(int));
 	vtString &GetErrorMsg() { return m_strErrorMsg; }
 
+	/// The HTTP status of the last request, such as 200 or 404, or 0 if none.
+	long GetResponseCode() const { return m_iResponseCode; }
+	bool IsErrorResponse();
+
 	/// Set level of logging output: 0 (none) 1 (some) 2 (lots)
 	void SetVerbosity(int i) { m_iVerbosity = i; }
 
@@ -78,6 +82,7 @@ protected:
 
 	int m_iVerbosity;
 	vtString m_strErrorMsg;
+	long m_iResponseCode;
 	static bool s_bFirst;
 };
 
@@ -0,0 +1,248 @@
+//
+// Viewshed.cpp
+//
+// Copyright (c) 2002-2011 Virtual Terrain Project
+// Free for all uses, see license.txt for details.
+//
+
+#include <float.h>
+#include <algorithm>
+#include "Viewshed.h"
+#include "HeightField.h"
+#include "vtDIB.h"
+#include "vtLog.h"
+
+// Get the true elevation at a fractional grid location, interpolated
+//  between the four surrounding heixels.
+static float TrueElevation(const vtHeightFieldGrid3d *pGrid, int iColumns,
+	int iRows, double x, double y)
+{
+	int ix = (int) x, iy = (int) y;
+	if (ix > iColumns - 2) ix = iColumns - 2;
+	if (iy > iRows - 2) iy = iRows - 2;
+	const float fx = (float) (x - ix), fy = (float) (y - iy);
+
+	const float a0 = pGrid->GetElevation(ix, iy, true);
+	const float a1 = pGrid->GetElevation(ix+1, iy, true);
+	const float a2 = pGrid->GetElevation(ix+1, iy+1, true);
+	const float a3 = pGrid->GetElevation(ix, iy+1, true);
+	if (a0 == INVALID_ELEVATION || a1 == INVALID_ELEVATION ||
+		a2 == INVALID_ELEVATION || a3 == INVALID_ELEVATION)
+		return INVALID_ELEVATION;
+
+	return (a0 + fx * (a1 - a0)) * (1.0f - fy) + (a3 + fx * (a2 - a3)) * fy;
+}
+
+vtViewshed::vtViewshed()
+{
+	m_fTargetHeight = 0.0f;
+	m_fMaxDistance = 0.0f;
+	m_iWidth = m_iHeight = 0;
+	m_fXSpacing = m_fYSpacing = 1.0f;
+}
+
+/**
+ * Add an observer.
+ *
+ * \param epos The location of the observer, in the earth coordinates of
+ *		the grid.
+ * \param fHeight The height of the observer's eye above the ground, in meters.
+ */
+void vtViewshed::AddObserver(const DPoint2 &epos, float fHeight)
+{
+	Observer ob;
+	ob.m_Pos = epos;
+	ob.m_fHeight = fHeight;
+	m_Observers.push_back(ob);
+}
+
+/**
+ * Compute the viewshed of all the observers on a grid.  Afterwards, the
+ * result has one value for each heixel of the grid.
+ *
+ * The true elevation values of the grid are used, ignoring any vertical
+ * exaggeration.
+ *
+ * \param pGrid The heightfield grid.
+ * \param progress_callback If supplied, will be called with values from 0 to 100.
+ * \return true if successful.
+ */
+bool vtViewshed::Compute(const vtHeightFieldGrid3d *pGrid,
+	bool progress_callback(int))
+{
+	int cols, rows;
+	pGrid->GetDimensions(cols, rows);
+	if (cols < 2 || rows < 2)
+		return false;
+
+	VTLOG("vtViewshed::Compute: grid %d x %d, %d observers\n", cols, rows,
+		(int) m_Observers.size());
+
+	m_iWidth = cols;
+	m_iHeight = rows;
+	m_Count.assign((size_t) cols * rows, 0);
+
+	const FPoint2 world_spacing = pGrid->GetWorldSpacing();
+	m_fXSpacing = fabs(world_spacing.x);
+	m_fYSpacing = fabs(world_spacing.y);
+
+	const DRECT &ext = pGrid->GetEarthExtents();
+	const DPoint2 spacing = pGrid->GetSpacing();
+
+	std::vector<uchar> seen;
+	std::vector<IPoint2> edge;
+	for (uint o = 0; o < m_Observers.size(); o++)
+	{
+		if (progress_callback != NULL)
+			progress_callback(o * 100 / m_Observers.size());
+
+		const Observer &ob = m_Observers[o];
+		const double ox = (ob.m_Pos.x - ext.left) / spacing.x;
+		const double oy = (ob.m_Pos.y - ext.bottom) / spacing.y;
+		if (ox < 0 || ox > cols-1 || oy < 0 || oy > rows-1)
+		{
+			VTLOG(" observer %d is off the grid.\n", o);
+			continue;
+		}
+		const float fGround = TrueElevation(pGrid, cols, rows, ox, oy);
+		if (fGround == INVALID_ELEVATION)
+		{
+			VTLOG(" observer %d has no ground.\n", o);
+			continue;
+		}
+		const float fEye = fGround + ob.m_fHeight;
+
+		// The area which the observer might see
+		IPoint2 lower(0, 0), upper(cols-1, rows-1);
+		if (m_fMaxDistance > 0)
+		{
+			const double rx = m_fMaxDistance / m_fXSpacing;
+			const double ry = m_fMaxDistance / m_fYSpacing;
+			lower.x = std::max(0, (int) floor(ox - rx));
+			lower.y = std::max(0, (int) floor(oy - ry));
+			upper.x = std::min(cols-1, (int) ceil(ox + rx));
+			upper.y = std::min(rows-1, (int) ceil(oy + ry));
+		}
+		const int sw = upper.x - lower.x + 1, sh = upper.y - lower.y + 1;
+		seen.assign((size_t) sw * sh, 0);
+
+		// The observer can see where it stands
+		seen[(size_t) ((int) (oy + 0.5) - lower.y) * sw + ((int) (ox + 0.5) - lower.x)] = 1;
+
+		// Cast a ray to each heixel on the edge of the area
+		edge.clear();
+		for (int x = lower.x; x <= upper.x; x++)
+		{
+			edge.push_back(IPoint2(x, lower.y));
+			if (sh > 1)
+				edge.push_back(IPoint2(x, upper.y));
+		}
+		for (int y = lower.y + 1; y < upper.y; y++)
+		{
+			edge.push_back(IPoint2(lower.x, y));
+			if (sw > 1)
+				edge.push_back(IPoint2(upper.x, y));
+		}
+		const int num_edge = (int) edge.size();
+#pragma omp parallel for schedule(dynamic, 16)
+		for (int e = 0; e < num_edge; e++)
+			CastRay(pGrid, ox, oy, fEye, edge[e], lower, seen, sw);
+
+		for (int y = 0; y < sh; y++)
+		{
+			unsigned short *count = &m_Count[(size_t) (lower.y + y) * cols + lower.x];
+			const uchar *s = &seen[(size_t) y * sw];
+			for (int x = 0; x < sw; x++)
+				if (s[x] && count[x] < USHRT_MAX)
+					count[x]++;
+		}
+	}
+	VTLOG(" %d heixels visible.\n", NumVisible());
+	return true;
+}
+
+/**
+ * Walk along a ray from the observer to a target heixel, one heixel at a
+ * time, marking the heixels which rise above the steepest slope so far.
+ */
+void vtViewshed::CastRay(const vtHeightFieldGrid3d *pGrid, double ox, double oy,
+	float fEye, const IPoint2 &target, const IPoint2 &lower,
+	std::vector<uchar> &seen, int iSeenWidth) const
+{
+	const double dx = target.x - ox, dy = target.y - oy;
+	const int steps = (int) ceil(std::max(fabs(dx), fabs(dy)));
+	if (steps == 0)
+		return;
+	const double sx = dx / steps, sy = dy / steps;
+
+	float fMaxSlope = -FLT_MAX;
+	for (int k = 1; k <= steps; k++)
+	{
+		const double x = ox + sx * k, y = oy + sy * k;
+		const float fx = (float) ((x - ox) * m_fXSpacing);
+		const float fy = (float) ((y - oy) * m_fYSpacing);
+		const float fDist = sqrtf(fx*fx + fy*fy);
+		if (m_fMaxDistance > 0 && fDist > m_fMaxDistance)
+			break;
+
+		const float fElev = TrueElevation(pGrid, m_iWidth, m_iHeight, x, y);
+		if (fElev == INVALID_ELEVATION)
+			continue;
+
+		const float fSlope = (fElev - fEye) / fDist;
+		if ((fElev + m_fTargetHeight - fEye) / fDist >= fMaxSlope)
+		{
+			uchar &s = seen[(size_t) ((int) (y + 0.5) - lower.y) * iSeenWidth +
+				((int) (x + 0.5) - lower.x)];
+#pragma omp atomic
+			s |= 1;
+		}
+		if (fSlope > fMaxSlope)
+			fMaxSlope = fSlope;
+	}
+}
+
+/**
+ * The number of heixels which can be seen by at least one observer.
+ */
+int vtViewshed::NumVisible() const
+{
+	int count = 0;
+	for (size_t i = 0; i < m_Count.size(); i++)
+		if (m_Count[i])
+			count++;
+	return count;
+}
+
+/**
+ * Draw the result into a bitmap of 24 or 32 bits.  The bitmap covers the
+ * whole grid, but need not be the same size as the grid.
+ *
+ * \param pBM The bitmap.
+ * \param unseen The color for places which no observer can see.
+ * \param seen The color for places which any observer can see.
+ */
+void vtViewshed::ToBitmap(vtBitmapBase *pBM, const RGBAi &unseen,
+	const RGBAi &seen) const
+{
+	const int w = pBM->GetWidth(), h = pBM->GetHeight();
+	const int depth = pBM->GetDepth();
+	if (m_Count.empty() || w < 2 || h < 2)
+		return;
+
+	const double ratiox = (double)(m_iWidth-1)/(w-1), ratioy = (double)(m_iHeight-1)/(h-1);
+	const RGBi unseen_24bit(unseen.r, unseen.g, unseen.b);
+	const RGBi seen_24bit(seen.r, seen.g, seen.b);
+	for (int j = 0; j < h; j++)
+	{
+		const int y = (int) (j * ratioy + 0.5);
+		for (int i = 0; i < w; i++)
+		{
+			const bool bSeen = IsVisible((int) (i * ratiox + 0.5), y);
+			if (depth == 32)
+				pBM->SetPixel32(i, h-1-j, bSeen ? seen : unseen);
+			else
+				pBM->SetPixel24(i, h-1-j, bSeen ? seen_24bit : unseen_24bit);
+		}
+	}
+}
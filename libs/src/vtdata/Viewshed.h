@@ -0,0 +1,94 @@
+//
+// Viewshed.h
+//
+// Copyright (c) 2002-2011 Virtual Terrain Project
+// Free for all uses, see license.txt for details.
+//
+
+#ifndef VIEWSHEDH
+#define VIEWSHEDH
+
+#include <vector>
+#include "MathTypes.h"
+
+class vtBitmapBase;
+class vtHeightFieldGrid3d;
+
+/**
+ * Computes which parts of a heightfield grid can be seen from one or more
+ * observers.
+ *
+ * Rather than testing a line of sight from each observer to each heixel,
+ * which resamples the grid over and over, the viewshed is found by sweeping
+ * rays out from each observer to the edge of the area of interest.  Each ray
+ * keeps track of the steepest slope it has passed, so each heixel is visited
+ * about once per observer.  The rays are divided among all the available
+ * processors (when vtdata is built with OpenMP).
+ *
+ * The result is a count, for each heixel, of the observers which can see it.
+ * It can be drawn into a bitmap, for example to drape over the terrain as
+ * an overlay.
+ *
+ * \par Example:
+	\code
+	vtViewshed viewshed;
+	viewshed.AddObserver(DPoint2(x1, y1), 2.0f);
+	viewshed.AddObserver(DPoint2(x2, y2), 2.0f);
+	viewshed.Compute(pTerrain->GetHeightFieldGrid3d());
+
+	vtImage *image = new vtImage;
+	image->Create(viewshed.GetWidth(), viewshed.GetHeight(), 32);
+	vtImageWrapper wrap(image);
+	viewshed.ToBitmap(&wrap, RGBAi(0,0,0,0), RGBAi(255,0,0,128));
+	pTerrain->AddMultiTextureOverlay(image,
+		pTerrain->GetHeightField()->GetEarthExtents(), GL_DECAL);
+	\endcode
+ */
+class vtViewshed
+{
+public:
+	vtViewshed();
+
+	void AddObserver(const DPoint2 &epos, float fHeight);
+	void ClearObservers() { m_Observers.clear(); }
+	uint NumObservers() const { return m_Observers.size(); }
+
+	/// Height above the ground of the points which are looked at.
+	void SetTargetHeight(float fHeight) { m_fTargetHeight = fHeight; }
+	/// The furthest distance which the observers can see, in meters, or 0 for no limit.
+	void SetMaxDistance(float fMeters) { m_fMaxDistance = fMeters; }
+
+	bool Compute(const vtHeightFieldGrid3d *pGrid, bool progress_callback(int) = NULL);
+
+	int GetWidth() const { return m_iWidth; }
+	int GetHeight() const { return m_iHeight; }
+	/// The number of observers which can see a heixel.
+	int GetCount(int i, int j) const { return m_Count[(size_t) j * m_iWidth + i]; }
+	bool IsVisible(int i, int j) const { return GetCount(i, j) != 0; }
+	int NumVisible() const;
+
+	void ToBitmap(vtBitmapBase *pBM, const RGBAi &unseen, const RGBAi &seen) const;
+
+protected:
+	struct Observer
+	{
+		DPoint2 m_Pos;
+		float m_fHeight;
+	};
+	void CastRay(const vtHeightFieldGrid3d *pGrid, double ox, double oy,
+		float fEye, const IPoint2 &target, const IPoint2 &lower,
+		std::vector<uchar> &seen, int iSeenWidth) const;
+
+	std::vector<Observer> m_Observers;
+	float	m_fTargetHeight;
+	float	m_fMaxDistance;
+
+	// Results, one value for each heixel, by rows starting from the south
+	int		m_iWidth, m_iHeight;
+	std::vector<unsigned short> m_Count;
+
+	// Meters between heixels
+	float	m_fXSpacing, m_fYSpacing;
+};
+
+#endif	// VIEWSHEDH
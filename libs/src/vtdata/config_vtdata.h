@@ -66,6 +66,18 @@
 #define SUPPORT_WSTRING	1
 #endif
 
+// Use SSE2 instructions in a few inner loops, such as batched altitude
+// queries.  By default this is enabled whenever the compiler targets a CPU
+// which has SSE2 (which includes every x86-64 CPU).
+//
+#ifndef SUPPORT_SSE2
+  #if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+	#define SUPPORT_SSE2	1
+  #else
+	#define SUPPORT_SSE2	0
+  #endif
+#endif
+
 // Put these useful typedefs here so that they can be used throughout the
 // VTP codebase.
 typedef unsigned int uint;
@@ -0,0 +1,94 @@
+//
+// AltitudeBench.cpp
+//
+// Times the batched altitude query, vtHeightField3d::FindAltitudesAtPoints,
+// against calling FindAltitudeAtPoint once for each point.
+//
+// Copyright (c) 2001-2012 Virtual Terrain Project
+// Free for all uses, see license.txt for details.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <time.h>
+#include <vector>
+
+#include "vtdata/ElevationGrid.h"
+
+static double Seconds(clock_t start)
+{
+	return (double) (clock() - start) / CLOCKS_PER_SEC;
+}
+
+static void TimeQueries(const char *name, const vtHeightField3d &hf,
+	const std::vector<FPoint3> &points, int passes)
+{
+	const int count = (int) points.size();
+	std::vector<float> single(count), batch(count);
+
+	// One point at a time
+	clock_t start = clock();
+	for (int pass = 0; pass < passes; pass++)
+		for (int i = 0; i < count; i++)
+			hf.FindAltitudeAtPoint(points[i], single[i]);
+	const double t_single = Seconds(start) / passes;
+
+	// All at once
+	start = clock();
+	for (int pass = 0; pass < passes; pass++)
+		hf.FindAltitudesAtPoints(&points[0], &batch[0], count);
+	const double t_batch = Seconds(start) / passes;
+
+	// The two paths should agree
+	float worst = 0;
+	for (int i = 0; i < count; i++)
+	{
+		const float diff = fabsf(single[i] - batch[i]);
+		if (diff > worst)
+			worst = diff;
+	}
+	printf("%-20s %8d points: per-point %8.2f ms, batched %8.2f ms, "
+		"%5.2fx, largest difference %g\n", name, count, t_single * 1000,
+		t_batch * 1000, t_batch > 0 ? t_single / t_batch : 0.0, worst);
+}
+
+int main(int argc, char **argv)
+{
+	const int count = (argc > 1) ? atoi(argv[1]) : 1000000;
+	const int passes = (argc > 2) ? atoi(argv[2]) : 5;
+
+	// A 2049 x 2049 grid of rolling hills, 10 m apart
+	vtProjection proj;
+	proj.SetProjectionSimple(true, 10, EPSG_DATUM_WGS84);
+	const int size = 2049;
+	vtElevationGrid grid;
+	if (!grid.Create(DRECT(500000, 4020480, 520480, 4000000), size, size,
+		true, proj))
+	{
+		printf("Couldn't create the grid.\n");
+		return 1;
+	}
+	for (int i = 0; i < size; i++)
+		for (int j = 0; j < size; j++)
+			grid.SetFValue(i, j, 500 + 200 * sinf(i * 0.01f) * cosf(j * 0.013f));
+	grid.ComputeHeightExtents();
+	grid.SetupConversion(1.0f);
+
+	// Points scattered over the grid, like plants, and points in a row,
+	//  like a road being draped
+	const FRECT &ext = grid.m_WorldExtents;
+	std::vector<FPoint3> scattered(count), line(count);
+	srand(1);
+	for (int i = 0; i < count; i++)
+	{
+		scattered[i].Set(ext.left + ext.Width() * rand() / RAND_MAX, 0,
+			ext.bottom + (ext.top - ext.bottom) * rand() / RAND_MAX);
+		const float f = (float) i / count;
+		line[i].Set(ext.left + ext.Width() * f, 0,
+			ext.bottom + (ext.top - ext.bottom) * (0.5f + 0.4f * sinf(f * 20)));
+	}
+	TimeQueries("grid, scattered", grid, scattered, passes);
+	TimeQueries("grid, along a line", grid, line, passes);
+	return 0;
+}
@@ -32,12 +32,35 @@ public:
 	virtual uint GetHeight() const = 0;
 	virtual uint GetDepth() const = 0;
 
+	/**
+	 * Direct access to the pixels of a row, where row 0 is the top, as with
+	 * the other methods.  The pixels are GetDepth()/8 bytes each, in RGB or
+	 * RGBA order.  Bitmaps which don't store their pixels that way return
+	 * NULL, and must be accessed with GetPixel and SetPixel.
+	 */
+	virtual uchar *GetPixelRow(int) { return NULL; }
+
 	void ScalePixel8(int x, int y, float fScale);
 	void ScalePixel24(int x, int y, float fScale);
 	void ScalePixel32(int x, int y, float fScale);
+	static void ScaleRawPixel(uchar *pixel, int iBytes, float fScale);
 	void BlitTo(vtBitmapBase &target, int x, int y);
 };
 
+/**
+ * Scale the color of a pixel from GetPixelRow, exactly as ScalePixel8,
+ * ScalePixel24 and ScalePixel32 do.  Alpha is not changed.
+ */
+inline void vtBitmapBase::ScaleRawPixel(uchar *pixel, int iBytes, float fScale)
+{
+	const int channels = (iBytes == 4) ? 3 : iBytes;
+	for (int c = 0; c < channels; c++)
+	{
+		const short value = (short) (pixel[c] * fScale);
+		pixel[c] = (value > 255) ? 255 : (uchar) value;
+	}
+}
+
 // for non-Win32 systems (or code which doesn't include the Win32 headers),
 // define some Microsoft types used by the DIB code
 #ifdef _WINGDI_
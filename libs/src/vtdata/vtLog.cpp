@@ -10,6 +10,10 @@
 #include "vtLog.h"
 #include "FilePath.h"
 #include <stdarg.h>
+#include <string.h>
+#include <algorithm>	// for min
+#include <string>
+#include <vector>
 
 #ifndef __DARWIN_OSX__
 #include <wchar.h>		// for fputws()
@@ -17,69 +21,792 @@
 
 #ifdef _MSC_VER
 #include <windows.h>	// for OutputDebugString, unfortunately
+#define vsnprintf	_vsnprintf
+#else
+#include <pthread.h>
+#include <sched.h>		// for sched_yield
+#include <unistd.h>		// for pipe, usleep
 #endif
 
+// Size of the buffer for each formatted message
+#define LOG_MESSAGE_SIZE	2048
+
+// By default, this much of the most recent output is kept in memory
+#define LOG_RECENT_SIZE		(64 * 1024)
+
+// Size of the buffer of each thread which logs, which must be a power of 2
+#define LOG_THREAD_BUFFER_SIZE	(16 * 1024)
+
 vtLog g_Log;
 
-vtLog::vtLog()
+// The few atomic operations which the per-thread buffers need.  Loads
+//  acquire and stores release; the others are full barriers.
+#ifdef _MSC_VER
+static inline long AtomicLoad(volatile long *p) { long v = *p; MemoryBarrier(); return v; }
+static inline void AtomicStore(volatile long *p, long v) { MemoryBarrier(); *p = v; }
+static inline long AtomicExchange(volatile long *p, long v) { return InterlockedExchange(p, v); }
+static inline bool AtomicClaim(volatile long *p) { return InterlockedCompareExchange(p, 1, 0) == 0; }
+static inline long AtomicIncrement(volatile long *p) { return InterlockedIncrement(p); }
+static inline size_t AtomicLoad(volatile size_t *p) { size_t v = *p; MemoryBarrier(); return v; }
+static inline void AtomicStore(volatile size_t *p, size_t v) { MemoryBarrier(); *p = v; }
+static inline void *AtomicLoad(void *volatile *p) { void *v = *p; MemoryBarrier(); return v; }
+static inline bool AtomicReplace(void *volatile *p, void *expected, void *v)
+{
+	return InterlockedCompareExchangePointer(p, v, expected) == expected;
+}
+static inline void FullBarrier() { MemoryBarrier(); }
+static inline void GiveWay() { SwitchToThread(); }
+static inline void Nap() { Sleep(1); }
+#else
+static inline long AtomicLoad(volatile long *p) { return __atomic_load_n(p, __ATOMIC_ACQUIRE); }
+static inline void AtomicStore(volatile long *p, long v) { __atomic_store_n(p, v, __ATOMIC_RELEASE); }
+static inline long AtomicExchange(volatile long *p, long v) { return __atomic_exchange_n(p, v, __ATOMIC_SEQ_CST); }
+static inline bool AtomicClaim(volatile long *p)
+{
+	long expected = 0;
+	return __atomic_compare_exchange_n(p, &expected, 1, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+}
+static inline long AtomicIncrement(volatile long *p) { return __atomic_add_fetch(p, 1, __ATOMIC_SEQ_CST); }
+static inline size_t AtomicLoad(volatile size_t *p) { return __atomic_load_n(p, __ATOMIC_ACQUIRE); }
+static inline void AtomicStore(volatile size_t *p, size_t v) { __atomic_store_n(p, v, __ATOMIC_RELEASE); }
+static inline void *AtomicLoad(void *volatile *p) { return __atomic_load_n(p, __ATOMIC_ACQUIRE); }
+static inline bool AtomicReplace(void *volatile *p, void *expected, void *v)
 {
-	m_log = NULL;
+	return __atomic_compare_exchange_n(p, &expected, v, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
 }
+static inline void FullBarrier() { __atomic_thread_fence(__ATOMIC_SEQ_CST); }
+static inline void GiveWay() { sched_yield(); }
+static inline void Nap() { usleep(1000); }
+#endif
 
-vtLog::~vtLog()
+// True once a position in a buffer has reached a target position.  The
+//  positions only grow, and may wrap around.
+static inline bool Reached(size_t pos, size_t target)
+{
+	return (size_t) (pos - target) <= ((size_t) -1) / 2;
+}
+
+/**
+ * The output of one thread which is waiting to be written.  It is a ring
+ * buffer with a single producer, the thread which owns it, and a single
+ * consumer, the writing thread, so neither has to lock.  The positions only
+ * grow; the producer advances m_iWrite, and the consumer m_iRead once it has
+ * taken the output and m_iWritten once it has written it.
+ *
+ * Each message is a vtLogRecord followed by its text.  When a thread exits,
+ * its buffer is released, and the next new thread to log claims it.
+ */
+struct vtLogRecord
+{
+	long seq;		// Order of the message among all the threads
+	size_t len;		// Length of the text which follows
+};
+
+struct vtLogBuffer
 {
-	if (m_log)
+	vtLogBuffer() : m_Data(LOG_THREAD_BUFFER_SIZE)
+	{
+		m_iWrite = m_iRead = m_iWritten = 0;
+		m_iOwned = 1;
+		m_pNext = NULL;
+	}
+	void Put(size_t pos, const void *src, size_t len)
+	{
+		const size_t at = pos & (m_Data.size() - 1);
+		const size_t first = std::min(len, m_Data.size() - at);
+		memcpy(&m_Data[at], src, first);
+		memcpy(&m_Data[0], (const char *) src + first, len - first);
+	}
+	void Get(size_t pos, void *dst, size_t len) const
 	{
-		fclose(m_log);
-		m_log = NULL;
+		const size_t at = pos & (m_Data.size() - 1);
+		const size_t first = std::min(len, m_Data.size() - at);
+		memcpy(dst, &m_Data[at], first);
+		memcpy((char *) dst + first, &m_Data[0], len - first);
 	}
+
+	std::vector<char> m_Data;
+	volatile size_t m_iWrite;
+	volatile size_t m_iRead;
+	volatile size_t m_iWritten;
+	volatile long m_iOwned;
+	vtLogBuffer *m_pNext;	// Set before the buffer is added to the list
+};
+
+// What each thread remembers about the log: its buffer, and which writer
+//  that buffer belongs to.
+struct vtLogThread
+{
+	vtLogBuffer *m_pBuffer;
+	long m_iGeneration;
+};
+
+/**
+ * The state of a started log: the file, the buffers of the threads which
+ * log, the recent output, and the thread which writes it.
+ *
+ * Logging never takes a lock.  Each message gets a sequence number and is
+ * copied into the buffer of the thread which logs it, then the writing
+ * thread is woken if it is asleep.  The writing thread takes everything
+ * waiting in all the buffers, puts it back in sequence order, and writes it.
+ * Only the writing thread uses the file and the recent output.
+ */
+struct vtLogWriter
+{
+	vtLogWriter(FILE *fp, unsigned int iRecentSize, bool bSync);
+	~vtLogWriter();
+
+	bool StartThread();
+	void StopThread();
+	void Run();
+
+	void Queue(const char *str, size_t len);
+	void Flush();
+	void Output(const char *str, size_t len);
+	void Remember(const char *str, size_t len);
+	void DumpPending(FILE *fp) const;
+
+	vtLogBuffer *GetBuffer();
+	bool HasPending() const;
+	bool Drain();
+	void WaitWritten(vtLogBuffer *buf, size_t target);
+	void WaitForWriter(int &iWaits);
+	void Wake();
+	void Signal();
+	void WaitForSignal();
+
+	FILE *m_fp;
+	bool m_bThread;
+	bool m_bSync;
+	long m_iGeneration;
+	volatile long m_iStop;
+	volatile long m_iSleeping;
+	volatile long m_iSequence;
+	void *volatile m_pBuffers;	// The first vtLogBuffer of the list
+
+	// Used by the writing thread to put the output back in order
+	struct Piece
+	{
+		long seq;
+		size_t start, len;
+		bool operator<(const Piece &other) const { return (long) ((unsigned long) seq - (unsigned long) other.seq) < 0; }
+	};
+	std::vector<Piece> m_Pieces;
+	std::string m_Text, m_Batch;
+	std::vector<std::pair<vtLogBuffer*, size_t> > m_Drained;
+
+	// A ring buffer of the most recent output
+	std::vector<char> m_Recent;
+	size_t m_iRecentPos;
+	bool m_bRecentWrapped;
+
+#ifdef _MSC_VER
+	HANDLE m_Event;
+	HANDLE m_Thread;
+#else
+	int m_Pipe[2];
+	pthread_t m_Thread;
+#endif
+};
+
+// The generation of the running writer, so that threads can tell whether
+//  the buffer they remember belongs to it.  Zero when there is none.
+static volatile long s_iGeneration = 0;
+static long s_iGenerations = 0;
+
+// When a thread exits, release its buffer for another thread to use.
+#ifdef _MSC_VER
+static VOID NTAPI LogThreadExit(PVOID param)
+#else
+static void LogThreadExit(void *param)
+#endif
+{
+	vtLogThread *thread = (vtLogThread *) param;
+	if (!thread)
+		return;
+	if (thread->m_iGeneration == AtomicLoad(&s_iGeneration))
+		AtomicStore(&thread->m_pBuffer->m_iOwned, 0);
+	delete thread;
 }
 
-void vtLog::StartLog(const char *fname)
+#ifdef _MSC_VER
+static DWORD s_ThreadKey = FLS_OUT_OF_INDEXES;
+static vtLogThread *GetLogThread() { return (vtLogThread *) FlsGetValue(s_ThreadKey); }
+static void SetLogThread(vtLogThread *thread) { FlsSetValue(s_ThreadKey, thread); }
+static DWORD WINAPI LogThreadFunc(LPVOID param)
 {
-	m_log = vtFileOpen(fname, "wb");
+	((vtLogWriter *) param)->Run();
+	return 0;
 }
+#else
+static pthread_key_t s_ThreadKey;
+static pthread_once_t s_ThreadKeyOnce = PTHREAD_ONCE_INIT;
+static void MakeThreadKey() { pthread_key_create(&s_ThreadKey, LogThreadExit); }
+static vtLogThread *GetLogThread() { return (vtLogThread *) pthread_getspecific(s_ThreadKey); }
+static void SetLogThread(vtLogThread *thread) { pthread_setspecific(s_ThreadKey, thread); }
+static void *LogThreadFunc(void *param)
+{
+	((vtLogWriter *) param)->Run();
+	return NULL;
+}
+#endif
 
-void vtLog::Log(const char *msg)
+vtLogWriter::vtLogWriter(FILE *fp, unsigned int iRecentSize, bool bSync)
+{
+	m_fp = fp;
+	m_bThread = false;
+	m_bSync = bSync;
+	m_iStop = 0;
+	m_iSleeping = 0;
+	m_iSequence = 0;
+	m_pBuffers = NULL;
+	m_Recent.resize(iRecentSize);
+	m_iRecentPos = 0;
+	m_bRecentWrapped = false;
+
+	// The log is started and stopped by one thread, so these need no care
+	m_iGeneration = ++s_iGenerations;
+	AtomicStore(&s_iGeneration, m_iGeneration);
+#ifdef _MSC_VER
+	if (s_ThreadKey == FLS_OUT_OF_INDEXES)
+		s_ThreadKey = FlsAlloc(LogThreadExit);
+	m_Event = CreateEvent(NULL, FALSE, FALSE, NULL);
+#else
+	pthread_once(&s_ThreadKeyOnce, MakeThreadKey);
+	if (pipe(m_Pipe) != 0)
+		m_Pipe[0] = m_Pipe[1] = -1;
+#endif
+}
+
+vtLogWriter::~vtLogWriter()
 {
-	if (m_log)
+	StopThread();
+	AtomicStore(&s_iGeneration, 0);
+	if (m_fp)
+		fclose(m_fp);
+#ifdef _MSC_VER
+	if (m_Event)
+		CloseHandle(m_Event);
+#else
+	if (m_Pipe[0] != -1)
 	{
-		fputs(msg, m_log);
-		fflush(m_log);
+		close(m_Pipe[0]);
+		close(m_Pipe[1]);
 	}
+#endif
+	vtLogBuffer *buf = (vtLogBuffer *) m_pBuffers;
+	while (buf)
+	{
+		vtLogBuffer *next = buf->m_pNext;
+		delete buf;
+		buf = next;
+	}
+}
+
+// Wake the writing thread, which may or may not be waiting.
+void vtLogWriter::Signal()
+{
+#ifdef _MSC_VER
+	SetEvent(m_Event);
+#else
+	const char ch = 0;
+	if (write(m_Pipe[1], &ch, 1) < 0)
+		return;
+#endif
+}
+
+void vtLogWriter::WaitForSignal()
+{
+#ifdef _MSC_VER
+	WaitForSingleObject(m_Event, INFINITE);
+#else
+	char ch[64];
+	if (read(m_Pipe[0], ch, sizeof(ch)) < 0)
+		Nap();
+#endif
+}
+
+// Wake the writing thread, only if it is asleep.  The barrier makes sure
+//  the thread either sees what was just queued, or is woken.
+void vtLogWriter::Wake()
+{
+	FullBarrier();
+	if (AtomicExchange(&m_iSleeping, 0) != 0)
+		Signal();
+}
+
+bool vtLogWriter::StartThread()
+{
+#ifdef _MSC_VER
+	if (!m_Event || s_ThreadKey == FLS_OUT_OF_INDEXES)
+		return false;
+	m_Thread = CreateThread(NULL, 0, LogThreadFunc, this, 0, NULL);
+	m_bThread = (m_Thread != NULL);
+#else
+	if (m_Pipe[0] == -1)
+		return false;
+	m_bThread = (pthread_create(&m_Thread, NULL, LogThreadFunc, this) == 0);
+#endif
+	return m_bThread;
+}
+
+// Write everything which is waiting, then stop the thread.
+void vtLogWriter::StopThread()
+{
+	if (!m_bThread)
+		return;
+	AtomicStore(&m_iStop, 1);
+	Signal();
 #ifdef _MSC_VER
-	OutputDebugStringA(msg);
+	WaitForSingleObject(m_Thread, INFINITE);
+	CloseHandle(m_Thread);
+#else
+	pthread_join(m_Thread, NULL);
+#endif
+	m_bThread = false;
+}
+
+// The buffer of the calling thread, which is made the first time it logs.
+vtLogBuffer *vtLogWriter::GetBuffer()
+{
+	vtLogThread *thread = GetLogThread();
+	if (thread && thread->m_iGeneration == m_iGeneration)
+		return thread->m_pBuffer;
+	if (!thread)
+	{
+		thread = new vtLogThread;
+		SetLogThread(thread);
+	}
+
+	// Claim the buffer of a thread which has exited, or add a new one
+	vtLogBuffer *buf;
+	for (buf = (vtLogBuffer *) AtomicLoad(&m_pBuffers); buf; buf = buf->m_pNext)
+	{
+		if (AtomicClaim(&buf->m_iOwned))
+			break;
+	}
+	if (!buf)
+	{
+		buf = new vtLogBuffer;
+		do
+			buf->m_pNext = (vtLogBuffer *) AtomicLoad(&m_pBuffers);
+		while (!AtomicReplace(&m_pBuffers, buf->m_pNext, buf));
+	}
+	thread->m_pBuffer = buf;
+	thread->m_iGeneration = m_iGeneration;
+	return buf;
+}
+
+// True if any thread has output which the writing thread hasn't taken.
+bool vtLogWriter::HasPending() const
+{
+	for (vtLogBuffer *buf = (vtLogBuffer *) AtomicLoad((void *volatile *) &m_pBuffers);
+		buf; buf = buf->m_pNext)
+	{
+		if (AtomicLoad(&buf->m_iWrite) != buf->m_iRead)
+			return true;
+	}
+	return false;
+}
+
+// Take the output of all the threads, put it in order, and write it.
+//  Return false if there was none.
+bool vtLogWriter::Drain()
+{
+	m_Pieces.clear();
+	m_Text.clear();
+	m_Drained.clear();
+	for (vtLogBuffer *buf = (vtLogBuffer *) AtomicLoad(&m_pBuffers); buf;
+		buf = buf->m_pNext)
+	{
+		const size_t end = AtomicLoad(&buf->m_iWrite);
+		size_t pos = buf->m_iRead;
+		if (pos == end)
+			continue;
+		while (pos != end)
+		{
+			vtLogRecord rec;
+			buf->Get(pos, &rec, sizeof(rec));
+			pos += sizeof(rec);
+			Piece piece;
+			piece.seq = rec.seq;
+			piece.start = m_Text.size();
+			piece.len = rec.len;
+			m_Text.resize(piece.start + rec.len);
+			buf->Get(pos, &m_Text[piece.start], rec.len);
+			pos += rec.len;
+			m_Pieces.push_back(piece);
+		}
+		// The space can be used again as soon as it has been copied
+		AtomicStore(&buf->m_iRead, end);
+		m_Drained.push_back(std::make_pair(buf, end));
+	}
+	if (m_Pieces.empty())
+		return false;
+
+	std::stable_sort(m_Pieces.begin(), m_Pieces.end());
+	m_Batch.clear();
+	for (size_t i = 0; i < m_Pieces.size(); i++)
+		m_Batch.append(m_Text, m_Pieces[i].start, m_Pieces[i].len);
+	Output(m_Batch.c_str(), m_Batch.size());
+	Remember(m_Batch.c_str(), m_Batch.size());
+
+	for (size_t i = 0; i < m_Drained.size(); i++)
+		AtomicStore(&m_Drained[i].first->m_iWritten, m_Drained[i].second);
+	return true;
+}
+
+// The writing thread: write whatever is waiting, and sleep when there is
+//  nothing, so that logging never waits for the disk.
+void vtLogWriter::Run()
+{
+	while (true)
+	{
+		if (Drain())
+			continue;
+
+		// Say that we are going to sleep, then look once more, since a
+		//  thread may have queued output without seeing that.
+		AtomicExchange(&m_iSleeping, 1);
+		if (HasPending())
+		{
+			AtomicExchange(&m_iSleeping, 0);
+			continue;
+		}
+		if (AtomicLoad(&m_iStop))
+			break;
+		WaitForSignal();
+	}
+}
+
+// Add output to the buffer of this thread (or write it now, if there is no
+//  writing thread).
+void vtLogWriter::Queue(const char *str, size_t len)
+{
+	if (!m_bThread)
+	{
+		Output(str, len);
+		return;
+	}
+	vtLogBuffer *buf = GetBuffer();
+	const size_t size = buf->m_Data.size();
+	const size_t needed = sizeof(vtLogRecord) + len;
+	if (needed > size)
+	{
+		// Too long for the buffer, so write it directly once this thread's
+		//  earlier output is written.  It isn't kept in the recent output.
+		WaitWritten(buf, buf->m_iWrite);
+		Output(str, len);
+		return;
+	}
+
+	// If the buffer is full, wait for the writing thread to take some
+	int iWaits = 0;
+	while (size - (buf->m_iWrite - AtomicLoad(&buf->m_iRead)) < needed)
+		WaitForWriter(iWaits);
+
+	vtLogRecord rec;
+	rec.seq = AtomicIncrement(&m_iSequence);
+	rec.len = len;
+	buf->Put(buf->m_iWrite, &rec, sizeof(rec));
+	buf->Put(buf->m_iWrite + sizeof(rec), str, len);
+	AtomicStore(&buf->m_iWrite, buf->m_iWrite + needed);
+	Wake();
+	if (m_bSync)
+		WaitWritten(buf, buf->m_iWrite);
+}
+
+// Let the writing thread run, while waiting for it.  It is usually quick,
+//  so only sleep after yielding to it for a while.
+void vtLogWriter::WaitForWriter(int &iWaits)
+{
+	Wake();
+	if (iWaits++ < 200)
+		GiveWay();
+	else
+		Nap();
+}
+
+// Wait until the writing thread has written a buffer up to a position.
+void vtLogWriter::WaitWritten(vtLogBuffer *buf, size_t target)
+{
+	int iWaits = 0;
+	while (!Reached(AtomicLoad(&buf->m_iWritten), target))
+		WaitForWriter(iWaits);
+}
+
+// Wait until all the output queued so far, by every thread, is written.
+void vtLogWriter::Flush()
+{
+	if (!m_bThread)
+		return;
+	std::vector<std::pair<vtLogBuffer*, size_t> > targets;
+	for (vtLogBuffer *buf = (vtLogBuffer *) AtomicLoad(&m_pBuffers); buf;
+		buf = buf->m_pNext)
+		targets.push_back(std::make_pair(buf, AtomicLoad(&buf->m_iWrite)));
+	Wake();
+	for (size_t i = 0; i < targets.size(); i++)
+		WaitWritten(targets[i].first, targets[i].second);
+}
+
+void vtLogWriter::Output(const char *str, size_t len)
+{
+	if (m_fp)
+	{
+		fwrite(str, 1, len, m_fp);
+		fflush(m_fp);
+	}
+#ifdef _MSC_VER
+	OutputDebugStringA(str);
 #endif
 	// also send to the console, for those console-mode developers!
-	fputs(msg, stdout);
+	fwrite(str, 1, len, stdout);
 }
 
-void vtLog::Log(char ch)
+void vtLogWriter::Remember(const char *str, size_t len)
+{
+	const size_t size = m_Recent.size();
+	if (size == 0)
+		return;
+	if (len > size)
+	{
+		// Only the end of the message fits
+		str += len - size;
+		len = size;
+	}
+	const size_t first = std::min(len, size - m_iRecentPos);
+	memcpy(&m_Recent[m_iRecentPos], str, first);
+	memcpy(&m_Recent[0], str + first, len - first);
+	if (m_iRecentPos + len >= size)
+		m_bRecentWrapped = true;
+	m_iRecentPos = (m_iRecentPos + len) % size;
+}
+
+// Write the output which the threads have queued but which hasn't been
+//  taken yet, without waiting for anything.
+void vtLogWriter::DumpPending(FILE *fp) const
 {
-	if (m_log)
+	std::vector<char> text;
+	for (vtLogBuffer *buf = (vtLogBuffer *) AtomicLoad((void *volatile *) &m_pBuffers);
+		buf; buf = buf->m_pNext)
 	{
-		fputc(ch, m_log);
-		fflush(m_log);
+		const size_t end = AtomicLoad(&buf->m_iWrite);
+		for (size_t pos = AtomicLoad((volatile size_t *) &buf->m_iRead); pos != end; )
+		{
+			vtLogRecord rec;
+			buf->Get(pos, &rec, sizeof(rec));
+			if (rec.len > buf->m_Data.size())
+				break;
+			text.resize(rec.len + 1);
+			buf->Get(pos + sizeof(rec), &text[0], rec.len);
+			fwrite(&text[0], 1, rec.len, fp);
+			pos += sizeof(rec) + rec.len;
+		}
 	}
+}
+
+
+/////////////////////////////////////////////////////////////////////////////
+// vtLog
+
+vtLog::vtLog()
+{
+	m_pWriter = NULL;
+	m_Level = VTLOG_LEVEL_INFO;
+	m_iRecentSize = LOG_RECENT_SIZE;
+	m_iModules = 0;
+}
+
+vtLog::~vtLog()
+{
+	StopLog();
+}
+
+/**
+ * Start logging to a file.
+ *
+ * \param fname The name of the log file.
+ * \param bAsync If true (the default), logging doesn't wait for the
+ *		background thread to write the log to the disk.  Otherwise each
+ *		message is written and flushed before returning.
+ */
+void vtLog::StartLog(const char *fname, bool bAsync)
+{
+	StopLog();
+	m_pWriter = new vtLogWriter(vtFileOpen(fname, "wb"), m_iRecentSize, !bAsync);
+	m_pWriter->StartThread();
+}
+
+/**
+ * Write any output which is still waiting, and close the log file.  The
+ * log is also stopped when the program exits.
+ */
+void vtLog::StopLog()
+{
+	delete m_pWriter;
+	m_pWriter = NULL;
+}
+
+/**
+ * Wait until all the messages so far have been written to the file.
+ */
+void vtLog::Flush()
+{
+	if (m_pWriter)
+		m_pWriter->Flush();
+}
+
+void vtLog::Write(const char *str, size_t len)
+{
+	if (m_pWriter)
+		m_pWriter->Queue(str, len);
+	else
+	{
+		// The log has not started, so there is only the console
 #ifdef _MSC_VER
+		OutputDebugStringA(str);
+#endif
+		fwrite(str, 1, len, stdout);
+	}
+}
+
+void vtLog::Log(const char *msg)
+{
+	if (IsEnabled(VTLOG_LEVEL_INFO))
+		Write(msg, strlen(msg));
+}
+
+void vtLog::Log(char ch)
+{
 	char str[2];
 	str[0] = ch;
 	str[1] = 0;
-	OutputDebugStringA(str);
-#endif
-	// also send to the console, for those console-mode developers!
-	fputc(ch, stdout);
+	Log(str);
 }
 
+// Format a message into a buffer, and log it.
+#define LOG_FORMATTED(pFormat) \
+	{ \
+		va_list va; \
+		va_start(va, pFormat); \
+		char ach[LOG_MESSAGE_SIZE]; \
+		int len = vsnprintf(ach, LOG_MESSAGE_SIZE, pFormat, va); \
+		va_end(va); \
+		if (len < 0 || len >= LOG_MESSAGE_SIZE) \
+		{ \
+			/* The message was truncated */ \
+			len = LOG_MESSAGE_SIZE - 1; \
+			ach[len] = 0; \
+		} \
+		Write(ach, len); \
+	}
+
 void vtLog::Printf(const char *pFormat, ...)
 {
-	va_list va;
-	va_start(va, pFormat);
+	if (IsEnabled(VTLOG_LEVEL_INFO))
+		LOG_FORMATTED(pFormat)
+}
 
-	char ach[2048];
-	vsprintf(ach, pFormat, va);
+/**
+ * Log a debug message, from a named module.  Use the macro VTLOG_DEBUG,
+ * so that release builds do not contain the call at all.
+ */
+void vtLog::Debug(const char *module, const char *pFormat, ...)
+{
+	if (IsEnabled(VTLOG_LEVEL_DEBUG, module))
+		LOG_FORMATTED(pFormat)
+}
 
-	Log(ach);
+/**
+ * Log a warning, from a named module.
+ */
+void vtLog::Warning(const char *module, const char *pFormat, ...)
+{
+	if (IsEnabled(VTLOG_LEVEL_WARNING, module))
+		LOG_FORMATTED(pFormat)
+}
+
+/**
+ * Log an error, from a named module.  Unlike other messages, this doesn't
+ * return until the message is written, so that it is not lost if the
+ * program then crashes.
+ */
+void vtLog::Error(const char *module, const char *pFormat, ...)
+{
+	if (IsEnabled(VTLOG_LEVEL_ERROR, module))
+	{
+		LOG_FORMATTED(pFormat)
+		Flush();
+	}
+}
+
+/**
+ * Set the lowest level of message which is logged for one module, which
+ * overrides the level set with SetLevel.  Set the levels before logging
+ * from other threads.
+ */
+void vtLog::SetModuleLevel(const char *module, vtLogLevel level)
+{
+	int i;
+	for (i = 0; i < m_iModules; i++)
+	{
+		if (!strcmp(m_Modules[i].name, module))
+			break;
+	}
+	if (i == m_iModules)
+	{
+		if (m_iModules == MAX_MODULES)
+			return;
+		strncpy(m_Modules[i].name, module, MAX_MODULE_NAME - 1);
+		m_Modules[i].name[MAX_MODULE_NAME - 1] = 0;
+		m_iModules++;
+	}
+	m_Modules[i].level = level;
+}
+
+/**
+ * Return true if a message of the given level, from the given module (or
+ * NULL for none), would be logged.
+ */
+bool vtLog::IsEnabled(vtLogLevel level, const char *module) const
+{
+	if (module)
+	{
+		for (int i = 0; i < m_iModules; i++)
+		{
+			if (!strcmp(m_Modules[i].name, module))
+				return level >= m_Modules[i].level;
+		}
+	}
+	return level >= m_Level;
+}
+
+/**
+ * Set how much of the most recent output to keep in memory, in bytes.
+ * This takes effect the next time the log is started.
+ */
+void vtLog::SetRecentSize(unsigned int bytes)
+{
+	m_iRecentSize = bytes;
+}
+
+/**
+ * Write the most recent output to a file, followed by any output which is
+ * still waiting to be written.  This is meant for a crash handler, so it
+ * does not wait for anything.
+ */
+void vtLog::DumpRecent(FILE *fp) const
+{
+	if (!m_pWriter)
+		return;
+	const std::vector<char> &recent = m_pWriter->m_Recent;
+	const size_t pos = m_pWriter->m_iRecentPos;
+	if (m_pWriter->m_bRecentWrapped)
+		fwrite(&recent[pos], 1, recent.size() - pos, fp);
+	if (pos > 0)
+		fwrite(&recent[0], 1, pos, fp);
+	m_pWriter->DumpPending(fp);
+	fflush(fp);
 }
 
 
@@ -87,43 +814,34 @@ void vtLog::Printf(const char *pFormat, ...)
 
 void vtLog::Log(const wchar_t *msg)
 {
+	if (!IsEnabled(VTLOG_LEVEL_INFO))
+		return;
+
+	// it is not so useful to write wide characters to the file, which
+	// otherwise contains 8-bit text, so convert back first
 	wstring2 str = msg;
 	const char *mbstr = str.mb_str();
-	if (m_log)
-	{
-		// it is not so useful to write wide characters to the file, which
-		// otherwise contains 8-bit text, so convert back first
-//		fputws(msg, m_log);
-		fputs(mbstr, m_log);
-		fflush(m_log);
-	}
-	// also send to the console, for those console-mode developers!
-	fputs(mbstr, stdout);
-
-#ifdef _MSC_VER
-	// We can pass a wide string, but unfortunately it may not display right.
-	// MSDN says: "OutputDebugStringW converts the specified string based on
-	//  the current system locale information and passes it to
-	//  OutputDebugStringA to be displayed. As a result, some Unicode
-	//  characters may not be displayed correctly."
-	OutputDebugStringW(msg);
-#endif
+	Write(mbstr, strlen(mbstr));
 }
 
 void vtLog::Printf(const wchar_t *pFormat, ...)
 {
+	if (!IsEnabled(VTLOG_LEVEL_INFO))
+		return;
+
 	va_list va;
 	va_start(va, pFormat);
 
 	// Use wide characters
-	wchar_t ach[2048];
+	wchar_t ach[LOG_MESSAGE_SIZE];
 
 #if defined(_MSC_VER) && _MSC_VER < 1300
 	vswprintf(ach, pFormat, va);
 #else
 	// on MSVC7.x and non-MSVC platforms this takes 4 arguments (safer)
-	vswprintf(ach, 2048, pFormat, va);
+	vswprintf(ach, LOG_MESSAGE_SIZE, pFormat, va);
 #endif
+	va_end(va);
 
 	Log(ach);
 }
@@ -12,6 +12,28 @@
 #include "config_vtdata.h"
 #include <stdio.h>
 
+/// The severity of a log message.
+enum vtLogLevel
+{
+	VTLOG_LEVEL_DEBUG,
+	VTLOG_LEVEL_INFO,
+	VTLOG_LEVEL_WARNING,
+	VTLOG_LEVEL_ERROR,
+	VTLOG_LEVEL_NONE
+};
+
+// Messages below this level are removed at compile time.  Debug messages are
+//  only compiled into debug builds, unless you define this yourself.
+#ifndef VTLOG_COMPILED_LEVEL
+  #if VTDEBUG || defined(_DEBUG)
+	#define VTLOG_COMPILED_LEVEL VTLOG_LEVEL_DEBUG
+  #else
+	#define VTLOG_COMPILED_LEVEL VTLOG_LEVEL_INFO
+  #endif
+#endif
+
+struct vtLogWriter;
+
 /**
  * This class provide a convenient way to log all the messages that your
  * application generates.  Everything logged will be saved to a file,
@@ -33,8 +55,27 @@
 	VTLOG1("Program starting.\n");
 	\endcode
  *
- * That's it.  The file will be flushed immediately after every write, so
- * that log output will not be lost even if your application crashes.
+ * Logging does not wait for the disk, or for other threads: each thread
+ * queues its messages in a buffer of its own, without locking, and a
+ * background thread writes them to the file and the console in the order
+ * they were logged.  Messages from VTLOG_ERROR
+ * are written before it returns, so they are not lost if the application
+ * then crashes.  The most recent output is also kept in memory, and a crash
+ * handler can save it with DumpRecent.
+ *
+ * Each message has a severity level (VTLOG and VTLOG1 are
+ * VTLOG_LEVEL_INFO), and may name the part of the program it comes from.
+ * Messages can be filtered by level, for all modules with SetLevel, or for
+ * one module with SetModuleLevel.  Filtered messages are not formatted at
+ * all.  Debug messages are compiled out of release builds entirely; see
+ * VTLOG_COMPILED_LEVEL.
+ *
+ * \par Example:
+	\code
+	g_Log.SetModuleLevel("Paging", VTLOG_LEVEL_DEBUG);
+	VTLOG_DEBUG("Paging", "Loaded tile %d, %d\n", col, row);
+	VTLOG_WARNING("Culture", "Couldn't find texture '%s'\n", fname);
+	\endcode
  */
 class vtLog
 {
@@ -42,18 +83,48 @@ public:
 	vtLog();
 	~vtLog();
 
-	void StartLog(const char *fname);
+	void StartLog(const char *fname, bool bAsync = true);
+	void StopLog();
+	void Flush();
+
 	void Log(const char *str);
 	void Log(char ch);
 	void Printf(const char *pFormat, ...);
 
+	void Debug(const char *module, const char *pFormat, ...);
+	void Warning(const char *module, const char *pFormat, ...);
+	void Error(const char *module, const char *pFormat, ...);
+
+	/// Set the lowest level of message which is logged, for modules which don't have their own.
+	void SetLevel(vtLogLevel level) { m_Level = level; }
+	vtLogLevel GetLevel() const { return m_Level; }
+	void SetModuleLevel(const char *module, vtLogLevel level);
+	bool IsEnabled(vtLogLevel level, const char *module = NULL) const;
+
+	void SetRecentSize(unsigned int bytes);
+	void DumpRecent(FILE *fp) const;
+
 #if SUPPORT_WSTRING
 	void Log(const wchar_t *str);
 	void Printf(const wchar_t *pFormat, ...);
 #endif
 
 private:
-	FILE *m_log;
+	void Write(const char *str, size_t len);
+
+	vtLogWriter *m_pWriter;
+	vtLogLevel m_Level;
+	unsigned int m_iRecentSize;
+
+	// Levels set for modules, which are few, so a small array is enough
+	enum { MAX_MODULES = 32, MAX_MODULE_NAME = 32 };
+	struct ModuleLevel
+	{
+		char name[MAX_MODULE_NAME];
+		vtLogLevel level;
+	};
+	ModuleLevel m_Modules[MAX_MODULES];
+	int m_iModules;
 };
 
 extern vtLog g_Log;
@@ -61,5 +132,11 @@ extern vtLog g_Log;
 #define VTLOG		g_Log.Printf
 #define VTLOG1		g_Log.Log		// for simple strings, takes 1 argument
 
+// Log a message with a level, e.g. VTLOG_WARNING("Paging", "%d tiles\n", n).
+//  Below VTLOG_COMPILED_LEVEL, the call is removed by the compiler.
+#define VTLOG_DEBUG		if (VTLOG_LEVEL_DEBUG < VTLOG_COMPILED_LEVEL) {} else g_Log.Debug
+#define VTLOG_WARNING	if (VTLOG_LEVEL_WARNING < VTLOG_COMPILED_LEVEL) {} else g_Log.Warning
+#define VTLOG_ERROR		g_Log.Error
+
 #endif // VTLOG_H
 
@@ -7,7 +7,9 @@
 // Free for all uses, see license.txt for details.
 //
 
+#include <float.h>
 #include "vtTin.h"
+#include "TinFile.h"
 #include "vtLog.h"
 #include "DxfParser.h"
 #include "FilePath.h"
@@ -16,7 +18,7 @@
 
 vtTin::vtTin()
 {
-	m_trianglebins = NULL;
+	m_iBinCols = m_iBinRows = 0;
 }
 
 vtTin::~vtTin()
@@ -40,6 +42,8 @@ void vtTin::AddVert(const DPoint2 &p, float z, FPoint3 &normal)
 
 void vtTin::AddTri(int i1, int i2, int i3, int surface_type)
 {
+	if (HasTriangleBins())
+		FreeTriangleBins();
 	m_tri.Append(i1);
 	m_tri.Append(i2);
 	m_tri.Append(i3);
@@ -52,6 +56,7 @@ void vtTin::RemVert(int v)
 	// safety check
 	if (v < 0 || v >= (int) m_vert.GetSize())
 		return;
+	FreeTriangleBins();
 	m_vert.RemoveAt(v);
 	m_z.RemoveAt(v);
 	m_vert_normal.RemoveAt(v);
@@ -80,6 +85,7 @@ void vtTin::RemTri(int t)
 	// safety check
 	if (t < 0 || t >= (int) m_tri.GetSize())
 		return;
+	FreeTriangleBins();
 	m_tri.RemoveAt(t*3, 3);
 }
 
@@ -120,95 +126,54 @@ bool vtTin::_ReadTinOld(FILE *fp)
 	return true;
 }
 
-bool vtTin::_ReadTin(FILE *fp)
+bool vtTin::_ReadTinHeader(const vtTinFile &file)
 {
-	if (!_ReadTinHeader(fp))
-		return false;
-	if (!_ReadTinBody(fp))
-		return false;
-	return true;
-}
-
-bool vtTin::_ReadTinHeader(FILE *fp)
-{
-	int proj_len;
-
-	char marker[5];
-	fread(marker, 5, 1, fp);
-	if (strncmp(marker, "tin", 3))
-		return false;	// Not a Tin
-	int version = marker[4] - '0';
-
-	fread(&m_file_verts, 4, 1, fp);
-	fread(&m_file_tris, 4, 1, fp);
-	fread(&m_file_data_start, 4, 1, fp);
-	fread(&proj_len, 4, 1, fp);
-	if (proj_len > 2000)
-		return false;
-
-	if (proj_len)
+	if (file.HasProjection())
+		m_proj = file.GetProjection();
+	if (file.HasExtents())
 	{
-		char wkt_buf[2000], *wkt = wkt_buf;
-		fread(wkt, proj_len, 1, fp);
-		wkt_buf[proj_len] = 0;
-
-		OGRErr err = m_proj.importFromWkt((char **) &wkt);
-		if (err != OGRERR_NONE)
-			return false;
+		m_EarthExtents = file.GetEarthExtents();
+		file.GetHeightExtents(m_fMinHeight, m_fMaxHeight);
 	}
-
-	if (version > 1)
-	{
-		// version 2 of the format has extents: left, top, right, bottom, min z, max h
-		fread(&m_EarthExtents.left, sizeof(double), 4, fp);
-		fread(&m_fMinHeight, sizeof(float), 1, fp);
-		fread(&m_fMaxHeight, sizeof(float), 1, fp);
-	}
-
+	m_file_verts = file.NumVerts();
+	m_file_tris = file.NumTris();
 	return true;
 }
 
-bool vtTin::_ReadTinBody(FILE *fp)
+bool vtTin::_ReadTinBody(const vtTinFile &file)
 {
-	fseek(fp, m_file_data_start, SEEK_SET);
-
-	// pre-allocate for efficiency
-	m_vert.SetMaxSize(m_file_verts);
-	m_tri.SetMaxSize(m_file_tris * 3);
+	const int verts = file.NumVerts();
+	const int tris = file.NumTris();
+
+	// The vertices are interleaved in the file, so they must be unpacked
+	m_vert.SetSize(verts);
+	m_z.SetSize(verts);
+	DPoint2 *vert = m_vert.GetData();
+	float *z = m_z.GetData();
+#pragma omp parallel for
+	for (int i = 0; i < verts; i++)
+		file.GetVert(i, vert[i], z[i]);
 
-	// read verts
-	DPoint2 p;
-	float z;
-	for (int i = 0; i < m_file_verts; i++)
-	{
-		fread(&p.x, 8, 2, fp);	// 2 doubles
-		fread(&z, 4, 1, fp);	// 1 float
-		AddVert(p, z);
-	}
-	// read tris
-	int tribuf[3];
-	for (int i = 0; i < m_file_tris; i++)
-	{
-		fread(tribuf, 4, 3, fp);	// 3 ints
-		AddTri(tribuf[0], tribuf[1], tribuf[2]);
-	}
+	// The triangles are already in the layout we want
+	FreeTriangleBins();
+	m_tri.SetSize(tris * 3);
+	memcpy(m_tri.GetData(), file.GetTriData(), (size_t) tris * 3 * sizeof(int));
 	return true;
 }
 
 /**
  * Read the TIN from a native TIN format (.itf) file.
+ *
+ * The file is memory-mapped, so the data is copied just once, straight
+ * from the operating system's file cache into the TIN's arrays.
  */
 bool vtTin::Read(const char *fname)
 {
-	// first read the point from the .tin file
-	FILE *fp = vtFileOpen(fname, "rb");
-	if (!fp)
+	vtTinFile file;
+	if (!file.Open(fname))
 		return false;
 
-	bool success = _ReadTin(fp);
-	fclose(fp);
-
-	if (!success)
+	if (!_ReadTinHeader(file) || !_ReadTinBody(file))
 		return false;
 
 	ComputeExtents();
@@ -222,18 +187,11 @@ bool vtTin::Read(const char *fname)
  */
 bool vtTin::ReadHeader(const char *fname)
 {
-	// first read the point from the .tin file
-	FILE *fp = vtFileOpen(fname, "rb");
-	if (!fp)
-		return false;
-
-	bool success = _ReadTinHeader(fp);
-	fclose(fp);
-
-	if (!success)
+	vtTinFile file;
+	if (!file.Open(fname))
 		return false;
 
-	return true;
+	return _ReadTinHeader(file);
 }
 
 /**
@@ -242,18 +200,11 @@ bool vtTin::ReadHeader(const char *fname)
  */
 bool vtTin::ReadBody(const char *fname)
 {
-	// first read the point from the .tin file
-	FILE *fp = vtFileOpen(fname, "rb");
-	if (!fp)
-		return false;
-
-	bool success = _ReadTinBody(fp);
-	fclose(fp);
-
-	if (!success)
+	vtTinFile file;
+	if (!file.Open(fname))
 		return false;
 
-	return true;
+	return _ReadTinBody(file);
 }
 
 /**
@@ -1098,11 +1049,7 @@ void vtTin::FreeData()
 	m_tri.FreeData();
 
 	// The bins must be cleared when the triangles are freed
-	if (m_trianglebins)
-	{
-		delete m_trianglebins;
-		m_trianglebins = NULL;
-	}
+	FreeTriangleBins();
 }
 
 /**
@@ -1169,11 +1116,19 @@ bool vtTin::Write(const char *fname, bool progress_callback(int)) const
 	return true;
 }
 
+/**
+ * Compute the extents of the TIN, and set up the bins which speed up height
+ * and ray testing (see SetupTriangleBins).  This is done automatically when
+ * a TIN is read; call it again after changing the vertices or triangles.
+ */
 bool vtTin::ComputeExtents()
 {
 	const int size = NumVerts();
 	if (size == 0)
+	{
+		FreeTriangleBins();
 		return false;
+	}
 
 	m_EarthExtents.SetRect(1E9, -1E9, -1E9, 1E9);
 	m_fMinHeight = 1E9;
@@ -1189,6 +1144,7 @@ bool vtTin::ComputeExtents()
 		if (z < m_fMinHeight)
 			m_fMinHeight = z;
 	}
+	SetupTriangleBins();
 	return true;
 }
 
@@ -1247,66 +1203,122 @@ bool vtTin::TestTriangle(int tri, const DPoint2 &p, float &fAltitude) const
 	return false;
 }
 
+// When the number of bins is chosen automatically, aim for this many
+//  triangles in each bin.
+#define TRIS_PER_BIN	8
+
+// Limit on the number of bins in each direction
+#define MAX_BINS		8192
+
+// The bin which contains a coordinate, clamped to the grid of bins.
+static inline int BinOf(double value, double origin, double size, int bins)
+{
+	const int bin = (int) floor((value - origin) / size);
+	return bin < 0 ? 0 : (bin >= bins ? bins - 1 : bin);
+}
+
 /**
- * If you are going to do a large number of height-testing of this TIN
- * (with FindAltitudeOnEarth), call this method once first to set up a
- * series of indexing bins which greatly speed up testing.
+ * Set up a grid of bins which index the triangles, and greatly speed up
+ * height testing (FindAltitudeOnEarth) and ray testing (CastRayToSurface).
+ * This is done automatically by ComputeExtents, so it is usually not
+ * necessary to call this method yourself.
+ *
+ * The bins are packed in two flat arrays, the start of each bin and the
+ * triangles in all the bins, so they take little memory: about 4 bytes for
+ * each bin, and 4 bytes for each triangle in each bin it overlaps.
  *
  * \param bins Number of bins per dimension, e.g. a value of 50 produces
- *		50*50=2500 bins.  More bins produces faster height-testing with
- *		the only tradeoff being a small amount of RAM per bin.
+ *		50*50=2500 bins.  If 0, the number of bins is chosen to suit the
+ *		number of triangles and the shape of the extents.
  * \param progress_callback If supplied, this function will be called back
  *		with a value of 0 to 100 as the operation progresses.
  */
 void vtTin::SetupTriangleBins(int bins, bool progress_callback(int))
 {
-	DRECT rect = m_EarthExtents;
-	m_BinSize.x = rect.Width() / bins;
-	m_BinSize.y = rect.Height() / bins;
+	FreeTriangleBins();
 
-	if (m_trianglebins)
-		delete m_trianglebins;
-	m_trianglebins = new BinArray(bins, bins);
+	const int tris = NumTris();
+	const DRECT &rect = m_EarthExtents;
+	if (tris == 0 || rect.Width() < 0 || rect.Height() < 0)
+		return;
 
-	DPoint2 p1, p2, p3;
-	uint tris = NumTris();
-	for (uint i = 0; i < tris; i++)
+	if (bins > 0)
+		m_iBinCols = m_iBinRows = bins;
+	else
 	{
-		if ((i%100)==0 && progress_callback)
-			progress_callback(i * 100 / tris);
-
-		// get 2D points
-		p1 = m_vert.GetAt(m_tri[i*3]);
-		p2 = m_vert.GetAt(m_tri[i*3+1]);
-		p3 = m_vert.GetAt(m_tri[i*3+2]);
-
-		// find the correct range of bins, and add the index of this index to it
-		DPoint2 fminrange, fmaxrange;
-
-		fminrange.x = std::min(std::min(p1.x, p2.x), p3.x);
-		fmaxrange.x = std::max(std::max(p1.x, p2.x), p3.x);
-
-		fminrange.y = std::min(std::min(p1.y, p2.y), p3.y);
-		fmaxrange.y = std::max(std::max(p1.y, p2.y), p3.y);
-
-		IPoint2 bin_start, bin_end;
+		// Roughly square bins, with a few triangles in each
+		const double target = (double) tris / TRIS_PER_BIN;
+		const double aspect = (rect.Height() > 0) ? rect.Width() / rect.Height() : 1.0;
+		m_iBinCols = (int) sqrt(target * aspect);
+		m_iBinCols = std::min(std::max(m_iBinCols, 1), MAX_BINS);
+		m_iBinRows = (int) (target / m_iBinCols);
+		m_iBinRows = std::min(std::max(m_iBinRows, 1), MAX_BINS);
+	}
+	m_BinSize.x = (rect.Width() > 0) ? rect.Width() / m_iBinCols : 1.0;
+	m_BinSize.y = (rect.Height() > 0) ? rect.Height() / m_iBinRows : 1.0;
+
+	// Each triangle goes into every bin which its bounding box touches.
+	//  First count the triangles in each bin, then fill them in.
+	const int num_bins = m_iBinCols * m_iBinRows;
+	m_BinStart.assign(num_bins + 1, 0);
+	std::vector<int> next;
+	for (int pass = 0; pass < 2; pass++)
+	{
+		for (int i = 0; i < tris; i++)
+		{
+			if ((i%1000)==0 && progress_callback)
+				progress_callback(pass * 50 + i * 50 / tris);
 
-		bin_start.x = (uint) ((fminrange.x-rect.left) / m_BinSize.x);
-		bin_end.x = (uint)	 ((fmaxrange.x-rect.left) / m_BinSize.x);
+			const DPoint2 &p1 = m_vert.GetAt(m_tri[i*3]);
+			const DPoint2 &p2 = m_vert.GetAt(m_tri[i*3+1]);
+			const DPoint2 &p3 = m_vert.GetAt(m_tri[i*3+2]);
 
-		bin_start.y = (uint) ((fminrange.y-rect.bottom) / m_BinSize.y);
-		bin_end.y = (uint)	 ((fmaxrange.y-rect.bottom) / m_BinSize.y);
+			const int x0 = BinOf(std::min(std::min(p1.x, p2.x), p3.x), rect.left, m_BinSize.x, m_iBinCols);
+			const int x1 = BinOf(std::max(std::max(p1.x, p2.x), p3.x), rect.left, m_BinSize.x, m_iBinCols);
+			const int y0 = BinOf(std::min(std::min(p1.y, p2.y), p3.y), rect.bottom, m_BinSize.y, m_iBinRows);
+			const int y1 = BinOf(std::max(std::max(p1.y, p2.y), p3.y), rect.bottom, m_BinSize.y, m_iBinRows);
 
-		for (int j = bin_start.x; j <= bin_end.x; j++)
-		{
-			for (int k = bin_start.y; k <= bin_end.y; k++)
+			for (int k = y0; k <= y1; k++)
 			{
-				Bin *bin = m_trianglebins->GetBin(j, k);
-				if (bin)
-					bin->Append(i);
+				for (int j = x0; j <= x1; j++)
+				{
+					const int b = k * m_iBinCols + j;
+					if (pass == 0)
+						m_BinStart[b+1]++;
+					else
+						m_BinTris[next[b]++] = i;
+				}
 			}
 		}
+		if (pass == 0)
+		{
+			for (int b = 0; b < num_bins; b++)
+				m_BinStart[b+1] += m_BinStart[b];
+			m_BinTris.resize(m_BinStart[num_bins]);
+			next.assign(m_BinStart.begin(), m_BinStart.end() - 1);
+		}
 	}
+	VTLOG("SetupTriangleBins: %d x %d bins, %d entries, %d KB\n", m_iBinCols,
+		m_iBinRows, (int) m_BinTris.size(), (int) (MemoryUsedByBins() / 1024));
+}
+
+/**
+ * Free the bins made by SetupTriangleBins.  Height and ray testing still
+ * work, but must test every triangle.
+ */
+void vtTin::FreeTriangleBins()
+{
+	m_iBinCols = m_iBinRows = 0;
+	m_BinStart.clear();
+	m_BinTris.clear();
+}
+
+/**
+ * The number of bytes of memory used by the triangle bins.
+ */
+size_t vtTin::MemoryUsedByBins() const
+{
+	return (m_BinStart.capacity() + m_BinTris.capacity()) * sizeof(int);
 }
 
 int vtTin::MemoryNeededToLoad() const
@@ -1319,32 +1331,40 @@ int vtTin::MemoryNeededToLoad() const
 
 bool vtTin::FindAltitudeOnEarth(const DPoint2 &p, float &fAltitude, bool bTrue) const
 {
-	uint tris = NumTris();
+	return (FindTriangleOnEarth(p, fAltitude) != -1);
+}
 
+/**
+ * Find the triangle which contains a 2D point, and the altitude there.
+ * \return The index of the triangle, or -1 if the point is not on the TIN.
+ */
+int vtTin::FindTriangleOnEarth(const DPoint2 &p, float &fAltitude) const
+{
 	// If we have some triangle bins, they can be used for a much faster test
-	if (m_trianglebins != NULL)
+	if (HasTriangleBins())
 	{
-		int col = (int) ((p.x - m_EarthExtents.left) / m_BinSize.x);
-		int row = (int) ((p.y - m_EarthExtents.bottom) / m_BinSize.y);
-		Bin *bin = m_trianglebins->GetBin(col, row);
-		if (!bin)
-			return false;
-
-		for (uint i = 0; i < bin->GetSize(); i++)
+		const DRECT &rect = m_EarthExtents;
+		if (p.x < rect.left || p.x > rect.right || p.y < rect.bottom || p.y > rect.top)
+			return -1;
+		const int col = BinOf(p.x, rect.left, m_BinSize.x, m_iBinCols);
+		const int row = BinOf(p.y, rect.bottom, m_BinSize.y, m_iBinRows);
+		const int b = row * m_iBinCols + col;
+		for (int i = m_BinStart[b]; i < m_BinStart[b+1]; i++)
 		{
-			if (TestTriangle(bin->GetAt(i), p, fAltitude))
-				return true;
+			if (TestTriangle(m_BinTris[i], p, fAltitude))
+				return m_BinTris[i];
 		}
 		// If it was not in any of these bins, then it did not hit anything
-		return false;
+		return -1;
 	}
 	// If no bins, we do a naive slow search.
-	for (uint i = 0; i < tris; i++)
+	const int tris = NumTris();
+	for (int i = 0; i < tris; i++)
 	{
 		if (TestTriangle(i, p, fAltitude))
-			return true;
+			return i;
 	}
-	return false;
+	return -1;
 }
 
 bool vtTin::FindAltitudeAtPoint(const FPoint3 &p3, float &fAltitude,
@@ -1357,6 +1377,184 @@ bool vtTin::FindAltitudeAtPoint(const FPoint3 &p3, float &fAltitude,
 	return FindAltitudeOnEarth(DPoint2(earth.x, earth.y), fAltitude, bTrue);
 }
 
+/**
+ * Find the altitude of many points at once.  Nearby points usually fall
+ * in the same triangle, so the triangle which contained the previous point
+ * is tested first, before searching the bins.
+ *
+ * \return The number of points which were on the TIN.
+ */
+int vtTin::FindAltitudesAtPoints(const FPoint3 *points, float *altitudes,
+	int count, bool bTrue, int iCultureFlags) const
+{
+	int found = 0;
+	int last = -1;
+	DPoint3 earth;
+	for (int n = 0; n < count; n++)
+	{
+		m_Conversion.ConvertToEarth(points[n], earth);
+		const DPoint2 p(earth.x, earth.y);
+
+		if (last != -1 && TestTriangle(last, p, altitudes[n]))
+		{
+			found++;
+			continue;
+		}
+		last = FindTriangleOnEarth(p, altitudes[n]);
+		if (last != -1)
+			found++;
+		else
+			altitudes[n] = 0.0f;
+	}
+	return found;
+}
+
+/**
+ * Test a ray against a triangle, in earth coordinates.
+ * \param t If the ray hits, the distance along it as a multiple of dir.
+ */
+bool vtTin::RayHitsTriangle(int tri, const DPoint3 &origin, const DPoint3 &dir,
+	double &t) const
+{
+	const int v0 = m_tri[tri*3], v1 = m_tri[tri*3+1], v2 = m_tri[tri*3+2];
+	const DPoint3 p0(m_vert[v0].x, m_vert[v0].y, m_z[v0]);
+	const DPoint3 edge1 = DPoint3(m_vert[v1].x, m_vert[v1].y, m_z[v1]) - p0;
+	const DPoint3 edge2 = DPoint3(m_vert[v2].x, m_vert[v2].y, m_z[v2]) - p0;
+
+	// Moller-Trumbore, accepting either side of the triangle
+	const DPoint3 pvec = dir.Cross(edge2);
+	const double det = edge1.Dot(pvec);
+	if (det == 0.0)
+		return false;
+	const double inv_det = 1.0 / det;
+
+	const DPoint3 tvec = origin - p0;
+	const double u = tvec.Dot(pvec) * inv_det;
+	if (u < 0.0 || u > 1.0)
+		return false;
+
+	const DPoint3 qvec = tvec.Cross(edge1);
+	const double v = dir.Dot(qvec) * inv_det;
+	if (v < 0.0 || u + v > 1.0)
+		return false;
+
+	t = edge2.Dot(qvec) * inv_det;
+	return (t >= 0.0);
+}
+
+/**
+ * Find the first point where a ray hits the TIN.
+ *
+ * With triangle bins (see SetupTriangleBins), only the triangles in the bins
+ * which the ray passes over are tested, in order along the ray, so the test
+ * is quick even for very large TINs.
+ *
+ * \return true if the ray hit the TIN.  The point of intersection is placed
+ *		in the 'result' argument.
+ */
+bool vtTin::CastRayToSurface(const FPoint3 &point, const FPoint3 &dir,
+	FPoint3 &result) const
+{
+	// Work in earth coordinates.  The conversion is linear on each axis, so
+	//  the distance along the ray, as a multiple of dir, is the same.
+	DPoint3 origin, edir;
+	m_Conversion.ConvertToEarth(point, origin);
+	DPoint2 e0, e1;
+	m_Conversion.ConvertToEarth(0, 0, e0);
+	m_Conversion.ConvertToEarth(dir.x, dir.z, e1);
+	edir.Set(e1.x - e0.x, e1.y - e0.y, dir.y);
+
+	double t, closest = -1;
+	if (!HasTriangleBins())
+	{
+		// Naive slow search
+		const int tris = NumTris();
+		for (int i = 0; i < tris; i++)
+		{
+			if (RayHitsTriangle(i, origin, edir, t) && (closest < 0 || t < closest))
+				closest = t;
+		}
+	}
+	else
+	{
+		// Walk through the bins under the ray, in bin coordinates
+		const DRECT &rect = m_EarthExtents;
+		const double g0[2] = { (origin.x - rect.left) / m_BinSize.x,
+							   (origin.y - rect.bottom) / m_BinSize.y };
+		const double dg[2] = { edir.x / m_BinSize.x, edir.y / m_BinSize.y };
+		const int size[2] = { m_iBinCols, m_iBinRows };
+
+		// Clip to the part of the ray which is over the bins
+		double t0 = 0, t1 = DBL_MAX;
+		for (int a = 0; a < 2; a++)
+		{
+			if (dg[a] == 0)
+			{
+				if (g0[a] < 0 || g0[a] > size[a])
+					return false;
+				continue;
+			}
+			double ta = -g0[a] / dg[a], tb = (size[a] - g0[a]) / dg[a];
+			if (ta > tb)
+				std::swap(ta, tb);
+			t0 = std::max(t0, ta);
+			t1 = std::min(t1, tb);
+		}
+		if (t0 > t1)
+			return false;
+
+		// The bin where the ray starts, and where it crosses into the next
+		//  bin along each axis
+		int cell[2], step[2];
+		double t_next[2], t_delta[2];
+		for (int a = 0; a < 2; a++)
+		{
+			const double g = g0[a] + dg[a] * t0;
+			int c = (int) floor(g);
+			if (dg[a] < 0 && c == g)
+				c--;	// on a boundary, moving into the lower bin
+			cell[a] = c < 0 ? 0 : (c >= size[a] ? size[a] - 1 : c);
+			step[a] = (dg[a] > 0) ? 1 : (dg[a] < 0 ? -1 : 0);
+			if (dg[a] > 0)
+				t_next[a] = (cell[a] + 1 - g0[a]) / dg[a];
+			else if (dg[a] < 0)
+				t_next[a] = (cell[a] - g0[a]) / dg[a];
+			else
+				t_next[a] = DBL_MAX;
+			t_delta[a] = (dg[a] != 0) ? fabs(1.0 / dg[a]) : DBL_MAX;
+		}
+		while (true)
+		{
+			const double t_exit = std::min(std::min(t_next[0], t_next[1]), t1);
+			const int b = cell[1] * m_iBinCols + cell[0];
+			for (int i = m_BinStart[b]; i < m_BinStart[b+1]; i++)
+			{
+				if (RayHitsTriangle(m_BinTris[i], origin, edir, t) &&
+					(closest < 0 || t < closest))
+					closest = t;
+			}
+			// A hit beyond this bin might not be the first; the triangles
+			//  of the bins in between must be tested first.
+			if (closest >= 0 && closest <= t_exit * (1 + 1E-9) + 1E-12)
+				break;
+			if (t_exit >= t1)
+				break;
+
+			// Step into the next bin
+			const int a = (t_next[0] < t_next[1]) ? 0 : 1;
+			cell[a] += step[a];
+			if (cell[a] < 0 || cell[a] >= size[a])
+				break;
+			t_next[a] += t_delta[a];
+		}
+	}
+	if (closest < 0)
+		return false;
+
+	result = point + dir * (float) closest;
+	return true;
+}
+
 bool vtTin::ConvertProjection(const vtProjection &proj_new)
 {
 	// Create conversion object
@@ -1375,6 +1573,9 @@ bool vtTin::ConvertProjection(const vtProjection &proj_new)
 	// adopt new projection
 	m_proj = proj_new;
 
+	// The bins are no longer valid until the extents are computed again
+	FreeTriangleBins();
+
 	return true;
 }
 
@@ -1509,193 +1710,111 @@ double vtTin::GetTriMaxEdgeLength(int iTri) const
 }
 
 
-// Number of bins used by the merge algorithm.  Time is roughly proportional
-// to N*N/BINS, where N is the number of vertices, so increase BINS for speed.
-//
-#define BINS	4000
+// Hash a vertex location, for MergeSharedVerts.  Vertices are merged only
+//  when they are exactly equal, so the hash is of the exact bits.
+static inline uint HashLocation(const DPoint2 &p)
+{
+	// Adding zero turns -0.0 into 0.0, which compares equal to it
+	const double xy[2] = { p.x + 0.0, p.y + 0.0 };
+	uint w[4];
+	memcpy(w, xy, sizeof(w));
+
+	// Mix the bits in both directions, since round coordinates have many
+	//  zero bits at the bottom.
+	uint h = 0;
+	for (int i = 0; i < 4; i++)
+	{
+		h ^= w[i];
+		h ^= h >> 16;
+		h *= 0x85ebca6bu;
+		h ^= h >> 13;
+		h *= 0xc2b2ae35u;
+		h ^= h >> 16;
+	}
+	return h;
+}
 
 /**
  * Combine all vertices which are at the same location.  By removing these
  * redundant vertices, the mesh will consume less space in memory and on disk.
+ *
+ * The vertices are put in a hash table by location, so the time is roughly
+ * proportional to the number of vertices, however they are arranged.
+ * Of each set of shared vertices, the first is kept, and the order of the
+ * remaining vertices is preserved.
  */
 void vtTin::MergeSharedVerts(bool progress_callback(int))
 {
-	uint verts = NumVerts();
-
-	uint i, j;
-	int bin;
-
-	DRECT rect = m_EarthExtents;
-	double width = rect.Width();
-
-	// make it slightly larger avoid edge condition
-	rect.left -= 0.000001;
-	width += 0.000002;
+	const int verts = NumVerts();
+	if (verts < 2)
+		return;
 
-	m_bReplace = new int[verts];
-	m_vertbin = new Bin[BINS];
-	m_tribin = new Bin[BINS];
+	// Chain the vertices into a hash table.  They are added in reverse, so
+	//  each chain is in order of increasing index.
+	uint table_size = 1;
+	while (table_size < (uint) verts * 2)
+		table_size <<= 1;
+	const uint mask = table_size - 1;
 
-	// sort the vertices into bins
+	std::vector<int> head(table_size, -1);
+	std::vector<int> next(verts);
+	std::vector<int> remap(verts);
+	int i;
+#pragma omp parallel for
 	for (i = 0; i < verts; i++)
+		remap[i] = (int) (HashLocation(m_vert[i]) & mask);
+	for (i = verts-1; i >= 0; i--)
 	{
-		// flag all vertices initially not to remove
-		m_bReplace[i] = -1;
-
-		// find the correct bin, and add the index of this vertex to it
-		bin = (int) (BINS * (m_vert[i].x - rect.left) / width);
-		m_vertbin[bin].Append(i);
-	}
-	uint trisize = m_tri.GetSize();
-	for (i = 0; i < trisize; i++)
-	{
-		// find the correct bin, and add the index of this index to it
-		bin = (int) (BINS * (m_vert[m_tri[i]].x - rect.left) / width);
-		m_tribin[bin].Append(i);
-	}
-
-	// compare within each bin, and between each adjacent bin,
-	// looking for matching vertices to flag for removal
-	for (bin = 0; bin < BINS; bin++)
-	{
-		if (progress_callback != NULL)
-			progress_callback(bin * 100 / BINS);
-
-		_CompareBins(bin, bin);
-		if (bin < BINS-1)
-			_CompareBins(bin, bin+1);
+		next[i] = head[remap[i]];
+		head[remap[i]] = i;
 	}
-	// now update each triangle index to point to the merge result
-	for (bin = 0; bin < BINS; bin++)
-	{
-		if (progress_callback != NULL)
-			progress_callback(bin * 100 / BINS);
-
-		_UpdateIndicesInInBin(bin);
-	}
-
-	// now compact the vertex bins into a single array
+	if (progress_callback != NULL)
+		progress_callback(25);
 
-	// make a copy to copy from
-	DLine2 *vertcopy = new DLine2(m_vert);
-	float *zcopy = new float[m_z.GetSize()];
-	for (i = 0; i < m_z.GetSize(); i++)
-		zcopy[i] = m_z[i];
-
-	int inew = 0;	// index into brand new array (actually re-using old)
-
-	for (bin = 0; bin < BINS; bin++)
+	// Find, for each vertex, the first vertex at the same location
+#pragma omp parallel for schedule(dynamic, 1024)
+	for (i = 0; i < verts; i++)
 	{
-		if (progress_callback != NULL)
-			progress_callback(bin * 100 / BINS);
-
-		uint binverts = m_vertbin[bin].GetSize();
-		for (i = 0; i < binverts; i++)
-		{
-			int v_old = m_vertbin[bin].GetAt(i);
-			if (m_bReplace[v_old] != -1)
-				continue;
-
-			int v_new = inew;
-
-			// copy old to new
-			m_vert[v_new] = vertcopy->GetAt(v_old);
-			m_z[v_new] = zcopy[v_old];
-
-			uint bintris = m_tribin[bin].GetSize();
-			for (j = 0; j < bintris; j++)
-			{
-				int trindx = m_tribin[bin].GetAt(j);
-				if (m_tri[trindx] == v_old)
-					m_tri[trindx] = v_new;
-			}
-			inew++;
-		}
+		int j = head[remap[i]];
+		while (j != i && m_vert[j] != m_vert[i])
+			j = next[j];
+		remap[i] = j;
 	}
+	if (progress_callback != NULL)
+		progress_callback(50);
 
-	// our original array containers now hold the compacted result
-	int newsize = inew;
-	m_vert.SetSize(newsize);
-	m_z.SetSize(newsize);
-
-	// free up all the stuff we allocated
-	delete [] m_bReplace;
-	delete [] m_vertbin;
-	delete [] m_tribin;
-	delete vertcopy;
-	delete [] zcopy;
-}
-
-void vtTin::_UpdateIndicesInInBin(int bin)
-{
-	int i, j;
-
-	int binverts = m_vertbin[bin].GetSize();
-	for (i = 0; i < binverts; i++)
+	// Compact the vertices which are kept, and find their new indices.  A
+	//  vertex only ever moves down, so this can be done in place.
+	const bool bNormals = (m_vert_normal.GetSize() == (uint) verts);
+	int inew = 0;
+	for (i = 0; i < verts; i++)
 	{
-		int v_before = m_vertbin[bin].GetAt(i);
-		int v_after = m_bReplace[v_before];
-
-		if (v_after == -1)
-			continue;
-
-		int bintris = m_tribin[bin].GetSize();
-		for (j = 0; j < bintris; j++)
+		if (remap[i] == i)
 		{
-			int trindx = m_tribin[bin].GetAt(j);
-			if (m_tri[trindx] == v_before)
-				m_tri[trindx] = v_after;
+			m_vert[inew] = m_vert[i];
+			m_z[inew] = m_z[i];
+			if (bNormals)
+				m_vert_normal[inew] = m_vert_normal[i];
+			remap[i] = inew++;
 		}
-	}
-}
-
-void vtTin::_CompareBins(int bin1, int bin2)
-{
-	int i, j;
-	int ix1, ix2;
-	int start;
-
-	int size1 = m_vertbin[bin1].GetSize();
-	int size2 = m_vertbin[bin2].GetSize();
-	for (i = 0; i < size1; i++)
-	{
-		ix1 = m_vertbin[bin1].GetAt(i);
-
-		// within a bin, we can do N*N/2 instead of N*N compares
-		// i.e. size1*size1/2, instead of size1*size2
-		if (bin1 == bin2)
-			start = i+1;
 		else
-			start = 0;
-
-		for (j = start; j < size2; j++)
-		{
-			ix2 = m_vertbin[bin2].GetAt(j);
-
-			// don't compare against itself
-			if (ix1 == ix2)
-				continue;
-
-			if (m_vert[ix1] == m_vert[ix2])
-			{
-				// ensure that one of them is flagged
-				if (m_bReplace[ix1] == -1)
-				{
-					if (m_bReplace[ix2] == -1)
-						m_bReplace[ix1] = ix2;
-					else if (m_bReplace[ix2] != ix1)
-						m_bReplace[ix1] = m_bReplace[ix2];
-				}
-				if (m_bReplace[ix2] == -1)
-				{
-					if (m_bReplace[ix1] == -1)
-						m_bReplace[ix2] = ix1;
-					else if (m_bReplace[ix1] != ix2)
-						m_bReplace[ix2] = m_bReplace[ix1];
-				}
-			}
-		}
+			remap[i] = remap[remap[i]];
 	}
+	if (progress_callback != NULL)
+		progress_callback(75);
+
+	// Point each triangle at the vertices which were kept
+	const int indices = m_tri.GetSize();
+	int *tri = m_tri.GetData();
+#pragma omp parallel for
+	for (i = 0; i < indices; i++)
+		tri[i] = remap[tri[i]];
+
+	VTLOG("MergeSharedVerts: %d vertices merged into %d\n", verts, inew);
+	m_vert.SetSize(inew);
+	m_z.SetSize(inew);
+	if (bNormals)
+		m_vert_normal.SetSize(inew);
 }
 
 /**
@@ -13,38 +13,10 @@
 #include "HeightField.h"
 #include "vtString.h"
 
-// a type useful for the Merge algorithm
-typedef vtArray<int> Bin;
+class vtTinFile;
 
-class BinArray
-{
-public:
-	BinArray(int cols, int rows) {
-		iData = new Bin[cols*rows];
-		iRows = rows;
-		iCols = cols;
-	}
-	~BinArray() {
-		delete [] iData;
-	}
-	Bin *GetBin(int col, int row)
-	{
-		if (col < 0 || col >= iCols) return NULL;
-		if (row < 0 || row >= iRows) return NULL;
-		return iData + iCols*row + col;
-	}
-	int GetMemoryUsed() const
-	{
-		int bins = iCols * iRows;
-		int bytes = sizeof(BinArray) + sizeof(Bin*) * bins;
-		for (int i = 0; i < bins; i++)
-			bytes += (sizeof(int) * iData[i].GetSize());
-		return bytes;
-	}
-private:
-	Bin *iData;
-	int	iCols, iRows;
-};
+// a list of indices, used when dividing a TIN into pieces
+typedef vtArray<int> Bin;
 
 /**
  * This class represents a TIN, a 'triangulated irregular network'.  A TIN
@@ -108,10 +80,11 @@ public:
 		bool bTrue = false) const;
 	virtual bool FindAltitudeAtPoint(const FPoint3 &p3, float &fAltitude,
 		bool bTrue = false, int iCultureFlags=0, FPoint3 *vNormal = NULL) const;
+	virtual int FindAltitudesAtPoints(const FPoint3 *points, float *altitudes,
+		int count, bool bTrue = false, int iCultureFlags = 0) const;
 
-	// Avoid implementing HeightField3d virtual methods
-	bool CastRayToSurface(const FPoint3 &point, const FPoint3 &dir,
-		FPoint3 &result) const { return false; }
+	virtual bool CastRayToSurface(const FPoint3 &point, const FPoint3 &dir,
+		FPoint3 &result) const;
 
 	void CleanupClockwisdom();
 	int RemoveUnusedVertices();
@@ -120,21 +93,23 @@ public:
 	void MergeSharedVerts(bool progress_callback(int) = NULL);
 	bool HasVertexNormals() const { return m_vert_normal.GetSize() != 0; }
 	int RemoveTrianglesBySegment(const DPoint2 &ep1, const DPoint2 &ep2);
-	void SetupTriangleBins(int bins, bool progress_callback(int) = NULL);
+	void SetupTriangleBins(int bins = 0, bool progress_callback(int) = NULL);
+	void FreeTriangleBins();
+	bool HasTriangleBins() const { return !m_BinStart.empty(); }
+	size_t MemoryUsedByBins() const;
 	int MemoryNeededToLoad() const;
 
 	vtProjection	m_proj;
 
 protected:
 	bool TestTriangle(int tri, const DPoint2 &p, float &fAltitude) const;
-	bool _ReadTin(FILE *fp);
-	bool _ReadTinHeader(FILE *fp);
-	bool _ReadTinBody(FILE *fp);
+	int FindTriangleOnEarth(const DPoint2 &p, float &fAltitude) const;
+	bool RayHitsTriangle(int tri, const DPoint3 &origin, const DPoint3 &dir,
+		double &t) const;
+	bool _ReadTinHeader(const vtTinFile &file);
+	bool _ReadTinBody(const vtTinFile &file);
 	bool _ReadTinOld(FILE *fp);
 
-	void _UpdateIndicesInInBin(int bin);
-	void _CompareBins(int bin1, int bin2);
-
 	DLine2			m_vert;
 	vtArray<float>	m_z;
 	vtArray<int>	m_tri;
@@ -145,16 +120,15 @@ protected:
 	vtStringArray	m_surftypes;
 	vtArray<bool>	m_surftype_tiled;
 
-	// These members are used only during MergeSharedVerts
-	int *m_bReplace;
-	Bin *m_vertbin;
-	Bin *m_tribin;
-
-	// This is used to speed up FindAltitudeOnEarth
-	BinArray *m_trianglebins;
+	// A grid of bins over the extents, used to speed up FindAltitudeOnEarth
+	//  and CastRayToSurface.  The triangles of bin b are the entries
+	//  m_BinTris[m_BinStart[b]] to m_BinTris[m_BinStart[b+1]-1].
+	int m_iBinCols, m_iBinRows;
 	DPoint2 m_BinSize;
+	std::vector<int> m_BinStart;
+	std::vector<int> m_BinTris;
 
-	int m_file_data_start, m_file_verts, m_file_tris;	// Used while reading ITF
+	int m_file_verts, m_file_tris;	// Set by ReadHeader
 };
 
 
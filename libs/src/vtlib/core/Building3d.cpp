@@ -19,6 +19,7 @@
 #include "Terrain.h"
 #include "Building3d.h"
 #include "FelkelStraightSkeleton.h"
+#include <OpenThreads/ScopedLock>
 
 
 /////////////////////////////////////////////////////////////////////////////
@@ -169,6 +170,7 @@ bool vtBuilding3d::CreateGeometry(vtHeightField3d *pHeightField)
 #if USE_EXPERIMENTAL_BUILDING_GEOMETRY_GENERATOR
 	UpdateWorldLocation(pHeightField);
 
+	OpenThreads::ScopedLock<OpenThreads::Mutex> lock(s_SharedMaterialMutex);
 	osg::ref_ptr<OSGGeomUtils::GenerateBuildingGeometry> pGenerator =
 		new OSGGeomUtils::GenerateBuildingGeometry(*this);
 	m_pGeode = pGenerator->Generate();
@@ -268,14 +270,17 @@ bool vtBuilding3d::CreateGeometry(vtHeightField3d *pHeightField)
 	// wrap in a shape and set materials
 	m_pGeode = new vtGeode;
 	m_pGeode->setName("building-geom");
-	vtMaterialArray *pShared = GetSharedMaterialArray();
-	m_pGeode->SetMaterials(pShared);
-
-	for (j = 0; j < m_Mesh.GetSize(); j++)
 	{
-		vtMesh *mesh = m_Mesh[j].m_pMesh;
-		int index = m_Mesh[j].m_iMatIdx;
-		m_pGeode->AddMesh(mesh, index);
+		OpenThreads::ScopedLock<OpenThreads::Mutex> lock(s_SharedMaterialMutex);
+		vtMaterialArray *pShared = GetSharedMaterialArray();
+		m_pGeode->SetMaterials(pShared);
+
+		for (j = 0; j < m_Mesh.GetSize(); j++)
+		{
+			vtMesh *mesh = m_Mesh[j].m_pMesh;
+			int index = m_Mesh[j].m_iMatIdx;
+			m_pGeode->AddMesh(mesh, index);
+		}
 	}
 #endif
 
@@ -1149,12 +1154,15 @@ bool vtBuilding3d::MakeFacade(vtEdge *pEdge, FLine3 &quad, int stories)
 		return false;
 	}
 
-	mm.m_iMatIdx = GetSharedMaterialArray()->AddTextureMaterial2(fname,
-			true, true, false, false,
-			TERRAIN_AMBIENT,
-			TERRAIN_DIFFUSE,
-			1.0f,		// alpha
-			TERRAIN_EMISSIVE);
+	{
+		OpenThreads::ScopedLock<OpenThreads::Mutex> lock(s_SharedMaterialMutex);
+		mm.m_iMatIdx = GetSharedMaterialArray()->AddTextureMaterial2(fname,
+				true, true, false, false,
+				TERRAIN_AMBIENT,
+				TERRAIN_DIFFUSE,
+				1.0f,		// alpha
+				TERRAIN_EMISSIVE);
+	}
 
 	// Create a mesh for the new material and add this to the mesh array
 	mm.m_pMesh = new vtMesh(osg::PrimitiveSet::TRIANGLE_FAN, VT_Normals | VT_TexCoords, 6);
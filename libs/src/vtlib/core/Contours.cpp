@@ -153,7 +153,9 @@ vtGeode *vtContourConverter::Setup(vtTerrain *pTerr, const RGBf &color, float fH
 	m_pGeode->setName("Contour Geometry");
 	m_pGeode->SetMaterials(pMats);
 
-	m_pMF = new vtGeomFactory(m_pGeode, osg::PrimitiveSet::LINE_STRIP, 0, 30000, 0);
+	// Meshes can be large, since they switch to 32-bit indices as needed
+	m_pMF = new vtGeomFactory(m_pGeode, osg::PrimitiveSet::LINE_STRIP, 0,
+		1000000, 0, 30000);
 
 	return m_pGeode;
 }
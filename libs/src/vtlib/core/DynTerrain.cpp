@@ -10,6 +10,7 @@
 
 #include "vtlib/vtlib.h"
 #include "DynTerrain.h"
+#include "vtdata/HeightFieldBatch.h"
 
 vtDynTerrainGeom::vtDynTerrainGeom() : vtDynGeom(), vtHeightFieldGrid3d()
 {
@@ -212,6 +213,43 @@ bool vtDynTerrainGeom::FindAltitudeAtPoint(const FPoint3 &p, float &fAltitude,
 	return true;
 }
 
+// Provides the heixels of a dynamic terrain to FindGridAltitudes
+class DynTerrainSampler
+{
+public:
+	DynTerrainSampler(const vtDynTerrainGeom *geom, bool bTrue) : m_geom(geom), m_bTrue(bTrue) {}
+	void Corners(int iX, int iZ, float alt[4]) const
+	{
+		alt[0] = m_geom->GetElevation(iX, iZ, m_bTrue);
+		alt[1] = m_geom->GetElevation(iX+1, iZ, m_bTrue);
+		alt[2] = m_geom->GetElevation(iX+1, iZ+1, m_bTrue);
+		alt[3] = m_geom->GetElevation(iX, iZ+1, m_bTrue);
+	}
+	bool Single(const FPoint3 &p, float &fAltitude) const
+	{
+		return m_geom->FindAltitudeAtPoint(p, fAltitude, m_bTrue);
+	}
+	const vtDynTerrainGeom *m_geom;
+	bool m_bTrue;
+};
+
+/**
+ * Find the altitude of many points at once.  The results are the same as
+ * calling FindAltitudeAtPoint for each point, but much faster.
+ */
+int vtDynTerrainGeom::FindAltitudesAtPoints(const FPoint3 *points,
+	float *altitudes, int count, bool bTrue, int iCultureFlags) const
+{
+	// Culture must be tested point by point
+	if (iCultureFlags != 0 && m_pCulture != NULL)
+		return vtHeightFieldGrid3d::FindAltitudesAtPoints(points, altitudes,
+			count, bTrue, iCultureFlags);
+
+	DynTerrainSampler sampler(this, bTrue);
+	return FindGridAltitudes(sampler, m_WorldExtents, m_fXStep, m_fZStep,
+		m_iColumns, m_iRows, true, 1.0f, points, altitudes, count);
+}
+
 
 void vtDynTerrainGeom::SetCull(bool bOnOff)
 {
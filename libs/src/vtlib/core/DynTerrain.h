@@ -67,6 +67,8 @@ public:
 	bool FindAltitudeAtPoint(const FPoint3 &p3, float &fAltitude,
 		bool bTrue = false, int iCultureFlags = 0,
 		FPoint3 *vNormal = NULL) const;
+	int FindAltitudesAtPoints(const FPoint3 *points, float *altitudes,
+		int count, bool bTrue = false, int iCultureFlags = 0) const;
 
 	// overridables
 	virtual void DoCulling(const vtCamera *pCam) = 0;
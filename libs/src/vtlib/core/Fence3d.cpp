@@ -15,6 +15,7 @@
 #include "Light.h"
 #include "Terrain.h"
 #include "Fence3d.h"
+#include <OpenThreads/ScopedLock>
 
 
 vtFence3d::vtFence3d() : vtFence()
@@ -718,6 +719,10 @@ void vtFence3d::DestroyGeometry()
  */
 bool vtFence3d::CreateNode(vtTerrain *pTerr)
 {
+	// Fences use the shared materials, which buildings may be adding to on
+	//  another thread.
+	OpenThreads::ScopedLock<OpenThreads::Mutex> lock(s_SharedMaterialMutex);
+
 	bool bHighlighted = (m_pHighlightMesh != NULL);
 	if (m_bBuilt)
 	{
@@ -1095,7 +1095,7 @@ void vtIcoGlobe::add_face1(vtMesh *mesh, int face, bool second)
 	}
 	// Next pass: the strips
 	int row_start = 0;
-	unsigned short *indices = new unsigned short[m_freq * 2 + 1];
+	uint *indices = new uint[m_freq * 2 + 1];
 
 	// Here we create the tristrips moving right to left, because that
 	//  gives us the desired right-handed order of the strip vertices.
@@ -1234,7 +1234,7 @@ void vtIcoGlobe::add_subface(vtMesh *mesh, int face, int v0, int v1, int v2,
 		return;
 	}
 
-	unsigned short Indices[3];
+	uint Indices[3];
 	if (flip)
 	{
 		Indices[0] = v2;
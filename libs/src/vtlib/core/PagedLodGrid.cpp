@@ -14,12 +14,17 @@
 
 #include "PagedLodGrid.h"
 
-#include <algorithm>	// for sort
+#include <algorithm>	// for the heap functions
+#include <osg/Timer>
+#include <OpenThreads/ScopedLock>
+
+typedef OpenThreads::ScopedLock<OpenThreads::Mutex> ScopedLock;
 
 vtPagedStructureLOD::vtPagedStructureLOD() : vtLOD()
 {
 	m_iNumConstructed = 0;
 	m_bAddedToQueue = false;
+	m_bActive = false;
 
 	SetCenter(FPoint3(0, 0, 0));
 
@@ -55,6 +60,8 @@ bool vtPagedStructureLOD::TestVisible(float fDistance, bool bLoad)
 
 void vtPagedStructureLOD::AppendToQueue()
 {
+	m_pGrid->ActivateCell(this);
+
 	int count = 0;
 	for (uint i = 0; i < m_StructureRefs.size(); i++)
 	{
@@ -68,10 +75,7 @@ void vtPagedStructureLOD::AppendToQueue()
 			count++;
 	}
 	if (count > 0)
-		VTLOG("Added %d buildings to queue.\n", count);
-
-	// We have just added a lump of structures, sort them by distance
-	m_pGrid->SortQueue();
+		VTLOG_DEBUG("Paging", "Added %d buildings to queue.\n", count);
 }
 
 void vtPagedStructureLOD::Add(vtStructureArray3d *pArray, int iIndex)
@@ -100,6 +104,214 @@ void vtPagedStructureLOD::Remove(vtStructureArray3d *pArray, int iIndex)
 }
 
 
+///////////////////////////////////////////////////////////////////////
+// vtStructureWorkerPool
+
+vtStructureWorkerPool::vtStructureWorkerPool()
+{
+	m_bStopping = false;
+}
+
+vtStructureWorkerPool::~vtStructureWorkerPool()
+{
+	Stop();
+}
+
+/**
+ * Start the threads.  Any existing threads are stopped first.
+ */
+void vtStructureWorkerPool::Start(int iThreads)
+{
+	Stop();
+	m_bStopping = false;
+	for (int i = 0; i < iThreads; i++)
+	{
+		Worker *pWorker = new Worker(this);
+		pWorker->start();
+		m_Threads.push_back(pWorker);
+	}
+	VTLOG("Started %d structure worker threads.\n", iThreads);
+}
+
+/**
+ * Stop the threads.  Jobs which have not yet started are dropped, and
+ * the results of any finished jobs which have not been taken are discarded.
+ */
+void vtStructureWorkerPool::Stop()
+{
+	if (m_Threads.empty())
+		return;
+	{
+		ScopedLock lock(m_Mutex);
+		m_bStopping = true;
+		m_Pending.clear();
+		m_JobReady.broadcast();
+	}
+	for (uint i = 0; i < m_Threads.size(); i++)
+	{
+		m_Threads[i]->join();
+		delete m_Threads[i];
+	}
+	m_Threads.clear();
+
+	ScopedLock lock(m_Mutex);
+	m_Finished.clear();
+}
+
+void vtStructureWorkerPool::Worker::run()
+{
+	QueueEntry e;
+	while (m_pPool->NextJob(e))
+	{
+		bool bSuccess = e.pStructureArray->ConstructStructure(e.iStructIndex);
+		m_pPool->JobDone(e, bSuccess);
+	}
+}
+
+bool vtStructureWorkerPool::NextJob(QueueEntry &e)
+{
+	ScopedLock lock(m_Mutex);
+	while (m_Pending.empty() && !m_bStopping)
+		m_JobReady.wait(&m_Mutex);
+	if (m_bStopping)
+		return false;
+	e = m_Pending.front();
+	m_Pending.pop_front();
+	m_Running.push_back(e);
+	return true;
+}
+
+void vtStructureWorkerPool::JobDone(const QueueEntry &e, bool bSuccess)
+{
+	ScopedLock lock(m_Mutex);
+	for (std::list<QueueEntry>::iterator it = m_Running.begin(); it != m_Running.end(); it++)
+	{
+		if (it->pStructureArray == e.pStructureArray && it->iStructIndex == e.iStructIndex)
+		{
+			m_Running.erase(it);
+			break;
+		}
+	}
+	Result r;
+	r.entry = e;
+	r.bSuccess = bSuccess;
+	m_Finished.push_back(r);
+	m_JobDone.broadcast();
+}
+
+/**
+ * Add a job: construct a structure.
+ */
+void vtStructureWorkerPool::Submit(const QueueEntry &e)
+{
+	ScopedLock lock(m_Mutex);
+	m_Pending.push_back(e);
+	m_JobReady.signal();
+}
+
+/**
+ * Take the result of a finished job, if there is one.
+ *
+ * \param e The job which finished.
+ * \param bSuccess True if the structure was successfully constructed.
+ * \return true if there was a finished job.
+ */
+bool vtStructureWorkerPool::TakeFinished(QueueEntry &e, bool &bSuccess)
+{
+	ScopedLock lock(m_Mutex);
+	if (m_Finished.empty())
+		return false;
+	e = m_Finished.front().entry;
+	bSuccess = m_Finished.front().bSuccess;
+	m_Finished.pop_front();
+	return true;
+}
+
+/**
+ * Return true if a structure has been submitted, and its result not yet
+ * taken.  Such a structure must not be touched by any other thread.
+ */
+bool vtStructureWorkerPool::IsBuilding(vtStructureArray3d *pArray, uint iIndex)
+{
+	ScopedLock lock(m_Mutex);
+	std::list<QueueEntry>::const_iterator it;
+	for (it = m_Pending.begin(); it != m_Pending.end(); it++)
+		if (it->pStructureArray == pArray && it->iStructIndex == iIndex)
+			return true;
+	for (it = m_Running.begin(); it != m_Running.end(); it++)
+		if (it->pStructureArray == pArray && it->iStructIndex == iIndex)
+			return true;
+	for (std::list<Result>::const_iterator r = m_Finished.begin(); r != m_Finished.end(); r++)
+		if (r->entry.pStructureArray == pArray && r->entry.iStructIndex == iIndex)
+			return true;
+	return false;
+}
+
+/**
+ * The number of jobs which have been submitted, and their results not yet
+ * taken.
+ */
+int vtStructureWorkerPool::NumBusy()
+{
+	ScopedLock lock(m_Mutex);
+	return (int) (m_Pending.size() + m_Running.size() + m_Finished.size());
+}
+
+/**
+ * Wait until all the submitted jobs have finished.
+ */
+void vtStructureWorkerPool::Wait()
+{
+	ScopedLock lock(m_Mutex);
+	while (!m_Pending.empty() || !m_Running.empty())
+		m_JobDone.wait(&m_Mutex);
+}
+
+/**
+ * Drop the jobs for one cell which have not yet started, and wait only for
+ * the ones which are running.  The jobs of other cells carry on.
+ *
+ * \param pLOD The cell.
+ * \param built The cell's structures which were constructed successfully,
+ *		and whose results had not yet been taken.  They are taken now.
+ */
+void vtStructureWorkerPool::CancelCell(vtPagedStructureLOD *pLOD,
+	std::vector<QueueEntry> &built)
+{
+	ScopedLock lock(m_Mutex);
+	std::list<QueueEntry>::iterator it = m_Pending.begin();
+	while (it != m_Pending.end())
+	{
+		if (it->pLOD == pLOD)
+			it = m_Pending.erase(it);
+		else
+			it++;
+	}
+	bool bRunning = true;
+	while (bRunning)
+	{
+		bRunning = false;
+		for (it = m_Running.begin(); it != m_Running.end(); it++)
+			if (it->pLOD == pLOD)
+				bRunning = true;
+		if (bRunning)
+			m_JobDone.wait(&m_Mutex);
+	}
+	std::list<Result>::iterator r = m_Finished.begin();
+	while (r != m_Finished.end())
+	{
+		if (r->entry.pLOD == pLOD)
+		{
+			if (r->bSuccess)
+				built.push_back(r->entry);
+			r = m_Finished.erase(r);
+		}
+		else
+			r++;
+	}
+}
+
+
 ///////////////////////////////////////////////////////////////////////
 // vtPagedStructureLodGrid
 
@@ -110,6 +322,20 @@ vtPagedStructureLodGrid::vtPagedStructureLodGrid()
 	m_pCells = NULL;
 	m_LoadingEnabled = true;
 	m_iLoadCount = 0;
+	m_iTotalConstructed = 0;
+	m_iPrioritizeCount = 0;
+
+	m_CamPos.Set(0, 0);
+	m_CamDir.Set(0, 0);
+	m_fCosHalfFOV = -1.0f;
+
+	// Nothing is queued yet, so the queue is in order for this camera
+	m_LastSortPos = m_CamPos;
+	m_LastSortDir = m_CamDir;
+
+	// Leave one processor for the main thread
+	m_iBuildThreads = std::max(1, OpenThreads::GetNumberOfProcessors() - 1);
+	m_fMergeBudget = 0.004f;
 }
 
 void vtPagedStructureLodGrid::Setup(const FPoint3 &origin, const FPoint3 &size,
@@ -137,12 +363,18 @@ void vtPagedStructureLodGrid::Setup(const FPoint3 &origin, const FPoint3 &size,
 
 void vtPagedStructureLodGrid::Cleanup()
 {
+	m_Workers.Stop();
+
 	// get rid of children first
 	removeChildren(0, getNumChildren());
 
 	// free all our pointers to them
 	free(m_pCells);
 	m_pCells = NULL;
+
+	m_Queue.clear();
+	m_Queued.clear();
+	m_ActiveCells.clear();
 }
 
 
@@ -257,6 +489,8 @@ bool vtPagedStructureLodGrid::AppendToGrid(vtStructureArray3d *pArray, int iInde
 
 void vtPagedStructureLodGrid::RemoveFromGrid(vtStructureArray3d *pArray, int iIndex)
 {
+	WaitForWorkers();
+
 	// Get 2D extents from the unbuild structure
 	vtStructure *str = pArray->GetAt(iIndex);
 	vtPagedStructureLOD *pGroup = FindGroup(str);
@@ -271,6 +505,17 @@ vtPagedStructureLOD *vtPagedStructureLodGrid::GetPagedCell(int a, int b)
 
 void vtPagedStructureLodGrid::DeconstructCell(vtPagedStructureLOD *pLOD)
 {
+	// Only this cell's structures need to be out of the workers' hands.
+	//  Those which the workers have already built are deleted below, with
+	//  the rest.
+	if (m_Workers.NumThreads() > 0)
+	{
+		std::vector<QueueEntry> built;
+		m_Workers.CancelCell(pLOD, built);
+		for (uint i = 0; i < built.size(); i++)
+			FinishConstruction(pLOD, built[i].pStructureArray, built[i].iStructIndex, true);
+	}
+
 	int count = 0;
 
 	StructureRefVector &refs = pLOD->m_StructureRefs;
@@ -308,118 +553,190 @@ void vtPagedStructureLodGrid::RemoveCellFromQueue(vtPagedStructureLOD *pLOD)
 			count++;
 	}
 	if (count != 0)
-		VTLOG("Dequeued %d of %d.\n", count, refs.size());
+		VTLOG_DEBUG("Paging", "Dequeued %d of %d.\n", count, (int) refs.size());
 	pLOD->m_bAddedToQueue = false;
 }
 
+/**
+ * Cells which have structures queued or constructed are kept in a list, so
+ * that each culling pass only needs to look at them, not the whole grid.
+ */
+void vtPagedStructureLodGrid::ActivateCell(vtPagedStructureLOD *pLOD)
+{
+	if (!pLOD->m_bActive)
+	{
+		pLOD->m_bActive = true;
+		m_ActiveCells.push_back(pLOD);
+	}
+}
+
 void vtPagedStructureLodGrid::CullFarawayStructures(const FPoint3 &CamPos,
 													int iMaxStructures,
 													float fDistance)
 {
+	uint i;
 	m_iTotalConstructed = 0;
-	for (int a = 0; a < m_dim; a++)
-	{
-		for (int b = 0; b < m_dim; b++)
-		{
-			vtPagedStructureLOD *lod = m_pCells[CellIndex(a,b)];
-			if (lod) m_iTotalConstructed += lod->getNumChildren();
-		}
-	}
+	for (i = 0; i < m_ActiveCells.size(); i++)
+		m_iTotalConstructed += m_ActiveCells[i]->m_iNumConstructed;
+
 	// If we have too many or have items in the queue
-	if (m_iTotalConstructed > iMaxStructures || m_Queue.size() > 0)
+	if (m_iTotalConstructed > iMaxStructures || !m_Queued.empty())
 	{
-		//VTLOG("CullFarawayStructures: %d in Queue, ", m_Queue.size());
-		int total = 0, removed = 0;
 		// Delete/dequeue the ones that are very far
 		FPoint3 center;
-		for (int a = 0; a < m_dim; a++)
+		for (i = 0; i < m_ActiveCells.size(); i++)
 		{
-			for (int b = 0; b < m_dim; b++)
-			{
-				vtPagedStructureLOD *lod = m_pCells[CellIndex(a,b)];
-				if (!lod)
-					continue;
-
-				total++;
-				lod->GetCenter(center);
-				float dist = (center - CamPos).Length();
-
-				// If very far, delete the structures entirely
-				if (lod->m_iNumConstructed != 0 &&
-					m_iTotalConstructed > iMaxStructures &&
-					dist > fDistance)
-					DeconstructCell(lod);
-
-				// If it has fallen out of the frustum, remove them
-				//  from the queue
-				if (dist > m_fLODDistance)
-				{
-					RemoveCellFromQueue(lod);
-					removed++;
-				}
-			}
+			vtPagedStructureLOD *lod = m_ActiveCells[i];
+			lod->GetCenter(center);
+			float dist = (center - CamPos).Length();
+
+			// If very far, delete the structures entirely
+			if (lod->m_iNumConstructed != 0 &&
+				m_iTotalConstructed > iMaxStructures &&
+				dist > fDistance)
+				DeconstructCell(lod);
+
+			// If it has fallen out of the frustum, remove them
+			//  from the queue
+			if (dist > m_fLODDistance)
+				RemoveCellFromQueue(lod);
 		}
-		//VTLOG(" %d cells, %d cell removed\n", total, removed);
 	}
+
+	// Forget the cells which no longer have anything queued or constructed
+	uint kept = 0;
+	for (i = 0; i < m_ActiveCells.size(); i++)
+	{
+		vtPagedStructureLOD *lod = m_ActiveCells[i];
+		if (lod->m_iNumConstructed != 0 || lod->m_bAddedToQueue)
+			m_ActiveCells[kept++] = lod;
+		else
+			lod->m_bActive = false;
+	}
+	m_ActiveCells.resize(kept);
 }
 
 bool operator<(const QueueEntry& a, const QueueEntry& b)
 {
-	// Reverse-sort, to put smallest values (closest points) at the end
-	//  of the list so they can be efficiently removed
-	return a.fDistance > b.fDistance;
+	// The heap puts the largest value, the highest priority, at the front
+	return a.fPriority < b.fPriority;
 }
 
-void vtPagedStructureLodGrid::SortQueue()
+/**
+ * Remember where the camera is, so that structures can be prioritized.
+ */
+void vtPagedStructureLodGrid::UpdateCamera(const FPoint3 &CamPos)
 {
 	vtCamera *cam = vtGetScene()->GetCamera();
-	FPoint3 CamPos = cam->GetTrans();
 	FPoint3 CamDir = cam->GetDirection();
 
-	// Prioritization is by distance.
-	// We can measure horizontal distance, which is faster.
-	DPoint3 cam_epos, cam_epos2;
-	g_Conv.ConvertToEarth(CamPos, cam_epos);
-	g_Conv.ConvertToEarth(CamPos+CamDir, cam_epos2);
-	DPoint2 cam_pos(cam_epos.x, cam_epos.y);
-	DPoint2 cam_dir(cam_epos2.x - cam_epos.x, cam_epos2.y - cam_epos.y);
-	cam_dir.Normalize();
+	// Prioritization is by horizontal position, which is faster.
+	m_CamPos.Set(CamPos.x, CamPos.z);
+	m_CamDir.Set(CamDir.x, CamDir.z);
+	if (m_CamDir.Length() < 0.01f)
+	{
+		// Looking straight down; everything nearby is in view
+		m_CamDir.Set(0, 0);
+		m_fCosHalfFOV = -1.0f;
+		return;
+	}
+	m_CamDir.Normalize();
+
+	// Widen the field of view a little, because structures have some size
+	float half = cam->GetFOV() / 2 + 0.2f;
+	m_fCosHalfFOV = (half < PIf) ? cosf(half) : -1.0f;
+}
 
-	DPoint2 p;
+/**
+ * The priority of a structure is about how large it will appear on screen:
+ * its size divided by its distance from the camera.
+ */
+float vtPagedStructureLodGrid::Priority(const QueueEntry &e) const
+{
+	FPoint2 diff = e.pos - m_CamPos;
+	float dist = diff.Length();
+	if (dist < 1.0f)
+		dist = 1.0f;
+	float priority = e.fRadius / dist;
+
+	// Is it behind the camera, or outside the view?  If so, give it much
+	//  lower priority.
+	float cosine = diff.Dot(m_CamDir) / dist;
+	if (cosine < 0)
+		priority *= 0.001f;
+	else if (cosine < m_fCosHalfFOV)
+		priority *= 0.1f;
+	return priority;
+}
+
+/**
+ * Update the priority of every structure in the queue, for the current
+ * position of the camera.
+ */
+void vtPagedStructureLodGrid::SortQueue()
+{
+	// Also drop the entries of structures which were removed from the queue
+	uint kept = 0;
 	for (uint i = 0; i < m_Queue.size(); i++)
 	{
 		QueueEntry &e = m_Queue[i];
-		vtStructure *st = e.pStructureArray->GetAt(e.iStructIndex);
-		vtBuilding *bld = st->GetBuilding();
-		vtStructInstance *inst = st->GetInstance();
-		if (bld)
-			p = bld->GetOuterFootprint(0).Centroid();
-		else if (inst)
-			p = inst->GetPoint();
-		else
+		if (m_Queued.find(StructureKey(e.pStructureArray, e.iStructIndex)) == m_Queued.end())
 			continue;
+		e.fPriority = Priority(e);
+		m_Queue[kept++] = e;
+	}
+	m_Queue.resize(kept);
+	std::make_heap(m_Queue.begin(), m_Queue.end());
+
+	m_LastSortPos = m_CamPos;
+	m_LastSortDir = m_CamDir;
+	m_iPrioritizeCount++;
+}
 
-		// Calculate distance
-		DPoint2 diff = p-cam_pos;
-		e.fDistance = (float) diff.Length();
+/**
+ * The structure with the highest priority, or NULL if the queue is empty.
+ */
+QueueEntry *vtPagedStructureLodGrid::TopOfQueue()
+{
+	while (!m_Queue.empty())
+	{
+		const QueueEntry &e = m_Queue.front();
+		if (m_Queued.find(StructureKey(e.pStructureArray, e.iStructIndex)) != m_Queued.end())
+			return &m_Queue.front();
 
-		// Is point behind the camera?  If so, give it lowest priority
-		if (diff.Dot(cam_dir) < 0)
-			e.fDistance += 1E5;
+		// It was removed from the queue after it was added
+		std::pop_heap(m_Queue.begin(), m_Queue.end());
+		m_Queue.pop_back();
 	}
-	std::sort(m_Queue.begin(), m_Queue.end());
+	return NULL;
+}
+
+/**
+ * Remove the structure with the highest priority from the queue.
+ */
+void vtPagedStructureLodGrid::PopQueue()
+{
+	const QueueEntry &e = m_Queue.front();
+	m_Queued.erase(StructureKey(e.pStructureArray, e.iStructIndex));
+	std::pop_heap(m_Queue.begin(), m_Queue.end());
+	m_Queue.pop_back();
 }
 
 void vtPagedStructureLodGrid::ClearQueue(vtStructureArray3d *pArray)
 {
-	QueueVector::iterator it = m_Queue.begin();
-	while (it != m_Queue.end())
+	WaitForWorkers();
+
+	uint kept = 0;
+	for (uint i = 0; i < m_Queue.size(); i++)
 	{
-		if (it->pStructureArray == pArray)
-			it = m_Queue.erase(it);
+		const QueueEntry &e = m_Queue[i];
+		if (e.pStructureArray == pArray)
+			m_Queued.erase(StructureKey(e.pStructureArray, e.iStructIndex));
 		else
-			it++;
+			m_Queue[kept++] = e;
 	}
+	m_Queue.resize(kept);
+	std::make_heap(m_Queue.begin(), m_Queue.end());
 }
 
 /**
@@ -445,9 +762,18 @@ void vtPagedStructureLodGrid::DoPaging(const FPoint3 &CamPos,
 	static float last_cull = 0.0f, last_load = 0.0f, last_prioritize = 0.0f;
 	float current = vtGetTime();
 
-	if (current - last_prioritize > 1.0f)
+	UpdateCamera(CamPos);
+
+	// Add what the workers have built to the scene graph, and give them more
+	MergeFinished(m_fMergeBudget);
+	SubmitToWorkers();
+
+	if (current - last_prioritize > 1.0f &&
+		(m_CamPos != m_LastSortPos || m_CamDir != m_LastSortDir))
 	{
-		// Do a re-priortization every 1 second.
+		// Do a re-priortization every 1 second, if the camera has moved.
+		//  Structures are given their priority when they are queued, so
+		//  there is no need to when it hasn't.
 		SortQueue();
 		last_prioritize = current;
 	}
@@ -458,7 +784,7 @@ void vtPagedStructureLodGrid::DoPaging(const FPoint3 &CamPos,
 		CullFarawayStructures(CamPos, iMaxStructures, fDeleteDistance);
 		last_cull = current;
 	}
-	else if (current - last_load > 0.01f && !m_Queue.empty())
+	else if (current - last_load > 0.01f && !m_Queued.empty())
 	{
 		// Do loading every other available frame
 		last_load = current;
@@ -471,22 +797,116 @@ void vtPagedStructureLodGrid::DoPaging(const FPoint3 &CamPos,
 		else
 			construct = 1;
 
-		for (int i = 0; i < construct && m_Queue.size() > 0; i++)
+		for (int i = 0; i < construct; i++)
 		{
-			// Gradually load anything that needs loading
-			const QueueEntry &e = m_Queue.back();
+			// Gradually load anything that needs loading, except what the
+			//  workers will build
+			QueueEntry *top = TopOfQueue();
+			if (!top || UseWorkers(*top))
+				break;
+			QueueEntry e = *top;
+			PopQueue();
 			ConstructByIndex(e.pLOD, e.pStructureArray, e.iStructIndex);
-			m_Queue.pop_back();
 		}
 		last_campos = CamPos;
 	}
 }
 
+/**
+ * Set the number of threads which construct buildings in the background.
+ * The default is one less than the number of processors.  Pass 0 to
+ * construct all structures on the main thread.
+ */
+void vtPagedStructureLodGrid::SetBuildThreads(int iThreads)
+{
+	WaitForWorkers();
+	m_Workers.Stop();
+	m_iBuildThreads = iThreads;
+}
+
+// Buildings are constructed by the workers.  Other structures, such as
+//  instances, share caches of models which are not safe to use from more
+//  than one thread, so they are constructed on the main thread.
+bool vtPagedStructureLodGrid::UseWorkers(const QueueEntry &e)
+{
+	if (m_iBuildThreads <= 0)
+		return false;
+	return (e.pStructureArray->GetAt(e.iStructIndex)->GetType() == ST_BUILDING);
+}
+
+void vtPagedStructureLodGrid::SubmitToWorkers()
+{
+	// Only give the workers a few jobs at a time, so that they are always
+	//  working on what is currently the highest priority.
+	const int most = m_iBuildThreads * 4;
+	int busy = m_Workers.NumBusy();
+	QueueEntry *top;
+	while (busy < most && (top = TopOfQueue()) != NULL && UseWorkers(*top))
+	{
+		if (m_Workers.NumThreads() == 0)
+		{
+			// Create the shared materials now, so that the workers only
+			//  need to look them up.
+			vtMaterialDescriptorArray3d &mats = vtStructure3d::GetMaterialDescriptors();
+			if (!mats.MaterialsCreated() && mats.GetMatArray() != NULL)
+				mats.CreateMaterials();
+			m_Workers.Start(m_iBuildThreads);
+		}
+		m_Workers.Submit(*top);
+		PopQueue();
+		busy++;
+	}
+}
+
+/**
+ * Add the structures which the workers have finished to the scene graph.
+ *
+ * \param fBudget The most time to spend, in seconds, or -1 for no limit.
+ */
+void vtPagedStructureLodGrid::MergeFinished(float fBudget)
+{
+	osg::Timer *timer = osg::Timer::instance();
+	const osg::Timer_t start = timer->tick();
+
+	QueueEntry e;
+	bool bSuccess;
+	while (m_Workers.TakeFinished(e, bSuccess))
+	{
+		FinishConstruction(e.pLOD, e.pStructureArray, e.iStructIndex, bSuccess);
+		if (fBudget >= 0 && timer->delta_s(start, timer->tick()) > fBudget)
+			break;
+	}
+}
+
+/**
+ * Wait until the workers have finished all their jobs, and add what they
+ * built to the scene graph.  Call this before changing anything which the
+ * workers read while constructing, such as the structures themselves or
+ * the heightfield they are draped on.
+ */
+void vtPagedStructureLodGrid::WaitForWorkers()
+{
+	if (m_Workers.NumThreads() == 0)
+		return;
+	m_Workers.Wait();
+	MergeFinished(-1);
+}
+
 void vtPagedStructureLodGrid::ConstructByIndex(vtPagedStructureLOD *pLOD,
 											   vtStructureArray3d *pArray,
 											   uint iStructIndex)
 {
 	bool bSuccess = pArray->ConstructStructure(iStructIndex);
+	FinishConstruction(pLOD, pArray, iStructIndex, bSuccess);
+}
+
+/**
+ * Add a structure which has been constructed to the scene graph.
+ */
+void vtPagedStructureLodGrid::FinishConstruction(vtPagedStructureLOD *pLOD,
+												 vtStructureArray3d *pArray,
+												 uint iStructIndex, bool bSuccess)
+{
 	if (bSuccess)
 	{
 		vtStructure3d *str3d = pArray->GetStructure3d(iStructIndex);
@@ -500,6 +920,7 @@ void vtPagedStructureLodGrid::ConstructByIndex(vtPagedStructureLOD *pLOD,
 				pLOD->addChild(pGeode);
 		}
 		pLOD->m_iNumConstructed ++;
+		ActivateCell(pLOD);
 
 		// Keep track of overall number of loads
 		m_iLoadCount++;
@@ -519,39 +940,53 @@ void vtPagedStructureLodGrid::ConstructByIndex(vtPagedStructureLOD *pLOD,
 bool vtPagedStructureLodGrid::AddToQueue(vtPagedStructureLOD *pLOD,
 										 vtStructureArray3d *pArray, int iIndex)
 {
-	// Check if it's already built
+	// Check if it's being built, or already built
+	if (m_Workers.NumThreads() > 0 && m_Workers.IsBuilding(pArray, iIndex))
+		return false;
 	vtStructure3d *str3d = pArray->GetStructure3d(iIndex);
 	if (str3d && str3d->IsCreated())
 		return false;
 
 	// Check if it's already in the queue
-	for (QueueVector::iterator it = m_Queue.begin(); it != m_Queue.end(); it++)
-	{
-		if (it->pStructureArray == pArray && it->iStructIndex == iIndex)
-			return false;
-	}
+	StructureKey key(pArray, iIndex);
+	if (m_Queued.find(key) != m_Queued.end())
+		return false;
 
-	// If not, add it
+	// If not, add it, with its position and size for prioritizing
 	QueueEntry e;
 	e.pLOD = pLOD;
 	e.pStructureArray = pArray;
 	e.iStructIndex = iIndex;
-	e.fDistance = 1E9;
+
+	DRECT rect;
+	if (pArray->GetAt(iIndex)->GetExtents(rect))
+	{
+		float xmin, xmax, zmin, zmax;
+		g_Conv.convert_earth_to_local_xz(rect.left, rect.bottom, xmin, zmin);
+		g_Conv.convert_earth_to_local_xz(rect.right, rect.top, xmax, zmax);
+		e.pos.Set((xmin+xmax) / 2, (zmin+zmax) / 2);
+		e.fRadius = FPoint2(xmax-xmin, zmax-zmin).Length() / 2;
+	}
+	else
+	{
+		FPoint3 center;
+		pLOD->GetCenter(center);
+		e.pos.Set(center.x, center.z);
+		e.fRadius = 0;
+	}
+	// Instances have no known size, so assume a small one
+	if (e.fRadius < 5.0f)
+		e.fRadius = 5.0f;
+	e.fPriority = Priority(e);
+
 	m_Queue.push_back(e);
+	std::push_heap(m_Queue.begin(), m_Queue.end());
+	m_Queued.insert(key);
 	return true;
 }
 
 bool vtPagedStructureLodGrid::RemoveFromQueue(vtStructureArray3d *pArray, int iIndex)
 {
-	// Check if it's in the queue
-	for (QueueVector::iterator it = m_Queue.begin(); it != m_Queue.end(); it++)
-	{
-		if (it->pStructureArray == pArray && it->iStructIndex == iIndex)
-		{
-			m_Queue.erase(it);
-			return true;
-		}
-	}
-	return false;
+	// The entry itself is discarded later; see TopOfQueue
+	return (m_Queued.erase(StructureKey(pArray, iIndex)) != 0);
 }
-
@@ -9,6 +9,11 @@
 #define PAGEDLODGRIDH
 
 #include "LodGrid.h"
+#include <list>
+#include <set>
+#include <OpenThreads/Thread>
+#include <OpenThreads/Mutex>
+#include <OpenThreads/Condition>
 
 class vtStructure;
 class vtStructure3d;
@@ -33,6 +38,7 @@ struct StructureRef {
 	uint iIndex;
 };
 typedef std::vector<StructureRef> StructureRefVector;
+typedef std::pair<vtStructureArray3d *, uint> StructureKey;
 
 /**
  * A vtPagedStructureLOD node controls the visibility of its child nodes.
@@ -56,6 +62,7 @@ public:
 	StructureRefVector m_StructureRefs;
 	int m_iNumConstructed;
 	bool m_bAddedToQueue;
+	bool m_bActive;		// In the grid's list of cells to check when culling
 
 	// Implement OSG's traversal with our own logic
 	virtual void traverse(osg::NodeVisitor& nv)
@@ -101,10 +108,65 @@ struct QueueEntry {
 	vtPagedStructureLOD *pLOD;
 	vtStructureArray3d *pStructureArray;
 	uint iStructIndex;
-	float fDistance;
+	FPoint2 pos;		// Center of the structure, in world (x,z) coordinates
+	float fRadius;		// Radius of the structure's footprint, in meters
+	float fPriority;	// Higher priority structures are constructed sooner
 };
 typedef std::vector<QueueEntry> QueueVector;
 
+/**
+ * A pool of threads which construct structures in the background.
+ *
+ * Each job calls vtStructureArray3d::ConstructStructure, which builds the
+ * structure's geometry as a subgraph which is not yet attached to the scene
+ * graph.  Attaching it is left to the main thread, which collects the
+ * finished jobs with TakeFinished.
+ */
+class vtStructureWorkerPool
+{
+public:
+	vtStructureWorkerPool();
+	~vtStructureWorkerPool();
+
+	void Start(int iThreads);
+	void Stop();
+	int NumThreads() const { return (int) m_Threads.size(); }
+
+	void Submit(const QueueEntry &e);
+	bool TakeFinished(QueueEntry &e, bool &bSuccess);
+	bool IsBuilding(vtStructureArray3d *pArray, uint iIndex);
+	int NumBusy();
+	void Wait();
+	void CancelCell(vtPagedStructureLOD *pLOD, std::vector<QueueEntry> &built);
+
+protected:
+	class Worker : public OpenThreads::Thread
+	{
+	public:
+		Worker(vtStructureWorkerPool *pPool) { m_pPool = pPool; }
+		virtual void run();
+		vtStructureWorkerPool *m_pPool;
+	};
+	bool NextJob(QueueEntry &e);
+	void JobDone(const QueueEntry &e, bool bSuccess);
+
+	struct Result
+	{
+		QueueEntry entry;
+		bool bSuccess;
+	};
+
+	// All of these are guarded by m_Mutex
+	OpenThreads::Mutex m_Mutex;
+	OpenThreads::Condition m_JobReady, m_JobDone;
+	std::list<QueueEntry> m_Pending;
+	std::list<QueueEntry> m_Running;
+	std::list<Result> m_Finished;
+	bool m_bStopping;
+
+	std::vector<Worker *> m_Threads;
+};
+
 /**
  * vtPagedStructureLodGrid provides a more complex implementation of vtLodGrid.
  *
@@ -113,6 +175,21 @@ typedef std::vector<QueueEntry> QueueVector;
  * when within a given distance.  Additionally, the cells can contain
  * structures (vtStructure) which are not constructed until the cell is
  * visible.
+ *
+ * Buildings are constructed in the background by a pool of worker threads
+ * (see SetBuildThreads), so loading keeps up with the camera on machines
+ * with several processors.  Each frame, DoPaging adds the buildings which
+ * the workers have finished to the scene graph, spending no more than a
+ * fixed amount of time (see SetMergeBudget).  The heightfield must be safe
+ * to query from several threads at once.
+ *
+ * The structures waiting to be constructed are kept in a priority queue
+ * (a heap), so that the ones which will appear largest on screen are
+ * constructed first.  Structures outside the view frustum, or behind the
+ * camera, have much lower priority.  The position and size of each
+ * structure are cached when it is queued, so re-prioritizing the queue as
+ * the camera moves is a quick linear pass.  Only the cells near enough to
+ * the camera to have been queued or constructed are checked when culling.
  */
 class vtPagedStructureLodGrid : public vtLodGrid
 {
@@ -132,7 +209,7 @@ public:
 	void DoPaging(const FPoint3 &CamPos, int iMaxStructures, float fDeleteDistance);
 	bool AddToQueue(vtPagedStructureLOD *pLOD, vtStructureArray3d *pArray, int iIndex);
 	bool RemoveFromQueue(vtStructureArray3d *pArray, int iIndex);
-	uint GetQueueSize() { return m_Queue.size(); }
+	uint GetQueueSize() { return m_Queued.size(); }
 	void SortQueue();
 	void ClearQueue(vtStructureArray3d *pArray);
 	void RefreshPaging(vtStructureArray3d *pArray);
@@ -140,19 +217,41 @@ public:
 	void EnableLoading(bool b) { m_LoadingEnabled = b; }
 	bool m_LoadingEnabled;
 
+	void SetBuildThreads(int iThreads);
+	int GetBuildThreads() const { return m_iBuildThreads; }
+	/// The most time, in seconds, to spend each frame adding built structures to the scene.
+	void SetMergeBudget(float fSeconds) { m_fMergeBudget = fSeconds; }
+
+	/// The number of structures constructed since the last ResetLoadCount.
 	int GetLoadCount() { return m_iLoadCount; }
 	void ResetLoadCount() { m_iLoadCount = 0; }
+	/// The number of paged structures which are currently constructed.
 	int GetTotalConstructed() { return m_iTotalConstructed; }
+	/// The number of cells which are checked by each culling pass.
+	uint GetActiveCellCount() { return m_ActiveCells.size(); }
+	/// The number of times the queue has been re-prioritized.
+	int GetPrioritizeCount() { return m_iPrioritizeCount; }
 
 	vtPagedStructureLOD *FindGroup(vtStructure *str);
 	void ConstructByIndex(vtPagedStructureLOD *pLOD, vtStructureArray3d *pArray,
 		uint iStructIndex);
+	void FinishConstruction(vtPagedStructureLOD *pLOD, vtStructureArray3d *pArray,
+		uint iStructIndex, bool bSuccess);
+	void ActivateCell(vtPagedStructureLOD *pLOD);
+	void WaitForWorkers();
 
 protected:
 	void CullFarawayStructures(const FPoint3 &CamPos,
 		int iMaxStructures, float fDistance);
 	void DeconstructCell(vtPagedStructureLOD *pLOD);
 	void RemoveCellFromQueue(vtPagedStructureLOD *pLOD);
+	void UpdateCamera(const FPoint3 &CamPos);
+	float Priority(const QueueEntry &e) const;
+	QueueEntry *TopOfQueue();
+	void PopQueue();
+	bool UseWorkers(const QueueEntry &e);
+	void SubmitToWorkers();
+	void MergeFinished(float fBudget);
 
 	vtPagedStructureLOD **m_pCells;
 	int m_iLoadCount, m_iTotalConstructed;
@@ -162,7 +261,25 @@ protected:
 	void AllocateCell(int a, int b);
 	osg::Group *GetCell(int a, int b);
 
+	// The queue is a heap, with the highest priority at the front.  Removed
+	//  structures are only dropped from m_Queued, and their entries are
+	//  discarded when they reach the front or the queue is re-prioritized.
 	QueueVector m_Queue;
+	std::set<StructureKey> m_Queued;
+	int m_iPrioritizeCount;
+
+	// The cells which have structures queued or constructed
+	std::vector<vtPagedStructureLOD *> m_ActiveCells;
+
+	// The camera, as of the last call to DoPaging
+	FPoint2 m_CamPos, m_CamDir;
+	float m_fCosHalfFOV;
+	FPoint2 m_LastSortPos, m_LastSortDir;
+
+	// Buildings are constructed by a pool of worker threads
+	vtStructureWorkerPool m_Workers;
+	int m_iBuildThreads;
+	float m_fMergeBudget;
 };
 
 #endif // PAGEDLODGRIDH
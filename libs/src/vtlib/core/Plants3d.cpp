@@ -7,6 +7,7 @@
 // vtPlantSpecies3d
 // vtSpeciesList3d
 // vtPlantInstance3d
+// PlantShaderDrawable
 // vtPlantInstanceArray3d
 //
 // Copyright (c) 2001-2012 Virtual Terrain Project
@@ -24,6 +25,11 @@
 #include "Light.h"
 #include "GeomUtil.h"	// for CreateBoundSphereGeom
 
+#include <algorithm>	// for copy, min, sort
+#include <osg/GLExtensions>
+#include <OpenThreads/Mutex>
+#include <OpenThreads/ScopedLock>
+
 #define SHADOW_HEIGHT		0.1f	// distance above groundpoint in meters
 
 float vtPlantAppearance3d::s_fPlantScale = 1.0f;
@@ -262,15 +268,24 @@ osg::StateSet *vtPlantAppearance3d::GetOrCreateShaderStateset()
 
 	osg::Program* program = new osg::Program;
 	stateset->setAttribute(program);
+	program->addBindAttribLocation("plant_position", PLANT_POSITION_ATTRIB);
+	program->addBindAttribLocation("plant_data", PLANT_DATA_ATTRIB);
 
 	///////////////////////////////////////////////////////////////////
-	// vertex shader using just Vec4 coefficients
+	// vertex shader using the packed data of each plant (see PackedPlant)
 	char vertexShaderSource[] = 
+		"attribute vec3 plant_position;\n"
+		"attribute vec4 plant_data;\n"
 		"varying vec2 texcoord;\n"
 		"\n"
 		"void main(void)\n"
 		"{\n"
-		"	vec3 position = gl_Vertex.xyz * gl_Color.w + gl_Color.xyz;\n"
+		"	float height = plant_data.x * 0.01;\n"
+		"	float angle = plant_data.z * (6.2831853 / 65536.0);\n"
+		"	float c = cos(angle), s = sin(angle);\n"
+		"	vec3 corner = vec3(gl_Vertex.x * c - gl_Vertex.z * s, gl_Vertex.y,\n"
+		"		gl_Vertex.x * s + gl_Vertex.z * c);\n"
+		"	vec3 position = corner * height + plant_position;\n"
 		"	gl_Position	 = gl_ModelViewProjectionMatrix * vec4(position,1.0);\n"
 		"	gl_FrontColor = vec4(1.0,1.0,1.0,1.0);\n"
 		"	texcoord = gl_MultiTexCoord0.st;\n"
@@ -505,6 +520,30 @@ int vtSpeciesList3d::CheckAvailability()
 	return num;
 }
 
+/**
+ * The index of an appearance among the appearances of all the species in
+ * the list, counting through each species in turn.  Each appearance has a
+ * different index, so it can address a place in a texture atlas shared by
+ * the whole list.
+ *
+ * \return The index, or -1 if the appearance is not one of that species'.
+ */
+int vtSpeciesList3d::GetAppearanceIndex(uint iSpecies,
+	const vtPlantAppearance3d *pa) const
+{
+	int index = 0;
+	for (uint i = 0; i < iSpecies; i++)
+		index += GetSpecies(i)->NumAppearances();
+
+	vtPlantSpecies3d *ps = GetSpecies(iSpecies);
+	for (uint j = 0; j < ps->NumAppearances(); j++)
+	{
+		if (ps->GetAppearance(j) == pa)
+			return index + j;
+	}
+	return -1;
+}
+
 /**
  * Create all of the appearances for all the species in this species list.
  */
@@ -576,6 +615,278 @@ void vtPlantInstance3d::ReleaseContents()
 }
 
 
+/////////////////////////////////////////////////////////////////////////////
+// PlantShaderDrawable
+//
+
+#ifndef APIENTRY
+#define APIENTRY
+#endif
+#ifndef GL_ARRAY_BUFFER
+#define GL_ARRAY_BUFFER		0x8892
+#endif
+#ifndef GL_STATIC_DRAW
+#define GL_STATIC_DRAW		0x88E4
+#endif
+
+// The OpenGL functions which PlantShaderDrawable needs beyond OpenGL 1.1,
+//  for each graphics context.
+struct PlantGLFunctions
+{
+	typedef void (APIENTRY *GenBuffersProc)(GLsizei n, GLuint *buffers);
+	typedef void (APIENTRY *DeleteBuffersProc)(GLsizei n, const GLuint *buffers);
+	typedef void (APIENTRY *BindBufferProc)(GLenum target, GLuint buffer);
+	typedef void (APIENTRY *BufferDataProc)(GLenum target, ptrdiff_t size, const GLvoid *data, GLenum usage);
+	typedef void (APIENTRY *VertexAttribPointerProc)(GLuint index, GLint size, GLenum type, GLboolean normalized, GLsizei stride, const GLvoid *pointer);
+	typedef void (APIENTRY *VertexAttribArrayProc)(GLuint index);
+	typedef void (APIENTRY *VertexAttrib3fProc)(GLuint index, GLfloat x, GLfloat y, GLfloat z);
+	typedef void (APIENTRY *VertexAttrib4fProc)(GLuint index, GLfloat x, GLfloat y, GLfloat z, GLfloat w);
+	typedef void (APIENTRY *VertexAttribDivisorProc)(GLuint index, GLuint divisor);
+	typedef void (APIENTRY *DrawArraysInstancedProc)(GLenum mode, GLint first, GLsizei count, GLsizei primcount);
+
+	PlantGLFunctions() : bInitialized(false), bInstanced(false) {}
+	void Init(uint contextID);
+
+	bool bInitialized;
+	bool bInstanced;	// True if the plants can be drawn with instancing
+
+	GenBuffersProc GenBuffers;
+	DeleteBuffersProc DeleteBuffers;
+	BindBufferProc BindBuffer;
+	BufferDataProc BufferData;
+	VertexAttribPointerProc VertexAttribPointer;
+	VertexAttribArrayProc EnableVertexAttribArray;
+	VertexAttribArrayProc DisableVertexAttribArray;
+	VertexAttrib3fProc VertexAttrib3f;
+	VertexAttrib4fProc VertexAttrib4f;
+	VertexAttribDivisorProc VertexAttribDivisor;
+	DrawArraysInstancedProc DrawArraysInstanced;
+};
+
+static osg::buffered_object<PlantGLFunctions> s_PlantGL;
+
+// This must be called with the context current.
+void PlantGLFunctions::Init(uint contextID)
+{
+	GenBuffers = NULL;
+	DeleteBuffers = NULL;
+	BindBuffer = NULL;
+	BufferData = NULL;
+	VertexAttribDivisor = NULL;
+	DrawArraysInstanced = NULL;
+	osg::setGLExtensionFuncPtr(VertexAttribPointer, "glVertexAttribPointer", "glVertexAttribPointerARB");
+	osg::setGLExtensionFuncPtr(EnableVertexAttribArray, "glEnableVertexAttribArray", "glEnableVertexAttribArrayARB");
+	osg::setGLExtensionFuncPtr(DisableVertexAttribArray, "glDisableVertexAttribArray", "glDisableVertexAttribArrayARB");
+	osg::setGLExtensionFuncPtr(VertexAttrib3f, "glVertexAttrib3f", "glVertexAttrib3fARB");
+	osg::setGLExtensionFuncPtr(VertexAttrib4f, "glVertexAttrib4f", "glVertexAttrib4fARB");
+
+	// Instancing needs vertex buffers, attribute divisors and instanced draws
+	if (osg::isGLExtensionOrVersionSupported(contextID, "GL_ARB_vertex_buffer_object", 1.5f) &&
+		osg::isGLExtensionOrVersionSupported(contextID, "GL_ARB_instanced_arrays", 3.3f) &&
+		osg::isGLExtensionOrVersionSupported(contextID, "GL_ARB_draw_instanced", 3.1f))
+	{
+		osg::setGLExtensionFuncPtr(GenBuffers, "glGenBuffers", "glGenBuffersARB");
+		osg::setGLExtensionFuncPtr(DeleteBuffers, "glDeleteBuffers", "glDeleteBuffersARB");
+		osg::setGLExtensionFuncPtr(BindBuffer, "glBindBuffer", "glBindBufferARB");
+		osg::setGLExtensionFuncPtr(BufferData, "glBufferData", "glBufferDataARB");
+		osg::setGLExtensionFuncPtr(VertexAttribDivisor, "glVertexAttribDivisor", "glVertexAttribDivisorARB");
+		osg::setGLExtensionFuncPtr(DrawArraysInstanced, "glDrawArraysInstanced", "glDrawArraysInstancedARB");
+	}
+	bInstanced = (GenBuffers && DeleteBuffers && BindBuffer && BufferData &&
+		VertexAttribPointer && EnableVertexAttribArray && DisableVertexAttribArray &&
+		VertexAttribDivisor && DrawArraysInstanced);
+	bInitialized = true;
+
+	VTLOG("Plant shaders: context %d %s instancing.\n", contextID,
+		bInstanced ? "supports" : "does not support");
+}
+
+// The buffers on the graphics card which are waiting to be deleted in their
+//  context, and the number of buffers in memory, all guarded by s_BufferMutex.
+typedef std::map<uint, std::vector<GLuint> > OrphanedBufferMap;
+static OrphanedBufferMap s_OrphanedBuffers;
+static int s_iNumBuffers = 0;
+static OpenThreads::Mutex s_BufferMutex;
+typedef OpenThreads::ScopedLock<OpenThreads::Mutex> BufferLock;
+
+PlantInstanceBuffer::PlantInstanceBuffer()
+{
+	BufferLock lock(s_BufferMutex);
+	s_iNumBuffers++;
+}
+
+PlantInstanceBuffer::~PlantInstanceBuffer()
+{
+	ReleaseAll();
+	BufferLock lock(s_BufferMutex);
+	s_iNumBuffers--;
+}
+
+/**
+ * Bind the buffer for drawing, copying it to the graphics card first if
+ * it hasn't been already.
+ */
+void PlantInstanceBuffer::Bind(uint contextID, const PlantGLFunctions &gl) const
+{
+	GLuint &id = m_BufferIds[contextID];
+	if (id == 0)
+	{
+		gl.GenBuffers(1, &id);
+		gl.BindBuffer(GL_ARRAY_BUFFER, id);
+		gl.BufferData(GL_ARRAY_BUFFER, m_Plants.size() * sizeof(PackedPlant),
+			m_Plants.empty() ? NULL : &m_Plants[0], GL_STATIC_DRAW);
+	}
+	else
+		gl.BindBuffer(GL_ARRAY_BUFFER, id);
+}
+
+// This must be called with the context current.
+void PlantInstanceBuffer::Release(uint contextID) const
+{
+	GLuint &id = m_BufferIds[contextID];
+	if (id != 0)
+	{
+		const PlantGLFunctions &gl = s_PlantGL[contextID];
+		if (gl.DeleteBuffers)
+			gl.DeleteBuffers(1, &id);
+		id = 0;
+	}
+}
+
+/**
+ * Release the copies on the graphics card in every context.  Since no
+ * context need be current, they are deleted later, by FlushDeleted.
+ */
+void PlantInstanceBuffer::ReleaseAll() const
+{
+	BufferLock lock(s_BufferMutex);
+	for (uint i = 0; i < m_BufferIds.size(); i++)
+	{
+		if (m_BufferIds[i] != 0)
+		{
+			s_OrphanedBuffers[i].push_back(m_BufferIds[i]);
+			m_BufferIds[i] = 0;
+		}
+	}
+}
+
+/**
+ * Delete the released buffers of a context.  This must be called with the
+ * context current.
+ */
+void PlantInstanceBuffer::FlushDeleted(uint contextID, const PlantGLFunctions &gl)
+{
+	BufferLock lock(s_BufferMutex);
+	OrphanedBufferMap::iterator it = s_OrphanedBuffers.find(contextID);
+	if (it == s_OrphanedBuffers.end() || it->second.empty())
+		return;
+	if (gl.DeleteBuffers)
+		gl.DeleteBuffers((GLsizei) it->second.size(), &it->second[0]);
+	it->second.clear();
+}
+
+/**
+ * The number of plant buffers in memory.  Each has at most one copy on the
+ * graphics card per context, which is deleted soon after the buffer is.
+ */
+int PlantInstanceBuffer::NumBuffers()
+{
+	BufferLock lock(s_BufferMutex);
+	return s_iNumBuffers;
+}
+
+void PlantShaderDrawable::drawImplementation(osg::RenderInfo &renderInfo) const
+{
+	if (!_buffer.valid() || _count == 0)
+		return;
+
+	osg::State &state = *renderInfo.getState();
+	const uint contextID = state.getContextID();
+	PlantGLFunctions &gl = s_PlantGL[contextID];
+	if (!gl.bInitialized)
+		gl.Init(contextID);
+	if (gl.bInstanced)
+		PlantInstanceBuffer::FlushDeleted(contextID, gl);
+
+	if (!gl.bInstanced)
+	{
+		if (!gl.VertexAttrib3f || !gl.VertexAttrib4f)
+			return;
+
+		// Draw the plants one at a time, passing the data of each as the
+		//  current value of the attributes.
+		const PackedPlant *pp = &_buffer->m_Plants[_first];
+		for (uint i = 0; i < _count; i++, pp++)
+		{
+			gl.VertexAttrib3f(PLANT_POSITION_ATTRIB, pp->pos[0], pp->pos[1], pp->pos[2]);
+			gl.VertexAttrib4f(PLANT_DATA_ATTRIB, pp->height, pp->appearance,
+				pp->rotation, pp->reserved);
+			_geometry->draw(renderInfo);
+		}
+		return;
+	}
+
+	// The corners of the quads are shared by all the plants
+	const osg::Array *verts = _geometry->getVertexArray();
+	const osg::Array *coords = _geometry->getTexCoordArray(0);
+	state.unbindVertexBufferObject();
+	state.setVertexPointer(3, GL_FLOAT, 0, verts->getDataPointer());
+	state.setTexCoordPointer(0, 2, GL_FLOAT, 0, coords->getDataPointer());
+
+	// The data for each plant comes from the buffer, one plant per instance
+	_buffer->Bind(contextID, gl);
+	const GLsizei stride = sizeof(PackedPlant);
+	const char *base = (const char *) (size_t) (_first * sizeof(PackedPlant));
+	gl.VertexAttribPointer(PLANT_POSITION_ATTRIB, 3, GL_FLOAT, GL_FALSE, stride, base);
+	gl.VertexAttribPointer(PLANT_DATA_ATTRIB, 4, GL_UNSIGNED_SHORT, GL_FALSE, stride,
+		base + 3 * sizeof(float));
+	gl.EnableVertexAttribArray(PLANT_POSITION_ATTRIB);
+	gl.EnableVertexAttribArray(PLANT_DATA_ATTRIB);
+	gl.VertexAttribDivisor(PLANT_POSITION_ATTRIB, 1);
+	gl.VertexAttribDivisor(PLANT_DATA_ATTRIB, 1);
+	gl.BindBuffer(GL_ARRAY_BUFFER, 0);
+
+	gl.DrawArraysInstanced(GL_QUADS, 0, 8, _count);
+
+	// Leave the attributes as OSG expects to find them
+	gl.VertexAttribDivisor(PLANT_POSITION_ATTRIB, 0);
+	gl.VertexAttribDivisor(PLANT_DATA_ATTRIB, 0);
+	gl.DisableVertexAttribArray(PLANT_POSITION_ATTRIB);
+	gl.DisableVertexAttribArray(PLANT_DATA_ATTRIB);
+}
+
+osg::BoundingBox PlantShaderDrawable::computeBound() const
+{
+	osg::BoundingBox bb;
+	if (!_buffer.valid() || _count == 0)
+		return bb;
+
+	// The quads can turn to any angle about the vertical
+	const PackedPlant *pp = &_buffer->m_Plants[_first];
+	for (uint i = 0; i < _count; i++, pp++)
+	{
+		const float height = pp->height * 0.01f;
+		const float r = _halfWidth * height;
+		bb.expandBy(pp->pos[0] - r, pp->pos[1], pp->pos[2] - r);
+		bb.expandBy(pp->pos[0] + r, pp->pos[1] + height, pp->pos[2] + r);
+	}
+	return bb;
+}
+
+void PlantShaderDrawable::releaseGLObjects(osg::State *state) const
+{
+	osg::Drawable::releaseGLObjects(state);
+	if (_geometry.valid())
+		_geometry->releaseGLObjects(state);
+	if (!_buffer.valid())
+		return;
+	if (state)
+		_buffer->Release(state->getContextID());
+	else
+		_buffer->ReleaseAll();
+}
+
+
 /////////////////////////////////////////////////////////////////////////////
 // Cell used to divide the PlantInstances into a heirarchy of LOD nodes,
 // for culling by distance.
@@ -600,122 +911,147 @@ void PlantCell::computeBound()
 	}
 }
 
-bool PlantCell::divide(unsigned int maxNumTreesPerCell)
+// While cells are being divided, the trees stay in one list, and each cell
+//  is a range of that list.
+struct PlantCellRange
 {
-	if (_trees.size() <= maxNumTreesPerCell)
-		return false;
-
-	computeBound();
+	PlantCell *cell;
+	uint begin, end;
+};
 
-	float radius = _bb.radius();
-	float divide_distance = radius*0.7f;
-	if (divide((_bb.xMax()-_bb.xMin())>divide_distance,
-			   (_bb.yMax()-_bb.yMin())>divide_distance,
-			   (_bb.zMax()-_bb.zMin())>divide_distance))
-	{
-		// recusively divide the new cells till maxNumTreesPerCell is met.
-		for(CellList::iterator citr=_cells.begin(); citr!=_cells.end(); ++citr)
-		{
-			(*citr)->divide(maxNumTreesPerCell);
-		}
-		return true;
-   }
-   else
-		return false;
-}
-
-bool PlantCell::divide(bool xAxis, bool yAxis, bool zAxis)
+// The working storage for PlantCell::divide, one entry for each tree.
+struct PlantCellDivider
 {
-	if (!(xAxis || yAxis || zAxis))
-		return false;
+	TreeList trees;
+	TreeList scratch;
+	std::vector<uchar> octant;
+	uint maxNumTreesPerCell;
 
-	if (_cells.empty())
-		_cells.push_back(new PlantCell(_bb));
+	void divideRange(const PlantCellRange &range, std::vector<PlantCellRange> &children);
+};
 
-	if (xAxis)
+/**
+ * Divide one cell's range of trees among up to 8 child cells, as evenly
+ * sized boxes.  The range is reordered so that the trees of each child are
+ * together, in the same order as before (a counting sort on the octant).
+ * Cells which are small enough, or can't be divided, become leaves and
+ * get their own list of trees.
+ */
+void PlantCellDivider::divideRange(const PlantCellRange &range,
+	std::vector<PlantCellRange> &children)
+{
+	PlantCell *cell = range.cell;
+	const uint begin = range.begin, end = range.end;
+	if (end - begin <= maxNumTreesPerCell)
 	{
-		unsigned int numCellsToDivide = _cells.size();
-		for(unsigned int i=0; i < numCellsToDivide; ++i)
-		{
-			PlantCell* orig_cell = _cells[i].get();
-			PlantCell* new_cell = new PlantCell(orig_cell->_bb);
-
-			float xCenter = (orig_cell->_bb.xMin()+orig_cell->_bb.xMax())*0.5f;
-			orig_cell->_bb.xMax() = xCenter;
-			new_cell->_bb.xMin() = xCenter;
-
-			_cells.push_back(new_cell);
-		}
+		cell->_trees.assign(trees.begin() + begin, trees.begin() + end);
+		return;
 	}
-	if (yAxis)
+
+	osg::BoundingBox &bb = cell->_bb;
+	bb.init();
+	uint i;
+	for (i = begin; i < end; i++)
+		bb.expandBy(trees[i].m_pos);
+
+	// Divide along the axes on which the cell is long enough
+	float divide_distance = bb.radius()*0.7f;
+	const bool xAxis = (bb.xMax()-bb.xMin()) > divide_distance;
+	const bool yAxis = (bb.yMax()-bb.yMin()) > divide_distance;
+	const bool zAxis = (bb.zMax()-bb.zMin()) > divide_distance;
+	if (!(xAxis || yAxis || zAxis))
 	{
-		unsigned int numCellsToDivide = _cells.size();
-		for(unsigned int i=0; i < numCellsToDivide; ++i)
-		{
-			PlantCell* orig_cell = _cells[i].get();
-			PlantCell* new_cell = new PlantCell(orig_cell->_bb);
+		cell->_trees.assign(trees.begin() + begin, trees.begin() + end);
+		return;
+	}
 
-			float yCenter = (orig_cell->_bb.yMin()+orig_cell->_bb.yMax())*0.5f;
-			orig_cell->_bb.yMax() = yCenter;
-			new_cell->_bb.yMin() = yCenter;
+	// The children are numbered with a bit for each divided axis, x lowest.
+	//  A tree exactly on a dividing plane goes in the lower child.
+	const int ybit = xAxis ? 1 : 0;
+	const int zbit = ybit + (yAxis ? 1 : 0);
+	const int num_children = 1 << (zbit + (zAxis ? 1 : 0));
+	const osg::Vec3 center((bb.xMin()+bb.xMax())*0.5f,
+		(bb.yMin()+bb.yMax())*0.5f, (bb.zMin()+bb.zMax())*0.5f);
 
-			_cells.push_back(new_cell);
-		}
+	uint count[8] = { 0, 0, 0, 0, 0, 0, 0, 0 };
+	for (i = begin; i < end; i++)
+	{
+		const osg::Vec3 &pos = trees[i].m_pos;
+		uchar c = 0;
+		if (xAxis && pos.x() > center.x()) c |= 1;
+		if (yAxis && pos.y() > center.y()) c |= (1 << ybit);
+		if (zAxis && pos.z() > center.z()) c |= (1 << zbit);
+		octant[i] = c;
+		count[c]++;
 	}
-	if (zAxis)
+	uint start[8], next = begin;
+	for (int c = 0; c < num_children; c++)
 	{
-		unsigned int numCellsToDivide = _cells.size();
-		for(unsigned int i=0; i < numCellsToDivide; ++i)
-		{
-			PlantCell* orig_cell = _cells[i].get();
-			PlantCell* new_cell = new PlantCell(orig_cell->_bb);
-
-			float zCenter = (orig_cell->_bb.zMin()+orig_cell->_bb.zMax())*0.5f;
-			orig_cell->_bb.zMax() = zCenter;
-			new_cell->_bb.zMin() = zCenter;
-
-			_cells.push_back(new_cell);
-		}
+		start[c] = next;
+		next += count[c];
 	}
-	bin();
-	return true;
-}
+	for (i = begin; i < end; i++)
+		scratch[start[octant[i]]++] = trees[i];
+	std::copy(scratch.begin() + begin, scratch.begin() + end, trees.begin() + begin);
 
-void PlantCell::bin()
-{   
-	// put trees in appropriate cells.
-	TreeList treesNotAssigned;
-	for(TreeList::iterator titr=_trees.begin(); titr!=_trees.end(); ++titr)
+	// Make a cell for each octant which has any trees
+	next = begin;
+	for (int c = 0; c < num_children; c++)
 	{
-		const vtPlantInstanceShader &tree = *titr;
-		bool assigned = false;
-		for(CellList::iterator citr=_cells.begin();
-			citr!=_cells.end() && !assigned;
-			++citr)
-		{
-			if ((*citr)->contains(tree.m_pos))
-			{
-				(*citr)->addTree(tree);
-				assigned = true;
-			}
-		}
-		if (!assigned) treesNotAssigned.push_back(tree);
+		if (count[c] == 0)
+			continue;
+		PlantCell *child = new PlantCell(bb);
+		if (xAxis) ((c & 1) ? child->_bb.xMin() : child->_bb.xMax()) = center.x();
+		if (yAxis) ((c & (1 << ybit)) ? child->_bb.yMin() : child->_bb.yMax()) = center.y();
+		if (zAxis) ((c & (1 << zbit)) ? child->_bb.zMin() : child->_bb.zMax()) = center.z();
+		cell->_cells.push_back(child);
+
+		PlantCellRange r;
+		r.cell = child;
+		r.begin = next;
+		r.end = next + count[c];
+		children.push_back(r);
+		next += count[c];
 	}
+}
 
-	// put the unassigned trees back into the original local tree list.
-	_trees.swap(treesNotAssigned);
-
+/**
+ * Divide the trees of this cell into a hierarchy of cells, until there are
+ * no more than the given number in each cell.
+ *
+ * The hierarchy is built a level at a time.  Dividing each cell is a
+ * single pass over its trees, and the cells of each level are divided at
+ * the same time on all processors (when vtlib is built with OpenMP).
+ */
+bool PlantCell::divide(unsigned int maxNumTreesPerCell)
+{
+	if (_trees.size() <= maxNumTreesPerCell)
+		return false;
 
-	// prune empty cells.
-	CellList cellsNotEmpty;
-	for(CellList::iterator citr=_cells.begin(); citr!=_cells.end(); ++citr)
+	PlantCellDivider divider;
+	divider.trees.swap(_trees);
+	divider.scratch.resize(divider.trees.size());
+	divider.octant.resize(divider.trees.size());
+	divider.maxNumTreesPerCell = maxNumTreesPerCell;
+
+	std::vector<PlantCellRange> level(1), next;
+	level[0].cell = this;
+	level[0].begin = 0;
+	level[0].end = divider.trees.size();
+	while (!level.empty())
 	{
-		if (!((*citr)->_trees.empty()))
-		{
-			cellsNotEmpty.push_back(*citr);
-		}
+		const int num = (int) level.size();
+		std::vector< std::vector<PlantCellRange> > children(num);
+#pragma omp parallel for schedule(dynamic, 1)
+		for (int i = 0; i < num; i++)
+			divider.divideRange(level[i], children[i]);
+
+		next.clear();
+		for (int i = 0; i < num; i++)
+			next.insert(next.end(), children[i].begin(), children[i].end());
+		level.swap(next);
 	}
-	_cells.swap(cellsNotEmpty);
+	return true;
 }
 
 /////////////////////////////////////////////////////////////////////////////
@@ -771,22 +1107,20 @@ osg::Geometry *MakeOrthogonalQuads(float w, float h)
 	// set up the coords
 	osg::Vec3Array &v = *(new osg::Vec3Array(8));
 	osg::Vec2Array &t = *(new osg::Vec2Array(8));
-	
-	// This provides a random orientation, but due to the way we're re-using
-	// the geometry, it's only random per PlantCell.
-	float rotation = random(osg::PI/2.0f);
-	float sw = sinf(rotation)*w*0.5f;
-	float cw = cosf(rotation)*w*0.5f;
-
-	v[0].set(-sw, 0.0f, -cw);
-	v[1].set(+sw, 0.0f,  cw);
-	v[2].set(+sw, h,	 cw);
-	v[3].set(-sw, h,	-cw);
-
-	v[4].set(-cw, 0.0f,  sw);
-	v[5].set(+cw, 0.0f, -sw);
-	v[6].set(+cw, h,	-sw);
-	v[7].set(-cw, h,	 sw);
+
+	// The quads are not rotated here; the shader gives each plant its own
+	//  random rotation.
+	const float hw = w*0.5f;
+
+	v[0].set(0.0f, 0.0f, -hw);
+	v[1].set(0.0f, 0.0f,  hw);
+	v[2].set(0.0f, h,	  hw);
+	v[3].set(0.0f, h,	 -hw);
+
+	v[4].set(-hw, 0.0f, 0.0f);
+	v[5].set( hw, 0.0f, 0.0f);
+	v[6].set( hw, h,	0.0f);
+	v[7].set(-hw, h,	0.0f);
 
 	t[0].set(0.0f, 0.0f);
 	t[1].set(1.0f, 0.0f);
@@ -805,34 +1139,103 @@ osg::Geometry *MakeOrthogonalQuads(float w, float h)
 	return geom;
 }
 
-void vtPlantInstanceArray3d::AddShaderGeometryForPlant(PlantCell *cell,
-	vtPlantInstanceShader &pi)
+/**
+ * Pack plants for PlantShaderDrawable, grouped by appearance so that the
+ * plants of each appearance are a contiguous range.  Each plant is given its
+ * appearance's index in the whole species list, and a random rotation.
+ * Plants whose species or appearance can't be found are left out.
+ *
+ * \param trees The plants to pack.
+ * \param species The species list which the plants' species ids refer to.
+ * \param plants Receives the packed plants.
+ * \param appearances Receives the appearances, in the order of their ranges.
+ * \param count Receives the number of plants of each appearance.
+ */
+void PackPlants(const TreeList &trees, const vtSpeciesList3d *species,
+	std::vector<PackedPlant> &plants,
+	std::vector<vtPlantAppearance3d*> &appearances, std::vector<uint> &count)
 {
-	vtPlantSpecies3d *ps = GetPlantList()->GetSpecies(pi.m_species_id);
-	if (!ps)
-		return;
+	const uint num = trees.size();
+	appearances.clear();
+	count.clear();
+
+	// Find the appearance of each plant
+	std::vector<int> global;
+	std::vector<int> which(num, -1);
+	uint i, a;
+	for (i = 0; i < num; i++)
+	{
+		const vtPlantInstanceShader &pi = trees[i];
+		vtPlantSpecies3d *ps = species->GetSpecies(pi.m_species_id);
+		if (!ps)
+			continue;
+		vtPlantAppearance3d *pa = ps->GetAppearanceByHeight(pi.m_size);
+		if (!pa)
+			continue;
 
-	vtPlantAppearance3d *pa = ps->GetAppearanceByHeight(pi.m_size);
-	if (!pa)
-		return;
+		// A cell only has a few appearances, so a simple search is fine
+		for (a = 0; a < appearances.size(); a++)
+			if (appearances[a] == pa)
+				break;
+		if (a == appearances.size())
+		{
+			appearances.push_back(pa);
+			global.push_back(species->GetAppearanceIndex(pi.m_species_id, pa));
+			count.push_back(0);
+		}
+		which[i] = a;
+		count[a]++;
+	}
 
-	// Do we already have a shader geometry for this species appearance?
-	PlantShaderDrawable *psd;
-	PlantShaderMap::iterator it = cell->m_ShaderDrawables.find(pa);
-	if (it == cell->m_ShaderDrawables.end())
+	// Pack them, grouped by appearance
+	std::vector<uint> next(appearances.size());
+	uint total = 0;
+	for (a = 0; a < appearances.size(); a++)
 	{
-		// Create and add to map
-		psd = MakePlantShaderDrawable(cell, pa);
-		cell->m_ShaderDrawables[pa] = psd;
+		next[a] = total;
+		total += count[a];
 	}
-	else
-		psd = it->second;
+	plants.resize(total);
+	for (i = 0; i < num; i++)
+	{
+		if (which[i] == -1)
+			continue;
+		const vtPlantInstanceShader &pi = trees[i];
+		PackedPlant &pp = plants[next[which[i]]++];
+		pp.pos[0] = pi.m_pos.x();
+		pp.pos[1] = pi.m_pos.y();
+		pp.pos[2] = pi.m_pos.z();
+		const float cm = pi.m_size * 100.0f + 0.5f;
+		pp.height = (unsigned short) (cm < 0 ? 0 : cm > 65535 ? 65535 : cm);
+		pp.appearance = (unsigned short) std::min(global[which[i]], 65535);
+		pp.rotation = (unsigned short) std::min((int) random(65536.0f), 65535);
+		pp.reserved = 0;
+	}
+}
 
-	psd->addPlant(osg::Vec4(pi.m_pos.x(), pi.m_pos.y(), pi.m_pos.z(), pi.m_size));
+/**
+ * Pack the plants of a cell into one buffer, grouped by appearance, and
+ * make a drawable for each appearance to draw its range of the buffer.
+ */
+void vtPlantInstanceArray3d::CreateShaderDrawables(PlantCell *cell)
+{
+	PlantInstanceBuffer *buffer = new PlantInstanceBuffer;
+	std::vector<vtPlantAppearance3d*> appearances;
+	std::vector<uint> count;
+	PackPlants(cell->_trees, GetPlantList(), buffer->m_Plants, appearances,
+		count);
+
+	uint first = 0;
+	for (uint a = 0; a < appearances.size(); a++)
+	{
+		cell->m_ShaderDrawables[appearances[a]] = MakePlantShaderDrawable(cell,
+			appearances[a], buffer, first, count[a]);
+		first += count[a];
+	}
 }
 
 PlantShaderDrawable *vtPlantInstanceArray3d::MakePlantShaderDrawable(PlantCell *cell,
-	vtPlantAppearance3d *pa)
+	vtPlantAppearance3d *pa, PlantInstanceBuffer *buffer, uint first, uint count)
 {
 	osg::StateSet *stateset = pa->GetOrCreateShaderStateset();
 
@@ -842,7 +1245,8 @@ PlantShaderDrawable *vtPlantInstanceArray3d::MakePlantShaderDrawable(PlantCell *
 	osg::Geometry* two_quads = MakeOrthogonalQuads(width, 1.0f);
 
 	PlantShaderDrawable *shader_drawable = new PlantShaderDrawable;
-	shader_drawable->setGeometry(two_quads);
+	shader_drawable->setGeometry(two_quads, width * 0.5f);
+	shader_drawable->setPlants(buffer, first, count);
 
 	osg::Geode* geode = new osg::Geode;
 	geode->setStateSet(stateset);
@@ -874,14 +1278,7 @@ osg::Node *vtPlantInstanceArray3d::CreateCellNodes(PlantCell *cell)
 	cell->m_group = new osg::GroupLOD;
 
 	if (needTrees)
-	{
-		for (TreeList::iterator itr=cell->_trees.begin();
-			itr!=cell->_trees.end(); ++itr)
-		{
-			vtPlantInstanceShader& tree = *itr;
-			AddShaderGeometryForPlant(cell, tree);
-		}
-	}
+		CreateShaderDrawables(cell);
 	else if (needGroup)
 	{
 		for (PlantCell::CellList::iterator itr=cell->_cells.begin();
@@ -905,21 +1302,29 @@ int vtPlantInstanceArray3d::CreatePlantShaderNodes(bool progress_dialog(int))
 {
 	VTLOG1(" Creating OpenGL shader based vegetation...\n");
 
-	FPoint3 p3;
 	uint num_plants = GetNumEntities();
 
 	// Create cell subdivision
 	osg::ref_ptr<PlantCell> cell = new PlantCell;
 	cell->reserveTrees(num_plants);
 
+	// Drape the plants on the surface in batches, which the heightfield
+	//  can do much faster than one at a time.
+	const uint batch = 65536;
+	std::vector<FPoint3> p3(batch);
 	vtPlantInstanceShader pi;
-	for (uint i = 0; i < num_plants; i++)
+	for (uint first = 0; first < num_plants; first += batch)
 	{
-		GetPlant(i, pi.m_size, pi.m_species_id);
-		m_pHeightField->ConvertEarthToSurfacePoint(GetPoint(i), p3);
-		pi.m_pos.set(p3.x, p3.y, p3.z);
-
-		cell->addTree(pi);
+		const uint count = std::min(batch, num_plants - first);
+		m_pHeightField->ConvertEarthToSurfacePoints(&GetPoint(first), &p3[0], count);
+		for (uint i = 0; i < count; i++)
+		{
+			GetPlant(first + i, pi.m_size, pi.m_species_id);
+			pi.m_pos.set(p3[i].x, p3[i].y, p3[i].z);
+			cell->addTree(pi);
+		}
+		if (progress_dialog != NULL)
+			progress_dialog(first * 100 / num_plants);
 	}
 	cell->divide(kMaxPlantsPerCell);
 #if VTDEBUG
@@ -936,6 +1341,174 @@ int vtPlantInstanceArray3d::CreatePlantShaderNodes(bool progress_dialog(int))
 	return GetNumEntities();
 }
 
+/**
+ * Prepare to page shader vegetation from a tiled (version 3) VF file,
+ * instead of loading all the plants at once.  Only the header of the file
+ * is read; the plants near the camera are then loaded, a tile at a time,
+ * by DoTilePaging.  The plants are not added to this array.
+ *
+ * The heightfield and species list must already be set.
+ *
+ * \return true if the file is a tiled VF file.
+ */
+bool vtPlantInstanceArray3d::OpenPlantTiles(const char *fname)
+{
+	if (!m_pPlantList || !m_pHeightField)
+		return false;
+	if (!m_TileFile.Open(fname))
+		return false;
+
+	VTLOG1(" Paging OpenGL shader based vegetation...\n");
+
+	m_TileSpecies.clear();
+	for (uint i = 0; i < m_TileFile.NumSpecies(); i++)
+	{
+		const char *name = m_TileFile.GetSpeciesName(i);
+		short species_id = m_pPlantList->GetSpeciesIdByName(name);
+		if (species_id == -1)
+			VTLOG("  Unknown species: %s\n", name);
+		m_TileSpecies.push_back(species_id);
+	}
+	m_pHeightField->m_Conversion.ConvertFromEarth(m_TileFile.GetExtents(),
+		m_TileWorldExtents);
+
+	m_TileCells.clear();
+	m_TileCells.resize(m_TileFile.NumColumns() * m_TileFile.NumRows());
+	m_LoadedTiles.clear();
+
+	m_group = new vtGroup;
+	m_group->setName("VegGroup");
+	return true;
+}
+
+/**
+ * Load the tiles of plants near the camera, and unload those which are far
+ * away.  Call this regularly, e.g. each frame, after OpenPlantTiles.
+ *
+ * \param CamPos The camera position, in world coordinates.
+ * \param fDistance Tiles which come within this distance of the camera are
+ *		loaded.  They are unloaded again once they are 25% further away.
+ * \param iMaxLoad The most tiles to load in one call, nearest first.
+ * \return The number of tiles which are in range but not yet loaded.
+ */
+int vtPlantInstanceArray3d::DoTilePaging(const FPoint3 &CamPos, float fDistance,
+										 int iMaxLoad)
+{
+	if (!m_TileFile.IsOpen())
+		return 0;
+
+	const int cols = m_TileFile.NumColumns(), rows = m_TileFile.NumRows();
+	const float fWidth = (m_TileWorldExtents.right - m_TileWorldExtents.left) / cols;
+	const float fDepth = (m_TileWorldExtents.top - m_TileWorldExtents.bottom) / rows;
+	const float fRadius = sqrtf(fWidth * fWidth + fDepth * fDepth) / 2;
+	const float fUnload = fDistance * 1.25f;
+
+	// Unload the tiles which are now too far away
+	uint i;
+	for (i = 0; i < m_LoadedTiles.size(); )
+	{
+		const int index = m_LoadedTiles[i];
+		const float x = m_TileWorldExtents.left + (index % cols + 0.5f) * fWidth;
+		const float z = m_TileWorldExtents.bottom + (index / cols + 0.5f) * fDepth;
+		const float fDist = FPoint2(x - CamPos.x, z - CamPos.z).Length() - fRadius;
+		if (fDist > fUnload)
+			UnloadPlantTile(index);
+		else
+			i++;
+	}
+
+	// Look at only the part of the grid which can be in range
+	float c0 = (CamPos.x - fDistance - fRadius - m_TileWorldExtents.left) / fWidth;
+	float c1 = (CamPos.x + fDistance + fRadius - m_TileWorldExtents.left) / fWidth;
+	float r0 = (CamPos.z - fDistance - fRadius - m_TileWorldExtents.bottom) / fDepth;
+	float r1 = (CamPos.z + fDistance + fRadius - m_TileWorldExtents.bottom) / fDepth;
+	if (c0 > c1) std::swap(c0, c1);
+	if (r0 > r1) std::swap(r0, r1);
+	const int col0 = std::max(0, (int) floorf(c0)), col1 = std::min(cols - 1, (int) floorf(c1));
+	const int row0 = std::max(0, (int) floorf(r0)), row1 = std::min(rows - 1, (int) floorf(r1));
+
+	// Find the tiles which should be loaded, nearest first
+	std::vector< std::pair<float,int> > wanted;
+	for (int row = row0; row <= row1; row++)
+	{
+		for (int col = col0; col <= col1; col++)
+		{
+			const int index = row * cols + col;
+			if (m_TileCells[index].valid() || m_TileFile.NumPlantsInTile(col, row) == 0)
+				continue;
+			const float x = m_TileWorldExtents.left + (col + 0.5f) * fWidth;
+			const float z = m_TileWorldExtents.bottom + (row + 0.5f) * fDepth;
+			const float fDist = FPoint2(x - CamPos.x, z - CamPos.z).Length() - fRadius;
+			if (fDist < fDistance)
+				wanted.push_back(std::pair<float,int>(fDist, index));
+		}
+	}
+	std::sort(wanted.begin(), wanted.end());
+
+	int loaded = 0;
+	for (i = 0; i < wanted.size() && loaded < iMaxLoad; i++, loaded++)
+		LoadPlantTile(wanted[i].second);
+
+	return (int) wanted.size() - loaded;
+}
+
+void vtPlantInstanceArray3d::LoadPlantTile(int index)
+{
+	const int col = index % m_TileFile.NumColumns();
+	const int row = index / m_TileFile.NumColumns();
+	const uint count = m_TileFile.NumPlantsInTile(col, row);
+
+	std::vector<DPoint2> epos(count);
+	std::vector<FPoint3> p3(count);
+	std::vector<float> sizes(count);
+	std::vector<unsigned short> species(count);
+	for (uint i = 0; i < count; i++)
+		m_TileFile.GetPlant(col, row, i, epos[i], sizes[i], species[i]);
+	m_pHeightField->ConvertEarthToSurfacePoints(&epos[0], &p3[0], count);
+
+	osg::ref_ptr<PlantCell> cell = new PlantCell;
+	cell->reserveTrees(count);
+	vtPlantInstanceShader pi;
+	for (uint i = 0; i < count; i++)
+	{
+		if (species[i] >= m_TileSpecies.size() || m_TileSpecies[species[i]] == -1)
+			continue;
+		pi.m_pos.set(p3[i].x, p3[i].y, p3[i].z);
+		pi.m_size = sizes[i];
+		pi.m_species_id = m_TileSpecies[species[i]];
+		cell->addTree(pi);
+	}
+	cell->divide(kMaxPlantsPerCell);
+	CreateCellNodes(cell.get());
+	m_group->addChild(cell->m_group);
+
+	m_TileCells[index] = cell;
+	m_LoadedTiles.push_back(index);
+}
+
+void vtPlantInstanceArray3d::UnloadPlantTile(int index)
+{
+	PlantCell *cell = m_TileCells[index].get();
+	if (!cell)
+		return;
+	// The drawables go away with the cell's group, so release them first
+	ReleaseCellGLObjects(cell);
+	m_group->removeChild(cell->m_group);
+	m_TileCells[index] = NULL;
+	m_LoadedTiles.erase(std::find(m_LoadedTiles.begin(), m_LoadedTiles.end(), index));
+}
+
+// Release the drawables of a cell and its children.  Their statesets are
+//  shared by every cell, so they are left alone.
+void vtPlantInstanceArray3d::ReleaseCellGLObjects(PlantCell *cell)
+{
+	PlantShaderMap::iterator it;
+	for (it = cell->m_ShaderDrawables.begin(); it != cell->m_ShaderDrawables.end(); it++)
+		it->second->releaseGLObjects();
+	for (uint i = 0; i < cell->_cells.size(); i++)
+		ReleaseCellGLObjects(cell->_cells[i].get());
+}
+
 bool vtPlantInstanceArray3d::CreatePlantNode(uint i)
 {
 	// If it was already constructed, destruct so we can build again
@@ -16,6 +16,8 @@
 /*@{*/
 
 #include "vtdata/Plants.h"
+#include "vtdata/PlantTileFile.h"
+#include <osg/buffered_value>
 
 class vtHeightField3d;
 
@@ -25,57 +27,100 @@ class vtHeightField3d;
 #include "\dism\xfrog2dism\xfrog2dism.h"
 #endif
 
+// The vertex attributes which carry each plant's data to the shader
+#define PLANT_POSITION_ATTRIB	6
+#define PLANT_DATA_ATTRIB		7
+
+/**
+ * The data for one plant drawn by PlantShaderDrawable, packed into 20 bytes.
+ * The shader reads the last 8 bytes as four unsigned shorts.
+ */
+struct PackedPlant
+{
+	float pos[3];				// Base of the plant, in world coordinates
+	unsigned short height;		// In centimeters
+	unsigned short appearance;	// See vtSpeciesList3d::GetAppearanceIndex
+	unsigned short rotation;	// About the vertical axis, 0-65535 for a full turn
+	unsigned short reserved;	// Keeps the size a multiple of 4 bytes
+};
+
+struct PlantGLFunctions;
+
+/**
+ * The plants of one cell, packed into a single buffer which is copied to
+ * the graphics card the first time it is drawn.  The plants are grouped by
+ * appearance, so the plants of each appearance are a contiguous range.
+ *
+ * The copies on the graphics card can only be deleted with their context
+ * current, so when the buffer is released without a context, or destroyed,
+ * they are queued and deleted the next time plants are drawn in that
+ * context, as OSG does for its own buffer objects.
+ */
+class PlantInstanceBuffer : public osg::Referenced
+{
+public:
+	PlantInstanceBuffer();
+
+	std::vector<PackedPlant> m_Plants;
+
+	void Bind(uint contextID, const PlantGLFunctions &gl) const;
+	void Release(uint contextID) const;
+	void ReleaseAll() const;
+
+	static void FlushDeleted(uint contextID, const PlantGLFunctions &gl);
+	static int NumBuffers();
+
+protected:
+	virtual ~PlantInstanceBuffer();
+	mutable osg::buffered_value<GLuint> m_BufferIds;
+};
+
+/**
+ * Draws a range of the plants in a PlantInstanceBuffer, all of which have
+ * the same appearance.  Each plant is a pair of crossed quads, which the
+ * shader scales, rotates and moves into place.  When the graphics card
+ * supports instancing, all the plants are drawn with a single call.
+ */
 class PlantShaderDrawable : public osg::Drawable
 {
 public:
-	PlantShaderDrawable() { setUseDisplayList(false); }
+	PlantShaderDrawable() : _halfWidth(0), _first(0), _count(0) { setUseDisplayList(false); }
 
 	/** Copy constructor using CopyOp to manage deep vs shallow copy.*/
 	PlantShaderDrawable(const PlantShaderDrawable& PlantShaderDrawable,
 						const osg::CopyOp& copyop=osg::CopyOp::SHALLOW_COPY) :
-		osg::Drawable(PlantShaderDrawable,copyop) {}
+		osg::Drawable(PlantShaderDrawable,copyop),
+		_geometry(PlantShaderDrawable._geometry),
+		_halfWidth(PlantShaderDrawable._halfWidth),
+		_buffer(PlantShaderDrawable._buffer),
+		_first(PlantShaderDrawable._first),
+		_count(PlantShaderDrawable._count) {}
 
 	META_Object(osg,PlantShaderDrawable)
 
-	typedef std::vector<osg::Vec4> VecVec4;
-
-	virtual void drawImplementation(osg::RenderInfo &renderInfo) const
-	{
-		for (VecVec4::const_iterator itr = _psizelist.begin();
-			itr != _psizelist.end(); ++itr)
-		{
-			renderInfo.getState()->Color((*itr)[0],(*itr)[1],(*itr)[2],(*itr)[3]);
-			_geometry->draw(renderInfo);
-		}
-	}
+	virtual void drawImplementation(osg::RenderInfo &renderInfo) const;
+	virtual osg::BoundingBox computeBound() const;
+	virtual void releaseGLObjects(osg::State *state = 0) const;
 
-	virtual osg::BoundingBox computeBound() const
-	{
-		osg::BoundingBox geom_box = _geometry->getBound();
-		osg::BoundingBox bb;
-		for (VecVec4::const_iterator itr = _psizelist.begin();
-			 itr != _psizelist.end(); ++itr)
-		{
-			bb.expandBy(geom_box.corner(0)*(*itr)[3] +
-				osg::Vec3( (*itr)[0], (*itr)[1], (*itr)[2] ));
-			bb.expandBy(geom_box.corner(7)*(*itr)[3] +
-				osg::Vec3( (*itr)[0], (*itr)[1], (*itr)[2] ));
-		}
-		return bb;
-	}
-	void setGeometry(osg::Geometry* geometry)
+	/// The quads for one plant, of height 1, and half their width.
+	void setGeometry(osg::Geometry* geometry, float halfWidth)
 	{
 		_geometry = geometry;
+		_halfWidth = halfWidth;
 	}
-	void addPlant(const osg::Vec4& pos_height)
+	void setPlants(PlantInstanceBuffer *buffer, uint first, uint count)
 	{
-		_psizelist.push_back(pos_height);
+		_buffer = buffer;
+		_first = first;
+		_count = count;
 	}
 
 protected:
 	virtual ~PlantShaderDrawable() {}
 	osg::ref_ptr<osg::Geometry> _geometry;
-	VecVec4 _psizelist;
+	float _halfWidth;
+	osg::ref_ptr<PlantInstanceBuffer> _buffer;
+	uint _first, _count;
 };
 
 /**
@@ -162,6 +207,8 @@ public:
 
 	// override a method of vtSpeciesList
 	vtPlantSpecies3d *GetSpecies(uint i) const;
+
+	int GetAppearanceIndex(uint iSpecies, const vtPlantAppearance3d *pa) const;
 };
 
 /**
@@ -193,6 +240,10 @@ struct vtPlantInstanceShader : public osg::Referenced
 };
 
 typedef std::vector< vtPlantInstanceShader > TreeList;
+
+void PackPlants(const TreeList &trees, const vtSpeciesList3d *species,
+	std::vector<PackedPlant> &plants,
+	std::vector<vtPlantAppearance3d*> &appearances, std::vector<uint> &count);
 typedef std::map<vtPlantAppearance3d*, PlantShaderDrawable*> PlantShaderMap;
 namespace osg { class GroupLOD; }
 
@@ -215,8 +266,6 @@ public:
         
     void computeBound();
     bool divide(unsigned int maxNumTreesPerCell=10);
-    bool divide(bool xAxis, bool yAxis, bool zAxis);
-    void bin();
 
     PlantCell*        _parent;
     osg::BoundingBox  _bb;
@@ -274,17 +323,37 @@ public:
 	bool FindPlantFromNode(osg::Node *pNode, int &iOffset);
 
 	// Shader support
-	void AddShaderGeometryForPlant(PlantCell *cell, vtPlantInstanceShader &pis);
-	PlantShaderDrawable *MakePlantShaderDrawable(PlantCell *cell, vtPlantAppearance3d *ps);
+	void CreateShaderDrawables(PlantCell *cell);
+	PlantShaderDrawable *MakePlantShaderDrawable(PlantCell *cell, vtPlantAppearance3d *ps,
+		PlantInstanceBuffer *buffer, uint first, uint count);
 	osg::Node *CreateCellNodes(PlantCell *cell);
 	int CreatePlantShaderNodes(bool progress_dialog(int) = NULL);
 
+	// Paging of shader vegetation from a tiled VF file
+	bool OpenPlantTiles(const char *fname);
+	int DoTilePaging(const FPoint3 &CamPos, float fDistance, int iMaxLoad = 1);
+	bool IsPagingTiles() const { return m_TileFile.IsOpen(); }
+	int NumTilesLoaded() const { return (int) m_LoadedTiles.size(); }
+
 	vtGroupPtr m_group;
 
 protected:
+	void LoadPlantTile(int index);
+	void UnloadPlantTile(int index);
+	void ReleaseCellGLObjects(PlantCell *cell);
+
 	vtArray<vtPlantInstance3d*>	m_Instances3d;
 	vtHeightField3d		*m_pHeightField;
 	int					m_iOffTerrain;
+
+	// Paging: the file, the species ID of each of its species, the extents
+	//  of its grid of tiles in world coordinates, and the cell of each tile
+	//  which is loaded.
+	vtPlantTileFile		m_TileFile;
+	std::vector<short>	m_TileSpecies;
+	FRECT				m_TileWorldExtents;
+	std::vector< osg::ref_ptr<PlantCell> > m_TileCells;
+	std::vector<int>	m_LoadedTiles;
 };
 
 /*@}*/	// Group veg
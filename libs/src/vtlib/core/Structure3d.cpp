@@ -21,6 +21,7 @@ const vtString BMAT_NAME_HIGHLIGHT = "Highlight";
 
 // Static members
 vtMaterialDescriptorArray3d vtStructure3d::s_MaterialDescriptors;
+OpenThreads::Mutex vtStructure3d::s_SharedMaterialMutex;
 
 
 // Helper: Linear distance in RGB space
@@ -268,7 +269,9 @@ vtStructureArray3d::vtStructureArray3d() : vtStructureArray()
 
 vtBuilding *vtStructureArray3d::NewBuilding()
 {
-	return new vtBuilding3d;
+	vtBuilding3d *bld = new (m_pArena) vtBuilding3d;
+	bld->SetArena(m_pArena);
+	return bld;
 }
 
 vtFence *vtStructureArray3d::NewFence()
@@ -348,6 +351,7 @@ void vtStructureArray3d::OffsetSelectedStructures(const DPoint2 &offset)
 			inst->UpdateTransform(m_pTerrain->GetHeightField());
 		}
 	}
+	InvalidateIndex();
 }
 
 void vtStructureArray3d::OffsetSelectedStructuresVertical(float offset)
@@ -15,6 +15,7 @@
 /*@{*/
 
 #include "vtdata/StructArray.h"
+#include <OpenThreads/Mutex>
 
 #define COLOR_SPREAD	216		// 216 color variations
 
@@ -43,6 +44,7 @@ public:
 		const RGBf &color = RGBf(), int iType = -1) const;
 	void InitializeMaterials();
 	void CreateMaterials();
+	bool MaterialsCreated() const { return m_bMaterialsCreated; }
 	vtMaterialArray *GetMatArray() const { return m_pMaterials; };
 
 protected:
@@ -128,6 +130,11 @@ protected:
 	static vtMaterialDescriptorArray3d s_MaterialDescriptors;
 	static bool s_bMaterialsLoaded;
 
+	// Structures may be built on background threads (see
+	//  vtPagedStructureLodGrid), so this must be held while adding materials
+	//  to the shared array, or assigning them to meshes.
+	static OpenThreads::Mutex s_SharedMaterialMutex;
+
 	// Visual Impact
     bool m_bIsVIAContributor;
 	bool m_bIsVIATarget;
@@ -200,7 +200,8 @@ protected:
 	<td>Int</td>
 	<td>80</td>
 	<td>For tiled terrain (Surface_Type=2), the size of the tile cache to
-	keep in host RAM, in MB.</td>
+	keep in host RAM, in MB.  The cache is shared by all the tiled terrains,
+	so it is as large as the largest size any of them asks for.</td>
 </tr>
 <tr>
 	<td>Time_On</td>
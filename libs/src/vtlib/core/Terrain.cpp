@@ -35,6 +35,10 @@
 //  This allows them to be culled more efficiently.
 #define LOD_GRIDSIZE		128
 
+// Lighting used to prelight the terrain texture
+#define PRELIGHT_AMBIENT	0.25f
+#define PRELIGHT_GAMMA		0.80f
+
 
 //////////////////////////////////////////////////////////////////////
 
@@ -49,6 +53,8 @@ vtTerrain::vtTerrain()
 	m_pTerrainGroup = NULL;
 	m_pUnshadowedGroup = NULL;
 	m_bTextureInitialized = false;
+	m_pPaintShading = NULL;
+	m_bPaintShaded = false;
 	m_iShadowTextureUnit = -1;
 	m_pFog = NULL;
 	m_pShadow = NULL;
@@ -396,11 +402,24 @@ void vtTerrain::_CreateTextures(const FPoint3 &light_dir, bool progress_callback
 		}
 		if (bFirstTime || !bRetain)
 		{
+			// If the image isn't retained, it can be shaded in the same pass
+			//  as it is colored, rather than with a second pass afterwards.
+			m_pPaintShading = NULL;
+			m_bPaintShaded = false;
+			if (!bRetain && pHFGrid && m_Params.GetValueBool(STR_PRELIGHT) &&
+				!m_Params.GetValueBool(STR_CAST_SHADOWS) &&
+				!m_Params.GetValueBool("ShadeQuick"))
+			{
+				m_pPaintShading = _PrepareShadingContext(pHFGrid,
+					m_pUnshadedImage->s(), m_pUnshadedImage->t(), light_dir,
+					progress_callback);
+			}
 			clock_t r1 = clock();
 			// The PaintDib method is virtual to allow subclasses to customize
 			// the unshaded image.
 			PaintDib(progress_callback);
 			VTLOG("  PaintDib: %.2f seconds.\n", (float)(clock() - r1) / CLOCKS_PER_SEC);
+			m_pPaintShading = NULL;
 		}
 	}
 
@@ -426,7 +445,12 @@ void vtTerrain::_CreateTextures(const FPoint3 &light_dir, bool progress_callback
 									true, false);
 		return;
 	}
-	if (m_Params.GetValueBool(STR_PRELIGHT) && pHFGrid)
+	if (m_bPaintShaded)
+	{
+		// PaintDib has already shaded the texture
+		m_bPaintShaded = false;
+	}
+	else if (m_Params.GetValueBool(STR_PRELIGHT) && pHFGrid)
 	{
 		// apply pre-lighting (a.k.a. darkening, a.k.a. shading)
 		vtImageWrapper wrap(m_pSingleImage);
@@ -555,7 +579,9 @@ void vtTerrain::PaintDib(bool progress_callback(int))
 
 	vtImageWrapper wrap(m_pUnshadedImage);
 	pHFGrid->ColorDibFromElevation(&wrap, m_pTextureColors.get(), 4000,
-		RGBi(255,0,0), progress_callback);
+		RGBi(255,0,0), progress_callback, m_pPaintShading);
+	if (m_pPaintShading)
+		m_bPaintShaded = true;
 }
 
 /**
@@ -738,13 +764,23 @@ bool vtTerrain::_CreateDynamicTerrain()
 	//  it with the terrain's culture
 	m_pDynGeom->SetCulture(this);
 
+	// Keep picking and line-of-sight tests quick, even on very large grids
+	m_pDynGeom->BuildMaxPyramid();
+
 	return true;
 }
 
 void vtTerrain::SetVerticalExag(float fExag)
 {
+	// The structure workers drape buildings on the heightfield
+	if (m_pPagedStructGrid)
+		m_pPagedStructGrid->WaitForWorkers();
+
 	m_fVerticalExag = fExag;
 
+	// The cached surface normals depend on the exaggeration
+	m_ShadingContext.Clear();
+
 	if (m_pDynGeom != NULL)
 	{
 		FPoint2 spacing = m_pDynGeom->GetWorldSpacing();
@@ -752,6 +788,8 @@ void vtTerrain::SetVerticalExag(float fExag)
 		m_pDynGeomScale->Scale3(spacing.x, m_fVerticalExag, -spacing.y);
 
 		m_pDynGeom->SetVerticalExag(m_fVerticalExag);
+		if (m_pDynGeom->HasMaxPyramid())
+			m_pDynGeom->BuildMaxPyramid();
 	}
 	else if (m_pTiledGeom != NULL)
 	{
@@ -823,6 +861,15 @@ void vtTerrain::AddFencepoint(vtFence3d *f, const DPoint2 &epos)
 
 	f->AddPoint(epos);
 
+	// The fence's extents have changed, so the spatial index of the layer
+	//  which contains it is out of date.
+	for (uint i = 0; i < m_Layers.size(); i++)
+	{
+		vtStructureLayer *slay = dynamic_cast<vtStructureLayer*>(m_Layers[i].get());
+		if (slay && slay->Find(f) != -1)
+			slay->InvalidateIndex();
+	}
+
 	f->CreateNode(this);
 
 	AddNodeToStructGrid(f->GetGeom());
@@ -995,7 +1042,10 @@ bool vtTerrain::GetGeoExtentsFromMetadata()
 	if (type == 0)	// grid
 	{
 		vtElevationGrid grid;
-		success = grid.LoadBTHeader(fname);
+		if (!GetExtension(fname).CompareNoCase(".vtt"))
+			success = grid.LoadFromTiles(fname);	// only reads the header
+		else
+			success = grid.LoadBTHeader(fname);
 		if (!success)
 		{
 			VTLOG("\tCouldn't load BT header.\n");
@@ -1048,6 +1098,9 @@ vtStructureLayer *vtTerrain::LoadStructuresFromXML(const vtString &strFilename)
 	VTLOG("LoadStructuresFromXML '%s'\n", (const char *) strFilename);
 	vtStructureLayer *structures = NewStructureLayer();
 
+	// A layer from a file can have very many buildings
+	structures->UseArena(true);
+
 	if (!structures->ReadXML(strFilename, m_progress_callback))
 	{
 		VTLOG("\tCouldn't load file.\n");
@@ -1447,11 +1500,20 @@ void vtTerrain::_CreateVegetation()
 			bool success;
 			if (!fname.Right(3).CompareNoCase("shp"))
 				success = m_PIA.ReadSHP(plants_path);
+			else if (m_Params.GetValueBool(STR_TREES_USE_SHADERS) &&
+				m_PIA.OpenPlantTiles(plants_path))
+			{
+				// A tiled file is paged in as the camera moves; see
+				//  DoVegetationPaging.
+				VTLOG1("\tPaging plants file.\n");
+				success = true;
+			}
 			else
 				success = m_PIA.ReadVF(plants_path);
 			if (success)
 			{
-				VTLOG("\tLoaded plants file, %d plants.\n", m_PIA.GetNumEntities());
+				if (!m_PIA.IsPagingTiles())
+					VTLOG("\tLoaded plants file, %d plants.\n", m_PIA.GetNumEntities());
 				m_PIA.SetFilename(plants_path);
 			}
 			else
@@ -1463,7 +1525,8 @@ void vtTerrain::_CreateVegetation()
 	if (m_Params.GetValueBool(STR_TREES_USE_SHADERS))
 	{
 		osg::GroupLOD::setGroupDistance(fVegDistance);
-		int created = m_PIA.CreatePlantShaderNodes(m_progress_callback);
+		if (!m_PIA.IsPagingTiles())
+			m_PIA.CreatePlantShaderNodes(m_progress_callback);
 		m_pVegGroup = m_PIA.m_group;
 		m_pTerrainGroup->addChild(m_pVegGroup);
 	}
@@ -1510,6 +1573,12 @@ void vtTerrain::_SetupStructGrid(float fLODDistance)
 		m_iPagingStructureMax = m_Params.GetValueInt(STR_STRUCTURE_PAGING_MAX);
 		m_fPagingStructureDist = m_Params.GetValueFloat(STR_STRUCTURE_PAGING_DIST);
 
+		// Buildings are constructed on worker threads, which query the
+		//  heightfield.  Tiled geometry pages its elevation in and out as
+		//  the camera moves, so it can't be queried from other threads.
+		if (m_pTiledGeom)
+			m_pPagedStructGrid->SetBuildThreads(0);
+
 		VTLOG("Created paged structure LOD grid, max %d, distance %f\n",
 			m_iPagingStructureMax, m_fPagingStructureDist);
 	}
@@ -2167,8 +2236,24 @@ bool vtTerrain::CreateStep1()
 		// Elevation input is a single grid; load it
 		m_pElevGrid.reset(new vtElevationGrid);
 
-		vtElevError err;
-		bool status = m_pElevGrid->LoadFromBT(elev_path, m_progress_callback, &err);
+		vtElevError err = EGE_FILE_OPEN;
+		bool status;
+		if (!GetExtension(elev_path).CompareNoCase(".vtt"))
+		{
+			// A tiles file is memory-mapped rather than read, so it opens
+			//  instantly no matter how large it is.
+			status = m_pElevGrid->LoadFromTiles(elev_path);
+		}
+		else
+		{
+			// An uncompressed BT file can likewise be mapped; if it can't,
+			//  fall back on reading it.
+			status = false;
+			if (!GetExtension(elev_path).CompareNoCase(".bt"))
+				status = m_pElevGrid->MapBT(elev_path);
+			if (!status)
+				status = m_pElevGrid->LoadFromBT(elev_path, m_progress_callback, &err);
+		}
 		if (status == false)
 		{
 			if (err == EGE_READ_CRS)
@@ -2262,7 +2347,7 @@ bool vtTerrain::CreateStep1()
 
 		// tile cache size is in MB for the user, but bytes for the class
 		int tile_cache_mb = m_Params.GetValueInt(STR_TILE_CACHE_SIZE);
-		//m_pTiledGeom->SetTileCacheSize(tile_cache_mb * 1024 * 1024);
+		m_pTiledGeom->SetTileCacheSize((size_t) tile_cache_mb * 1024 * 1024);
 
 		bool bThread = m_Params.GetValueBool(STR_TILE_THREADING);
 		bool bGradual = m_Params.GetValueBool(STR_TEXTURE_GRADUAL);
@@ -2890,9 +2975,28 @@ void vtTerrain::_ApplyPreLight(vtHeightFieldGrid3d *pElevGrid, vtBitmapBase *bit
 	float shade_factor = m_Params.GetValueFloat(STR_PRELIGHTFACTOR);
 	bool bTrue = m_Params.GetValueBool("ShadeTrue");
 	bool bQuick = m_Params.GetValueBool("ShadeQuick");
-	float ambient = 0.25f;
-	float gamma = 0.80f;
-	if (m_Params.GetValueBool(STR_CAST_SHADOWS))
+	float ambient = PRELIGHT_AMBIENT;
+	const int w = bitmap->GetWidth(), h = bitmap->GetHeight();
+	if (m_Params.GetValueBool(STR_CAST_SHADOWS) && m_Params.GetValueBool("ShadowHorizons"))
+	{
+		// Cast shadows from a horizon map, which is slow to make the first
+		//  time, but then quick for any position of the sun.
+		if (!m_ShadingContext.Matches(pElevGrid, w, h, 1.0f, true) ||
+			!m_ShadingContext.HasHorizons())
+		{
+			m_ShadingContext.Setup(pElevGrid, w, h, 1.0f, true);
+			m_ShadingContext.SetupHorizons(32, progress_callback);
+		}
+		if (m_ShadingContext.HasHorizons())
+			m_ShadingContext.ShadowBitmap(bitmap, light_dir, shade_factor, ambient,
+				progress_callback);
+		else
+		{
+			// No horizon map could be made, so cast the shadows directly
+			pElevGrid->ShadowCastDib(bitmap, light_dir, shade_factor, ambient, progress_callback);
+		}
+	}
+	else if (m_Params.GetValueBool(STR_CAST_SHADOWS))
 	{
 		// A more accurate shading, still a little experimental
 		pElevGrid->ShadowCastDib(bitmap, light_dir, shade_factor, ambient, progress_callback);
@@ -2900,8 +3004,13 @@ void vtTerrain::_ApplyPreLight(vtHeightFieldGrid3d *pElevGrid, vtBitmapBase *bit
 	else if (bQuick)
 		pElevGrid->ShadeQuick(bitmap, shade_factor, bTrue, progress_callback);
 	else
-		pElevGrid->ShadeDibFromElevation(bitmap, light_dir, shade_factor,
-			ambient, gamma, bTrue, progress_callback);
+	{
+		// The surface normals are only computed the first time; after that,
+		//  re-shading for a new light direction is quick.
+		_PrepareShadingContext(pElevGrid, w, h, light_dir, progress_callback);
+		m_ShadingContext.ShadeBitmap(bitmap, light_dir, PRELIGHT_AMBIENT,
+			PRELIGHT_GAMMA);
+	}
 
 	clock_t c2 = clock();
 
@@ -2909,6 +3018,23 @@ void vtTerrain::_ApplyPreLight(vtHeightFieldGrid3d *pElevGrid, vtBitmapBase *bit
 	VTLOG("%.3f seconds.\n", (float)c3 / CLOCKS_PER_SEC);
 }
 
+/**
+ * Make sure the shading context has the normals for a texture of the given
+ * size, and the light set for dot-product prelighting.
+ */
+const vtShadingContext *vtTerrain::_PrepareShadingContext(
+	vtHeightFieldGrid3d *pElevGrid, int w, int h, const FPoint3 &light_dir,
+	bool progress_callback(int))
+{
+	float shade_factor = m_Params.GetValueFloat(STR_PRELIGHTFACTOR);
+	bool bTrue = m_Params.GetValueBool("ShadeTrue");
+	if (!m_ShadingContext.Matches(pElevGrid, w, h, shade_factor, bTrue))
+		m_ShadingContext.Setup(pElevGrid, w, h, shade_factor, bTrue,
+			progress_callback);
+	m_ShadingContext.SetLight(light_dir, PRELIGHT_AMBIENT, PRELIGHT_GAMMA);
+	return &m_ShadingContext;
+}
+
 /**
  * Create geometry on the terrain for a 2D line by draping the point onto
  * the terrain surface.
@@ -2974,9 +3100,8 @@ float vtTerrain::AddSurfaceLineToMesh(vtGeomFactory *pMF, const DLine2 &line,
 		}
 	}
 
-	float fTotalLength = 0.0f;
-	pMF->PrimStart();
-	int iVerts = 0;
+	// First find all the ground points, then their altitudes all at once
+	std::vector<FPoint3> ground;
 	uint points = line.GetSize();
 	if (bCurve)
 	{
@@ -3007,28 +3132,19 @@ float vtTerrain::AddSurfaceLineToMesh(vtGeomFactory *pMF, const DLine2 &line,
 			iSteps = 3;
 		double dStep = full / iSteps;
 
-		FPoint3 last_v;
 		double f;
 		for (f = 0; f <= full; f += dStep)
 		{
 			spline.Interpolate(f, &p3);
 
 			m_pHeightField->m_Conversion.convert_earth_to_local_xz(p3.x, p3.y, v.x, v.z);
-			m_pHeightField->FindAltitudeAtPoint(v, v.y, bTrue);
-			v.y += fOffset;
-			pMF->AddVertex(v);
-			iVerts++;
-
-			// keep a running total of approximate ground length
-			if (f > 0)
-				fTotalLength += (v - last_v).Length();
-			last_v = v;
+			v.y = 0.0f;
+			ground.push_back(v);
 		}
 	}
 	else
 	{
 		// not curved: straight line in earth coordinates
-		FPoint3 last_v;
 		for (i = 0; i < points; i++)
 		{
 			if (bInterp)
@@ -3048,26 +3164,36 @@ float vtTerrain::AddSurfaceLineToMesh(vtGeomFactory *pMF, const DLine2 &line,
 				{
 					// simple linear interpolation of the ground coordinate
 					v.Set(v1.x + diff.x / iSteps * j, 0.0f, v1.z + diff.z / iSteps * j);
-					m_pHeightField->FindAltitudeAtPoint(v, v.y, bTrue);
-					v.y += fOffset;
-					pMF->AddVertex(v);
-					iVerts++;
-
-					// keep a running total of approximate ground length
-					if (j > 0)
-						fTotalLength += (v - last_v).Length();
-					last_v = v;
+					ground.push_back(v);
 				}
 			}
 			else
 			{
 				m_pHeightField->m_Conversion.ConvertFromEarth(line[i], v.x, v.z);
-				m_pHeightField->FindAltitudeAtPoint(v, v.y, bTrue);
-				v.y += fOffset;
-				pMF->AddVertex(v);
+				v.y = 0.0f;
+				ground.push_back(v);
 			}
 		}
 	}
+	const uint count = (uint) ground.size();
+	std::vector<float> altitudes(count);
+	if (count > 0)
+		m_pHeightField->FindAltitudesAtPoints(&ground[0], &altitudes[0], count, bTrue);
+
+	float fTotalLength = 0.0f;
+	FPoint3 last_v;
+	pMF->PrimStart();
+	for (i = 0; i < count; i++)
+	{
+		v = ground[i];
+		v.y = altitudes[i] + fOffset;
+		pMF->AddVertex(v);
+
+		// keep a running total of approximate ground length
+		if (i > 0 && (bCurve || bInterp))
+			fTotalLength += (v - last_v).Length();
+		last_v = v;
+	}
 	pMF->PrimEnd();
 	return fTotalLength;
 }
@@ -3302,6 +3428,24 @@ int vtTerrain::DoStructurePaging()
 	return m_pPagedStructGrid->GetQueueSize();
 }
 
+/**
+ * If the terrain's vegetation is being paged from a tiled file, load the
+ * tiles near the camera and unload those which are far away.  Like
+ * DoStructurePaging, call this each frame.
+ *
+ * \return The number of tiles which still need to be loaded.
+ */
+int vtTerrain::DoVegetationPaging()
+{
+	if (!m_PIA.IsPagingTiles())
+		return 0;
+
+	vtCamera *cam = vtGetScene()->GetCamera();
+	FPoint3 CamPos = cam->GetTrans();
+
+	return m_PIA.DoTilePaging(CamPos, GetLODDistance(TFT_VEGETATION));
+}
+
 void vtTerrain::SetStructurePageOutDistance(float f)
 {
 	if (m_pPagedStructGrid)
@@ -3436,7 +3580,12 @@ void vtTerrain::UpdateElevation()
 	SRTerrain *sr = dynamic_cast<SRTerrain*>(m_pDynGeom.get());
 	if (!sr)
 		return;
+	if (m_pPagedStructGrid)
+		m_pPagedStructGrid->WaitForWorkers();
 	sr->ReInit(m_pElevGrid.get());
+	m_ShadingContext.Clear();
+	if (sr->HasMaxPyramid())
+		sr->BuildMaxPyramid();
 }
 
 /**
@@ -3449,20 +3598,29 @@ void vtTerrain::UpdateElevation()
  */
 void vtTerrain::RedrapeCulture(const DRECT &area)
 {
+	// The structure workers must not be building what we are about to move
+	if (m_pPagedStructGrid)
+		m_pPagedStructGrid->WaitForWorkers();
+
 	// Tell the terrain to re-drape all its structure instances.
 	for (uint i = 0; i < m_Layers.size(); i++)
 	{
 		vtStructureLayer *slay = dynamic_cast<vtStructureLayer *>(m_Layers[i].get());
 		if (slay)
 		{
-			for (uint j = 0; j < slay->GetSize(); j++)
+			// If we were given an area, omit structures outside it
+			std::vector<int> which;
+			if (area.IsEmpty())
 			{
-				vtStructure *st = slay->GetAt(j);
-				vtStructure3d *s3 = slay->GetStructure3d(j);
+				for (uint j = 0; j < slay->GetSize(); j++)
+					which.push_back(j);
+			}
+			else
+				slay->FindStructuresInRect(area, which);
 
-				// If we were given an area, omit structures outside it
-				if (!area.IsEmpty() && !st->IsContainedBy(area))
-					continue;
+			for (uint k = 0; k < which.size(); k++)
+			{
+				vtStructure3d *s3 = slay->GetStructure3d(which[k]);
 
 				// A fence might need re-draping, so we have to rebuild geometry
 				vtFence3d *f3 = dynamic_cast<vtFence3d*>(s3);
@@ -10,6 +10,7 @@
 
 #include "vtdata/vtTime.h"
 #include "vtdata/FilePath.h"
+#include "vtdata/ShadingContext.h"
 
 #include "AbstractLayer.h"
 #include "AnimPath.h"	// for vtAnimContainer
@@ -229,6 +230,7 @@ public:
 	/// Get the plant array for this terrain.  You can modify it directly.
 	vtPlantInstanceArray3d &GetPlantInstances() { return m_PIA; }
 	bool AddNodeToVegGrid(osg::Node *pNode);
+	int DoVegetationPaging();
 
 	// structures
 	vtStructureLayer *GetStructureLayer();
@@ -391,6 +393,8 @@ protected:
 
 	void _ApplyPreLight(vtHeightFieldGrid3d *pLocalGrid, vtBitmapBase *dib,
 		const FPoint3 &light_dir, bool progress_callback(int) = NULL);
+	const vtShadingContext *_PrepareShadingContext(vtHeightFieldGrid3d *pElevGrid,
+		int w, int h, const FPoint3 &light_dir, bool progress_callback(int) = NULL);
 	void _ComputeCenterLocation();
 	void GetTerrainBounds();
 	void EnforcePageOut();
@@ -481,6 +485,9 @@ protected:
 	// ground texture and shadows
 	ImagePtr		m_pUnshadedImage;
 	ImagePtr		m_pSingleImage;
+	vtShadingContext m_ShadingContext;	// re-used each time the sun moves
+	const vtShadingContext *m_pPaintShading;	// for PaintDib to shade as it colors
+	bool			m_bPaintShaded;
 
 	auto_ptr<ColorMap>	m_pTextureColors;
 	bool			m_bTextureInitialized;
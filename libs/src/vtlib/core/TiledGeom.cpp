@@ -17,6 +17,9 @@
 #include <mini/datacloud.h>
 #include <mini/miniOGL.h>
 
+#include <OpenThreads/ScopedLock>
+typedef OpenThreads::ScopedLock<OpenThreads::Mutex> ScopedLock;
+
 // If we use a threading library, we can support multithreading
 #define SUPPORT_THREADING	1
 #define USE_PTHREADS		0
@@ -30,12 +33,12 @@
 
 #define LOG_TILE_LOADS		0
 
-// libMini helper
-void InitMiniConvHook(int iJpegQuality = 99);
+// A file in the streamer's cache folder which is larger than this is not a tile
+#define MAX_CACHED_TILE_BYTES	(256L * 1024 * 1024)
 
-/////////////
-// singleton; TODO: get rid of this to allow multiple instances
-static vtTiledGeom *s_pTiledGeom = NULL;
+// libMini helpers
+void InitMiniConvHook(int iJpegQuality = 99);
+bool ReadMiniDatabuf(const unsigned char *data, unsigned int len, databuf *buf);
 
 #if USE_PTHREADS
   #include <pthread.h>
@@ -44,43 +47,55 @@ static vtTiledGeom *s_pTiledGeom = NULL;
 	#pragma comment( lib, "pthreadVC2.lib" )
   #endif
    const int numthreads = 1;
-   pthread_t pthread[numthreads];
-   pthread_mutex_t mutex,iomutex;
-   pthread_attr_t attr;
 
-   void threadinit()
+   // The threads of one vtTiledGeom; libMini passes them to the callbacks
+   //  as their data.
+   struct vtTileThreads
 	  {
-	  pthread_mutex_init(&mutex,NULL);
-	  pthread_mutex_init(&iomutex,NULL);
+	  pthread_t pthread[numthreads];
+	  pthread_mutex_t mutex;
+	  pthread_attr_t attr;
+	  };
 
-	  pthread_attr_init(&attr);
-	  pthread_attr_setdetachstate(&attr,PTHREAD_CREATE_JOINABLE);
+   // Tile I/O is shared by all the tiled terrains, which take turns at it
+   pthread_mutex_t iomutex = PTHREAD_MUTEX_INITIALIZER;
+
+   vtTileThreads *threadinit()
+	  {
+	  vtTileThreads *tt = new vtTileThreads;
+	  pthread_mutex_init(&tt->mutex,NULL);
+
+	  pthread_attr_init(&tt->attr);
+	  pthread_attr_setdetachstate(&tt->attr,PTHREAD_CREATE_JOINABLE);
+	  return tt;
 	  }
 
-   void threadexit()
+   void threadexit(vtTileThreads *tt)
 	  {
-	  pthread_mutex_destroy(&mutex);
-	  pthread_mutex_destroy(&iomutex);
-	  pthread_attr_destroy(&attr);
+	  pthread_mutex_destroy(&tt->mutex);
+	  pthread_attr_destroy(&tt->attr);
+	  delete tt;
 	  }
 
    void startthread(void *(*thread)(void *background),backarrayelem *background,
 	   void *data)
 	  {
-	  pthread_create(&pthread[background->background-1],&attr,thread,background);
+	  vtTileThreads *tt = (vtTileThreads *) data;
+	  pthread_create(&tt->pthread[background->background-1],&tt->attr,thread,background);
 	  }
 
    void jointhread(backarrayelem *background,void *data)
 	  {
+	  vtTileThreads *tt = (vtTileThreads *) data;
 	  void *status;
-	  pthread_join(pthread[background->background-1],&status);
+	  pthread_join(tt->pthread[background->background-1],&status);
 	  }
 
    void lock_cs(void *data)
-	  {pthread_mutex_lock(&mutex);}
+	  {pthread_mutex_lock(&((vtTileThreads *) data)->mutex);}
 
    void unlock_cs(void *data)
-	  {pthread_mutex_unlock(&mutex);}
+	  {pthread_mutex_unlock(&((vtTileThreads *) data)->mutex);}
 
 	void lock_io(void *data)
 	  {pthread_mutex_lock(&iomutex);}
@@ -112,41 +127,51 @@ static vtTiledGeom *s_pTiledGeom = NULL;
 		void *(*m_function)(void *background);
 		backarrayelem *m_param;
 	};
-	MyThread *pthread[numthreads];
-	OpenThreads::Mutex mutex, iomutex;
 
-	void threadinit()
+	// The threads of one vtTiledGeom; libMini passes them to the callbacks
+	//  as their data.
+	struct vtTileThreads
 	{
+		MyThread *pthread[numthreads];
+		OpenThreads::Mutex mutex;
+	};
+
+	// Tile I/O is shared by all the tiled terrains, which take turns at it
+	OpenThreads::Mutex iomutex;
+
+	vtTileThreads *threadinit()
+	{
+		vtTileThreads *tt = new vtTileThreads;
 		for (int i = 0; i < numthreads; i++)
-		{
-			MyThread *th = new MyThread;
-			pthread[i] = th;
-		}
+			tt->pthread[i] = new MyThread;
+		return tt;
 	}
 
-	void threadexit()
+	void threadexit(vtTileThreads *tt)
 	{
 		for (int i = 0; i < numthreads; i++)
-			delete pthread[i];
+			delete tt->pthread[i];
+		delete tt;
 	}
 
 	void startthread(void *(*thread)(void *background),backarrayelem *background,void *data)
 	{
-		pthread[background->background-1]->m_function = thread;
-		pthread[background->background-1]->m_param = background;
-		pthread[background->background-1]->start();
+		MyThread *th = ((vtTileThreads *) data)->pthread[background->background-1];
+		th->m_function = thread;
+		th->m_param = background;
+		th->start();
 	}
 
 	void jointhread(backarrayelem *background,void *data)
 	{
-		pthread[background->background-1]->join();
+		((vtTileThreads *) data)->pthread[background->background-1]->join();
 	}
 
 	void lock_cs(void *data)
-	{mutex.lock();}
+	{((vtTileThreads *) data)->mutex.lock();}
 
 	void unlock_cs(void *data)
-	{mutex.unlock();}
+	{((vtTileThreads *) data)->mutex.unlock();}
 
 	void lock_io(void *data)
 	{iomutex.lock();}
@@ -340,13 +365,13 @@ int request_callback(int col,int row,const uchar *mapfile,int hlod,
 
 	// we need to load (or get from cache) one or both: hfield and texture
 	if (mapfile!=NULL)
-		*hfield = s_pTiledGeom->FetchTile((char *)mapfile);
+		*hfield = tg->FetchTile((char *)mapfile);
 
 	if (texfile!=NULL)
-		*texture = s_pTiledGeom->FetchTile((char *)texfile);
+		*texture = tg->FetchTile((char *)texfile);
 
 	if (fogfile!=NULL)
-		*fogmap = s_pTiledGeom->FetchTile((char *)fogfile);
+		*fogmap = tg->FetchTile((char *)fogfile);
 
 	return 1;
 }
@@ -360,25 +385,15 @@ void request_callback_async(const uchar *mapfile, databuf *map,
 							int istexture, int background, void *data)
 {
 	vtTiledGeom *tg = (vtTiledGeom*) data;
-#if SUPPORT_CURL
-	if (tg->m_strBaseURL != "")
-	{
-		vtBytes data;
-		vtString url = tg->m_strBaseURL + (char *)mapfile;
-		tg->m_pReqContext->GetURL(url, data);
-	}
-	else
-#endif
-	{
-//		if (istexture && tg->m_image_info.bJPEG)
-//		{
-//			vtString fname = tg->m_folder_image + "/tile." + mapfile + ".jpg";
-////			map->loaddataJPEG(fname);
-//			map->loaddata(fname);
-//		}
-		// normal disk load
-		map->loaddata((char *)mapfile);
-	}
+
+//	if (istexture && tg->m_image_info.bJPEG)
+//	{
+//		vtString fname = tg->m_folder_image + "/tile." + mapfile + ".jpg";
+////		map->loaddataJPEG(fname);
+//		map->loaddata(fname);
+//	}
+	// from the tile cache, or else from disk or the server
+	tg->LoadTile((char *)mapfile, map);
 	if (tg->m_progress_callback != NULL)
 	{
 		tg->m_iTileLoads++;
@@ -429,17 +444,530 @@ int query_callback(int col, int row, const uchar *texfile, int tlod,
 	return tg->CheckMapFile((char *)texfile, true);
 }
 
+///////////////////////////////////////////////////////////////////////
+// class vtTileCache implementation
+
+vtTileCache::vtTileCache()
+{
+	m_iBytes = 0;
+	m_iMaxBytes = 80 * 1024 * 1024;
+	m_iHits = m_iMisses = 0;
+}
+
+vtTileCache::~vtTileCache()
+{
+	Clear();
+}
+
+/**
+ * Set the budget of the cache, in bytes.  If the tiles already in the cache
+ * take more than this, the least recently used are dropped.
+ */
+void vtTileCache::SetMaxBytes(size_t bytes)
+{
+	ScopedLock lock(m_Mutex);
+	m_iMaxBytes = bytes;
+	Evict(bytes);
+}
+
+/**
+ * Look for a tile in the cache.
+ *
+ * \param fname The filename of the tile.
+ * \param result If the tile is found, it receives a copy of the tile, which
+ *		the caller owns.
+ * \return true if the tile was found.
+ */
+bool vtTileCache::Get(const char *fname, databuf *result)
+{
+	ScopedLock lock(m_Mutex);
+	std::map<vtString, EntryList::iterator>::iterator it = m_Lookup.find(fname);
+	if (it == m_Lookup.end())
+	{
+		m_iMisses++;
+		return false;
+	}
+	m_iHits++;
+
+	// It is now the most recently used
+	m_Tiles.splice(m_Tiles.begin(), m_Tiles, it->second);
+	result->duplicate(it->second->buf);
+	return true;
+}
+
+/**
+ * Put a copy of a tile in the cache.  The caller still owns the tile.
+ */
+void vtTileCache::Put(const char *fname, databuf *buf)
+{
+	if (buf->data == NULL)
+		return;
+
+	// Copy the tile before taking the lock, since it may be large
+	const size_t bytes = buf->bytes;
+	databuf *copy = new databuf;
+	copy->duplicate(buf);
+
+	ScopedLock lock(m_Mutex);
+	if (bytes > m_iMaxBytes || m_Lookup.find(fname) != m_Lookup.end())
+	{
+		copy->release();
+		delete copy;
+		return;
+	}
+	Evict(m_iMaxBytes - bytes);
+
+	Entry e;
+	e.fname = fname;
+	e.buf = copy;
+	m_Tiles.push_front(e);
+	m_Lookup[e.fname] = m_Tiles.begin();
+	m_iBytes += bytes;
+}
+
+/**
+ * Return true if a tile is in the cache.  Unlike Get, this does not count
+ * as a use of the tile.
+ */
+bool vtTileCache::Contains(const char *fname)
+{
+	ScopedLock lock(m_Mutex);
+	return (m_Lookup.find(fname) != m_Lookup.end());
+}
+
+/**
+ * Remove all the tiles from the cache.
+ */
+void vtTileCache::Clear()
+{
+	ScopedLock lock(m_Mutex);
+	Evict(0);
+}
+
+// Drop the least recently used tiles until they take no more than the given
+//  number of bytes.  The caller must hold the lock.
+void vtTileCache::Evict(size_t bytes)
+{
+	while (m_iBytes > bytes && !m_Tiles.empty())
+	{
+		Entry &e = m_Tiles.back();
+		m_iBytes -= e.buf->bytes;
+		e.buf->release();
+		delete e.buf;
+		m_Lookup.erase(e.fname);
+		m_Tiles.pop_back();
+	}
+}
+
+
+///////////////////////////////////////////////////////////////////////
+// class vtTilePrefetcher implementation
+
+vtTilePrefetcher::vtTilePrefetcher(vtTileCache *pCache)
+{
+	m_pCache = pCache;
+	m_bStopping = false;
+	m_iLoaded = 0;
+}
+
+vtTilePrefetcher::~vtTilePrefetcher()
+{
+	Stop();
+}
+
+/**
+ * Ask for tiles to be loaded, most important first.  Any tiles from earlier
+ * requests which have not yet been loaded are forgotten.
+ */
+void vtTilePrefetcher::Request(const std::vector<vtString> &fnames)
+{
+	ScopedLock lock(m_Mutex);
+	m_Pending.assign(fnames.begin(), fnames.end());
+	m_Ready.signal();
+}
+
+/**
+ * Stop the thread, after it finishes loading the tile it is loading.
+ */
+void vtTilePrefetcher::Stop()
+{
+	{
+		ScopedLock lock(m_Mutex);
+		m_bStopping = true;
+		m_Pending.clear();
+		m_Ready.broadcast();
+	}
+	if (isRunning())
+		join();
+}
+
+void vtTilePrefetcher::run()
+{
+	while (true)
+	{
+		vtString fname;
+		{
+			ScopedLock lock(m_Mutex);
+			while (m_Pending.empty() && !m_bStopping)
+				m_Ready.wait(&m_Mutex);
+			if (m_bStopping)
+				return;
+			fname = m_Pending.front();
+			m_Pending.pop_front();
+		}
+		if (m_pCache->Contains(fname))
+			continue;
+
+		databuf buf;
+		buf.loaddata(fname);
+		if (buf.data != NULL)
+		{
+			m_pCache->Put(fname, &buf);
+			m_iLoaded++;
+		}
+		buf.release();
+	}
+}
+
+
+///////////////////////////////////////////////////////////////////////
+// class vtTileStreamer implementation
+
+// A tile which is waiting to be fetched, or being fetched, by a streamer
+struct vtTileJob
+{
+	vtString path;
+	int iWaiters;		// the number of threads waiting for it in Get
+	bool bStarted, bDone, bSuccess;
+	databuf buf;
+};
+
+vtTileStreamer::vtTileStreamer(vtTileCache *pCache)
+{
+	m_pCache = pCache;
+	m_iRetries = 2;
+	m_bRunning = false;
+	m_iFetched = m_iFailed = 0;
+}
+
+vtTileStreamer::~vtTileStreamer()
+{
+	Stop();
+}
+
+/**
+ * Keep the fetched tiles in a folder on disk.  Tiles which are already in
+ * the folder are read from it, rather than fetched again.
+ */
+void vtTileStreamer::SetCacheFolder(const char *folder)
+{
+	m_strCacheFolder = folder;
+	if (m_strCacheFolder != "")
+		vtCreateDir(m_strCacheFolder);
+}
+
+/**
+ * Start fetching, with a number of connections to the server.  Any existing
+ * connections are closed first.
+ */
+void vtTileStreamer::Start(int iConnections)
+{
+	Stop();
+	m_bRunning = true;
+	for (int i = 0; i < iConnections; i++)
+	{
+		// The contexts are made here rather than by the threads, since
+		//  libcurl must not be initialized by several threads at once.
+		Worker *pWorker = new Worker(this, new ReqContext);
+		pWorker->start();
+		m_Workers.push_back(pWorker);
+	}
+	VTLOG("Streaming tiles from '%s' with %d connections.\n",
+		(const char *) m_strBaseURL, iConnections);
+}
+
+/**
+ * Stop fetching.  Tiles which are being fetched are finished, but those
+ * still waiting are dropped, and any thread waiting for one of them in Get
+ * is told that it failed.
+ */
+void vtTileStreamer::Stop()
+{
+	{
+		ScopedLock lock(m_Mutex);
+		m_bRunning = false;
+		m_JobReady.broadcast();
+	}
+	for (uint i = 0; i < m_Workers.size(); i++)
+	{
+		m_Workers[i]->join();
+		delete m_Workers[i];
+	}
+	m_Workers.clear();
+
+	ScopedLock lock(m_Mutex);
+	while (!m_Queue.empty())
+	{
+		vtTileJob *job = m_Queue.front();
+		m_Queue.pop_front();
+		job->bDone = true;
+		job->bSuccess = false;
+		if (job->iWaiters == 0)
+			DeleteJob(job);
+	}
+	m_JobDone.broadcast();
+}
+
+/**
+ * Get a tile, waiting until it has been fetched.  This can take a while, so
+ * it should be called by a loader thread, never by the render thread.
+ *
+ * \param path The path of the tile, relative to the base URL.
+ * \param result Receives the tile, which the caller then owns.
+ * \return true if successful.
+ */
+bool vtTileStreamer::Get(const char *path, databuf *result)
+{
+	ScopedLock lock(m_Mutex);
+	if (!m_bRunning)
+		return false;
+
+	vtTileJob *job = AddJob(path, true);
+	job->iWaiters++;
+	while (!job->bDone)
+		m_JobDone.wait(&m_Mutex);
+
+	const bool bSuccess = job->bSuccess;
+	if (bSuccess)
+		result->duplicate(&job->buf);
+	if (--job->iWaiters == 0)
+		DeleteJob(job);
+	return bSuccess;
+}
+
+/**
+ * Ask for tiles to be fetched in the background, in order, and put in the
+ * tile cache.  Tiles asked for earlier which are still waiting are dropped,
+ * unless a thread is waiting for them, since they are no longer wanted.
+ */
+void vtTileStreamer::Request(const std::vector<vtString> &paths)
+{
+	ScopedLock lock(m_Mutex);
+	if (!m_bRunning)
+		return;
+
+	std::list<vtTileJob *>::iterator it = m_Queue.begin();
+	while (it != m_Queue.end())
+	{
+		vtTileJob *job = *it;
+		if (job->iWaiters == 0)
+		{
+			it = m_Queue.erase(it);
+			DeleteJob(job);
+		}
+		else
+			it++;
+	}
+	for (uint i = 0; i < paths.size(); i++)
+	{
+		if (!m_pCache->Contains(GetURL(paths[i])))
+			AddJob(paths[i], false);
+	}
+}
+
+uint vtTileStreamer::NumFetched()
+{
+	ScopedLock lock(m_Mutex);
+	return m_iFetched;
+}
+
+uint vtTileStreamer::NumFailed()
+{
+	ScopedLock lock(m_Mutex);
+	return m_iFailed;
+}
+
+// Find the job for a tile, or add one.  The caller must hold the lock.
+vtTileJob *vtTileStreamer::AddJob(const vtString &path, bool bUrgent)
+{
+	std::map<vtString, vtTileJob *>::iterator it = m_Jobs.find(path);
+	if (it != m_Jobs.end())
+	{
+		// If it is still waiting, and is now needed right away, move it up
+		vtTileJob *job = it->second;
+		if (bUrgent && !job->bStarted && !job->bDone)
+		{
+			m_Queue.remove(job);
+			m_Queue.push_front(job);
+		}
+		return job;
+	}
+	vtTileJob *job = new vtTileJob;
+	job->path = path;
+	job->iWaiters = 0;
+	job->bStarted = job->bDone = job->bSuccess = false;
+	m_Jobs[path] = job;
+	if (bUrgent)
+		m_Queue.push_front(job);
+	else
+		m_Queue.push_back(job);
+	m_JobReady.signal();
+	return job;
+}
+
+// The caller must hold the lock.
+void vtTileStreamer::DeleteJob(vtTileJob *job)
+{
+	m_Jobs.erase(job->path);
+	job->buf.release();
+	delete job;
+}
+
+bool vtTileStreamer::NextJob(vtTileJob *&job)
+{
+	ScopedLock lock(m_Mutex);
+	while (m_Queue.empty() && m_bRunning)
+		m_JobReady.wait(&m_Mutex);
+	if (!m_bRunning)
+		return false;
+	job = m_Queue.front();
+	m_Queue.pop_front();
+	job->bStarted = true;
+	return true;
+}
+
+void vtTileStreamer::JobDone(vtTileJob *job, databuf &buf, bool bSuccess)
+{
+	// Copying into the cache may take a moment, so do it before locking
+	if (bSuccess)
+		m_pCache->Put(GetURL(job->path), &buf);
+
+	ScopedLock lock(m_Mutex);
+	if (bSuccess)
+		m_iFetched++;
+	else
+		m_iFailed++;
+
+	// The job now owns the tile
+	job->bDone = true;
+	job->bSuccess = bSuccess;
+	job->buf = buf;
+	if (job->iWaiters == 0)
+		DeleteJob(job);
+	else
+		m_JobDone.broadcast();
+}
+
+// Fetch a tile, from the cache folder or else from the server, and decode it.
+bool vtTileStreamer::Fetch(ReqContext *pContext, const vtString &path, databuf &buf)
+{
+	vtString cached;
+	if (m_strCacheFolder != "")
+	{
+		cached = m_strCacheFolder + "/" + path;
+		FILE *fp = vtFileOpen(cached, "rb");
+		if (fp)
+		{
+			// If the size can't be told, or makes no sense, e.g. for a
+			//  folder, it is treated as a cache miss
+			std::vector<uchar> bytes;
+			long size = -1;
+			if (fseek(fp, 0, SEEK_END) == 0)
+				size = ftell(fp);
+			if (size > 0 && size <= MAX_CACHED_TILE_BYTES && fseek(fp, 0, SEEK_SET) == 0)
+				bytes.resize(size);
+			const bool bRead = !bytes.empty() &&
+				fread(&bytes[0], bytes.size(), 1, fp) == 1;
+			fclose(fp);
+
+			// A file which was only partly written is simply fetched again
+			if (bRead && ReadMiniDatabuf(&bytes[0], (uint) bytes.size(), &buf))
+				return true;
+		}
+	}
+#if SUPPORT_CURL
+	const vtString url = GetURL(path);
+	for (int attempt = 0; attempt <= m_iRetries; attempt++)
+	{
+		// Wait a little longer before each retry
+		if (attempt > 0)
+			OpenThreads::Thread::microSleep(200000 << attempt);
+
+		vtBytes data;
+		if (!pContext->GetURL(url, data))
+		{
+			// If the server says there is no such tile, don't ask again
+			const long code = pContext->GetResponseCode();
+			if (code >= 400 && code < 500)
+				break;
+			VTLOG("Tile fetch of '%s' failed: %s\n", (const char *) url,
+				(const char *) pContext->GetErrorMsg());
+			continue;
+		}
+		if (!ReadMiniDatabuf(data.Get(), (uint) data.Len(), &buf))
+		{
+			VTLOG("Tile '%s' could not be decoded.\n", (const char *) url);
+			break;
+		}
+		if (cached != "")
+		{
+			vtCreateDir(ExtractPath(cached, false));
+			FILE *fp = vtFileOpen(cached, "wb");
+			if (fp)
+			{
+				fwrite(data.Get(), data.Len(), 1, fp);
+				fclose(fp);
+			}
+		}
+		return true;
+	}
+#endif
+	return false;
+}
+
+vtTileStreamer::Worker::~Worker()
+{
+	delete m_pContext;
+}
+
+void vtTileStreamer::Worker::run()
+{
+	vtTileJob *job;
+	while (m_pStreamer->NextJob(job))
+	{
+		databuf buf;
+		bool bSuccess = m_pStreamer->Fetch(m_pContext, job->path, buf);
+		m_pStreamer->JobDone(job, buf, bSuccess);
+	}
+}
+
+
 ///////////////////////////////////////////////////////////////////////
 // class vtTiledGeom implementation
 
-vtTiledGeom::vtTiledGeom()
+vtTileCache vtTiledGeom::s_TileCache;
+size_t vtTiledGeom::s_iTileCacheSize = 0;
+
+/**
+ * Ask for a tile cache of a given size.  Since the cache is shared by all the
+ * tiled terrains, one terrain asking for less does not shrink it below what
+ * another has asked for.
+ */
+void vtTiledGeom::SetTileCacheSize(size_t bytes)
 {
-	s_pTiledGeom = this;
+	if (bytes <= s_iTileCacheSize)
+		return;
+	s_iTileCacheSize = bytes;
+	s_TileCache.SetMaxBytes(bytes);
+}
 
+vtTiledGeom::vtTiledGeom()
+{
 	m_pMiniLoad = NULL;
 	m_pMiniTile = NULL;
 	m_pMiniCache = NULL;
 	m_pDataCloud = NULL;
+	m_pThreads = NULL;
 
 	// This maxiumum scale is a reasonable tradeoff between the exaggeration
 	//  that the user is likely to need, and numerical precision issues.
@@ -453,11 +981,21 @@ vtTiledGeom::vtTiledGeom()
 	m_fHResolution = 2 * m_fResolution;
 	m_fLResolution = TILEDGEOM_RESOLUTION_MIN;
 	m_bNeedResolutionAdjust = false;
+	m_bFirstRender = true;
+	m_fLastResolution = 0;
+	m_iLastVertexCount = 0;
 
 	m_iFrame = 0;
 	m_iTileLoads = 0;
 	m_progress_callback = NULL;
 
+	m_pPrefetcher = NULL;
+	m_bPrefetch = true;
+	m_fPrefetchTime = 2.0f;
+	m_EyeVelocity.Set(0, 0, 0);
+	m_fLastEyeTime = -1.0f;
+	m_iPredictedCol = m_iPredictedRow = -1;
+
 	// The terrain surface is not lit by diffuse light (since there are no normals
 	//  for per-vertex lighting).  However, it does respond to ambient light level
 	//  (so that the terrain is dark at night).
@@ -466,7 +1004,7 @@ vtTiledGeom::vtTiledGeom()
 	m_pPlainMaterial->SetAmbient(1,1,1);
 	m_pPlainMaterial->SetLighting(true);
 
-	m_pReqContext = NULL;
+	m_pStreamer = NULL;
 
 	// register libMini conversion hook (JPEG/PNG)
 	InitMiniConvHook();
@@ -474,13 +1012,30 @@ vtTiledGeom::vtTiledGeom()
 
 vtTiledGeom::~vtTiledGeom()
 {
-#if SUPPORT_THREADING
-	// We should exit the thread here, but there might be more than one
-	//  vtTiledGeom, so we aren't handling thread deletion correctly yet.
-	// TODO: fix this so that threads are correctly exited and freed.
-	//threadexit();
+	// The prefetcher fills the tile cache, so stop it first
+	if (m_pPrefetcher)
+	{
+		VTLOG("Tile prefetcher loaded %d tiles.\n", m_pPrefetcher->NumLoaded());
+		delete m_pPrefetcher;
+	}
+	VTLOG("Tile cache: %d hits, %d misses.\n", s_TileCache.NumHits(),
+		s_TileCache.NumMisses());
 
+	// A loader thread may be waiting for the streamer, so stop it before
+	//  the datacloud waits for the loader threads.
+	if (m_pStreamer)
+	{
+		VTLOG("Tile streamer fetched %d tiles, %d failed.\n",
+			m_pStreamer->NumFetched(), m_pStreamer->NumFailed());
+		m_pStreamer->Stop();
+	}
+
+#if SUPPORT_THREADING
+	// Deleting the datacloud stops its threads, which are our own, so they
+	//  can then be freed.
 	delete m_pDataCloud;
+	if (m_pThreads)
+		threadexit(m_pThreads);
 #endif
 
 #if USE_VERTEX_CACHE
@@ -492,7 +1047,7 @@ vtTiledGeom::~vtTiledGeom()
 
 	delete m_pPlainMaterial;
 
-	delete m_pReqContext;
+	delete m_pStreamer;
 }
 
 bool vtTiledGeom::ReadTileList(const char *dataset_fname_elev,
@@ -792,13 +1347,13 @@ void vtTiledGeom::SetupMiniLoad(bool bThreading, bool bGradual)
 	//	m_pDataCloud->setmaxsize(512.0);
 		m_pDataCloud->setmaxsize(0);
 
-		m_pDataCloud->setthread(startthread, NULL, jointhread,
+		// Each vtTiledGeom has its own threads
+		m_pThreads = threadinit();
+		m_pDataCloud->setthread(startthread, m_pThreads, jointhread,
 			lock_cs, unlock_cs,
 			lock_io, unlock_io);
 		m_pDataCloud->setmulti(numthreads);
 
-		threadinit();
-
 		// If the user wants, start with minimal tileset and load first tiles gradually
 		if (bGradual)
 		{
@@ -839,6 +1394,34 @@ float vtTiledGeom::GetPagingRange()
 databuf vtTiledGeom::FetchTile(const char *fname)
 {
 	databuf result;
+	m_iTileLoads++;
+	LoadTile(fname, &result);
+	return result;
+}
+
+/**
+ * Load a tile: from the tile cache if it is there, otherwise from disk, or
+ * from the server if the tiles are streamed.  This can take a while, so it
+ * is best called by a loader thread.  Tiles are only streamed with
+ * threading on (see SetBaseURL), so the render thread never waits for the
+ * server.
+ *
+ * \return true if successful.
+ */
+bool vtTiledGeom::LoadTile(const char *fname, databuf *result)
+{
+	if (m_pStreamer)
+	{
+		// The streamer puts the tiles it fetches in the cache itself
+		const vtString path = GetTilePath(fname);
+		if (s_TileCache.Get(m_pStreamer->GetURL(path), result))
+			return true;
+		return m_pStreamer->Get(path, result);
+	}
+
+	// A tile which was loaded before may still be in the cache
+	if (s_TileCache.Get(fname, result))
+		return true;
 
 	// load it
 #if LOG_TILE_LOADS
@@ -847,12 +1430,152 @@ databuf vtTiledGeom::FetchTile(const char *fname)
 	VTLOG1(str);
 	VTLOG1("\n");
 #endif
-	m_iTileLoads++;
 
 	// Load data buffer directly
-	result.loaddata(fname);
+	result->loaddata(fname);
 
-	return result;
+	// Keep a copy, since libMini will free this one when it pages it out
+	s_TileCache.Put(fname, result);
+
+	return (result->data != NULL);
+}
+
+/**
+ * Turn on or off the prefetching of tiles.  When on, the motion of the
+ * camera is used to predict where it will be a few seconds ahead (see
+ * SetPrefetchTime), and the tiles there are loaded into the tile cache in
+ * the background, so they are ready when libMini asks for them.
+ */
+void vtTiledGeom::SetPrefetch(bool bOn)
+{
+	m_bPrefetch = bOn;
+	if (!bOn && m_pPrefetcher)
+	{
+		delete m_pPrefetcher;
+		m_pPrefetcher = NULL;
+	}
+	m_iPredictedCol = m_iPredictedRow = -1;
+}
+
+// Predict where the camera is going, and ask the prefetcher for the tiles
+//  around that place.
+void vtTiledGeom::PredictTiles()
+{
+	const float fTime = vtGetTime();
+	const float dt = fTime - m_fLastEyeTime;
+	if (m_fLastEyeTime < 0 || dt > 1.0f)
+	{
+		// First frame, or after a pause; the old motion means nothing now
+		m_EyeVelocity.Set(0, 0, 0);
+		m_LastEyePos = m_eyepos_ogl;
+		m_fLastEyeTime = fTime;
+		return;
+	}
+	if (dt <= 0)
+		return;
+
+	// Smooth the velocity over several frames, so that a single uneven
+	//  frame doesn't send the prefetcher somewhere else.
+	const FPoint3 velocity = (m_eyepos_ogl - m_LastEyePos) / dt;
+	m_EyeVelocity = m_EyeVelocity * 0.8f + velocity * 0.2f;
+	m_LastEyePos = m_eyepos_ogl;
+	m_fLastEyeTime = fTime;
+
+	// The tile under the predicted eye, with the tiles laid out as they
+	//  were given to miniload.
+	const FPoint3 predicted = m_eyepos_ogl + m_EyeVelocity * m_fPrefetchTime;
+	const float x0 = center.x - cols * coldim / 2;
+	const float z0 = center.z - rows * rowdim / 2;
+	int col = (int) floorf((predicted.x - x0) / coldim);
+	int row = (int) floorf((predicted.z - z0) / rowdim);
+	if (col < 0) col = 0;
+	if (col > cols - 1) col = cols - 1;
+	if (row < 0) row = 0;
+	if (row > rows - 1) row = rows - 1;
+
+	// Only ask again when the predicted tile changes
+	if (col == m_iPredictedCol && row == m_iPredictedRow)
+		return;
+	m_iPredictedCol = col;
+	m_iPredictedRow = row;
+
+	// That tile first, then its neighbors
+	std::vector<vtString> fnames;
+	GetTileFilenames(col, row, predicted, fnames);
+	for (int i = col - 1; i <= col + 1; i++)
+	{
+		for (int j = row - 1; j <= row + 1; j++)
+		{
+			if ((i != col || j != row) && i >= 0 && i < cols && j >= 0 && j < rows)
+				GetTileFilenames(i, j, predicted, fnames);
+		}
+	}
+	if (fnames.empty())
+		return;
+
+	if (m_pStreamer)
+	{
+		// Streamed tiles are prefetched by the streamer's own connections
+		for (uint i = 0; i < fnames.size(); i++)
+			fnames[i] = GetTilePath(fnames[i]);
+		m_pStreamer->Request(fnames);
+		return;
+	}
+	if (!m_pPrefetcher)
+	{
+		m_pPrefetcher = new vtTilePrefetcher(&s_TileCache);
+		m_pPrefetcher->start();
+	}
+	m_pPrefetcher->Request(fnames);
+}
+
+// Get the filenames of the elevation and image tiles at a column and row,
+//  at the LODs which will likely be needed when the eye is at a place.
+void vtTiledGeom::GetTileFilenames(int col, int row, const FPoint3 &eye,
+								   std::vector<vtString> &fnames)
+{
+	const FPoint3 tile_center(center.x + (col + 0.5f - cols / 2.0f) * coldim, 0,
+		center.z + (row + 0.5f - rows / 2.0f) * rowdim);
+	const float dist = (eye - tile_center).Length();
+	const float diagonal = sqrtf(coldim*coldim + rowdim*rowdim);
+
+	vtString base;
+	base.Format("/tile.%d-%d.db", col, row);
+
+	for (int k = 0; k < 2; k++)
+	{
+		const bool bIsTexture = (k == 1);
+		LODMap &lodmap = bIsTexture ? m_image_info.lodmap : m_elev_info.lodmap;
+
+		// The finest LOD (0) is needed within a certain range, and each
+		//  coarser one within twice the range of the one before.
+		int num_lods = 8;
+		if (lodmap.exists())
+		{
+			int mmin, mmax;
+			lodmap.get(col, row, mmin, mmax);
+			num_lods = mmin - mmax + 1;
+			if (mmin == 0)
+				continue;
+		}
+		float range = bIsTexture ? prange : diagonal;
+		int lod = 0;
+		while (dist > range && lod < num_lods - 1)
+		{
+			range *= 2;
+			lod++;
+		}
+
+		vtString fname = (bIsTexture ? m_folder_image : m_folder_elev) + base;
+		if (lod > 0)
+		{
+			vtString str;
+			str.Format("%d", lod);
+			fname += str;
+		}
+		if (CheckMapFile(fname, bIsTexture))
+			fnames.push_back(fname);
+	}
 }
 
 bool vtTiledGeom::CheckMapFile(const char *mapfile, bool bIsTexture)
@@ -884,6 +1607,11 @@ bool vtTiledGeom::CheckMapFile(const char *mapfile, bool bIsTexture)
 			return (lod < num_lods);
 		}
 	}
+	else if (m_pStreamer)
+	{
+		// no lod info, and no way to check the server, so assume it's there
+		return true;
+	}
 	else
 	{
 		// no lod info, must check file
@@ -892,17 +1620,56 @@ bool vtTiledGeom::CheckMapFile(const char *mapfile, bool bIsTexture)
 	return false;
 }
 
-void vtTiledGeom::SetBaseURL(const char *url)
+/**
+ * Stream the tiles from a server, instead of loading them from disk.  The
+ * tileset's .ini files are still read from disk, and should have LOD maps,
+ * so that the tiles don't need to be checked for on the server.
+ *
+ * Call this before the terrain is first drawn.  Streaming needs threading
+ * (see ReadTileList), so that the tiles are fetched by the loader thread:
+ * fetching a tile from the render thread would stall the frame.
+ *
+ * \param url The base URL, which the tiles' paths relative to the folders
+ *		containing the tilesets are appended to, e.g.
+ *		"http://example.com/tilesets/".
+ * \param iConnections The most tiles to fetch at once.
+ * \return true if the tiles will be streamed, false if threading is off.
+ */
+bool vtTiledGeom::SetBaseURL(const char *url, int iConnections)
 {
-	if (!m_pReqContext)
-		m_pReqContext = new ReqContext;
+	if (!m_pDataCloud)
+	{
+		VTLOG("Can't stream tiles from '%s' without threading, loading them from disk.\n", url);
+		return false;
+	}
 	m_strBaseURL = url;
+	if (!m_pStreamer)
+		m_pStreamer = new vtTileStreamer(&s_TileCache);
+	m_pStreamer->SetBaseURL(url);
+	m_pStreamer->Start(iConnections);
+	return true;
+}
+
+/**
+ * Get the path of a tile relative to the folder which contains its
+ * tileset, which is also its path relative to the base URL.  For example,
+ * "C:/Data/Elevation/Foo/tile.0-0.db" in the tileset "C:/Data/Elevation/Foo"
+ * has the path "Foo/tile.0-0.db".
+ */
+vtString vtTiledGeom::GetTilePath(const char *mapfile) const
+{
+	const vtString &folder =
+		!strncmp(mapfile, m_folder_image, m_folder_image.GetLength()) ?
+		m_folder_image : m_folder_elev;
+	if (strncmp(mapfile, folder, folder.GetLength()))
+		return vtString(StartOfFilename(mapfile));
+	const char *name = StartOfFilename(folder);
+	return vtString(mapfile + (name - (const char *) folder));
 }
 
 void vtTiledGeom::DoRender()
 {
-	static bool bFirst = true;
-	if (bFirst)
+	if (m_bFirstRender)
 		VTLOG1("First vtTiledGeom render\n");
 
 	clock_t c1 = clock();
@@ -916,10 +1683,9 @@ void vtTiledGeom::DoRender()
 
 	// One update every 5 frames is a good approximation
 	int fpu=5;
-	static float last_res = 0;
-	if (last_res != m_fResolution)
+	if (m_fLastResolution != m_fResolution)
 		fpu=1;
-	last_res = m_fResolution;
+	m_fLastResolution = m_fResolution;
 
 	// If we have an orthographic camera, then fov is negative, and we cannot
 	//  use update (fpu) greater than 0.
@@ -948,21 +1714,20 @@ void vtTiledGeom::DoRender()
 	m_pMiniCache->setalphatest(0);
 
 	// render vertex arrays
-	static int last_vtx = 0;
 	// int vtx=m_pMiniCache->rendercache();
 	m_iVertexCount = m_pMiniCache->rendercache();
 //	m_iVertexCount = m_pMiniCache->getvtxcnt();
 #endif
 
-	if (bFirst)
+	if (m_bFirstRender)
 	{
 		VTLOG("  First Render: %.3f seconds.\n", (float)(clock() - c1) / CLOCKS_PER_SEC);
 		SetProgressCallback(NULL);
-		bFirst = false;
+		m_bFirstRender = false;
 	}
 
 	// When vertex count changes, we know a full update occurred
-	if (m_iVertexCount != last_vtx || m_bNeedResolutionAdjust)
+	if (m_iVertexCount != m_iLastVertexCount || m_bNeedResolutionAdjust)
 	{
 		m_bNeedResolutionAdjust = false;
 
@@ -1010,7 +1775,7 @@ void vtTiledGeom::DoRender()
 			m_bNeedResolutionAdjust = true;
 		}
 	}
-	last_vtx = m_iVertexCount;
+	m_iLastVertexCount = m_iVertexCount;
 }
 
 void vtTiledGeom::DoCalcBoundBox(FBox3 &box)
@@ -1057,6 +1822,9 @@ void vtTiledGeom::DoCull(const vtCamera *pCam)
 		float fov_y2 = atan(tan (fov/2) / m_fAspect);
 		m_fFOVY = fov_y2 * 2.0f * 180 / PIf;
 	}
+
+	if (m_bPrefetch && m_pMiniLoad)
+		PredictTiles();
 }
 
 bool vtTiledGeom::FindAltitudeOnEarth(const DPoint2 &p, float &fAltitude,
@@ -1112,6 +1880,31 @@ bool vtTiledGeom::FindAltitudeAtPoint(const FPoint3 &p3, float &fAltitude,
 	return true;
 }
 
+int vtTiledGeom::FindAltitudesAtPoints(const FPoint3 *points,
+	float *altitudes, int count, bool bTrue, int iCultureFlags) const
+{
+	// Culture must be tested point by point
+	if (iCultureFlags != 0 && m_pCulture != NULL)
+		return vtHeightFieldGrid3d::FindAltitudesAtPoints(points, altitudes,
+			count, bTrue, iCultureFlags);
+
+	// convert stored values to true values, or leave them as drawn values
+	const float fScale = bTrue ? 1.0f / m_fDrawScale / m_fMaximumScale : 1.0f;
+	int found = 0;
+	for (int i = 0; i < count; i++)
+	{
+		const float alt = m_pMiniLoad->getheight(points[i].x, points[i].z);
+		if (alt == -FLT_MAX)
+			altitudes[i] = 0.0f;
+		else
+		{
+			altitudes[i] = alt * fScale;
+			found++;
+		}
+	}
+	return found;
+}
+
 bool vtTiledGeom::CastRayToSurface(const FPoint3 &point, const FPoint3 &dir,
 	FPoint3 &result) const
 {
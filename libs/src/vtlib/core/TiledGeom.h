@@ -12,6 +12,10 @@
 #include "vtdata/vtString.h"
 #include "minidata/MiniDatabuf.h"
 #include <map>
+#include <list>
+#include <OpenThreads/Thread>
+#include <OpenThreads/Mutex>
+#include <OpenThreads/Condition>
 
 #define TILEDGEOM_RESOLUTION_MIN 80.0f
 #define TILEDGEOM_RESOLUTION_MAX 80000.0f
@@ -35,10 +39,153 @@ public:
 	bool bJPEG;
 };
 
-// Simple cache of tiles loaded from disk
 typedef uchar *ucharptr;
 class databuf;
 class ReqContext;
+struct vtTileThreads;
+struct vtTileJob;
+
+/**
+ * A cache, in host RAM, of tiles which have been loaded from disk and
+ * decoded.  libMini pages tiles out as the camera moves away from them; with
+ * this cache, a tile which is paged in again is copied from memory, instead
+ * of being read and decoded again.
+ *
+ * Tiles are kept by filename, which also identifies the LOD of the tile.
+ * When they take more than the cache's budget of bytes, the least recently
+ * used tiles are dropped.  The cache can be used from several threads.
+ */
+class vtTileCache
+{
+public:
+	vtTileCache();
+	~vtTileCache();
+
+	void SetMaxBytes(size_t bytes);
+	size_t GetMaxBytes() const { return m_iMaxBytes; }
+
+	bool Get(const char *fname, databuf *result);
+	void Put(const char *fname, databuf *buf);
+	bool Contains(const char *fname);
+	void Clear();
+
+	size_t NumBytes() const { return m_iBytes; }
+	size_t NumTiles() const { return m_Tiles.size(); }
+	uint NumHits() const { return m_iHits; }
+	uint NumMisses() const { return m_iMisses; }
+
+protected:
+	struct Entry
+	{
+		vtString fname;
+		databuf *buf;
+	};
+	typedef std::list<Entry> EntryList;
+	void Evict(size_t bytes);
+
+	// All of these are guarded by m_Mutex
+	OpenThreads::Mutex m_Mutex;
+	EntryList m_Tiles;		// most recently used first
+	std::map<vtString, EntryList::iterator> m_Lookup;
+	size_t m_iBytes, m_iMaxBytes;
+	uint m_iHits, m_iMisses;
+};
+
+/**
+ * A thread which loads tiles into a vtTileCache ahead of when libMini will
+ * ask for them.  Only the most recent requests are kept: each call to
+ * Request replaces those which have not yet been loaded.
+ */
+class vtTilePrefetcher : public OpenThreads::Thread
+{
+public:
+	vtTilePrefetcher(vtTileCache *pCache);
+	~vtTilePrefetcher();
+
+	void Request(const std::vector<vtString> &fnames);
+	void Stop();
+	uint NumLoaded() const { return m_iLoaded; }
+
+protected:
+	virtual void run();
+
+	vtTileCache *m_pCache;
+
+	// All of these are guarded by m_Mutex
+	OpenThreads::Mutex m_Mutex;
+	OpenThreads::Condition m_Ready;
+	std::list<vtString> m_Pending;
+	bool m_bStopping;
+	uint m_iLoaded;
+};
+
+/**
+ * Streams the tiles of a tileset from a web server, or from any other URL
+ * which libcurl can fetch.  A tile's URL is the base URL followed by its
+ * path relative to the folder which contains the tileset.  For testing
+ * without a server, the base URL can also be a local "file://" URL.
+ *
+ * Tiles are fetched by a few worker threads, each of which keeps its own
+ * connection to the server open to be reused.  A failed fetch is retried a
+ * few times, unless the server says that the tile does not exist.  Fetched
+ * tiles are decoded straight from memory, put in the tile cache, and can
+ * also be kept in a folder on disk so that they are not fetched again in a
+ * later session.
+ */
+class vtTileStreamer
+{
+public:
+	vtTileStreamer(vtTileCache *pCache);
+	~vtTileStreamer();
+
+	void SetBaseURL(const char *url) { m_strBaseURL = url; }
+	const vtString &GetBaseURL() const { return m_strBaseURL; }
+	void SetCacheFolder(const char *folder);
+	void SetRetries(int iRetries) { m_iRetries = iRetries; }
+
+	void Start(int iConnections = 4);
+	void Stop();
+	int NumConnections() const { return (int) m_Workers.size(); }
+
+	vtString GetURL(const char *path) const { return m_strBaseURL + path; }
+	bool Get(const char *path, databuf *result);
+	void Request(const std::vector<vtString> &paths);
+
+	uint NumFetched();
+	uint NumFailed();
+
+protected:
+	class Worker : public OpenThreads::Thread
+	{
+	public:
+		Worker(vtTileStreamer *pStreamer, ReqContext *pContext)
+		{ m_pStreamer = pStreamer; m_pContext = pContext; }
+		~Worker();
+		virtual void run();
+		vtTileStreamer *m_pStreamer;
+		ReqContext *m_pContext;		// our own connection
+	};
+	vtTileJob *AddJob(const vtString &path, bool bUrgent);
+	bool NextJob(vtTileJob *&job);
+	void JobDone(vtTileJob *job, databuf &buf, bool bSuccess);
+	void DeleteJob(vtTileJob *job);
+	bool Fetch(ReqContext *pContext, const vtString &path, databuf &buf);
+
+	vtTileCache *m_pCache;
+	vtString m_strBaseURL;
+	vtString m_strCacheFolder;
+	int m_iRetries;
+
+	// All of these are guarded by m_Mutex
+	OpenThreads::Mutex m_Mutex;
+	OpenThreads::Condition m_JobReady, m_JobDone;
+	std::map<vtString, vtTileJob *> m_Jobs;	// waiting or being fetched
+	std::list<vtTileJob *> m_Queue;			// waiting, most urgent first
+	bool m_bRunning;
+	uint m_iFetched, m_iFailed;
+
+	std::vector<Worker *> m_Workers;
+};
 
 typedef bool (*ProgFuncPtrType)(int);
 
@@ -74,11 +221,14 @@ public:
 	bool FindAltitudeAtPoint(const FPoint3 &p3, float &fAltitude,
 		bool bTrue = false, int iCultureFlags = 0,
 		FPoint3 *vNormal = NULL) const;
+	int FindAltitudesAtPoints(const FPoint3 *points, float *altitudes,
+		int count, bool bTrue = false, int iCultureFlags = 0) const;
 	bool CastRayToSurface(const FPoint3 &point, const FPoint3 &dir,
 		FPoint3 &result) const;
 
 	// Tile methods
 	databuf FetchTile(const char *fname);
+	bool LoadTile(const char *fname, databuf *result);
 
 	// CRS of this tileset
 	vtProjection m_proj;
@@ -90,10 +240,19 @@ public:
 	int m_iVertexTarget;
 	int m_iVertexCount;
 
-	// Tile cache in host RAM, to reduce loading from disk
+	// Tile cache in host RAM, to reduce loading from disk.  It is shared by
+	//  all the tiled terrains, so it is as large as the largest of them asks.
+	static void SetTileCacheSize(size_t bytes);
+	static vtTileCache &GetTileCache() { return s_TileCache; }
 	int m_iFrame;
 	int m_iTileLoads;
 
+	// Prefetching of the tiles ahead of the moving camera
+	void SetPrefetch(bool bOn);
+	bool GetPrefetch() const { return m_bPrefetch; }
+	void SetPrefetchTime(float fSeconds) { m_fPrefetchTime = fSeconds; }
+	float GetPrefetchTime() const { return m_fPrefetchTime; }
+
 	// Size of base texture LOD
 	int image_lod0size;
 
@@ -122,9 +281,10 @@ public:
 	ProgFuncPtrType m_progress_callback;
 
 	// Options WWW fetch
-	void SetBaseURL(const char *url);
+	bool SetBaseURL(const char *url, int iConnections = 4);
+	vtTileStreamer *GetStreamer() { return m_pStreamer; }
+	vtString GetTilePath(const char *mapfile) const;
 	vtString m_strBaseURL;
-	ReqContext *m_pReqContext;
 
 protected:
 	// a vtlib material
@@ -138,6 +298,9 @@ protected:
 	float m_fNear, m_fFar;
 	FPoint3 eye_up, eye_forward;
 	bool m_bNeedResolutionAdjust;
+	bool m_bFirstRender;
+	float m_fLastResolution;
+	int m_iLastVertexCount;
 
 	// vertical scale (exaggeration)
 	float m_fMaximumScale;
@@ -149,8 +312,24 @@ protected:
 	class minitile *m_pMiniTile;
 	class minicache *m_pMiniCache;	// This is cache of OpenGL primitives to be rendered
 	class datacloud *m_pDataCloud;
+	vtTileThreads *m_pThreads;		// the datacloud's threads
 
 	void SetupMiniLoad(bool bThreading, bool bGradual);
+
+	static vtTileCache s_TileCache;
+	static size_t s_iTileCacheSize;	// largest size asked for
+
+	// Prefetching: the camera's motion, and where it was predicted to be
+	void PredictTiles();
+	void GetTileFilenames(int col, int row, const FPoint3 &eye,
+		std::vector<vtString> &fnames);
+	vtTilePrefetcher *m_pPrefetcher;
+	vtTileStreamer *m_pStreamer;
+	bool m_bPrefetch;
+	float m_fPrefetchTime;
+	FPoint3 m_LastEyePos, m_EyeVelocity;
+	float m_fLastEyeTime;
+	int m_iPredictedCol, m_iPredictedRow;
 };
 typedef osg::ref_ptr<vtTiledGeom> vtTiledGeomPtr;
 
@@ -110,20 +110,60 @@ void OutputSOG::WriteMaterials(FILE *fp, const vtMaterialArray *pMats)
 	}
 }
 
-void OutputSOG::WriteSingleGeometry(FILE *fp, const vtGeode *pGeode)
+//
+// The counts of a mesh, and the byte lengths of its index and primitive
+//  arrays, are stored as signed shorts, which limits how large it can be.
+//
+static bool FitsInSOG(const vtGeode *pGeode)
+{
+	for (uint i = 0; i < pGeode->GetNumMeshes(); i++)
+	{
+		vtMesh *pMesh = pGeode->GetMesh(i);
+		if (pMesh && (pMesh->GetNumVertices() > 32767 ||
+			pMesh->GetNumIndices() > 32767 / 2 ||
+			pMesh->GetNumPrims() > 32767 / 2))
+		{
+			VTLOG("SOG: mesh of %d vertices, %d indices is too large to write.\n",
+				pMesh->GetNumVertices(), pMesh->GetNumIndices());
+			return false;
+		}
+	}
+	return true;
+}
+
+/**
+ * Write a geometry and its materials.  Nothing is written, and false is
+ * returned, if any of its meshes is too large for the format.
+ */
+bool OutputSOG::WriteSingleGeometry(FILE *fp, const vtGeode *pGeode)
 {
+	if (!FitsInSOG(pGeode))
+		return false;
+
 	const vtMaterialArray	*pMats = pGeode->GetMaterials();
 	WriteMaterials(fp, pMats);
 
 	short num_geom = 1;
 	Write(fp, FT_NUM_GEOMETRIES, num_geom);
 	WriteGeometry(fp, pGeode, 0);
+	return true;
 }
 
-void OutputSOG::WriteMultiGeometry(FILE *fp, const vtGroup *pParent)
+/**
+ * Write the geometries of a group, which share the materials of the first.
+ * Nothing is written, and false is returned, if any of their meshes is too
+ * large for the format.
+ */
+bool OutputSOG::WriteMultiGeometry(FILE *fp, const vtGroup *pParent)
 {
 	int i;
 	short num_geom = pParent->getNumChildren();
+	for (i = 0; i < num_geom; i++)
+	{
+		const vtGeode *pGeode = dynamic_cast<const vtGeode*>(pParent->getChild(i));
+		if (pGeode && !FitsInSOG(pGeode))
+			return false;
+	}
 
 	Write(fp, FT_NUM_GEOMETRIES, num_geom);
 	for (i = 0; i < num_geom; i++)
@@ -138,6 +178,7 @@ void OutputSOG::WriteMultiGeometry(FILE *fp, const vtGroup *pParent)
 		}
 		WriteGeometry(fp, pGeode, i);
 	}
+	return true;
 }
 
 //
@@ -311,7 +352,7 @@ void OutputSOG::WriteMesh(FILE *fp, const vtMesh *pMesh)
 	short idx;
 	for (i = 0; i < idxs; i++)
 	{
-		idx = pMesh->GetIndex(i);
+		idx = (short) pMesh->GetIndex(i);	// fits, since FitsInSOG checked verts
 		fwrite(&idx, 2, 1, fp);
 	}
 
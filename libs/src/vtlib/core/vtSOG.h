@@ -41,8 +41,8 @@ class OutputSOG
 {
 public:
 	void WriteHeader(FILE *fp);
-	void WriteSingleGeometry(FILE *fp, const vtGeode *pGeode);
-	void WriteMultiGeometry(FILE *fp, const vtGroup *pParent);
+	bool WriteSingleGeometry(FILE *fp, const vtGeode *pGeode);
+	bool WriteMultiGeometry(FILE *fp, const vtGroup *pParent);
 
 private:
 	void Write(FILE *fp, FileToken ft, RGBf &rgb);
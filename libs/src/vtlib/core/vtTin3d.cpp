@@ -10,6 +10,7 @@
 #include "vtlib/vtlib.h"
 #include "vtdata/FilePath.h"	// for FindFileOnPaths
 #include "vtdata/DataPath.h"
+#include "vtdata/vtLog.h"
 #include "vtTin3d.h"
 
 
@@ -18,6 +19,8 @@ vtTin3d::vtTin3d()
 	m_pMats = NULL;
 	m_pGeode = NULL;
 	m_pDropGeode = NULL;
+	m_iStreamTri = 0;
+	m_iStreamMatIdx = 0;
 }
 
 /**
@@ -74,7 +77,10 @@ void vtTin3d::MakeSurfaceMaterials()
 }
 
 
-#define MAX_CHUNK_VERTS	30000
+// The most triangles in one mesh.  Meshes switch to 32-bit indices when they
+//  need to, so this only trades culling against the number of draw calls.
+#define MAX_CHUNK_TRIS	100000
+#define MAX_CHUNK_VERTS	(MAX_CHUNK_TRIS * 3)
 
 vtGeode *vtTin3d::CreateGeometry(bool bDropShadowMesh, int m_matidx)
 {
@@ -176,7 +182,7 @@ vtGeode *vtTin3d::CreateGeometry(bool bDropShadowMesh, int m_matidx)
 			if (newsize > most)
 				most = newsize;
 		}
-		if (most > 10000)
+		if (most > MAX_CHUNK_TRIS)
 		{
 			delete [] bins;
 			divs = divs * 3 / 2;
@@ -390,6 +396,154 @@ vtGeode *vtTin3d::CreateGeometry(bool bDropShadowMesh, int m_matidx)
 	return m_pGeode;
 }
 
+/**
+ * Begin streaming the geometry of a TIN from a native TIN (.itf) file.
+ *
+ * This is for TINs which are too large to load comfortably.  The file is
+ * memory-mapped, and its triangles go straight from the file into the
+ * geometry, a piece at a time, without being loaded into this object's
+ * arrays.  The memory used is therefore just that of the geometry itself.
+ *
+ * After opening, call StreamGeometry repeatedly (for example, once per
+ * frame) until it returns 0.  The geometry appears as it is built.
+ *
+ * Since the vertices and triangles are not loaded, the TIN can't be used
+ * for height testing (FindAltitudeAtPoint), but CastRayToSurface still
+ * works, using the geometry.
+ *
+ * \param fname The file to stream from.
+ * \param m_matidx The material of the geometry.
+ * \return The geode which will hold the geometry, or NULL if the file
+ *		could not be opened.
+ */
+vtGeode *vtTin3d::OpenStreaming(const char *fname, int m_matidx)
+{
+	if (!m_StreamFile.Open(fname))
+		return NULL;
+
+	if (m_StreamFile.HasProjection())
+		m_proj = m_StreamFile.GetProjection();
+	if (m_StreamFile.HasExtents())
+	{
+		m_EarthExtents = m_StreamFile.GetEarthExtents();
+		m_StreamFile.GetHeightExtents(m_fMinHeight, m_fMaxHeight);
+	}
+	else
+	{
+		// Older files don't have the extents in the header, so we must
+		//  look through the vertices for them.
+		DPoint2 p;
+		float z;
+		m_EarthExtents.SetRect(1E9, -1E9, -1E9, 1E9);
+		m_fMinHeight = 1E9;
+		m_fMaxHeight = -1E9;
+		for (int i = 0; i < m_StreamFile.NumVerts(); i++)
+		{
+			m_StreamFile.GetVert(i, p, z);
+			m_EarthExtents.GrowToContainPoint(p);
+			if (z < m_fMinHeight) m_fMinHeight = z;
+			if (z > m_fMaxHeight) m_fMaxHeight = z;
+		}
+	}
+	Initialize(m_proj.GetUnits(), m_EarthExtents, m_fMinHeight, m_fMaxHeight);
+
+	VTLOG("vtTin3d::OpenStreaming: %d verts, %d tris\n",
+		m_StreamFile.NumVerts(), m_StreamFile.NumTris());
+
+	if (!m_pMats)
+	{
+		m_pMats = new vtMaterialArray;
+		m_pMats->AddRGBMaterial1(RGBf(1, 1, 1), false, false, false);
+	}
+	m_pGeode = new vtGeode;
+	m_pGeode->SetMaterials(m_pMats);
+	m_pGeode->SetCastShadow(false);
+
+	m_iStreamTri = 0;
+	m_iStreamMatIdx = m_matidx;
+	return m_pGeode;
+}
+
+/**
+ * Build the geometry for the next piece of the TIN being streamed.
+ *
+ * \param iMaxTris The most triangles to add in this call.
+ * \return The number of triangles which remain.  When this reaches 0, the
+ *		file is closed.
+ */
+int vtTin3d::StreamGeometry(int iMaxTris)
+{
+	if (!m_StreamFile.IsOpen())
+		return 0;
+
+	FPoint3 light_dir(0.5, 1, 0);
+	light_dir.Normalize();
+	const float height_range = (m_fMaxHeight - m_fMinHeight);
+	const int verts = m_StreamFile.NumVerts();
+	const int tris = m_StreamFile.NumTris();
+	const int last = std::min(tris, m_iStreamTri + iMaxTris);
+
+	DPoint3 ep;
+	DPoint2 p2;
+	FPoint3 p[3], norm;
+	float z[3];
+	int v[3];
+	RGBf color;
+	while (m_iStreamTri < last)
+	{
+		const int chunk = std::min(last - m_iStreamTri, MAX_CHUNK_TRIS);
+		vtMesh *pMesh = new vtMesh(osg::PrimitiveSet::TRIANGLES,
+			VT_Normals|VT_Colors, chunk * 3);
+
+		for (int i = m_iStreamTri; i < m_iStreamTri + chunk; i++)
+		{
+			m_StreamFile.GetTri(i, v);
+			if (v[0] < 0 || v[0] >= verts || v[1] < 0 || v[1] >= verts ||
+				v[2] < 0 || v[2] >= verts)
+				continue;
+			for (int k = 0; k < 3; k++)
+			{
+				m_StreamFile.GetVert(v[k], p2, z[k]);
+				ep.Set(p2.x, p2.y, z[k]);
+				m_Conversion.ConvertFromEarth(ep, p[k]);
+			}
+			norm = ComputeNormal(p[0], p[1], p[2]);
+
+			float shade = norm.Dot(light_dir);	// shading 0 (dark) to 1 (light)
+			if (shade < 0)
+				shade = -shade;
+
+			int vert_base = pMesh->GetNumVertices();
+			for (int k = 0; k < 3; k++)
+			{
+				int vert_index = pMesh->AddVertex(p[k]);
+				pMesh->SetVtxNormal(vert_index, norm);
+
+				// red varies by elevation
+				color.Set((z[k] - m_fMinHeight) / height_range, 1.0f, 0.5f);
+				color *= shade;
+				pMesh->SetVtxColor(vert_index, color);
+			}
+			pMesh->AddTri(vert_base, vert_base+1, vert_base+2);
+		}
+		m_pGeode->AddMesh(pMesh, m_iStreamMatIdx);
+		m_Meshes.Append(pMesh);
+		m_iStreamTri += chunk;
+	}
+	const int remaining = tris - m_iStreamTri;
+	if (remaining == 0)
+		CloseStreaming();
+	return remaining;
+}
+
+/**
+ * Stop streaming, and close the file.  The geometry built so far is kept.
+ */
+void vtTin3d::CloseStreaming()
+{
+	m_StreamFile.Close();
+}
+
 /**
  * Returns true if the point was over the TIN, false otherwise.
  */
@@ -452,6 +606,17 @@ bool vtTin3d::FindAltitudeAtPoint(const FPoint3 &input, float &fAltitude,
 #endif
 }
 
+int vtTin3d::FindAltitudesAtPoints(const FPoint3 *points, float *altitudes,
+	int count, bool bTrue, int iCultureFlags) const
+{
+	// Culture must be tested point by point
+	if (iCultureFlags != 0 && m_pCulture != NULL)
+		return vtHeightField3d::FindAltitudesAtPoints(points, altitudes, count,
+			bTrue, iCultureFlags);
+	return vtTin::FindAltitudesAtPoints(points, altitudes, count, bTrue,
+		iCultureFlags);
+}
+
 
 /*
  * Algorithm from 'Fast, Minimum Storage Ray-Triangle Intersection',
@@ -508,6 +673,10 @@ bool intersect_triangle(const FPoint3 &orig, const FPoint3 &dir,
 bool vtTin3d::CastRayToSurface(const FPoint3 &point, const FPoint3 &dir,
 							   FPoint3 &result) const
 {
+	// The triangle bins are much faster than testing every mesh.
+	if (HasTriangleBins())
+		return vtTin::CastRayToSurface(point, dir, result);
+
 	FPoint3 wp1, wp2, wp3;
 	float t, u, v, closest = 1E9;
 	int i;
@@ -9,6 +9,7 @@
 #define TIN3DH
 
 #include "vtdata/vtTin.h"
+#include "vtdata/TinFile.h"
 #include "vtdata/HeightField.h"
 
 /** \defgroup tin TINs
@@ -30,12 +31,20 @@ public:
 
 	vtGeode *CreateGeometry(bool bDropShadowMesh, int m_matidx = 0);
 	vtGeode *GetGeometry() { return m_pGeode; }
+
+	// Build the geometry of a very large TIN a piece at a time
+	vtGeode *OpenStreaming(const char *fname, int m_matidx = 0);
+	int StreamGeometry(int iMaxTris);
+	bool IsStreaming() const { return m_StreamFile.IsOpen(); }
+	void CloseStreaming();
 	void SetTextureMaterials(vtMaterialArray *pMats);
 
 	// implement HeightField3d virtual methods
 	virtual bool FindAltitudeAtPoint(const FPoint3 &p3, float &fAltitude,
 		bool bTrue = false, int iCultureFlags = 0,
 		FPoint3 *vNormal = NULL) const;
+	virtual int FindAltitudesAtPoints(const FPoint3 *points, float *altitudes,
+		int count, bool bTrue = false, int iCultureFlags = 0) const;
 	virtual bool CastRayToSurface(const FPoint3 &point, const FPoint3 &dir,
 		FPoint3 &result) const;
 
@@ -48,6 +57,11 @@ protected:
 	vtMaterialArrayPtr m_pMats;
 	vtGeode		*m_pGeode;
 	vtGeode		*m_pDropGeode;
+
+	// Used while streaming
+	vtTinFile	m_StreamFile;
+	int			m_iStreamTri;
+	int			m_iStreamMatIdx;
 };
 typedef osg::ref_ptr<vtTin3d> vtTin3dPtr;
 
@@ -0,0 +1,95 @@
+//
+// PlantPackTest.cpp
+//
+// Checks the buffer which PackPlants fills for the shader vegetation.  It
+// needs no window or graphics context.
+//
+// Copyright (c) 2001-2012 Virtual Terrain Project
+// Free for all uses, see license.txt for details.
+//
+
+#include <stdio.h>
+#include <math.h>
+
+#include "vtlib/vtlib.h"
+#include "vtlib/core/Plants3d.h"
+#include "TestUtil.h"
+
+static void AddTree(TreeList &trees, float x, float y, float z, float size,
+	short species)
+{
+	vtPlantInstanceShader pi;
+	pi.m_pos.set(x, y, z);
+	pi.m_size = size;
+	pi.m_species_id = species;
+	trees.push_back(pi);
+}
+
+static bool SamePos(const PackedPlant &pp, float x, float y, float z)
+{
+	return pp.pos[0] == x && pp.pos[1] == y && pp.pos[2] == z;
+}
+
+int main(int argc, char **argv)
+{
+	Check(sizeof(PackedPlant) == 20, "PackedPlant is 20 bytes");
+
+	// Two species: the first with a short and a tall appearance, the second
+	//  with one appearance.  Their indices in the list are 0, 1 and 2.
+	vtSpeciesList3d species;
+	vtPlantSpecies3d *oak = new vtPlantSpecies3d;
+	oak->AddAppearance(AT_BILLBOARD, "oak_small.png", 3, 5, 0, 0);
+	oak->AddAppearance(AT_BILLBOARD, "oak_large.png", 6, 10, 0, 0);
+	species.Append(oak);
+	vtPlantSpecies3d *fern = new vtPlantSpecies3d;
+	fern->AddAppearance(AT_BILLBOARD, "fern.png", 1, 1, 0, 0);
+	species.Append(fern);
+
+	TreeList trees;
+	AddTree(trees, 1, 2, 3, 0.8f, 1);		// fern
+	AddTree(trees, 4, 5, 6, 9.5f, 0);		// large oak
+	AddTree(trees, 7, 8, 9, 4.25f, 0);		// small oak
+	AddTree(trees, 10, 11, 12, 5, 7);		// no such species, left out
+	AddTree(trees, 13, 14, 15, 1.2f, 1);	// fern
+	AddTree(trees, 16, 17, 18, 11, 0);		// large oak
+
+	std::vector<PackedPlant> plants;
+	std::vector<vtPlantAppearance3d*> appearances;
+	std::vector<uint> count;
+	PackPlants(trees, &species, plants, appearances, count);
+
+	// The appearances are in the order they were first found
+	Check(plants.size() == 5, "unknown species is left out");
+	Check(appearances.size() == 3 && count.size() == 3, "three appearances");
+	if (plants.size() != 5 || appearances.size() != 3 || count.size() != 3)
+		return 1;
+	Check(appearances[0] == fern->GetAppearance(0), "first range is the fern");
+	Check(appearances[1] == oak->GetAppearance(1), "second range is the large oak");
+	Check(appearances[2] == oak->GetAppearance(0), "third range is the small oak");
+	Check(count[0] == 2 && count[1] == 2 && count[2] == 1, "plants per appearance");
+
+	// Grouped by appearance, in their original order within each group
+	Check(SamePos(plants[0], 1, 2, 3), "position of plant 0");
+	Check(SamePos(plants[1], 13, 14, 15), "position of plant 1");
+	Check(SamePos(plants[2], 4, 5, 6), "position of plant 2");
+	Check(SamePos(plants[3], 16, 17, 18), "position of plant 3");
+	Check(SamePos(plants[4], 7, 8, 9), "position of plant 4");
+
+	// Heights in centimeters
+	Check(plants[0].height == 80, "height of plant 0");
+	Check(plants[1].height == 120, "height of plant 1");
+	Check(plants[2].height == 950, "height of plant 2");
+	Check(plants[3].height == 1100, "height of plant 3");
+	Check(plants[4].height == 425, "height of plant 4");
+
+	// Appearances are indices in the whole species list, not in the cell
+	Check(plants[0].appearance == 2 && plants[1].appearance == 2,
+		"fern appearance index");
+	Check(plants[2].appearance == 1 && plants[3].appearance == 1,
+		"large oak appearance index");
+	Check(plants[4].appearance == 0, "small oak appearance index");
+	for (uint i = 0; i < plants.size(); i++)
+		Check(plants[i].reserved == 0, "reserved is zero");
+
+	return TestResult("PlantPackTest");
+}
@@ -0,0 +1,80 @@
+//
+// PlantPagingTest.cpp
+//
+// Pages tiles of shader vegetation in and out, as the camera comes and
+// goes, and checks that the buffers of the unloaded tiles are freed.  It
+// needs no window or graphics context.
+//
+// Copyright (c) 2001-2012 Virtual Terrain Project
+// Free for all uses, see license.txt for details.
+//
+
+#include <stdio.h>
+
+#include "vtlib/vtlib.h"
+#include "vtlib/core/Plants3d.h"
+#include "vtdata/ElevationGrid.h"
+#include "vtdata/FilePath.h"
+#include "TestUtil.h"
+
+int main(int argc, char **argv)
+{
+	vtProjection proj;
+	proj.SetProjectionSimple(true, 10, EPSG_DATUM_WGS84);
+
+	vtSpeciesList3d species;
+	vtPlantSpecies3d *oak = new vtPlantSpecies3d;
+	oak->SetSciName("Quercus robur");
+	oak->AddAppearance(AT_BILLBOARD, "oak.png", 3, 5, 0, 0);
+	species.Append(oak);
+
+	// Enough plants for several tiles, which are written to a tiled VF file
+	const DRECT area(0, 500, 1000, 0);
+	vtPlantInstanceArray plants;
+	plants.SetProjection(proj);
+	plants.SetPlantList(&species);
+	for (int i = 0; i < 100; i++)
+		for (int j = 0; j < 100; j++)
+			plants.AddPlant(DPoint2(5 + i * 10, 2.5 + j * 5), 4.0f, (short) 0);
+	const char *fname = "PlantPagingTest.vf";
+	Check(plants.WriteVF(fname, 3), "tiled VF file is written");
+
+	vtElevationGrid grid(area, 11, 6, false, proj);
+	grid.FillWithSingleValue(0);
+
+	vtPlantInstanceArray3d pia;
+	pia.SetHeightField(&grid);
+	pia.SetPlantList(&species);
+	Check(pia.OpenPlantTiles(fname), "tiled VF file is opened");
+
+	// The camera over the middle of the plants, and then far away
+	FRECT world;
+	grid.m_Conversion.ConvertFromEarth(area, world);
+	const FPoint3 near_pos((world.left + world.right) / 2, 100,
+		(world.top + world.bottom) / 2);
+	const FPoint3 far_pos = near_pos + FPoint3(100000, 0, 0);
+
+	const int before = PlantInstanceBuffer::NumBuffers();
+	int loaded = 0;
+	for (int cycle = 0; cycle < 3; cycle++)
+	{
+		while (pia.DoTilePaging(near_pos, 200, 4) > 0)
+			;
+		if (cycle == 0)
+			loaded = PlantInstanceBuffer::NumBuffers();
+		else
+			Check(PlantInstanceBuffer::NumBuffers() == loaded,
+				"each page-in makes as many buffers as the first");
+		Check(pia.NumTilesLoaded() > 0, "tiles near the camera are loaded");
+
+		pia.DoTilePaging(far_pos, 200, 4);
+		Check(pia.NumTilesLoaded() == 0, "tiles far from the camera are unloaded");
+		Check(PlantInstanceBuffer::NumBuffers() == before,
+			"the buffers of unloaded tiles are freed");
+	}
+	Check(loaded > before, "loaded tiles have buffers");
+
+	vtDeleteFile(fname);
+
+	return TestResult("PlantPagingTest");
+}
@@ -0,0 +1,287 @@
+//
+// TestTileServer.cpp
+//
+// Copyright (c) 2001-2012 Virtual Terrain Project
+// Free for all uses, see license.txt for details.
+//
+
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+
+#ifdef _WIN32
+  #include <winsock2.h>
+  typedef int socklen_t;
+#else
+  #include <sys/types.h>
+  #include <sys/socket.h>
+  #include <sys/select.h>
+  #include <netinet/in.h>
+  #include <arpa/inet.h>
+  #include <unistd.h>
+  #define closesocket close
+#endif
+#ifndef MSG_NOSIGNAL
+  #define MSG_NOSIGNAL 0
+#endif
+
+#include <OpenThreads/ScopedLock>
+
+#include "vtdata/FilePath.h"
+#include "TestTileServer.h"
+
+typedef OpenThreads::ScopedLock<OpenThreads::Mutex> ScopedLock;
+
+vtTestTileServer::vtTestTileServer(const char *folder)
+{
+	m_strFolder = folder;
+	m_iListen = -1;
+	m_iPort = 0;
+	m_bStopping = false;
+	m_iConnections = 0;
+}
+
+vtTestTileServer::~vtTestTileServer()
+{
+	Stop();
+}
+
+/**
+ * Start listening, on a port chosen by the system, and serving.
+ *
+ * \return true if successful.
+ */
+bool vtTestTileServer::Start()
+{
+#ifdef _WIN32
+	WSADATA wsa;
+	if (WSAStartup(MAKEWORD(2, 2), &wsa) != 0)
+		return false;
+#endif
+	m_iListen = (int) socket(AF_INET, SOCK_STREAM, 0);
+	if (m_iListen < 0)
+		return false;
+
+	sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	addr.sin_port = 0;
+	socklen_t len = sizeof(addr);
+	if (bind(m_iListen, (sockaddr *) &addr, sizeof(addr)) != 0 ||
+		listen(m_iListen, 16) != 0 ||
+		getsockname(m_iListen, (sockaddr *) &addr, &len) != 0)
+	{
+		closesocket(m_iListen);
+		m_iListen = -1;
+		return false;
+	}
+	m_iPort = ntohs(addr.sin_port);
+	start();
+	return true;
+}
+
+void vtTestTileServer::Stop()
+{
+	if (m_iListen < 0)
+		return;
+	{
+		ScopedLock lock(m_Mutex);
+		m_bStopping = true;
+	}
+	join();
+	closesocket(m_iListen);
+	m_iListen = -1;
+#ifdef _WIN32
+	WSACleanup();
+#endif
+}
+
+vtString vtTestTileServer::GetBaseURL() const
+{
+	vtString url;
+	url.Format("http://127.0.0.1:%d/", m_iPort);
+	return url;
+}
+
+void vtTestTileServer::FailNext(const char *path, int status, int count)
+{
+	ScopedLock lock(m_Mutex);
+	for (int i = 0; i < count; i++)
+		m_Failures[path].push_back(status);
+}
+
+int vtTestTileServer::NumConnections()
+{
+	ScopedLock lock(m_Mutex);
+	return m_iConnections;
+}
+
+int vtTestTileServer::NumRequests(const char *path)
+{
+	ScopedLock lock(m_Mutex);
+	return m_Requests[path];
+}
+
+bool vtTestTileServer::IsStopping()
+{
+	ScopedLock lock(m_Mutex);
+	return m_bStopping;
+}
+
+void vtTestTileServer::run()
+{
+	std::list<Connection>::iterator it;
+	while (!IsStopping())
+	{
+		// Wake up now and then to see if we should stop
+		fd_set readable;
+		FD_ZERO(&readable);
+		FD_SET(m_iListen, &readable);
+		int highest = m_iListen;
+		for (it = m_Connections.begin(); it != m_Connections.end(); it++)
+		{
+			FD_SET(it->sock, &readable);
+			if (it->sock > highest)
+				highest = it->sock;
+		}
+		timeval timeout;
+		timeout.tv_sec = 0;
+		timeout.tv_usec = 20000;
+		if (select(highest + 1, &readable, NULL, NULL, &timeout) <= 0)
+			continue;
+
+		if (FD_ISSET(m_iListen, &readable))
+		{
+			Connection conn;
+			conn.sock = (int) accept(m_iListen, NULL, NULL);
+			if (conn.sock >= 0)
+			{
+				m_Connections.push_back(conn);
+				ScopedLock lock(m_Mutex);
+				m_iConnections++;
+			}
+		}
+		it = m_Connections.begin();
+		while (it != m_Connections.end())
+		{
+			bool bOpen = true;
+			if (FD_ISSET(it->sock, &readable))
+			{
+				char buf[4096];
+				int got = recv(it->sock, buf, sizeof(buf), 0);
+				if (got <= 0)
+					bOpen = false;
+				else
+				{
+					it->input.append(buf, got);
+
+					// Answer each complete request; a GET has no body
+					size_t end;
+					while (bOpen && (end = it->input.find("\r\n\r\n")) != std::string::npos)
+					{
+						std::string request = it->input.substr(0, end);
+						it->input.erase(0, end + 4);
+						bOpen = HandleRequest(*it, request);
+					}
+				}
+			}
+			if (bOpen)
+				it++;
+			else
+			{
+				closesocket(it->sock);
+				it = m_Connections.erase(it);
+			}
+		}
+	}
+	for (it = m_Connections.begin(); it != m_Connections.end(); it++)
+		closesocket(it->sock);
+	m_Connections.clear();
+}
+
+// Answer one request.  Returns false if the connection should be closed.
+bool vtTestTileServer::HandleRequest(Connection &conn, const std::string &request)
+{
+	// The request line is "GET /path HTTP/1.1"
+	const size_t first = request.find(' ');
+	const size_t second = request.find(' ', first + 1);
+	if (request.compare(0, 5, "GET /") != 0 || second == std::string::npos)
+	{
+		Send(conn.sock, 400, "", 0, true);
+		return false;
+	}
+	const vtString path = request.substr(first + 2, second - first - 2).c_str();
+
+	std::string headers = request;
+	for (size_t i = 0; i < headers.size(); i++)
+		headers[i] = tolower(headers[i]);
+	const bool bClose = (headers.find("connection: close") != std::string::npos);
+
+	int status = 200;
+	{
+		ScopedLock lock(m_Mutex);
+		m_Requests[path]++;
+
+		std::list<int> &failures = m_Failures[path];
+		if (!failures.empty())
+		{
+			status = failures.front();
+			failures.pop_front();
+		}
+	}
+	if (status == 0)
+		return false;	// drop the connection without an answer
+	if (status != 200)
+	{
+		const char *body = "Injected failure";
+		Send(conn.sock, status, body, strlen(body), bClose);
+		return !bClose;
+	}
+
+	std::vector<char> data;
+	FILE *fp = vtFileOpen(m_strFolder + "/" + path, "rb");
+	if (fp)
+	{
+		fseek(fp, 0, SEEK_END);
+		data.resize(ftell(fp));
+		fseek(fp, 0, SEEK_SET);
+		if (!data.empty() && fread(&data[0], data.size(), 1, fp) != 1)
+			data.clear();
+		fclose(fp);
+	}
+	if (!fp)
+	{
+		const char *body = "No such tile";
+		Send(conn.sock, 404, body, strlen(body), bClose);
+	}
+	else
+		Send(conn.sock, 200, data.empty() ? "" : &data[0], data.size(), bClose);
+	return !bClose;
+}
+
+void vtTestTileServer::Send(int sock, int status, const char *body,
+	size_t len, bool bClose)
+{
+	const char *reason = (status == 200) ? "OK" : (status == 404) ? "Not Found" :
+		(status < 500) ? "Client Error" : "Server Error";
+	vtString header;
+	header.Format("HTTP/1.1 %d %s\r\n"
+		"Content-Type: application/octet-stream\r\n"
+		"Content-Length: %d\r\n"
+		"Connection: %s\r\n\r\n",
+		status, reason, (int) len, bClose ? "close" : "keep-alive");
+
+	std::string reply = (const char *) header;
+	reply.append(body, len);
+	const char *p = reply.data();
+	int left = (int) reply.size();
+	while (left > 0)
+	{
+		int sent = send(sock, p, left, MSG_NOSIGNAL);
+		if (sent <= 0)
+			break;
+		p += sent;
+		left -= sent;
+	}
+}
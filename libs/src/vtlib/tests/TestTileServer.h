@@ -0,0 +1,75 @@
+//
+// TestTileServer.h
+//
+// A small HTTP server on the loopback interface, which serves the files of a
+// tileset folder so that vtTileStreamer can be tested without a real server.
+//
+// Copyright (c) 2001-2012 Virtual Terrain Project
+// Free for all uses, see license.txt for details.
+//
+
+#ifndef TESTTILESERVERH
+#define TESTTILESERVERH
+
+#include <map>
+#include <list>
+#include <string>
+
+#include <OpenThreads/Thread>
+#include <OpenThreads/Mutex>
+
+#include "vtdata/vtString.h"
+
+/**
+ * Serves the files in a folder over HTTP/1.1 at http://127.0.0.1:port/,
+ * keeping connections open between requests as a real server would.
+ *
+ * Failures can be injected for a path: the next few requests for it are
+ * answered with a given status code instead of the file, or the connection
+ * is dropped without any answer.  The server counts the connections it
+ * accepts and the requests for each path, so a test can check how the
+ * client retried.
+ */
+class vtTestTileServer : public OpenThreads::Thread
+{
+public:
+	vtTestTileServer(const char *folder);
+	~vtTestTileServer();
+
+	bool Start();
+	void Stop();
+	vtString GetBaseURL() const;
+
+	/// Answer the next 'count' requests for the path with this status code,
+	/// or, if the status is 0, close the connection without answering.
+	void FailNext(const char *path, int status, int count = 1);
+
+	int NumConnections();
+	int NumRequests(const char *path);
+
+protected:
+	virtual void run();
+
+	struct Connection
+	{
+		int sock;
+		std::string input;	// may hold several requests, or part of one
+	};
+	bool IsStopping();
+	bool HandleRequest(Connection &conn, const std::string &request);
+	void Send(int sock, int status, const char *body, size_t len, bool bClose);
+
+	vtString m_strFolder;
+	int m_iListen;
+	int m_iPort;
+	std::list<Connection> m_Connections;	// only used by the server thread
+
+	// All of these are guarded by m_Mutex
+	OpenThreads::Mutex m_Mutex;
+	std::map<vtString, std::list<int> > m_Failures;
+	std::map<vtString, int> m_Requests;
+	bool m_bStopping;
+	int m_iConnections;
+};
+
+#endif // TESTTILESERVERH
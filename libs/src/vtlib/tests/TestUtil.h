@@ -0,0 +1,35 @@
+//
+// TestUtil.h
+//
+// The checks shared by the vtlib tests.  Each test counts its failed
+// checks, and passes if there are none.
+//
+// Copyright (c) 2001-2012 Virtual Terrain Project
+// Free for all uses, see license.txt for details.
+//
+
+#ifndef TESTUTILH
+#define TESTUTILH
+
+#include <stdio.h>
+
+static int s_iFailures = 0;
+
+static void Check(bool bOK, const char *what)
+{
+	if (!bOK)
+	{
+		printf("FAILED: %s\n", what);
+		s_iFailures++;
+	}
+}
+
+// Report the result of a test, and return its exit code.
+static int TestResult(const char *name)
+{
+	if (s_iFailures == 0)
+		printf("%s passed.\n", name);
+	return s_iFailures == 0 ? 0 : 1;
+}
+
+#endif // TESTUTILH
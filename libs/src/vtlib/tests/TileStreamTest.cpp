@@ -0,0 +1,161 @@
+//
+// TileStreamTest.cpp
+//
+// Streams tiles through vtTileStreamer from a vtTestTileServer on the
+// loopback interface, with failures injected, and checks how the streamer
+// answers each status code, retries, and reuses its connections.
+//
+// Copyright (c) 2001-2012 Virtual Terrain Project
+// Free for all uses, see license.txt for details.
+//
+
+#include <stdio.h>
+#include <string.h>
+
+#include "vtlib/vtlib.h"
+#include "vtlib/core/TiledGeom.h"
+#include "vtdata/FilePath.h"
+#include "TestTileServer.h"
+#include "TestUtil.h"
+
+// Write a small tile in libMini's .db format: a header of "name=value"
+//  lines, a zero byte, and then the data, which is 'size' bytes of 'value'.
+//  The header claims a width of 'xsize', if it is given, instead of 'size'.
+static void WriteTile(const vtString &fname, int size, unsigned char value,
+	uint xsize = 0)
+{
+	FILE *fp = vtFileOpen(fname, "wb");
+	if (!fp)
+		return;
+	fprintf(fp, "MAGIC=1\nxsize=%u\nysize=1\nzsize=1\ntsteps=1\ntype=0\n"
+		"extformat=0\nbytes=%d\n", xsize ? xsize : (uint) size, size);
+	fputc(0, fp);
+	for (int i = 0; i < size; i++)
+		fputc(value, fp);
+	fclose(fp);
+}
+
+static bool GetTile(vtTileStreamer &streamer, const char *path, int size,
+	unsigned char value)
+{
+	databuf buf;
+	if (!streamer.Get(path, &buf))
+		return false;
+	const bool bOK = (buf.xsize == (uint) size && buf.bytes == (uint) size &&
+		((unsigned char *) buf.data)[size - 1] == value);
+	buf.release();
+	return bOK;
+}
+
+int main(int argc, char **argv)
+{
+	// A tileset of 16 tiles, in a folder under the current one
+	const vtString folder = "TileStreamTest_tiles";
+	vtCreateDir(folder);
+	vtCreateDir(folder + "/elev");
+	vtString paths[16];
+	for (int i = 0; i < 16; i++)
+	{
+		paths[i].Format("elev/%d-%d.db", i % 4, i / 4);
+		WriteTile(folder + "/" + paths[i], 10 + i, (unsigned char) i);
+	}
+
+	vtTestTileServer server(folder);
+	if (!server.Start())
+	{
+		printf("FAILED: could not start the tile server\n");
+		return 1;
+	}
+	vtTileCache cache;
+	vtTileStreamer streamer(&cache);
+	streamer.SetBaseURL(server.GetBaseURL());
+	streamer.SetRetries(2);
+	streamer.Start(1);
+
+	// 200: each tile arrives intact, all over the one connection
+	for (int i = 0; i < 4; i++)
+		Check(GetTile(streamer, paths[i], 10 + i, (unsigned char) i), "200 tile is fetched");
+	Check(server.NumRequests(paths[0]) == 1, "200 tile is asked for once");
+	Check(server.NumConnections() == 1, "one connection is reused for every tile");
+	Check(cache.Contains(streamer.GetURL(paths[0])), "fetched tile is in the tile cache");
+
+	// Integers in the header are read exactly, even those a float would round
+	WriteTile(folder + "/elev/wide.db", 1, 99, 16777217);
+	databuf wide;
+	Check(streamer.Get("elev/wide.db", &wide) && wide.xsize == 16777217,
+		"header integers are read exactly");
+	wide.release();
+
+	// 404: a missing tile fails, and is not asked for again
+	Check(!GetTile(streamer, "elev/9-9.db", 1, 0), "404 tile fails");
+	Check(server.NumRequests("elev/9-9.db") == 1, "404 is not retried");
+
+	// Other 4xx are not retried either
+	server.FailNext(paths[4], 403);
+	Check(!GetTile(streamer, paths[4], 14, 4), "403 tile fails");
+	Check(server.NumRequests(paths[4]) == 1, "403 is not retried");
+
+	// 503 twice, then success: the third attempt gets it
+	server.FailNext(paths[5], 503, 2);
+	Check(GetTile(streamer, paths[5], 15, 5), "tile is fetched after two 503s");
+	Check(server.NumRequests(paths[5]) == 3, "503 is retried until it succeeds");
+
+	// 500 every time: the retries run out
+	server.FailNext(paths[6], 500, 10);
+	Check(!GetTile(streamer, paths[6], 16, 6), "tile fails after repeated 500s");
+	Check(server.NumRequests(paths[6]) == 3, "500 is retried SetRetries times");
+	Check(streamer.NumFailed() == 3, "the failures are counted");
+	Check(server.NumConnections() == 1, "error responses keep the connection open");
+
+	// A connection which is dropped without an answer is made again
+	const int connections = server.NumConnections();
+	server.FailNext(paths[7], 0);
+	Check(GetTile(streamer, paths[7], 17, 7), "tile is fetched after a dropped connection");
+	Check(server.NumRequests(paths[7]) == 2, "dropped connection is retried");
+	Check(server.NumConnections() == connections + 1, "a new connection replaces the dropped one");
+
+	// Something in the cache folder which is not a tile, such as a folder,
+	//  is a cache miss, and the tile is fetched from the server instead
+	streamer.Stop();
+	const vtString cache_folder = "TileStreamTest_cache";
+	streamer.SetCacheFolder(cache_folder);
+	vtCreateDir(cache_folder + "/elev");
+	vtCreateDir(cache_folder + "/elev/odd.db");
+	WriteTile(folder + "/elev/odd.db", 5, 42);
+	streamer.Start(1);
+	Check(GetTile(streamer, "elev/odd.db", 5, 42), "a folder in the cache folder is a miss");
+	Check(server.NumRequests("elev/odd.db") == 1, "the missed tile is fetched");
+	streamer.Stop();
+	streamer.SetCacheFolder("");
+
+	// Several connections, prefetching the rest of the tiles in the
+	//  background: no more connections are made than there are workers
+	streamer.Start(4);
+	const int before = server.NumConnections();
+	const uint fetched = streamer.NumFetched();
+	std::vector<vtString> rest;
+	for (int i = 8; i < 16; i++)
+		rest.push_back(paths[i]);
+	streamer.Request(rest);
+	for (int wait = 0; wait < 500 && streamer.NumFetched() < fetched + 8; wait++)
+		OpenThreads::Thread::microSleep(10000);
+	Check(streamer.NumFetched() == fetched + 8, "prefetched tiles are fetched");
+	for (int i = 8; i < 16; i++)
+		Check(cache.Contains(streamer.GetURL(paths[i])), "prefetched tile is in the tile cache");
+	Check(server.NumConnections() - before <= 4, "each worker reuses its connection");
+
+	streamer.Stop();
+	server.Stop();
+
+	for (int i = 0; i < 16; i++)
+		vtDeleteFile(folder + "/" + paths[i]);
+	vtDeleteFile(folder + "/elev/wide.db");
+	vtDeleteFile(folder + "/elev/odd.db");
+	vtDestroyDir(cache_folder + "/elev/odd.db");
+	vtDestroyDir(cache_folder + "/elev");
+	vtDestroyDir(cache_folder);
+	vtDestroyDir(folder + "/elev");
+	vtDestroyDir(folder);
+
+	return TestResult("TileStreamTest");
+}
@@ -25,6 +25,15 @@
 #define USE_OSG_FOR_BMP		1
 #define USE_OSG_FOR_JPG		1
 
+// True if the image is stored as plain 8-bit luminance, RGB or RGBA, so
+//  that its rows can be given out by GetPixelRow.
+static bool HasRawPixelRows(const osg::Image *image)
+{
+	const GLenum format = image->getPixelFormat();
+	return (image->getDataType() == GL_UNSIGNED_BYTE &&
+		(format == GL_LUMINANCE || format == GL_RGB || format == GL_RGBA));
+}
+
 
 ////////////////////////////////////////////////////////////////////////
 // vtImage class
@@ -459,6 +468,14 @@ uint vtImage::GetDepth() const
 	return getPixelSizeInBits();
 }
 
+uchar *vtImage::GetPixelRow(int y)
+{
+	if (!HasRawPixelRows(this))
+		return NULL;
+	// OSG appears to reference y=0 as the bottom of the image
+	return data(0, _t-1-y);
+}
+
 
 //////////////////////////////////////////////////////////////////////////
 // vtImageWrapper
@@ -515,6 +532,14 @@ void vtImageWrapper::SetPixel32(int x, int y, const RGBAi &rgba)
 	buf[3] = rgba.a;
 }
 
+uchar *vtImageWrapper::GetPixelRow(int y)
+{
+	if (!HasRawPixelRows(m_image))
+		return NULL;
+	// OSG appears to reference y=0 as the bottom of the image
+	return m_image->data(0, m_image->t()-1-y);
+}
+
 
 //////////////////////////////////////////////////////////////////////////
 // Helpers
@@ -50,6 +50,7 @@ public:
 	uint GetWidth() const;
 	uint GetHeight() const;
 	uint GetDepth() const;
+	uchar *GetPixelRow(int y);
 
 	uchar *GetData() { return data(); }
 	uchar *GetRowData(int row) { return data(0, row); }
@@ -85,6 +86,7 @@ public:
 	uint GetWidth() const { return m_image->s(); }
 	uint GetHeight() const { return m_image->t(); }
 	uint GetDepth() const { return m_image->getPixelSizeInBits(); }
+	uchar *GetPixelRow(int y);
 
 	uchar *GetData() { return m_image->data(); }
 	uchar *GetRowData(int row) { return m_image->data(0, row); }
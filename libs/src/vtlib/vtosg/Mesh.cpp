@@ -92,7 +92,8 @@ static FPoint2 t[4] =
  *		contain.  If more than this number of vertices are added, the mesh
  *		will automatically grow to contain them.  However it is more
  *		efficient if you know the number at creation time and pass it in
- *		this parameter.
+ *		this parameter.  A mesh with more than 65536 vertices uses 32-bit
+ *		indices, otherwise 16-bit; see SetLargeIndices().
  */
 vtMesh::vtMesh(PrimType ePrimType, int VertType, int NumVertices)
 {
@@ -100,6 +101,7 @@ vtMesh::vtMesh(PrimType ePrimType, int VertType, int NumVertices)
 	m_PrimType = ePrimType;
 #endif
 	m_iMatIdx = -1;
+	m_bLargeIndices = (NumVertices > 0x10000);
 
 	osg::Vec3Array *pVert = new osg::Vec3Array;
 	pVert->reserve(NumVertices);
@@ -192,13 +194,13 @@ vtMesh::vtMesh(PrimType ePrimType, int VertType, int NumVertices)
 		pPrimSet = new osg::DrawArrays(osg::PrimitiveSet::POINTS, 0, NumVertices);
 		break;
 	case osg::PrimitiveSet::LINES:
-		pPrimSet = new osg::DrawElementsUShort(osg::PrimitiveSet::LINES);
+		pPrimSet = _NewDrawElements(osg::PrimitiveSet::LINES);
 		break;
 	case osg::PrimitiveSet::TRIANGLES:
-		pPrimSet = new osg::DrawElementsUShort(osg::PrimitiveSet::TRIANGLES);
+		pPrimSet = _NewDrawElements(osg::PrimitiveSet::TRIANGLES);
 		break;
 	case osg::PrimitiveSet::QUADS:
-		pPrimSet = new osg::DrawElementsUShort(osg::PrimitiveSet::QUADS);
+		pPrimSet = _NewDrawElements(osg::PrimitiveSet::QUADS);
 		break;
 	}
 	if (NULL != pPrimSet)
@@ -206,6 +208,83 @@ vtMesh::vtMesh(PrimType ePrimType, int VertType, int NumVertices)
 #endif
 }
 
+/**
+ * Reserve room for a number of vertices and indices, so that the mesh's
+ * arrays don't need to grow again and again as they are added.  If there
+ * will be more vertices than 16-bit indices can reach, the mesh switches to
+ * 32-bit indices now, rather than when the vertices are added.
+ *
+ * \param iVertices The number of vertices the mesh will have.
+ * \param iIndices The number of vertex indices its primitives will have.
+ */
+void vtMesh::Reserve(int iVertices, int iIndices)
+{
+	if (iVertices > 0x10000)
+		SetLargeIndices(true);
+
+	getVerts()->reserve(iVertices);
+	if (hasVertexNormals())
+		getNormals()->reserve(iVertices);
+	if (hasVertexColors())
+		getColors()->reserve(iVertices);
+	if (hasVertexTexCoords())
+		getTexCoords()->reserve(iVertices);
+
+#ifdef AVOID_OSG_INDICES
+	if (getNumPrimitiveSets() > 0 && getPrimSet()->getDrawElements())
+		getPrimSet()->getDrawElements()->reserveElements(iIndices);
+#else
+	getIndices()->reserve(iIndices);
+#endif
+}
+
+/**
+ * Set whether the primitives of this mesh use 32-bit vertex indices, rather
+ * than 16-bit.  16-bit indices take half the memory, and are faster to
+ * draw, but can only reach 65536 vertices.  A mesh chooses by itself, and
+ * switches to 32-bit as soon as it has more vertices than that, so you only
+ * need to call this to make the choice up front.
+ *
+ * With OSG's indexed vertex arrays (the default, unless AVOID_OSG_INDICES
+ * is defined), the indices are always 32-bit, and only the choice is kept.
+ */
+void vtMesh::SetLargeIndices(bool bLarge)
+{
+	// 16-bit indices can't reach all the vertices of a large mesh
+	if (!bLarge && GetNumVertices() > 0x10000)
+		return;
+	if (bLarge == m_bLargeIndices)
+		return;
+	m_bLargeIndices = bLarge;
+
+#ifdef AVOID_OSG_INDICES
+	// Convert any existing primitives to the new index size
+	for (uint i = 0; i < getNumPrimitiveSets(); i++)
+	{
+		osg::DrawElements *pOld = getPrimitiveSet(i)->getDrawElements();
+		if (!pOld)
+			continue;	// e.g. DrawArrays for points
+		const uint num = pOld->getNumIndices();
+		osg::DrawElements *pNew = _NewDrawElements((PrimType) pOld->getMode());
+		pNew->reserveElements(num);
+		for (uint j = 0; j < num; j++)
+			pNew->addElement(pOld->index(j));
+		setPrimitiveSet(i, pNew);
+	}
+#endif
+}
+
+#ifdef AVOID_OSG_INDICES
+// Make a primitive set with indices of the size this mesh uses.
+osg::DrawElements *vtMesh::_NewDrawElements(PrimType ePrimType, int iCount)
+{
+	if (m_bLargeIndices)
+		return new osg::DrawElementsUInt(ePrimType, iCount);
+	else
+		return new osg::DrawElementsUShort(ePrimType, iCount);
+}
+#endif
+
 /**
  * Adds a vertex to the mesh.
  *
@@ -318,7 +397,7 @@ int vtMesh::AddVertexNUV(const FPoint3 &p, const FPoint3 &n, const FPoint2 &uv)
  */
 void vtMesh::AddStrip2(int iNVerts, int iStartIndex)
 {
-	unsigned short *idx = new unsigned short[iNVerts];
+	uint *idx = new uint[iNVerts];
 
 	for (int i = 0; i < iNVerts; i++)
 		idx[i] = iStartIndex + i;
@@ -452,7 +531,7 @@ void vtMesh::CreateRectangularMesh(int xsize, int ysize, bool bReverseNormals)
 {
 	int i, j;
 
-	unsigned short *strip = new unsigned short[xsize*2];
+	uint *strip = new uint[xsize*2];
 	for (j = 0; j < ysize - 1; j++)
 	{
 		int start = j * xsize;
@@ -621,7 +700,7 @@ void vtMesh::CreateCylinder(float height, float radius, int res,
 		}
 	}
 	// Create sides
-	unsigned short *indices = new unsigned short[(res+1) * 2];
+	uint *indices = new uint[(res+1) * 2];
 	j = 0;
 	k = 0;
 	for (i = 0; i < res+1; i++)
@@ -944,7 +1023,7 @@ void vtMesh::AddTri(int p0, int p1, int p2)
 	}
 	else if (PrimType == osg::PrimitiveSet::TRIANGLE_STRIP || PrimType == osg::PrimitiveSet::TRIANGLE_FAN)
 	{
-		pDrawElements = new osg::DrawElementsUShort(PrimType, 3);
+		pDrawElements = _NewDrawElements(PrimType, 3);
 		addPrimitiveSet(pDrawElements);
 	}
 	pDrawElements->addElement(p0);
@@ -977,7 +1056,7 @@ void vtMesh::AddFan(int p0, int p1, int p2, int p3, int p4, int p5)
 {
 #ifdef AVOID_OSG_INDICES
 	osg::DrawElements *pDrawElements;
-	pDrawElements = new osg::DrawElementsUShort(osg::PrimitiveSet::TRIANGLE_FAN);
+	pDrawElements = _NewDrawElements(osg::PrimitiveSet::TRIANGLE_FAN);
 	pDrawElements->addElement(p0);
 	pDrawElements->addElement(p1);
 	if (p2 != -1)
@@ -1014,7 +1093,7 @@ void vtMesh::AddFan(int *idx, int iNVerts)
 {
 #ifdef AVOID_OSG_INDICES
 	osg::DrawElements *pDrawElements;
-	pDrawElements = new osg::DrawElementsUShort(osg::PrimitiveSet::TRIANGLE_FAN);
+	pDrawElements = _NewDrawElements(osg::PrimitiveSet::TRIANGLE_FAN);
 	pDrawElements->reserveElements(iNVerts);
 	for (int i = 0; i < iNVerts; i++)
 		pDrawElements->addElement(idx[i]);
@@ -1036,21 +1115,23 @@ void vtMesh::AddFan(int *idx, int iNVerts)
  * \param pIndices An array of the indices of the vertices in the strip.
  */
 void vtMesh::AddStrip(int iNVerts, unsigned short *pIndices)
+{
+	std::vector<uint> idx(pIndices, pIndices + iNVerts);
+	if (iNVerts > 0)
+		AddStrip(iNVerts, &idx[0]);
+}
+
+/**
+ * Adds an indexed strip to the mesh.  Unlike the 16-bit version, this can
+ * refer to any of the vertices of a large mesh.
+ *
+ * \param iNVerts The number of vertices in the strip.
+ * \param pIndices An array of the indices of the vertices in the strip.
+ */
+void vtMesh::AddStrip(int iNVerts, const uint *pIndices)
 {
 #ifdef AVOID_OSG_INDICES
-	osg::DrawElements *pDrawElements;
-	switch(m_PrimType)
-	{
-		case osg::PrimitiveSet::LINE_STRIP:
-			pDrawElements = new osg::DrawElementsUShort(osg::PrimitiveSet::LINE_STRIP);
-			break;
-		case osg::PrimitiveSet::TRIANGLE_STRIP:
-			pDrawElements = new osg::DrawElementsUShort(osg::PrimitiveSet::TRIANGLE_STRIP);
-			break;
-		case osg::PrimitiveSet::QUAD_STRIP:
-			pDrawElements = new osg::DrawElementsUShort(osg::PrimitiveSet::QUAD_STRIP);
-			break;
-	}
+	osg::DrawElements *pDrawElements = _NewDrawElements(m_PrimType);
 	pDrawElements->reserveElements(iNVerts);
 	for (int i = 0; i < iNVerts; i++)
 		pDrawElements->addElement(pIndices[i]);
@@ -1081,7 +1162,7 @@ void vtMesh::AddLine(int p0, int p1)
 	else if (PrimType == osg::PrimitiveSet::LINE_STRIP)
 	{
 		// This seems a bit pointless
-		pDrawElements = new osg::DrawElementsUShort(PrimType, 2);
+		pDrawElements = _NewDrawElements(PrimType, 2);
 		addPrimitiveSet(pDrawElements);
 	}
 	pDrawElements->addElement(p0);
@@ -1156,7 +1237,12 @@ void vtMesh::SetVtxPos(uint i, const FPoint3 &p)
 	v2s(p, s);
 
 	if (i >= (int)getVerts()->size())
+	{
+		// Past the reach of 16-bit indices
+		if (i > 0xFFFF && !m_bLargeIndices)
+			SetLargeIndices(true);
 		getVerts()->resize(i + 1);
+	}
 	getVerts()->at(i) = s;
 
 #ifdef AVOID_OSG_INDICES
@@ -1383,7 +1469,7 @@ void vtMesh::_AddStripNormals()
 #ifdef AVOID_OSG_INDICES
 	uint i, j, len;
 	uint NumPrimitiveSets = getNumPrimitiveSets();
-	unsigned short v0 = 0, v1 = 0, v2 = 0;
+	uint v0 = 0, v1 = 0, v2 = 0;
 	osg::Vec3 p0, p1, p2, d0, d1, norm;
 	osg::Vec3Array *norms = getNormals();
 
@@ -1416,7 +1502,7 @@ void vtMesh::_AddStripNormals()
 	osg::DrawArrayLengths *dal = getDrawArrayLengths();
 	int prims = GetNumPrims();
 	int i, j, len, idx;
-	unsigned short v0 = 0, v1 = 0, v2 = 0;
+	uint v0 = 0, v1 = 0, v2 = 0;
 	osg::Vec3 p0, p1, p2, d0, d1, norm;
 
 	osg::UIntArray *uia = getIndices();
@@ -1456,7 +1542,7 @@ void vtMesh::_AddPolyNormals()
 #ifdef AVOID_OSG_INDICES
 	uint i, j, len;
 	uint NumPrimitiveSets = getNumPrimitiveSets();
-	unsigned short v0 = 0, v1 = 0, v2 = 0;
+	uint v0 = 0, v1 = 0, v2 = 0;
 	osg::Vec3 p0, p1, p2, d0, d1, norm;
 	osg::Vec3Array *norms = getNormals();
 
@@ -1495,7 +1581,7 @@ void vtMesh::_AddPolyNormals()
 
 	int prims = GetNumPrims();
 	int i, j, len, idx;
-	unsigned short v0 = 0, v1 = 0, v2 = 0;
+	uint v0 = 0, v1 = 0, v2 = 0;
 	osg::Vec3 p0, p1, p2, d0, d1, norm;
 
 	osg::UIntArray *uia = getIndices();
@@ -1536,7 +1622,7 @@ void vtMesh::_AddTriangleNormals()
 {
 #ifdef AVOID_OSG_INDICES
 	int tris = GetNumPrims();
-	unsigned short v0, v1, v2;
+	uint v0, v1, v2;
 	osg::Vec3 p0, p1, p2, d0, d1, norm;
 
 	osg::DrawElements *pDrawElements = getPrimitiveSet(0)->getDrawElements();
@@ -1563,7 +1649,7 @@ void vtMesh::_AddTriangleNormals()
 	}
 #else
 	int tris = GetNumPrims();
-	unsigned short v0, v1, v2;
+	uint v0, v1, v2;
 	osg::Vec3 p0, p1, p2, d0, d1, norm;
 
 	osg::UIntArray *uia = getIndices();
@@ -1595,7 +1681,7 @@ void vtMesh::_AddQuadNormals()
 {
 #ifdef AVOID_OSG_INDICES
 	int quads = GetNumPrims();
-	unsigned short v0, v1, v2, v3;
+	uint v0, v1, v2, v3;
 	osg::Vec3 p0, p1, p2, d0, d1, norm;
 
 	osg::Vec3Array *norms = getNormals();
@@ -1626,7 +1712,7 @@ void vtMesh::_AddQuadNormals()
 	}
 #else
 	int quads = GetNumPrims();
-	unsigned short v0, v1, v2, v3;
+	uint v0, v1, v2, v3;
 	osg::Vec3 p0, p1, p2, d0, d1, norm;
 
 	osg::UIntArray *uia = getIndices();
@@ -51,6 +51,11 @@ public:
 
 	vtMesh(PrimType ePrimType, int VertType, int NumVertices);
 
+	// Capacity and index size
+	void Reserve(int iVertices, int iIndices);
+	void SetLargeIndices(bool bLarge);
+	bool HasLargeIndices() const { return m_bLargeIndices; }
+
 	// Get bounding box
 	void GetBoundBox(FBox3 &box) const;
 
@@ -59,6 +64,7 @@ public:
 	void AddFan(int p0, int p1, int p2 = -1, int p3 = -1, int p4 = -1, int p5 = -1);
 	void AddFan(int *idx, int iNVerts);
 	void AddStrip(int iNVerts, unsigned short *pIndices);
+	void AddStrip(int iNVerts, const uint *pIndices);
 	void AddLine(int p0, int p1);
 	int  AddLine(const FPoint3 &pos1, const FPoint3 &pos2);
 	void AddQuad(int p0, int p1, int p2, int p3);
@@ -147,7 +153,7 @@ public:
 	// Access values
 	int GetNumPrims() const;
 	int GetNumIndices() const { return getVertexIndices()->getNumElements(); }
-	short GetIndex(int i) const { return getIndices()->at(i); }
+	int GetIndex(int i) const { return getIndices()->at(i); }
 	int GetPrimLen(int i) const { return dynamic_cast<const osg::DrawArrayLengths*>(getPrimitiveSet(0))->at(i); }
 
 	void SetNormalsFromPrimitives();
@@ -162,6 +168,9 @@ protected:
 	void _AddPolyNormals();
 	void _AddTriangleNormals();
 	void _AddQuadNormals();
+#ifdef AVOID_OSG_INDICES
+	osg::DrawElements *_NewDrawElements(PrimType ePrimType, int iCount = 0);
+#endif
 
 	osg::PrimitiveSet *getPrimSet() { return getPrimitiveSet(0); }
 	const osg::PrimitiveSet *getPrimSet() const { return getPrimitiveSet(0); }
@@ -189,6 +198,7 @@ protected:
 	const osg::Vec2Array *getTexCoords() const { return (const osg::Vec2Array*) getTexCoordArray(0); }
 
 	int m_iMatIdx;
+	bool m_bLargeIndices;
 #ifdef AVOID_OSG_INDICES
 	PrimType m_PrimType;
 #endif
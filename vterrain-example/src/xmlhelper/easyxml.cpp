@@ -244,6 +244,45 @@ void readXML (istream &input, XMLVisitor &visitor, const string &path,
 	XML_ParserFree(parser);
 }
 
+/**
+ * Parse XML text which is already in memory.  Nothing here is shared
+ * between calls, so several buffers can be parsed at once on different
+ * threads, each with its own visitor.
+ */
+void readXMLBuffer(const char *buf, size_t len, XMLVisitor &visitor,
+				   const string &path)
+{
+	XML_Parser parser = XML_ParserCreate(0);
+	XML_SetUserData(parser, &visitor);
+	XML_SetElementHandler(parser, start_element, end_element);
+	XML_SetCharacterDataHandler(parser, character_data);
+	XML_SetProcessingInstructionHandler(parser, processing_instruction);
+
+	visitor.startXML();
+
+	// Expat takes the length as an int, so very large buffers go in pieces
+	const size_t BLOCK = 1 << 30;
+	size_t done = 0;
+	do
+	{
+		const size_t count = (len - done < BLOCK) ? len - done : BLOCK;
+		const bool bFinal = (done + count == len);
+		if (!XML_Parse(parser, buf + done, (int) count, bFinal))
+		{
+			const XML_LChar *message = XML_ErrorString(XML_GetErrorCode(parser));
+			int line = XML_GetCurrentLineNumber(parser);
+			int col = XML_GetCurrentColumnNumber(parser);
+			XML_ParserFree(parser);
+			throw xh_io_exception(message, xh_location(path, line, col),
+				"XML Parser");
+		}
+		done += count;
+	}
+	while (done < len);
+
+	XML_ParserFree(parser);
+}
+
 /**
  * Read and parse the XML from a file.
  */
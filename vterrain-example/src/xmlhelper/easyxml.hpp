@@ -359,6 +359,20 @@ extern void readCompressedXML(gzFile fp, XMLVisitor &visitor,
 							  int iFileLength = -1,
 							  bool progress_callback(int) = NULL);
 
+/**
+ * @relates XMLVisitor
+ * Read an XML document which is already in memory.
+ *
+ * @param buf The text of the document.
+ * @param len The length of the text, in bytes.
+ * @param visitor An object that contains callbacks for XML parsing
+ * events.
+ * @param path A string describing the original path of the resource.
+ * @exception Throws xh_io_exception if there is a problem parsing the text.
+ */
+extern void readXMLBuffer(const char *buf, size_t len, XMLVisitor &visitor,
+						  const string &path="");
+
 
 /**
  * @relates XMLVisitor